@@ -0,0 +1,427 @@
+#!/bin/env python2
+
+# aot.py -- Ahead-of-time compiler
+#
+# Translates the code in the fixed ROM bank of a .kpr image into a C source
+# file, to be built into qpra with 'make AOT=<file>' and run with
+# '-engine aot'. Code is found by following control flow from the reset
+# address, and from handlers stored into the interrupt vector at
+# $fff8-$ffff. Jumps which cannot be resolved, and code anywhere else,
+# go back to the interpreter at run time.
+
+from __future__ import print_function
+
+import os
+import re
+import struct
+import sys
+
+ROM_FIXED_END = 0x3fff
+INT_VEC = 0xfff8
+
+HDR_ROMF = 0
+
+names = [
+        "nop", "int", "rti", "rts", "jp", "cl", "jz", "cz", "jc", "cc", "jo",
+        "co", "jn", "cn", "not", "inc", "dec", "ind", "ded", "mv", "cmp",
+        "tst", "add", "sub", "mul", "div", "lsl", "lsr", "asr", "and", "or",
+        "xor"
+        ]
+
+OP_NOP, OP_INT, OP_RTI, OP_RTS, OP_JP, OP_CL, OP_JZ = 0, 1, 2, 3, 4, 5, 6
+OP_CN, OP_NOT, OP_MV = 13, 14, 19
+
+modes = [
+        "DR", "IR", "DB", "IB", "DW", "IW", "DR_DR", "DR_IR", "IR_DR",
+        "DR_DB", "DR_IB", "DR_DW", "DR_IW", "IB_DR", "IW_DR", "RESERVED"
+        ]
+
+(AM_DR, AM_IR, AM_DB, AM_IB, AM_DW, AM_IW, AM_DR_DR, AM_DR_IR, AM_IR_DR,
+ AM_DR_DB, AM_DR_IB, AM_DR_DW, AM_DR_IW, AM_IB_DR, AM_IW_DR,
+ AM_RESERVED) = range(16)
+
+# Cycles taken per addressing mode, as in core_cpu_am_cycles.
+am_cycles = [2, 5, 3, 5, 3, 5, 2, 3, 7, 3, 4, 3, 4, 5, 5, 7]
+
+HAS_DB = (AM_DB, AM_IB, AM_DR_DB, AM_DR_IB, AM_IB_DR)
+HAS_DW = (AM_DW, AM_IW, AM_DR_DW, AM_DR_IW, AM_IW_DR)
+OP1REG = (AM_DR_DR, AM_DR_IR, AM_DR_DB, AM_DR_IB, AM_DR_DW, AM_DR_IW)
+
+R_P, R_S, R_F = 5, 6, 7
+regnames = ["R_A", "R_B", "R_C", "R_D", "R_E", "R_P", "R_S", "R_F"]
+
+jump_flags = { 4:None, 6:"FLAG_Z", 8:"FLAG_C", 10:"FLAG_O", 12:"FLAG_N" }
+
+
+class Instr:
+    """ A decoded instruction, as the emulator's predecode table has it. """
+    def __init__(self, rom, pc):
+        ib0 = rom[pc]
+        ib1 = rom[pc + 1]
+        self.pc = pc
+        self.op = ib0 >> 3
+        self.size = "OP_16" if ib0 & 4 else "OP_8"
+        self.am = ((ib0 << 2) | (ib1 >> 6)) & 0x0f
+        self.rx = (ib1 >> 3) & 7
+        self.ry = ib1 & 7
+        self.data = 0
+        if self.op < 4:
+            self.length = 1
+            self.cycles = { OP_INT:5, OP_RTI:4, OP_RTS:3 }.get(self.op, 2)
+        else:
+            if self.am in HAS_DW:
+                self.length = 4
+            elif self.am in HAS_DB:
+                self.length = 3
+            else:
+                self.length = 2
+            if self.length > 2:
+                self.data = rom[pc + 2] | (rom[pc + 3] << 8)
+            if self.am in (AM_DR, AM_DR_DR) and self.is_call():
+                self.cycles = 3
+            else:
+                self.cycles = am_cycles[self.am]
+        self.next = pc + self.length
+
+    def is_void(self):
+        return self.op < 4
+
+    def is_jump(self):
+        return self.op >= OP_JP and self.op <= OP_CN and not self.op & 1
+
+    def is_call(self):
+        return self.op >= OP_JP and self.op <= OP_CN and self.op & 1
+
+    def writes(self):
+        """ Registers written by the store phase. """
+        if self.am == AM_DR_DR:
+            return (self.rx, self.ry)
+        if self.am == AM_DR or self.am in OP1REG:
+            return (self.rx,)
+        return ()
+
+    def reads_f(self):
+        """ As instr_reads_f(): must the flags be worked out first? """
+        if self.op == OP_INT or (self.op >= OP_JZ and self.op <= OP_CN):
+            return True
+        return not self.is_void() and R_F in (self.rx, self.ry)
+
+    def writes_f(self):
+        """ As instr_writes_f(): does it overwrite F as a whole? """
+        return self.op == OP_RTI or R_F in self.writes()
+
+    def ends_block(self):
+        """ As instr_ends_block() in the emulator. """
+        if self.op != OP_NOP and self.op <= OP_CN:
+            return True
+        return R_P in self.writes() or R_F in self.writes()
+
+    def terminal(self):
+        """ Is the next instruction never reached by falling through? """
+        if self.op in (OP_RTI, OP_RTS, OP_JP):
+            return True
+        return not self.is_jump() and not self.is_call() and \
+                R_P in self.writes()
+
+    def target(self):
+        """ Constant jump or call target, or None. """
+        if self.am == AM_DB:
+            return self.data & 0xff
+        if self.am == AM_DW:
+            return self.data
+        return None
+
+    def d8(self):
+        return "0x%02x" % (self.data & 0xff)
+
+    def d16(self):
+        if self.am in HAS_DW:
+            return "0x%04x" % self.data
+        return "AOT_D16B(0x%02x)" % (self.data & 0xff)
+
+    def __str__(self):
+        s = names[self.op]
+        if not self.is_void():
+            s += (".w " if self.size == "OP_16" else ".b ") + modes[self.am]
+        return s
+
+
+def read_rom(fn):
+    """ Return the fixed ROM bank of a .kpr image, as core_load_rom reads it. """
+    f = open(fn, "rb")
+    hdr = f.read(68)
+    if len(hdr) != 68:
+        print("error: couldn't read full ROM header")
+        sys.exit(1)
+    size = struct.unpack("<I", hdr[4:8])[0]
+    total = 68
+    romf = None
+    while total < size:
+        buf = f.read(4)
+        if len(buf) < 4:
+            break
+        btype, bnum, blen = struct.unpack("<BBH", buf)
+        data = f.read(blen)
+        total += 4 + len(data)
+        if btype == HDR_ROMF:
+            romf = bytearray(data)
+    f.close()
+    if romf is None:
+        print("error: ROM has no fixed bank")
+        sys.exit(1)
+    # Padded so that decoding may look past the end of the bank.
+    return romf + bytearray(ROM_FIXED_END + 5 - len(romf))
+
+
+def discover(rom):
+    """
+    Follow control flow through the fixed bank. Returns the instructions found
+    by address, and the addresses which start a basic block.
+    """
+    code = {}
+    heads = set()
+    work = []
+
+    def add(t):
+        if t is not None and t <= ROM_FIXED_END and t not in heads:
+            heads.add(t)
+            work.append(t)
+
+    add(0)
+    while work:
+        pc = work.pop()
+        # Constants known to be in registers along this path.
+        known = {}
+        while pc + 1 <= ROM_FIXED_END and pc not in code:
+            ins = Instr(rom, pc)
+            if ins.next - 1 > ROM_FIXED_END:
+                break
+            code[pc] = ins
+
+            if ins.is_jump() or ins.is_call():
+                t = ins.target()
+                if t is None and ins.am == AM_DR:
+                    t = known.get(ins.rx)
+                add(t)
+            # Handlers installed in the interrupt vector.
+            if ins.op == OP_MV and ins.am == AM_IW_DR and \
+                    ins.data >= INT_VEC and ins.ry in known:
+                add(known[ins.ry])
+
+            for w in ins.writes():
+                known.pop(w, None)
+            if ins.op == OP_MV and ins.am == AM_DR_DW:
+                known[ins.rx] = ins.data
+            elif ins.op == OP_MV and ins.am == AM_DR_DB:
+                known[ins.rx] = ins.data & 0xff
+
+            if ins.terminal():
+                break
+            if ins.ends_block() or ins.op == OP_INT:
+                add(ins.next)
+            pc = ins.next
+
+    return code, heads
+
+
+def emit(ins, code, heads, used):
+    """
+    Return the translation of one instruction, as lines of C. Adds the block
+    heads it jumps to directly to used.
+    """
+    am, rx, ry, sz = ins.am, "r[%s]" % regnames[ins.rx], \
+            "r[%s]" % regnames[ins.ry], ins.size
+    body = []
+
+    def goto(t):
+        if t in code and t in heads:
+            used.add(t)
+            return "goto H_%04x;" % t
+        return "goto dispatch;"
+
+    body.append("cycles += %d;" % ins.cycles)
+    body.append("r[R_P] = 0x%04x;" % (ins.next & 0xffff))
+    if am in HAS_DW and not ins.is_void():
+        body.append("i->db1 = 0x%02x;" % (ins.data >> 8))
+    if ins.reads_f():
+        body.append("core_alu_sync(&r[R_F], &cpu->lf);")
+
+    if ins.is_void():
+        if ins.op == OP_INT:
+            body += ["r[R_S] -= 2;",
+                     "core_mmu_writew(mmu, r[R_S], r[R_P]);",
+                     "cpu->ahead = cycles - %d;" % ins.cycles,
+                     "core_cpu_int_raise(cpu, INT_USER_IRQ);",
+                     "r[R_S] -= 2;",
+                     "core_mmu_writew(mmu, r[R_S], r[R_F]);",
+                     "r[R_P] = core_mmu_readw(mmu, 0xfffe);",
+                     "goto dispatch;"]
+        elif ins.op in (OP_RTI, OP_RTS):
+            body += ["r[R_P] = core_mmu_readw(mmu, r[R_S]);",
+                     "r[R_S] += 2;"]
+            if ins.op == OP_RTI:
+                body += ["r[R_F] = core_mmu_readw(mmu, r[R_S]);",
+                         "cpu->lf.mask = 0;",
+                         "r[R_S] += 2;",
+                         "if(cpu->intstat != NULL)",
+                         "    core_cpu_intstat_leave(cpu, cycles);"]
+            body.append("goto dispatch;")
+        return body
+
+    if am in (AM_IR_DR, AM_RESERVED):
+        body.append('LOGE("core.cpu: invalid addressing mode %%d", %d);' % am)
+        return body
+
+    t = ins.target()
+    if (ins.is_jump() or ins.is_call()) and t is not None:
+        flag = jump_flags.get(ins.op & ~1)
+        inner = []
+        if ins.is_call():
+            inner += ["r[R_S] -= 2;",
+                      "core_mmu_writew(mmu, r[R_S], 0x%04x);" % ins.next]
+        inner.append("r[R_P] = 0x%04x;" % t)
+        if ins.is_call():
+            inner.append("AOT_HLE()")
+        if ins.is_jump() and t <= ins.pc:
+            # May close a loop which only waits; see idle.c.
+            inner.append("cycles += core_cpu_idle(cpu, r, &cpu->lf, 0x%04x, "
+                         "cycles, budget);" % ins.pc)
+        inner.append(goto(t))
+        if flag:
+            body.append("if(r[R_F] & %s) {" % flag)
+            body += ["    " + l for l in inner]
+            body.append("}")
+        else:
+            body += inner
+        return body
+
+    loads = {
+        AM_DR: ("%s" % rx, "%s" % ry),
+        AM_DR_DR: ("%s" % rx, "%s" % ry),
+        AM_IR: ("AOT_READ(%s, %s)" % (sz, ry), "0"),
+        AM_DB: (ins.d8(), "0"),
+        AM_DW: (ins.d16(), "0"),
+        AM_IB: ("AOT_READ(%s, %s)" % (sz, rx), ins.d16()),
+        AM_IW: ("AOT_READ(%s, %s)" % (sz, rx), ins.d16()),
+        AM_DR_IR: (rx, "AOT_READ(%s, %s)" % (sz, ry)),
+        AM_DR_DB: (rx, ins.d8()),
+        AM_DR_DW: (rx, ins.d16()),
+        AM_DR_IB: (rx, "AOT_READ(%s, %s)" % (sz, ins.d16())),
+        AM_DR_IW: (rx, "AOT_READ(%s, %s)" % (sz, ins.d16())),
+        AM_IB_DR: (rx, ins.d16()),
+        AM_IW_DR: (rx, ins.d16()),
+    }
+    la, lb = loads[am]
+    if am in (AM_IB, AM_IW):
+        body += ["b = %s;" % lb, "a = %s;" % la]
+    else:
+        body += ["a = %s;" % la, "b = %s;" % lb]
+
+    if ins.is_jump() or ins.is_call():
+        flag = jump_flags.get(ins.op & ~1)
+        body.append("t = %s;" % (("(r[R_F] & %s) != 0" % flag) if flag
+                                 else "1"))
+        body.append("if(t) {")
+        if ins.is_call():
+            body += ["    r[R_S] -= 2;",
+                     "    core_mmu_writew(mmu, r[R_S], 0x%04x);" % ins.next]
+        body += ["    r[R_P] = a;", "}"]
+    else:
+        body.append("a = core_alu_%s(&cpu->lf, a, b);" % names[ins.op])
+
+    if am == AM_DR_DR:
+        body += ["%s = a;" % rx, "%s = b;" % ry]
+    elif am in (AM_IR, AM_IB, AM_IW):
+        body.append("AOT_WRITE(%s, %s, a);" % (sz, rx))
+    elif am in (AM_IB_DR, AM_IW_DR):
+        body.append("AOT_WRITE(%s, %s, %s);" % (sz, ins.d16(), ry))
+    elif am not in (AM_DB, AM_DW):
+        body.append("%s = a;" % rx)
+    if ins.writes_f():
+        body.append("cpu->lf.mask = 0;")
+
+    if ins.is_call():
+        body += ["if(t) {", "    AOT_HLE()", "    goto dispatch;", "}"]
+    elif ins.is_jump():
+        body.append("if(t)")
+        body.append("    goto dispatch;")
+    elif R_P in ins.writes():
+        body.append("goto dispatch;")
+    return body
+
+
+def main():
+    if len(sys.argv) < 2:
+        print("usage: aot.py <rom.kpr> [output.c]")
+        sys.exit(1)
+    fn = sys.argv[1]
+    if len(sys.argv) > 2:
+        ofn = sys.argv[2]
+    else:
+        ofn = os.path.splitext(fn)[0] + "_aot.c"
+
+    rom = read_rom(fn)
+    code, heads = discover(rom)
+
+    h = 14695981039346656037
+    for b in rom[:ROM_FIXED_END + 1]:
+        h = ((h ^ b) * 1099511628211) & 0xffffffffffffffff
+
+    pages = [0] * 256
+    for pc in code:
+        for a in range(pc, code[pc].next):
+            pages[a >> 8] = 1
+
+    out = open(ofn, "w")
+    out.write("/*\n * %s -- Translation of %s.\n *\n" %
+              (os.path.basename(ofn), os.path.basename(fn)))
+    out.write(" * Generated by aot.py; do not edit.\n *\n */\n\n")
+    out.write("#include \"core/cpu/aot.h\"\n#include \"log.h\"\n\n")
+    out.write("const uint64_t core_aot_rom_hash = 0x%016xULL;\n\n" % h)
+    out.write("const uint8_t core_aot_pages[256] = {")
+    for p in range(256):
+        if p % 16 == 0:
+            out.write("\n   ")
+        out.write(" %d," % pages[p])
+    out.write("\n};\n\n")
+
+    used = set()
+    bodies = dict((pc, emit(code[pc], code, heads, used)) for pc in code)
+    text = "\n".join(l for b in bodies.values() for l in b)
+
+    out.write("int core_aot_run(struct core_cpu *cpu, int budget)\n{\n")
+    out.write("    struct core_mmu *mmu = cpu->mmu;\n")
+    out.write("    struct core_instr *i = cpu->i;\n")
+    out.write("    uint16_t *r = cpu->r;\n")
+    if re.search(r"\ba\b", text):
+        out.write("    uint16_t a, b;\n")
+    if re.search(r"\bt\b", text):
+        out.write("    int t;\n")
+    out.write("    int cycles = 0;\n\n")
+    out.write("AOT_DISPATCH_BEGIN\n")
+
+    prev = None
+    for pc in sorted(code):
+        ins = code[pc]
+        if prev is not None and not prev.terminal() and prev.next != pc:
+            out.write("        goto dispatch;\n")
+        out.write("\n")
+        out.write("    case 0x%04x: /* %s */\n" % (pc, ins))
+        if pc in heads:
+            out.write("    %sAOT_HEAD(0x%04x)\n" %
+                      ("H_%04x: " % pc if pc in used else "", pc))
+        else:
+            out.write("        AOT_STEP(0x%04x)\n" % pc)
+        for l in bodies[pc]:
+            out.write("        %s\n" % l)
+        prev = ins
+    out.write("        goto dispatch;\n\n")
+
+    out.write("AOT_DISPATCH_END\n}\n")
+    out.close()
+
+    print("Translated", len(code), "instructions in", len(heads),
+          "blocks to", ofn)
+
+if __name__ == "__main__":
+    main()
@@ -4,7 +4,12 @@
 #
 # Simple Python script to convert Khepra assembly programs into
 # working ROMs loadable by qpra and other emulators as per the specification.
+#
+#     as.py source.s [rom.kpr]
+#
+# The ROM is written to test.kpr unless named, and its symbol map next to it.
 
+import os
 import sys
 import re
 import struct
@@ -38,6 +43,9 @@ $
 
 defs = {}
 
+# Bank each label defined in the source lies in, for the map file
+label_banks = {}
+
 directives = { ".bank":0, ".db":1, ".org":3 }
 
 banks = {
@@ -60,18 +68,23 @@ opcodes = {
         "sub":23, "mul":24, "div":25, "lsl":26, "lsr":27, "asr":28, "and":29,
         "or":30, "xor":31
         }
-rr = ["a","b","c","d","e","f"]
+rr = ["a","b","c","d","e","f","p","s"]
 
-regs = { 'a':0, 'b':1, 'c':2, 'd':3, 'e':4, 'f':5, 'p':6, 's':7 }
+# Numbered as in enum core_rid, src/core/cpu/cpu.h
+regs = { 'a':0, 'b':1, 'c':2, 'd':3, 'e':4, 'p':5, 's':6, 'f':7 }
+
+# A register operand; p and s must stand alone, not start a label
+regPattern = r"(?:[abcdef]|[ps]\b)"
+indPattern = r"\[" + regPattern + r"\]"
 
 def getAddrMode(nops, op1, op2, ds):
     #print 'getAddrMode: ', nops, ': ', op1, ', ', op2, ' -- ', ds
     if nops == 0:
         return 0
     if nops == 1:
-        if re.match("[abcdef]", op1) is not None:
+        if re.match(regPattern, op1) is not None:
             return 0
-        elif re.match("\[[abcdef]\]", op1) is not None:
+        elif re.match(indPattern, op1) is not None:
             return 1
         elif re.match("(\$[abcdef0-9]{1,2}?)|(\d{1,3}?)", op1) is not None:
             if num(op1) < 256:
@@ -97,10 +110,10 @@ def getAddrMode(nops, op1, op2, ds):
             print 'nops1 1 error: invalid operand: ', op1
             return 0
     elif nops == 2:
-        if re.match("[abcdef]", op1) is not None:
-            if re.match("[abcdef]", op2) is not None:
+        if re.match(regPattern, op1) is not None:
+            if re.match(regPattern, op2) is not None:
                 return 6
-            elif re.match("\[[abcdef]\]", op2) is not None:
+            elif re.match(indPattern, op2) is not None:
                 return 7
             elif re.match("(\$[abcdef0-9]{1,4}?)|(\d{1,5}?)", op2) is not None:
                 if num(op2) < 256:
@@ -125,13 +138,13 @@ def getAddrMode(nops, op1, op2, ds):
             else:
                 print 'nops2 1 error: invalid operand: ', op2
                 return 0
-        elif re.match("\[[abcdef]\]", op1) is not None:
-            if re.match("[abcdef]", op2) is not None:
+        elif re.match(indPattern, op1) is not None:
+            if re.match(regPattern, op2) is not None:
                 return 8
             else:
                 print 'nop2 2 error: invalid operand: ', op2
                 return 0
-        elif re.match("[abcdef]", op2) is not None:
+        elif re.match(regPattern, op2) is not None:
             if re.match("\[(\$[abcdef0-9]{1,4}?)|(\d{1,5}?)\]", op1) is not None:
                 if num(op1) < 256:
                     return 13
@@ -171,13 +184,12 @@ class instr:
         if nops > 1:
             self.op2 = op2
 
+        am = getAddrMode(nops, op1, op2, defs)
         if strop in ["nop", "int", "rti", "rts"]:
             self.size = 1
-        elif nops == 1 and self.op1 in rr:
-            self.size = 2
-        elif nops == 2 and self.op1 in rr and self.op2 in rr:
+        elif am in [0,1,6,7,8]:
             self.size = 2
-        elif getAddrMode(nops, op1, op2, defs) in [2,3,9,10,13]:
+        elif am in [2,3,9,10,13]:
             self.size = 3
         else:
             self.size = 4
@@ -195,6 +207,70 @@ class instr:
     strdata = []
     data = []
 
+    # Source line the instruction was assembled from
+    line = 0
+
+# Operands exercising each addressing mode, for checkIsa
+mode_samples = [
+        ["a"], ["[a]"], ["$10"], ["[$10]"], ["$1234"], ["[$1234]"],
+        ["a", "b"], ["a", "[b]"], ["[a]", "b"], ["a", "$10"], ["a", "[$10]"],
+        ["a", "$1234"], ["a", "[$1234]"], ["[$10]", "a"], ["[$1234]", "a"]
+        ]
+
+def checkIsa(fn):
+    """
+    Compare the opcodes, and the addressing modes and instruction lengths
+    the assembler picks, against the emulator's description of the
+    instruction set in src/core/cpu/isa.h. Returns the number of mismatches.
+    """
+    f = open(fn, "r")
+    text = f.read()
+    f.close()
+    ops = re.findall(r"X\(OP_\w+,\s*(\w+),", text)
+    modes = re.findall(r"X\((AM_\w+),\s*\w+,\s*(\d+),", text)
+    errors = 0
+
+    for o in xrange(len(ops)):
+        if opcodes.get(ops[o]) != o:
+            print 'opcode', ops[o], 'is', o, 'in', fn, 'but', \
+                    opcodes.get(ops[o]), 'here'
+            errors += 1
+
+    for am in xrange(len(mode_samples)):
+        args = mode_samples[am]
+        i = instr("mv", opcodes["mv"], len(args), *args)
+        got = getAddrMode(len(args), args[0], args[1] if len(args) > 1 else "",
+                          defs)
+        if got != am:
+            print 'operands', ', '.join(args), 'assemble to mode', got, \
+                    'not', am
+            errors += 1
+        if i.size != int(modes[am][1]):
+            print modes[am][0], 'is', modes[am][1], 'bytes long in', fn, \
+                    'but', i.size, 'here'
+            errors += 1
+
+    print 'Checked against', fn, ':', errors, 'mismatches'
+    return errors
+
+def writeMap(mapname, srcname, il):
+    """
+    Write the map file loaded by the emulator alongside the ROM: the bank and
+    address of each label, and the bank, address and source line of each
+    instruction. Banks are numbered as in the ROM file.
+    """
+    f = open(mapname, "w")
+    f.write('; qpra symbol map\n')
+    f.write('source %s\n' % srcname)
+    for name in sorted(label_banks, key=lambda n: (label_banks[n], defs[n])):
+        f.write('label %d %04x %s\n' % (label_banks[name], defs[name], name))
+    for bn in xrange(len(il)):
+        for i in il[bn]:
+            if not i.isdata:
+                f.write('line %d %04x %d\n' % (bn, i.addr, i.line))
+    f.close()
+    print 'Wrote symbol map to', mapname
+
 def main():
     argx = re.compile(anyPattern, re.VERBOSE)
     irgx = re.compile(instrPattern, re.VERBOSE)
@@ -208,6 +284,10 @@ def main():
     if(len(sys.argv) < 2):
         print 'no input files, exiting'
         exit(0)
+    if sys.argv[1] == '--check-isa':
+        exit(1 if checkIsa(sys.argv[2]) else 0)
+    if(len(sys.argv) > 2):
+        romname = sys.argv[2]
 
     # Parse the input assembly source file
     f = open(sys.argv[1], "r")
@@ -220,7 +300,7 @@ def main():
     f.close()
 
     f = open(sys.argv[1], "r")
-    for line in f:
+    for lineno, line in enumerate(f, 1):
         # Handle directives
         result = drgx.match(line)
         if result is not None:
@@ -270,9 +350,11 @@ def main():
             if result.group(3) is not None:
                 iii.w = 1 if result.group(3) == '.w' else 0
             iii.addr = org
+            iii.line = lineno
             il[b].append(iii)
             if result.group(1) is not None:
                 defs[result.group(1)[:-1]] = org
+                label_banks[result.group(1)[:-1]] = b
             org += iii.size
             continue
 
@@ -281,6 +363,7 @@ def main():
         if result is not None:
             if result.group(1) is not None:
                 defs[result.group(1)[:-1]] = org
+                label_banks[result.group(1)[:-1]] = b
 
     f.close()
 
@@ -405,6 +488,7 @@ def main():
     f.close()
 
     print 'Wrote', tc, 'bytes to', romname
+    writeMap(os.path.splitext(romname)[0] + '.map', sys.argv[1], il)
     print 'Found following labels:'
     for ddd in defs:
         print ddd, ':', hex(defs[ddd])
@@ -0,0 +1,42 @@
+; Count frames in an interrupt handler while a long straight-line loop runs.
+;
+; The VBlank interrupt is raised in the middle of the loop body, and every
+; engine must enter it at the instruction it is raised on, so traces of any
+; two written with -trace match; tracediff shows where they do not.
+
+.bank rom_fixed
+
+init:       mv a, v_handler     ; load the video IRQ handler address
+            mv [$fffa], a       ; store it in the interrupt vector
+            mv b, 0             ; frames counted by the handler
+            mv c, 0
+
+loop:       inc c               ; a block as long as the engines allow
+            add c, b
+            xor c, $55
+            lsl c, 1
+            lsr c, 1
+            inc c
+            add c, b
+            xor c, $55
+            lsl c, 1
+            lsr c, 1
+            inc c
+            add c, b
+            xor c, $55
+            lsl c, 1
+            lsr c, 1
+            inc c
+            add c, b
+            xor c, $55
+            lsl c, 1
+            lsr c, 1
+            mv [$8000], c       ; keep the running total in RAM
+            jp loop
+
+v_handler:  inc b               ; count the frame
+            rti
+
+.bank tile_swap 0
+
+.db $00,$00,$00,$00,
@@ -70,6 +70,7 @@ lib_set_sprite_pi:  mv c, s         ; Save the stack pointer
                     mv a, [s]       ; Read pi
                     mv [$eb81], a   ; Write it in the sprite palette index reg.
                     mv s, c         ; Restore the stack pointer
+                    rts
 
 ;------------------------------------------------------------------------------
 ; Set the tilemap layer 1 palette index to pi.
@@ -87,10 +88,10 @@ lib_set_layer1_pi:  mv c, s         ; Save the stack pointer
                     rts
 
 ;------------------------------------------------------------------------------
-; Set the tilemap layer 1 palette index to pi.
+; Set the tilemap layer 2 palette index to pi.
 ; Usage: lib_set_layer2_pi(pi)
 
-lib_set_layer1_pi:  mv c, s         ; Save the stack pointer
+lib_set_layer2_pi:  mv c, s         ; Save the stack pointer
                     ind s           ; s += 2 to point to pi
                     mv a, [s]       ; Read pi
                     mv b, [$eb80]   ; Read current layer 1-2 palette index
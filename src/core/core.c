@@ -7,12 +7,25 @@
  *
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "core/core.h"
+#include "core/cpu/cfg.h"
+#include "core/cpu/codecache.h"
 #include "core/cpu/cpu.h"
+#include "core/cpu/hrc.h"
+#include "core/cpu/intstat.h"
+#include "core/cpu/prof.h"
+#include "core/cpu/tier.h"
+#include "core/dbg/break.h"
+#include "core/dbg/cov.h"
+#include "core/dbg/gdb.h"
+#include "core/dbg/lockstep.h"
+#include "core/dbg/sym.h"
+#include "core/dbg/trace.h"
 //#include "core/apu/apu.h"
 #include "core/vpu/vpu.h"
 #include "core/mmu/mmu.h"
@@ -24,6 +37,97 @@ int done();
 
 const char *palette_fn = "palette.bin";
 
+/*
+ * How to run each engine, and the variants used instead when profiling,
+ * tracing, logging code and data or stopping at breakpoints, which see every
+ * instruction.
+ */
+static int (*const core_run_fns[CPU_ENGINE_NUM])(struct core_system *) = {
+    [CPU_ENGINE_CYCLE] = core_run_cycle,
+    [CPU_ENGINE_INSTR] = core_run_instr,
+    [CPU_ENGINE_THREADED] = core_run_slice,
+    [CPU_ENGINE_BLOCK] = core_run_slice,
+    [CPU_ENGINE_JIT] = core_run_slice,
+    [CPU_ENGINE_AOT] = core_run_slice,
+    [CPU_ENGINE_TIERED] = core_run_slice
+};
+static int (*const core_run_probe_fns[CPU_ENGINE_NUM])(struct core_system *) = {
+    [CPU_ENGINE_CYCLE] = core_run_cycle_probe,
+    [CPU_ENGINE_INSTR] = core_run_instr_probe,
+    [CPU_ENGINE_THREADED] = core_run_slice_probe,
+    [CPU_ENGINE_BLOCK] = core_run_slice_probe,
+    [CPU_ENGINE_JIT] = core_run_slice_probe,
+    [CPU_ENGINE_AOT] = core_run_slice_probe,
+    [CPU_ENGINE_TIERED] = core_run_slice_probe
+};
+
+/* Set by SIGUSR1 to have the profiler's output written at the next frame. */
+static volatile sig_atomic_t core_prof_requested = 0;
+/* Set by SIGUSR2 to stop in the monitor at the next frame. */
+static volatile sig_atomic_t core_break_requested = 0;
+
+static void core_prof_signal(int sig)
+{
+    core_prof_requested = 1;
+}
+
+static void core_break_signal(int sig)
+{
+    core_break_requested = 1;
+}
+
+/*
+ * Write the profiler's report and call stack samples to the files given on
+ * the command line.
+ */
+static void core_write_profile(struct core_system *core)
+{
+    FILE *fp;
+
+    if(core->opts.profile != NULL) {
+        fp = fopen(core->opts.profile, "w");
+        if(fp == NULL) {
+            LOGE("Couldn't open profile '%s' for writing", core->opts.profile);
+        } else {
+            core_prof_report(core->prof, core->cpu, core->syms, fp);
+            fclose(fp);
+            LOGD("Wrote profile to '%s'", core->opts.profile);
+        }
+    }
+    if(core->opts.sample != NULL) {
+        fp = fopen(core->opts.sample, "w");
+        if(fp == NULL) {
+            LOGE("Couldn't open samples '%s' for writing", core->opts.sample);
+        } else {
+            core_prof_folded(core->prof, core->syms, fp);
+            fclose(fp);
+            LOGD("Wrote call stack samples to '%s'", core->opts.sample);
+        }
+    }
+    if(core->opts.tierstat != NULL && core->cpu->tier != NULL) {
+        fp = fopen(core->opts.tierstat, "w");
+        if(fp == NULL) {
+            LOGE("Couldn't open tier statistics '%s' for writing",
+                 core->opts.tierstat);
+        } else {
+            core_tier_report(core->cpu->tier, fp);
+            fclose(fp);
+            LOGD("Wrote tier statistics to '%s'", core->opts.tierstat);
+        }
+    }
+    if(core->opts.intstat != NULL) {
+        fp = fopen(core->opts.intstat, "w");
+        if(fp == NULL) {
+            LOGE("Couldn't open interrupt statistics '%s' for writing",
+                 core->opts.intstat);
+        } else {
+            core_intstat_report(core->cpu->intstat, fp);
+            fclose(fp);
+            LOGD("Wrote interrupt statistics to '%s'", core->opts.intstat);
+        }
+    }
+}
+
 struct arg_pair
 {
     int argc;
@@ -39,10 +143,12 @@ void *core_entry(void *data)
 {
     struct core_system *core;
     struct core_temp_banks banks;
+    int (*const *run)(struct core_system *) = core_run_fns;
     struct timespec ts0, ts1, ts_sleep;
+    FILE *fp;
     unsigned int frame = 0;
     intmax_t us, us_sum = 0;
-    int cycles = 0;
+    int cycles = 0, dtab_kept;
 
     struct arg_pair *pair = (struct arg_pair *)data;
     
@@ -52,40 +158,157 @@ void *core_entry(void *data)
         return 0;
     }
 
+    if(!core_parse_args(&core->opts, pair->argc, pair->argv)) {
+        free(core);
+        return NULL;
+    }
+
+    memset(&banks, 0, sizeof(banks));
+    core->syms = NULL;
     if(pair->argv[1][0] != '-' && core_load_rom(core, pair->argv[1], &banks)) {
         LOGD("Loaded ROM file '%s' successfully", pair->argv[1]);
+        core_sym_load(&core->syms, pair->argv[1]);
     } else {
         LOGD("Couldn't load a ROM file");
     }
 
+    /* The predecoded instructions are the same for every ROM and engine. */
+    dtab_kept = core->opts.cache != NULL &&
+                core_codecache_read_dtab(core->opts.cache);
     if(!core_init(core, &banks)) {
         LOGE("System initialization failed; exiting");
         return NULL;
     }
+    core->cpu->engine = core->opts.engine;
+    LOGD("Using the '%s' CPU engine", core_cpu_engine_names[core->cpu->engine]);
+    core->cpu->hle = core->opts.hle;
+    if(core->cpu->engine == CPU_ENGINE_TIERED) {
+        if(!core_tier_init(&core->cpu->tier, core->opts.tier_block,
+                           core->opts.tier_jit))
+            return NULL;
+        LOGD("Promoting blocks after %d entries, and to the recompiler "
+             "after %d", core->opts.tier_block, core->opts.tier_jit);
+        if(core->opts.tierstat != NULL)
+            signal(SIGUSR1, core_prof_signal);
+    } else if(core->opts.tierstat != NULL) {
+        LOGW("Only the tiered engine keeps tier statistics");
+    }
+    if(core->cpu->hle)
+        LOGD("Running library routines natively");
+
+    core->cfg = NULL;
+    if(core->opts.cfg != NULL) {
+        if(!core_cfg_init(&core->cfg, core->mmu))
+            return NULL;
+        fp = fopen(core->opts.cfg, "w");
+        if(fp == NULL) {
+            LOGE("Couldn't open control flow graph '%s' for writing",
+                 core->opts.cfg);
+        } else {
+            core_cfg_report(core->cfg, core->syms, fp);
+            fclose(fp);
+            LOGD("Wrote control flow graph to '%s'", core->opts.cfg);
+        }
+    }
+
+    if(core->opts.cache != NULL) {
+        if(!dtab_kept)
+            core_codecache_write_dtab(core->opts.cache);
+        if(core->cpu->engine != CPU_ENGINE_BLOCK &&
+           core->cpu->engine != CPU_ENGINE_JIT) {
+            LOGW("Only the block and jit engines keep their blocks in the "
+                 "code cache");
+        } else {
+            if(!core_codecache_init(&core->cpu->codecache, core->opts.cache,
+                                    core->header->crc32, pair->argv[1]))
+                return NULL;
+            core_codecache_warm(core->cpu->codecache, core->cpu);
+        }
+    }
+
+    core->prof = NULL;
+    if(core->opts.profile != NULL || core->opts.sample != NULL) {
+        if(!core_prof_init(&core->prof, core->opts.sample != NULL ?
+                           core->opts.sample_cycles : 0))
+            return NULL;
+        run = core_run_probe_fns;
+        signal(SIGUSR1, core_prof_signal);
+        if(core->opts.profile != NULL)
+            LOGD("Profiling to '%s'", core->opts.profile);
+        if(core->opts.sample != NULL)
+            LOGD("Sampling the call stack every %d cycles to '%s'",
+                 core->opts.sample_cycles, core->opts.sample);
+        LOGD("Send SIGUSR1 to write the profiler's output early");
+    }
+
+    if(core->opts.intstat != NULL) {
+        if(!core_intstat_init(&core->cpu->intstat))
+            return NULL;
+        signal(SIGUSR1, core_prof_signal);
+        LOGD("Keeping interrupt statistics for '%s'", core->opts.intstat);
+    }
+
+    core->trace = NULL;
+    if(core->opts.trace != NULL) {
+        if(!core_trace_init(&core->trace, core->cpu, core->opts.trace,
+                            !core->opts.trace_ring))
+            return NULL;
+        run = core_run_probe_fns;
+        if(core->opts.trace_ring)
+            LOGD("Tracing the last %d KiB of execution to '%s'",
+                 CORE_TRACE_BLOCKS * CORE_TRACE_BLOCK / 1024, core->opts.trace);
+        else
+            LOGD("Tracing execution to '%s'", core->opts.trace);
+    }
+
+    core->lockstep = NULL;
+    if(core->opts.lockstep >= 0 && !core_lockstep_init(core, pair->argv[1]))
+        return NULL;
+
+    core->cov = NULL;
+    if(core->opts.cov != NULL) {
+        if(!core_cov_init(&core->cov, core->mmu))
+            return NULL;
+        core->mmu->cov = core->cov;
+        run = core_run_probe_fns;
+        LOGD("Logging code and data accesses to '%s'", core->opts.cov);
+    }
+
+    if(!core_break_init(&core->brk, core->mmu))
+        return NULL;
+    if(core->opts.debug)
+        core->brk->reason = BREAK_PAUSE;
+    signal(SIGUSR2, core_break_signal);
+    LOGD("Send SIGUSR2 to stop in the monitor");
+
+    core->gdb = NULL;
+    if(core->opts.gdb != NULL) {
+        if(!core_gdb_init(&core->gdb, core, core->opts.gdb))
+            return NULL;
+        LOGD("Serving a debugger on '%s'", core->opts.gdb);
+    }
 
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts0);
     LOGD("Beginning emulation");
     while(!done()) {
-        uint16_t pc = core->cpu->r[R_P];
-        core->cpu->i_cycles = 0;
-        core->cpu->i_done = 0;
-        core->cpu->i_middle = 0;
-
-        do {
-            /* Apply any pending read/write requests on the bus. */
-            core_mmu_update(core->cpu->mmu);
-            /* Execute a cycle in the VPU. */
-            core_vpu_cycle(core->vpu, core->cpu->total_cycles);
-            /* Execute an instruction cycle in the CPU. */
-            core_cpu_i_cycle(core->cpu);
-            LOGV("core.cpu: ... cycle %d", core->cpu->i_cycles);
-
-            //core->cpu->i_middle = 0;
-            cycles += 1;
-        } while(!core->cpu->i_done);
-
-        LOGV("core.cpu: %04x: %s (%d cycles)",
-             pc, instrnam[INSTR_OP(core->cpu->i)], core->cpu->i_cycles);
+        if(core->brk->reason != BREAK_NONE) {
+            if(core->gdb != NULL ? !core_gdb_stopped(core->gdb) :
+               !core_break_monitor(core))
+                break;
+            if(core->cov != NULL)
+                core_cov_forget(core->cov);
+            run = core_break_armed(core->brk) || core->prof != NULL ||
+                  core->trace != NULL || core->cov != NULL ?
+                  core_run_probe_fns : core_run_fns;
+            clock_gettime(CLOCK_MONOTONIC_RAW, &ts0);
+        }
+        if(core->lockstep != NULL) {
+            cycles += core_run_lockstep(core, run);
+            if(core->lockstep->failed)
+                break;
+        } else {
+            cycles += run[core->cpu->engine](core);
+        }
 #ifdef _DEBUG
         getc(stdin);
 #else
@@ -112,12 +335,53 @@ void *core_entry(void *data)
                 nanosleep(&ts_sleep, NULL);
             }
             
+            if(core->cpu->intstat != NULL)
+                core_intstat_frame(core->cpu->intstat);
+            if(core_prof_requested) {
+                core_prof_requested = 0;
+                core_write_profile(core);
+            }
+            if(core_break_requested) {
+                core_break_requested = 0;
+                core->brk->reason = BREAK_PAUSE;
+            }
+            if(core->gdb != NULL && core_gdb_stop_requested(core->gdb))
+                core->brk->reason = BREAK_PAUSE;
+
             clock_gettime(CLOCK_MONOTONIC_RAW, &ts0);
             cycles = 0;
         }
 #endif
     }
     LOGD("Finished emulation");
+    if(core->prof != NULL || core->cpu->intstat != NULL ||
+       core->cpu->tier != NULL)
+        core_write_profile(core);
+    if(core->prof != NULL)
+        core_prof_destroy(core->prof);
+    if(core->cpu->intstat != NULL)
+        core_intstat_destroy(core->cpu->intstat);
+    if(core->trace != NULL)
+        core_trace_destroy(core->trace);
+    if(core->lockstep != NULL)
+        core_lockstep_destroy(core);
+    if(core->gdb != NULL)
+        core_gdb_destroy(core->gdb);
+    if(core->cov != NULL) {
+        core_cov_write(core->cov, core->opts.cov);
+        core_cov_destroy(core->cov);
+    }
+    core_break_destroy(core->brk);
+    if(core->syms != NULL)
+        core_sym_destroy(core->syms);
+    if(core->cfg != NULL)
+        core_cfg_destroy(core->cfg);
+    if(core->cpu->codecache != NULL) {
+        core_cpu_b_keep(core->cpu);
+        core_cpu_j_keep(core->cpu);
+        core_codecache_write(core->cpu->codecache);
+        core_codecache_destroy(core->cpu->codecache);
+    }
     core_destroy(core);
     free(core);
 
@@ -125,6 +389,639 @@ void *core_entry(void *data)
 }
 
 
+/*
+ * Parse the options following the ROM file name.
+ * Returns 0 if an option is not understood.
+ */
+int core_parse_args(struct core_options *opts, int argc, char **argv)
+{
+    int i, e;
+
+    opts->engine = CPU_ENGINE_CYCLE;
+    opts->hle = 0;
+    opts->profile = NULL;
+    opts->sample = NULL;
+    opts->sample_cycles = CORE_PROF_SAMPLE_CYCLES;
+    opts->trace = NULL;
+    opts->trace_ring = 0;
+    opts->lockstep = -1;
+    opts->lockstep_cycles = 0;
+    opts->debug = 0;
+    opts->gdb = NULL;
+    opts->cov = NULL;
+    opts->intstat = NULL;
+    opts->cache = NULL;
+    opts->cfg = NULL;
+    opts->tier_block = CORE_TIER_BLOCK;
+    opts->tier_jit = CORE_TIER_JIT;
+    opts->tierstat = NULL;
+
+    for(i = 2; i < argc; ++i) {
+        if((!strcmp(argv[i], "-engine") || !strcmp(argv[i], "-lockstep")) &&
+           i + 1 < argc) {
+            ++i;
+            for(e = 0; e < CPU_ENGINE_NUM; ++e) {
+                if(!strcmp(argv[i], core_cpu_engine_names[e]))
+                    break;
+            }
+            if(e == CPU_ENGINE_NUM) {
+                LOGE("Unknown CPU engine '%s'", argv[i]);
+                return 0;
+            }
+            if(!strcmp(argv[i - 1], "-engine"))
+                opts->engine = e;
+            else
+                opts->lockstep = e;
+        } else if(!strcmp(argv[i], "-hle")) {
+            opts->hle = 1;
+        } else if(!strcmp(argv[i], "-debug")) {
+            opts->debug = 1;
+        } else if(!strcmp(argv[i], "-gdb") && i + 1 < argc) {
+            opts->gdb = argv[++i];
+        } else if(!strcmp(argv[i], "-cov") && i + 1 < argc) {
+            opts->cov = argv[++i];
+        } else if(!strcmp(argv[i], "-intstat") && i + 1 < argc) {
+            opts->intstat = argv[++i];
+        } else if(!strcmp(argv[i], "-cache") && i + 1 < argc) {
+            opts->cache = argv[++i];
+        } else if(!strcmp(argv[i], "-cfg") && i + 1 < argc) {
+            opts->cfg = argv[++i];
+        } else if((!strcmp(argv[i], "-tier-block") ||
+                   !strcmp(argv[i], "-tier-jit")) && i + 1 < argc) {
+            ++i;
+            e = atoi(argv[i]);
+            if(e < 0) {
+                LOGE("Bad number of entries before promotion '%s'", argv[i]);
+                return 0;
+            }
+            if(!strcmp(argv[i - 1], "-tier-block"))
+                opts->tier_block = e;
+            else
+                opts->tier_jit = e;
+        } else if(!strcmp(argv[i], "-tierstat") && i + 1 < argc) {
+            opts->tierstat = argv[++i];
+        } else if(!strcmp(argv[i], "-profile") && i + 1 < argc) {
+            opts->profile = argv[++i];
+        } else if(!strcmp(argv[i], "-sample") && i + 1 < argc) {
+            opts->sample = argv[++i];
+        } else if(!strcmp(argv[i], "-sample-cycles") && i + 1 < argc) {
+            opts->sample_cycles = atoi(argv[++i]);
+            if(opts->sample_cycles <= 0) {
+                LOGE("Bad number of cycles between samples '%s'", argv[i]);
+                return 0;
+            }
+        } else if(!strcmp(argv[i], "-trace") && i + 1 < argc) {
+            opts->trace = argv[++i];
+            opts->trace_ring = 0;
+        } else if(!strcmp(argv[i], "-trace-ring") && i + 1 < argc) {
+            opts->trace = argv[++i];
+            opts->trace_ring = 1;
+        } else if(!strcmp(argv[i], "-lockstep-cycles") && i + 1 < argc) {
+            opts->lockstep_cycles = atoi(argv[++i]);
+            if(opts->lockstep_cycles < 0) {
+                LOGE("Bad number of cycles between comparisons '%s'",
+                     argv[i]);
+                return 0;
+            }
+        } else {
+            LOGE("Unknown option '%s'", argv[i]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+ * Run the devices in lockstep, one cycle at a time, until the CPU has
+ * finished its current instruction. Returns the number of cycles run.
+ */
+int core_run_cycle(struct core_system *core)
+{
+    int cycles = 0;
+
+    core->cpu->i_cycles = 0;
+    core->cpu->i_done = 0;
+    core->cpu->i_middle = 0;
+    core_cpu_int_update(core->cpu);
+
+    do {
+        /* Apply any pending read/write requests on the bus. */
+        core_mmu_update(core->cpu->mmu);
+        /* Execute a cycle in the VPU. */
+        core_vpu_cycle(core->vpu, core->cpu->total_cycles);
+        /* Execute an instruction cycle in the CPU. */
+        core_cpu_i_cycle(core->cpu);
+        LOGV("core.cpu: ... cycle %d", core->cpu->i_cycles);
+
+        //core->cpu->i_middle = 0;
+        cycles += 1;
+    } while(!core->cpu->i_done);
+
+    return cycles;
+}
+
+
+/*
+ * Run a whole CPU instruction at once, then let the other devices catch up.
+ * Returns the number of cycles run.
+ */
+int core_run_instr(struct core_system *core)
+{
+    struct core_cpu *cpu = core->cpu;
+    uint16_t pc = cpu->r[R_P];
+    int ahead = core_run_ahead(core), cycles, total;
+
+    cycles = total = core_cpu_i_instr(cpu);
+    core_catch_up(core, cycles - ahead);
+
+    /*
+     * Only an interrupt gets the CPU out of a jump to itself, so skip
+     * executing it again while waiting for one, up to a slice at a time.
+     */
+    if(core_cpu_idle_self(cpu, pc)) {
+        while(total < CORE_SLICE_CYCLES && !core_event_now(core) &&
+              !core_cpu_int_due(cpu, cpu->r[R_F])) {
+            core_catch_up(core, cycles);
+            total += cycles;
+        }
+    }
+    return total;
+}
+
+
+/*
+ * Does the VPU or the HRC raise an interrupt, or begin or end VBlank, on the
+ * cycle the CPU is about to start?
+ */
+int core_event_now(struct core_system *core)
+{
+    return core_vpu_next_event(core->vpu, core->cpu->total_cycles) == 1 ||
+           core_cpu_hrc_next(core->cpu) == 1;
+}
+
+/*
+ * The cycle engine runs the other devices before the CPU on every cycle, so
+ * an interrupt raised on the cycle an instruction would start on is entered
+ * instead. To do the same, run the devices through that cycle before the CPU
+ * starts, if one of them has anything to do on it. Returns the cycles run
+ * ahead, which the catch-up after the CPU has run must leave out.
+ */
+int core_run_ahead(struct core_system *core)
+{
+    if(!core_event_now(core))
+        return 0;
+    core_catch_up(core, 1);
+    core->cpu->lead = 1;
+    return 1;
+}
+
+/*
+ * Cycles the CPU may run ahead of the other devices: a slice, cut short so
+ * that it ends on the first instruction boundary at or after the cycle on
+ * which the VPU or the HRC next has anything to do. core_run_ahead() then
+ * enters an interrupt raised on that cycle before the next instruction, as
+ * the cycle engine would. The HRC may still be started in the slice, and
+ * fire before its end.
+ */
+int core_slice_budget(struct core_system *core)
+{
+    int budget = CORE_SLICE_CYCLES, n;
+
+    n = core_vpu_next_event(core->vpu, core->cpu->total_cycles) - 1;
+    if(n < budget)
+        budget = n;
+    n = core_cpu_hrc_next(core->cpu) - 1;
+    if(n < budget)
+        budget = n;
+    return budget > 0 ? budget : 1;
+}
+
+/*
+ * Let the CPU run ahead of the other devices for a slice of cycles, then
+ * catch them up. Returns the number of cycles run.
+ */
+int core_run_slice(struct core_system *core)
+{
+    int ahead = core_run_ahead(core);
+
+    return core_run_budget(core, core_slice_budget(core), ahead);
+}
+
+/*
+ * Let the CPU run ahead of the other devices through a slice engine for at
+ * least the given number of cycles, then catch them up, leaving out those
+ * already run ahead. Returns the number of cycles run.
+ */
+int core_run_budget(struct core_system *core, int budget, int ahead)
+{
+    int cycles = 0;
+
+    switch(core->cpu->engine) {
+        case CPU_ENGINE_THREADED:
+            cycles = core_cpu_t_run(core->cpu, budget);
+            break;
+        case CPU_ENGINE_BLOCK:
+            cycles = core_cpu_b_run(core->cpu, budget);
+            break;
+        case CPU_ENGINE_JIT:
+            cycles = core_cpu_j_run(core->cpu, budget);
+            break;
+        case CPU_ENGINE_AOT:
+            cycles = core_cpu_a_run(core->cpu, budget);
+            break;
+        case CPU_ENGINE_TIERED:
+            cycles = core_cpu_tier_run(core->cpu, budget);
+            break;
+        default:
+            break;
+    }
+
+    core_catch_up(core, cycles - ahead);
+    return cycles;
+}
+
+/*
+ * Record the instruction just run from pc, which started with the stack
+ * pointer at s and took the given cycles, in the profiler, the trace and the
+ * code/data log.
+ */
+static void core_probe_instr(struct core_system *core, uint16_t pc,
+        uint16_t s, int cycles)
+{
+    if(core->prof != NULL)
+        core_prof_instr(core->prof, core->cpu, pc, s, cycles);
+    if(core->trace != NULL)
+        core_trace_instr(core->trace, core->cpu, pc, cycles);
+    if(core->cov != NULL)
+        core_cov_instr(core->cov, core->mmu, pc, core->cpu->d->len);
+}
+
+/* Likewise for the interrupt just entered. */
+static void core_probe_interrupt(struct core_system *core, int cycles)
+{
+    if(core->prof != NULL)
+        core_prof_interrupt(core->prof, core->cpu, cycles);
+    if(core->trace != NULL)
+        core_trace_interrupt(core->trace, core->cpu, cycles);
+    if(core->cov != NULL)
+        core_cov_interrupt(core->cov);
+}
+
+/*
+ * Stop before the next instruction if there is a breakpoint at it or a step
+ * has been taken, or now if the step just run from pc, an instruction or an
+ * interrupt entry, hit a watchpoint.
+ */
+static void core_probe_break(struct core_system *core, uint16_t pc)
+{
+    struct core_break *brk = core->brk;
+
+    if(brk->reason == BREAK_WATCH)
+        brk->at = pc;
+    else if(brk->step)
+        brk->reason = BREAK_STEP;
+    else if(core_break_at(brk, core->cpu->r[R_P]))
+        brk->reason = BREAK_EXEC;
+    else
+        return;
+    brk->step = 0;
+}
+
+/*
+ * As core_run_cycle(), also recording the instruction in the profiler and
+ * the trace, along with any interrupts entered before it.
+ */
+int core_run_cycle_probe(struct core_system *core)
+{
+    struct core_cpu *cpu = core->cpu;
+    uint16_t pc = cpu->r[R_P], s = cpu->r[R_S], p, sp;
+    int cycles = 0, start = 0, entering = 0, middle;
+
+    cpu->i_cycles = 0;
+    cpu->i_done = 0;
+    cpu->i_middle = 0;
+    core_cpu_int_update(cpu);
+
+    do {
+        p = cpu->r[R_P];
+        sp = cpu->r[R_S];
+        middle = cpu->i_middle;
+        core_mmu_update(cpu->mmu);
+        core_vpu_cycle(core->vpu, cpu->total_cycles);
+        core_cpu_i_cycle(cpu);
+
+        /* The instruction starts on the cycle which leaves i_middle set. */
+        if(!middle && cpu->i_middle) {
+            pc = p;
+            s = sp;
+            start = cycles;
+        } else if(!middle) {
+            entering += 1;
+            if(cpu->i_cycles == 0) {
+                core_probe_interrupt(core, entering);
+                entering = 0;
+                /* Stop before the handler's first instruction if need be. */
+                core_probe_break(core, p);
+                if(core->brk->reason != BREAK_NONE)
+                    return cycles + 1;
+            }
+        }
+        cycles += 1;
+    } while(!cpu->i_done);
+
+    core_probe_instr(core, pc, s, cycles - start);
+    core_probe_break(core, pc);
+    return cycles;
+}
+
+
+/*
+ * As core_run_instr(), also recording the instruction in the profiler and the
+ * trace. Loops waiting on an interrupt are run in full.
+ */
+int core_run_instr_probe(struct core_system *core)
+{
+    struct core_cpu *cpu = core->cpu;
+    uint16_t pc = cpu->r[R_P], s = cpu->r[R_S];
+    int ahead = core_run_ahead(core), cycles;
+
+    if(core_cpu_int_due(cpu, cpu->r[R_F])) {
+        cycles = core_cpu_i_interrupt(cpu);
+        core_probe_interrupt(core, cycles);
+    } else {
+        cycles = core_cpu_i_exec(cpu);
+        core_probe_instr(core, pc, s, cycles);
+    }
+    core_probe_break(core, pc);
+    core_catch_up(core, cycles - ahead);
+    return cycles;
+}
+
+
+/*
+ * Record an instruction run by an engine going through a block, and stop
+ * the block at a breakpoint or, as its own run would, once the slice's
+ * budget is spent; see core_cpu_probe_fn.
+ */
+static int core_probe_step(void *data, uint16_t pc, uint16_t s, int cycles)
+{
+    struct core_system *core = data;
+
+    core_probe_instr(core, pc, s, cycles);
+    core_probe_break(core, pc);
+    core->probe_left -= cycles;
+    return core->brk->reason != BREAK_NONE || core->probe_left <= 0;
+}
+
+/*
+ * Run what the slice engine runs between two checks for interrupts and for
+ * the end of its budget, through its own dispatch: an instruction for the
+ * threaded engine and the translated ROM, which check before every one, and
+ * a block for the others. Each instruction is recorded as it is run.
+ * Returns the cycles taken.
+ */
+static int core_run_probe_step(struct core_system *core)
+{
+    struct core_cpu *cpu = core->cpu;
+    uint16_t pc = cpu->r[R_P], s = cpu->r[R_S];
+    int cycles = -1;
+
+    switch(cpu->engine) {
+        case CPU_ENGINE_THREADED:
+            cycles = core_cpu_t_run(cpu, 1);
+            break;
+        case CPU_ENGINE_AOT:
+            cycles = core_cpu_a_single(cpu);
+            break;
+        /* These record the instructions of the block themselves. */
+        case CPU_ENGINE_BLOCK:
+            cycles = core_cpu_b_probe(cpu, core_probe_step, core);
+            if(cycles >= 0)
+                return cycles;
+            break;
+        case CPU_ENGINE_JIT:
+            cycles = core_cpu_j_probe(cpu, core_probe_step, core);
+            if(cycles >= 0)
+                return cycles;
+            break;
+        case CPU_ENGINE_TIERED:
+            cycles = core_cpu_tier_probe(cpu, core_probe_step, core);
+            if(cycles >= 0)
+                return cycles;
+            break;
+        default:
+            break;
+    }
+
+    /* Code an engine cannot run is interpreted, as its own run would. */
+    if(cycles < 0) {
+        cpu->ahead = 0;
+        cycles = core_cpu_i_exec(cpu);
+    }
+    core_probe_step(core, pc, s, cycles);
+    return cycles;
+}
+
+/*
+ * Stands in for core_run_slice() when profiling, tracing or debugging. Runs
+ * the slice through the engine's own dispatch, recording each instruction,
+ * so that what is recorded is what that engine did. Interrupts are entered
+ * where the engine would enter them. Loops waiting on an interrupt are run
+ * in full, and the block cache does not fuse instructions. The slice ends
+ * early on reaching a breakpoint.
+ */
+int core_run_slice_probe(struct core_system *core)
+{
+    struct core_cpu *cpu = core->cpu;
+    uint16_t pc;
+    int ahead = core_run_ahead(core), budget = core_slice_budget(core);
+    int cycles = 0, n;
+
+    while(cycles < budget && core->brk->reason == BREAK_NONE) {
+        /* The engine is entered afresh, the devices behind by the slice. */
+        cpu->lead = ahead - cycles;
+        if(core_cpu_int_due(cpu, cpu->r[R_F])) {
+            pc = cpu->r[R_P];
+            cpu->ahead = 0;
+            n = core_cpu_i_interrupt(cpu);
+            core_probe_interrupt(core, n);
+            core_probe_break(core, pc);
+        } else {
+            core->probe_left = budget - cycles;
+            n = core_run_probe_step(core);
+        }
+        cycles += n;
+    }
+
+    core_catch_up(core, cycles - ahead);
+    return cycles;
+}
+
+
+/*
+ * Run a system of a lockstep comparison up to the given cycle. The slice
+ * engines are given no more than the cycles left as their budget, and the
+ * instr engine does not skip idle loops, so that each stops at the first
+ * instruction boundary it can on or after that cycle. Only the cycle engine,
+ * running an interrupt entry and the instruction after it as one step, may
+ * leave it further on.
+ */
+void core_lockstep_follow(struct core_system *other, uint64_t now)
+{
+    struct core_cpu *cpu = other->cpu;
+    uint64_t left;
+    int ahead, budget;
+
+    while(cpu->total_cycles < now) {
+        if(cpu->engine == CPU_ENGINE_CYCLE) {
+            core_run_cycle(other);
+            continue;
+        }
+        left = now - cpu->total_cycles;
+        ahead = core_run_ahead(other);
+        if(cpu->engine == CPU_ENGINE_INSTR) {
+            core_catch_up(other, core_cpu_i_instr(cpu) - ahead);
+        } else {
+            budget = core_slice_budget(other);
+            if(left < (uint64_t)budget)
+                budget = left;
+            core_run_budget(other, budget, ahead);
+        }
+    }
+}
+
+/*
+ * Run the system a step, with the given run functions, then the other system
+ * of the lockstep comparison up to the same cycle, comparing the two there.
+ * Should the cycle engine take the other past it, the system runs on to meet
+ * it, without the run functions or their probes. Two systems which still do
+ * not stop on the same cycle have diverged. Returns the number of cycles the
+ * system ran.
+ */
+int core_run_lockstep(struct core_system *core,
+        int (*const *run)(struct core_system *))
+{
+    struct core_lockstep *ls = core->lockstep;
+    struct core_system *other = ls->other;
+    int cycles = run[core->cpu->engine](core);
+    uint64_t now = core->cpu->total_cycles;
+
+    core_lockstep_follow(other, now);
+    if(other->cpu->total_cycles > now) {
+        core_lockstep_follow(core, other->cpu->total_cycles);
+        cycles += core->cpu->total_cycles - now;
+        now = core->cpu->total_cycles;
+    }
+
+    if(other->cpu->total_cycles != now) {
+        LOGE("core.lockstep: the engines stopped on cycles %llu and %llu",
+             (unsigned long long)now,
+             (unsigned long long)other->cpu->total_cycles);
+        core_lockstep_dump(core, other, ls->agreed);
+        ls->failed = 1;
+        return cycles;
+    }
+
+    if(now >= ls->next) {
+        /*
+         * The cycle engine leaves an instruction's last access on the bus
+         * for the next cycle to make, which may as well happen now.
+         */
+        core_mmu_update(core->mmu);
+        core_mmu_update(other->mmu);
+        ls->checks += 1;
+        if(!core_lockstep_compare(core, other)) {
+            core_lockstep_dump(core, other, ls->agreed);
+            ls->failed = 1;
+        }
+        ls->agreed = now;
+        ls->next = now + ls->every;
+    }
+    return cycles;
+}
+
+/*
+ * Start a second system on the ROM file, running the engine given to compare
+ * against in lockstep.
+ */
+int core_lockstep_init(struct core_system *core, const char *fn)
+{
+    struct core_temp_banks banks;
+    struct core_lockstep *ls;
+    struct core_system *other;
+
+    if(fn[0] == '-') {
+        LOGE("A ROM file is needed to compare engines in lockstep");
+        return 0;
+    }
+    ls = calloc(1, sizeof(struct core_lockstep));
+    other = calloc(1, sizeof(struct core_system));
+    if(ls == NULL || other == NULL) {
+        LOGE("Could not allocate the lockstep system");
+        free(ls);
+        free(other);
+        return 0;
+    }
+    memset(&banks, 0, sizeof(banks));
+    if(!core_load_rom(other, fn, &banks) || !core_init(other, &banks)) {
+        LOGE("Lockstep system initialization failed");
+        free(ls);
+        free(other);
+        return 0;
+    }
+    other->opts = core->opts;
+    other->cpu->engine = core->opts.lockstep;
+    other->cpu->hle = core->opts.hle;
+
+    ls->other = other;
+    ls->every = core->opts.lockstep_cycles;
+    core->lockstep = ls;
+    if(ls->every > 0)
+        LOGD("Comparing with the '%s' engine every %d cycles",
+             core_cpu_engine_names[other->cpu->engine], ls->every);
+    else
+        LOGD("Comparing with the '%s' engine after every instruction",
+             core_cpu_engine_names[other->cpu->engine]);
+    return 1;
+}
+
+void core_lockstep_destroy(struct core_system *core)
+{
+    struct core_lockstep *ls = core->lockstep;
+
+    if(!ls->failed)
+        LOGD("core.lockstep: the engines agreed %llu times, up to cycle %llu",
+             (unsigned long long)ls->checks,
+             (unsigned long long)ls->agreed);
+    core_destroy(ls->other);
+    free(ls->other->header);
+    free(ls->other);
+    free(ls);
+    core->lockstep = NULL;
+}
+
+
+/*
+ * Advance the VPU, the HRC and the cycle counter by the given number of
+ * cycles, which the CPU has already executed.
+ */
+void core_catch_up(struct core_system *core, int cycles)
+{
+    struct core_cpu *cpu = core->cpu;
+
+    cpu->ahead = 0;
+    cpu->lead = 0;
+    while(cycles-- > 0) {
+        core_mmu_update(cpu->mmu);
+        core_vpu_cycle(core->vpu, cpu->total_cycles);
+        core_cpu_hrc_step(cpu);
+        cpu->total_cycles += 1;
+    }
+}
+
+
 /* 
  * Top-level initialization routine.
  * Initializes the various devices in core_system, turn by turn.
@@ -23,6 +23,10 @@
 #define CORE_CYCLES_F_PRE_VBLANK    88319
 #endif
 
+/* Cycles the CPU may run ahead of the other devices in the faster engines. */
+#ifndef CORE_SLICE_CYCLES
+#define CORE_SLICE_CYCLES           64
+#endif
 
 enum core_buf_type {
     CORE_HDR_ROMF=0, CORE_HDR_ROMS=1, CORE_HDR_RAMF=2,
@@ -66,6 +70,46 @@ struct core_temp_banks
     uint8_t *dpcm_s[256];
 };
 
+/* Options given on the command line after the ROM file name. */
+struct core_options
+{
+    /* CPU execution engine, an enum core_cpu_engine. */
+    int engine;
+    /* Run library routines natively; see core/cpu/hle.c. */
+    int hle;
+    /* File to write the profiler's report to, or NULL not to profile. */
+    const char *profile;
+    /* File to write call stack samples to, or NULL not to sample. */
+    const char *sample;
+    /* Cycles between call stack samples. */
+    int sample_cycles;
+    /* File to write an execution trace to, or NULL not to trace. */
+    const char *trace;
+    /* Only keep the end of the trace, in memory until exit. */
+    int trace_ring;
+    /* Engine to compare against in lockstep, or -1 not to. */
+    int lockstep;
+    /* Cycles between lockstep comparisons; 0 for every chance. */
+    int lockstep_cycles;
+    /* Start stopped in the monitor; see dbg/break.c. */
+    int debug;
+    /* Port or Unix socket to serve a debugger on, or NULL; see dbg/gdb.c. */
+    const char *gdb;
+    /* File to write the code/data log to, or NULL not to log. */
+    const char *cov;
+    /* File to write interrupt statistics to, or NULL not to keep them. */
+    const char *intstat;
+    /* Directory to keep code caches in, or NULL not to; see codecache.c. */
+    const char *cache;
+    /* File to write the ROM's control flow graph to, or NULL not to. */
+    const char *cfg;
+    /* Entries before the tiered engine promotes a block to each tier. */
+    int tier_block;
+    int tier_jit;
+    /* File to write the tiered engine's statistics to, or NULL not to. */
+    const char *tierstat;
+};
+
 struct core_system
 {
     struct core_cpu *cpu;
@@ -76,11 +120,48 @@ struct core_system
     struct core_pad *pad;
 
     struct core_header_map *header;
+    struct core_options opts;
+    /* Guest code profiler, if enabled. */
+    struct core_prof *prof;
+    /* Execution trace, if enabled. */
+    struct core_trace *trace;
+    /* Symbol map of the ROM, if as.py left one next to it. */
+    struct core_syms *syms;
+    /* Second system run with another engine to compare with, if enabled. */
+    struct core_lockstep *lockstep;
+    /* Breakpoints and watchpoints. */
+    struct core_break *brk;
+    /* Debugger stub, if enabled, which takes the monitor's place. */
+    struct core_gdb *gdb;
+    /* Code/data log, if enabled. */
+    struct core_cov *cov;
+    /* Control flow found in the ROM before running it, if asked for. */
+    struct core_cfg *cfg;
+    /* Cycles left of the slice being probed, to end a block where its own
+     * run would. */
+    int probe_left;
 };
 
 void *core_entry(void *);
 int core_init(struct core_system *, struct core_temp_banks *);
 int core_destroy(struct core_system *core);
+static int core_parse_args(struct core_options *, int, char **);
+static int core_run_cycle(struct core_system *);
+static int core_run_instr(struct core_system *);
+static int core_event_now(struct core_system *);
+static int core_run_ahead(struct core_system *);
+static int core_slice_budget(struct core_system *);
+static int core_run_slice(struct core_system *);
+static int core_run_budget(struct core_system *, int, int);
+static int core_run_cycle_probe(struct core_system *);
+static int core_run_instr_probe(struct core_system *);
+static int core_run_slice_probe(struct core_system *);
+static int core_run_lockstep(struct core_system *,
+        int (*const *)(struct core_system *));
+static void core_lockstep_follow(struct core_system *, uint64_t);
+static int core_lockstep_init(struct core_system *, const char *);
+static void core_lockstep_destroy(struct core_system *);
+static void core_catch_up(struct core_system *, int);
 static int core_load_rom(struct core_system *, const char *,
         struct core_temp_banks *);
 static int core_load_palette(struct core_system *, uint8_t *);
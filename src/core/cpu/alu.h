@@ -0,0 +1,256 @@
+/*
+ * core/cpu/alu.h -- CPU arithmetic and logic operations (header).
+ *
+ * Defines the arithmetic and logic instructions as operations on plain
+ * values. They are shared by every execution engine, so that they all agree
+ * on results and flags.
+ *
+ * Flags are evaluated lazily. An operation only records itself in the
+ * core_lazy_flags passed in, adding the flags it clears to the mask, and
+ * core_alu_sync() works the flags out when something reads F: those set by
+ * the last operation, over the previous value with every flag in the mask
+ * taken out. This is what running the operations one at a time would leave
+ * only if every flag an operation can set is cleared by any operation which
+ * may follow it; a flag set earlier and not cleared later would otherwise be
+ * lost. It holds because every operation here only ever sets Z, as
+ * core_alu__flags() joins its terms with ||, and every mask includes Z. An
+ * operation setting any other flag must keep it true.
+ *
+ */
+
+#ifndef QPRA_CORE_ALU_H
+#define QPRA_CORE_ALU_H
+
+#include <stdint.h>
+
+#include "core/cpu/cpu.h"
+
+#define ALU_FLAGS_ALL   (FLAG_Z | FLAG_N | FLAG_C | FLAG_O)
+#define ALU_FLAGS_ZN    (FLAG_Z | FLAG_N)
+
+/* Record a flag-setting operation and the flags it clears. */
+static inline void core_alu__defer(struct core_lazy_flags *lf, int op,
+        uint16_t mask, uint16_t a, uint16_t b)
+{
+    lf->mask |= mask;
+    lf->op = op;
+    lf->a = a;
+    lf->b = b;
+}
+
+/*
+ * Flags shared by the two-operand arithmetic and logic operations, given the
+ * 16-bit result and the same operation performed on 32 bits.
+ */
+static inline uint16_t core_alu__flags(uint16_t temp, int32_t itemp)
+{
+    return !temp ||                     /* Z */
+            ((itemp > 0xffff) << 1) ||  /* C */
+            ((itemp > 0x7fff) << 2);    /* O */
+}
+
+/* Apply the flags of the pending operation, if any, to f. */
+static inline void core_alu_sync(uint16_t *f, struct core_lazy_flags *lf)
+{
+    uint16_t a = lf->a, b = lf->b, set = 0;
+    uint32_t utemp;
+    int32_t itemp;
+    int16_t temp;
+
+    if(!lf->mask)
+        return;
+    switch(lf->op) {
+        case OP_MV:
+            set = !b;
+            break;
+        case OP_TST:
+            set = !(a & b);
+            break;
+        case OP_CMP:
+        case OP_SUB:
+            set = core_alu__flags(a - b, (int32_t)a - (int32_t)b);
+            break;
+        case OP_ADD:
+            set = core_alu__flags(a + b, (int32_t)a + (int32_t)b);
+            break;
+        case OP_MUL:
+            set = core_alu__flags(a * b, (int32_t)a * (int32_t)b);
+            break;
+        case OP_DIV:
+            set = core_alu__flags(a / b, (int32_t)a / (int32_t)b);
+            break;
+        case OP_LSL:
+            set = core_alu__flags(a << b, (int32_t)a << (int32_t)b);
+            break;
+        case OP_LSR:
+            utemp = (uint32_t)a >> (uint32_t)b;
+            set = !(uint16_t)(a >> b) ||        /* Z */
+                    ((utemp > 0xffff) << 1) ||  /* C */
+                    ((utemp > 0x7fff) << 2);    /* O */
+            break;
+        case OP_ASR:
+            /*
+             * The 32-bit shift operates on both operands packed together, as
+             * the instruction always has.
+             */
+            temp = (int16_t)a >> (int16_t)b;
+            itemp = (int32_t)((uint32_t)a | (uint32_t)b << 16) >> (int32_t)b;
+            set = !temp ||                      /* Z */
+                    ((itemp > 0xffff) << 1) ||  /* C */
+                    ((itemp > 0x7fff) << 2) ||  /* O */
+                    ((temp < 0) << 3);          /* N */
+            break;
+        case OP_AND:
+            set = core_alu__flags(a & b, (int32_t)a & (int32_t)b);
+            break;
+        case OP_OR:
+            set = core_alu__flags(a | b, (int32_t)a | (int32_t)b);
+            break;
+        case OP_XOR:
+            set = core_alu__flags(a ^ b, (int32_t)a ^ (int32_t)b);
+            break;
+    }
+    *f = (*f & ~lf->mask) | set;
+    lf->mask = 0;
+}
+
+/* NOT: bitwise complement. Flags are unaffected. */
+static inline uint16_t core_alu_not(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    return ~a;
+}
+
+/* INC: increment by one. Flags are unaffected. */
+static inline uint16_t core_alu_inc(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    return a + 1;
+}
+
+/* DEC: decrement by one. Flags are unaffected. */
+static inline uint16_t core_alu_dec(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    return a - 1;
+}
+
+/* IND: increment by two. Flags are unaffected. */
+static inline uint16_t core_alu_ind(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    return a + 2;
+}
+
+/* DED: decrement by two. Flags are unaffected. */
+static inline uint16_t core_alu_ded(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    return a - 2;
+}
+
+/* MV: copy the second operand into the first. */
+static inline uint16_t core_alu_mv(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_MV, ALU_FLAGS_ZN, a, b);
+    return b;
+}
+
+/* CMP: compare by subtraction, discarding the result. */
+static inline uint16_t core_alu_cmp(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_CMP, ALU_FLAGS_ALL, a, b);
+    return a;
+}
+
+/* TST: compare by bitwise and, discarding the result. */
+static inline uint16_t core_alu_tst(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_TST, ALU_FLAGS_ZN, a, b);
+    return a;
+}
+
+/* ADD: addition. */
+static inline uint16_t core_alu_add(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_ADD, ALU_FLAGS_ALL, a, b);
+    return a + b;
+}
+
+/* SUB: subtraction. */
+static inline uint16_t core_alu_sub(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_SUB, ALU_FLAGS_ALL, a, b);
+    return a - b;
+}
+
+/* MUL: multiplication, truncated to 16 bits. */
+static inline uint16_t core_alu_mul(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_MUL, ALU_FLAGS_ALL, a, b);
+    return a * b;
+}
+
+/* DIV: unsigned division. */
+static inline uint16_t core_alu_div(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_DIV, ALU_FLAGS_ALL, a, b);
+    return a / b;
+}
+
+/* LSL: logical shift left. */
+static inline uint16_t core_alu_lsl(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_LSL, ALU_FLAGS_ALL, a, b);
+    return a << b;
+}
+
+/* LSR: logical shift right. */
+static inline uint16_t core_alu_lsr(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_LSR, ALU_FLAGS_ALL, a, b);
+    return a >> b;
+}
+
+/* ASR: arithmetic shift right. */
+static inline uint16_t core_alu_asr(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_ASR, ALU_FLAGS_ALL, a, b);
+    return (uint16_t)((int16_t)a >> b);
+}
+
+/* AND: bitwise and. */
+static inline uint16_t core_alu_and(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_AND, ALU_FLAGS_ALL, a, b);
+    return a & b;
+}
+
+/* OR: bitwise or. */
+static inline uint16_t core_alu_or(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_OR, ALU_FLAGS_ALL, a, b);
+    return a | b;
+}
+
+/* XOR: bitwise exclusive or. */
+static inline uint16_t core_alu_xor(struct core_lazy_flags *lf, uint16_t a,
+        uint16_t b)
+{
+    core_alu__defer(lf, OP_XOR, ALU_FLAGS_ALL, a, b);
+    return a ^ b;
+}
+
+#endif
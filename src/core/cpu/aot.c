@@ -0,0 +1,85 @@
+/*
+ * core/cpu/aot.c -- Ahead-of-time translated ROMs.
+ *
+ * Runs the C translation of a ROM made by aot.py, when one is built in with
+ * CORE_CPU_AOT and it matches the ROM loaded. Anything else falls back to the
+ * threaded interpreter.
+ *
+ */
+
+#include "core/cpu/aot.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+#ifdef CORE_CPU_AOT
+/* Check the translation was made from the loaded ROM, and watch its pages. */
+static int core_cpu_a__check(struct core_cpu *cpu)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int a;
+
+    for(a = A_ROM_FIXED; a <= A_ROM_FIXED_END; ++a)
+        h = (h ^ cpu->mmu->rom_f[a - A_ROM_FIXED]) * 1099511628211ULL;
+    if(h != core_aot_rom_hash) {
+        LOGW("core.cpu: translated ROM does not match the one loaded");
+        return 0;
+    }
+
+    for(a = 0; a < 256; ++a) {
+        if(core_aot_pages[a])
+            cpu->mmu->code_pages[a] |= CODE_AOT;
+    }
+    return 1;
+}
+#endif
+
+/*
+ * Run the translated ROM until at least the given number of cycles have been
+ * spent. As with core_cpu_t_run(), returns the number of cycles the other
+ * devices must be caught up on.
+ */
+int core_cpu_a_run(struct core_cpu *cpu, int budget)
+{
+#ifdef CORE_CPU_AOT
+    if(!cpu->aot.checked) {
+        cpu->aot.usable = core_cpu_a__check(cpu);
+        cpu->aot.checked = 1;
+    }
+    if(cpu->aot.usable)
+        return core_aot_run(cpu, budget);
+#else
+    LOGW("core.cpu: no translated ROM built in");
+#endif
+    LOGW("core.cpu: falling back to the threaded engine");
+    cpu->engine = CPU_ENGINE_THREADED;
+    return core_cpu_t_run(cpu, budget);
+}
+
+/*
+ * Run the one instruction at the program counter through its translation,
+ * for core_run_slice_probe(). The translation checks the budget before
+ * every instruction, so a budget of one runs a single one.
+ */
+int core_cpu_a_single(struct core_cpu *cpu)
+{
+    struct core_instr_decoded *d;
+    uint16_t data = 0;
+
+    d = &core_cpu_dtab[core_mmu_readw(cpu->mmu, cpu->r[R_P])];
+    if(d->flags & DEC_HAS_DATA)
+        data = core_mmu_readw(cpu->mmu, cpu->r[R_P] + 2);
+    core_cpu_i_latch(cpu, d, data);
+    return core_cpu_a_run(cpu, 1);
+}
+
+/* Stop using the translation of the page holding an address. */
+void core_cpu_a_invalidate(struct core_cpu *cpu, uint16_t a)
+{
+    if(cpu->engine != CPU_ENGINE_AOT)
+        return;
+    if(a <= A_ROM_FIXED_END && !cpu->aot.dirty[a >> 8]) {
+        LOGD("core.cpu: translated code at $%04x overwritten", a);
+        cpu->aot.dirty[a >> 8] = 1;
+        cpu->mmu->code_pages[a >> 8] &= ~CODE_AOT;
+    }
+}
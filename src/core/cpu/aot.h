@@ -0,0 +1,100 @@
+/*
+ * core/cpu/aot.h -- Ahead-of-time translated ROMs (header).
+ *
+ * Declares the interface between the core and the C translation of a ROM
+ * produced by aot.py, along with the macros the translation is written in.
+ *
+ */
+
+#ifndef QPRA_CORE_AOT_H
+#define QPRA_CORE_AOT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "core/cpu/cpu.h"
+#include "core/cpu/alu.h"
+#include "core/mmu/mmu.h"
+
+/* Defined by the translation. */
+/* FNV-1a hash of the fixed ROM bank the translation was made from. */
+extern const uint64_t core_aot_rom_hash;
+/* Pages of the fixed ROM bank holding translated code. */
+extern const uint8_t core_aot_pages[256];
+/* Same contract as core_cpu_t_run(). */
+int core_aot_run(struct core_cpu *, int);
+
+/*
+ * Used by the translation; each expects locals cpu, mmu, r, i, cycles and
+ * budget, and a dispatch label.
+ */
+#define AOT_READ(sz, a)     ((sz) == OP_16 ? core_mmu_readw(mmu, (a)) : \
+                                             core_mmu_readb(mmu, (a)))
+#define AOT_WRITE(sz, a, v) do {                                            \
+        if((sz) == OP_16)                                                   \
+            core_mmu_writew(mmu, (a), (v));                                 \
+        else                                                                \
+            core_mmu_writeb(mmu, (a), (v));                                 \
+        if(cpu->block_exit)                                                 \
+            goto dispatch;                                                  \
+    } while(0)
+
+/* Address operand of the byte-addressed modes, with the stale high byte. */
+#define AOT_D16B(lo)        ((uint16_t)((lo) | (i->db1 << 8)))
+
+/*
+ * After taking a call: run a library routine natively if there is one at the
+ * target (see hle.c), and carry on from wherever that leaves the CPU.
+ */
+#define AOT_HLE()                                                           \
+    if(cpu->hle) {                                                          \
+        cycles += core_cpu_hle(cpu, r, &cpu->lf);                           \
+        goto dispatch;                                                      \
+    }
+
+/*
+ * Start of a basic block: go back through the dispatcher if the budget is
+ * spent, an interrupt is due or the code here has been overwritten.
+ */
+#define AOT_HEAD(pc)                                                        \
+    if(cycles >= budget || cpu->aot.dirty[(pc) >> 8] ||                     \
+       core_cpu_int_due(cpu, r[R_F])) {                                     \
+        r[R_P] = (pc);                                                      \
+        goto dispatch;                                                      \
+    }
+
+/*
+ * Start of any other instruction: go back through the dispatcher if the
+ * budget is spent, so that a budget of one runs a single instruction.
+ */
+#define AOT_STEP(pc)                                                        \
+    if(cycles >= budget) {                                                  \
+        r[R_P] = (pc);                                                      \
+        goto dispatch;                                                      \
+    }
+
+/*
+ * The dispatcher: enter interrupts, return once the budget is spent, and
+ * otherwise jump to the translation of the program counter, or interpret one
+ * instruction if there is none.
+ */
+#define AOT_DISPATCH_BEGIN                                                  \
+dispatch:                                                                   \
+    if(cycles >= budget)                                                    \
+        return cycles;                                                      \
+    cpu->ahead = cycles;                                                    \
+    if(core_cpu_int_due(cpu, r[R_F])) {                                     \
+        cycles += core_cpu_i_interrupt(cpu);                                \
+        goto dispatch;                                                      \
+    }                                                                       \
+    cpu->block_exit = 0;                                                    \
+    if(r[R_P] <= A_ROM_FIXED_END && !cpu->aot.dirty[r[R_P] >> 8]) {         \
+        switch(r[R_P]) {
+
+#define AOT_DISPATCH_END                                                    \
+        }                                                                   \
+    }                                                                       \
+    cycles += core_cpu_i_exec(cpu);                                         \
+    goto dispatch;
+
+#endif
@@ -0,0 +1,529 @@
+/*
+ * core/cpu/block.c -- Basic-block cache.
+ *
+ * Decodes runs of instructions, up to the next control transfer, into arrays
+ * of intermediate instructions cached by address and swappable bank. Blocks
+ * are then executed without fetching or decoding again. Unlike the
+ * recompiler, this works on any host.
+ *
+ * Common pairs of instructions are fused when decoded, and executed as one
+ * operation taking the cycles of both. A pair is only run fused when the
+ * budget cannot run out between the two, so that a block still stops, and
+ * interrupts are still entered, where the threaded engine would.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/cpu/cpu.h"
+#include "core/cpu/alu.h"
+#include "core/cpu/codecache.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+#define B_MAX_BLOCKS    16384
+#define B_MAX_INSTRS    64
+#define B_MAX_IR        (B_MAX_BLOCKS * 8)
+
+/* Fused instruction pairs. */
+enum core_fusion
+{
+    /* Not fused. */
+    FUSE_NONE,
+    /* cmp or tst of a register against a register or immediate, then a
+     * conditional jump to an immediate address. */
+    FUSE_CMP_JCC,
+    /* dec of a register, then a conditional jump to an immediate address. */
+    FUSE_DEC_JCC,
+    /* mv of an immediate into a register, then mv of a register into
+     * memory at an immediate address. */
+    FUSE_MV_STORE,
+    FUSE_NUM
+};
+
+static const char *core_fusion_names[FUSE_NUM] = {
+    "none", "cmp+jcc", "dec+jcc", "mv+store"
+};
+
+/* Flag tested by each conditional jump. */
+static const uint16_t core_jump_flags[NUM_INSTRS] = {
+    [OP_JZ] = FLAG_Z, [OP_JC] = FLAG_C, [OP_JO] = FLAG_O, [OP_JN] = FLAG_N
+};
+
+/*
+ * An instruction in intermediate form: its decoding and data bytes, and
+ * whether it is fused with the next one.
+ */
+struct core_ir
+{
+    struct core_instr_decoded *d;
+    uint16_t data;
+    uint8_t fuse;
+};
+
+/* A cached block. */
+struct core_block
+{
+    /* Index of the first instruction in core_bcache.ir. */
+    int ir;
+    int num;
+    /* Address range covered, end exclusive. */
+    uint16_t start;
+    uint32_t end;
+    /* Bank swapped in at the start address when decoded. */
+    uint8_t bank;
+    uint8_t valid;
+    /* Times run, for the persistent code cache. */
+    uint32_t runs;
+};
+
+/* Block cache state. */
+struct core_bcache
+{
+    struct core_ir ir[B_MAX_IR];
+    int num_ir;
+
+    struct core_block blocks[B_MAX_BLOCKS];
+    int num_blocks;
+    /* Latest block decoded at each address, plus one; 0 if none. */
+    uint16_t map[65536];
+
+    /* Times each kind of fused pair has been executed. */
+    unsigned long fused[FUSE_NUM];
+};
+
+/* Drop every block, when the instruction pool or block table is full. */
+static void core_cpu_b__flush(struct core_cpu *cpu)
+{
+    struct core_bcache *bc = cpu->bcache;
+    int page;
+
+    LOGD("core.cpu: flushing %d cached blocks", bc->num_blocks);
+    core_cpu_b_keep(cpu);
+    bc->num_ir = 0;
+    bc->num_blocks = 0;
+    memset(bc->map, 0, sizeof(bc->map));
+    for(page = 0; page < 256; ++page)
+        cpu->mmu->code_pages[page] &= ~CODE_BLOCK;
+}
+
+/* Which fused pair, if any, do two consecutive instructions make? */
+static int core_cpu_b__fusion(struct core_instr_decoded *x,
+        struct core_instr_decoded *y)
+{
+    int jcc = core_jump_flags[y->opcode] && y->mode == AM_DW;
+
+    if(x->flags & (DEC_READS_F | DEC_WRITES_F | DEC_ENDS_BLOCK))
+        return FUSE_NONE;
+    if((x->opcode == OP_CMP || x->opcode == OP_TST) && jcc &&
+            (x->mode == AM_DR_DR || x->mode == AM_DR_DB ||
+             x->mode == AM_DR_DW))
+        return FUSE_CMP_JCC;
+    if(x->opcode == OP_DEC && x->mode == AM_DR && jcc)
+        return FUSE_DEC_JCC;
+    if(x->opcode == OP_MV && (x->mode == AM_DR_DB || x->mode == AM_DR_DW) &&
+            y->opcode == OP_MV &&
+            (y->mode == AM_IB_DR || y->mode == AM_IW_DR) &&
+            !(y->flags & (DEC_READS_F | DEC_WRITES_F)))
+        return FUSE_MV_STORE;
+    return FUSE_NONE;
+}
+
+/*
+ * Add the block of n instructions from start to end (exclusive), set out at
+ * the top of the instruction pool.
+ */
+static struct core_block *core_cpu_b__add(struct core_cpu *cpu,
+        uint16_t start, uint32_t end, uint8_t bank, int n)
+{
+    struct core_bcache *bc = cpu->bcache;
+    struct core_block *b;
+    uint32_t page;
+
+    b = &bc->blocks[bc->num_blocks++];
+    b->ir = bc->num_ir;
+    b->num = n;
+    b->start = start;
+    b->end = end;
+    b->bank = bank;
+    b->valid = 1;
+    b->runs = 0;
+    bc->num_ir += n;
+    bc->map[start] = bc->num_blocks;
+
+    for(page = start >> 8; page <= (end - 1) >> 8; ++page)
+        cpu->mmu->code_pages[page] |= CODE_BLOCK;
+
+    return b;
+}
+
+/* Decode the block at an address. Returns NULL if it cannot be cached. */
+static struct core_block *core_cpu_b__decode(struct core_cpu *cpu,
+        uint16_t start, uint8_t bank)
+{
+    struct core_bcache *bc = cpu->bcache;
+    struct core_mmu *mmu = cpu->mmu;
+    struct core_instr_decoded *d;
+    struct core_ir *ir;
+    uint16_t end = core_mmu_segment_end(start);
+    uint32_t a = start;
+    int n;
+
+    if(end == 0)
+        return NULL;
+    if(bc->num_ir + B_MAX_INSTRS > B_MAX_IR || bc->num_blocks == B_MAX_BLOCKS)
+        core_cpu_b__flush(cpu);
+
+    ir = &bc->ir[bc->num_ir];
+    for(n = 0; n < B_MAX_INSTRS && a + 1 <= end; ) {
+        d = &core_cpu_dtab[core_mmu_readw(mmu, a)];
+        if(a + d->len - 1 > end)
+            break;
+        ir[n].d = d;
+        ir[n].data = (d->flags & DEC_HAS_DATA) ? core_mmu_readw(mmu, a + 2)
+                                               : 0;
+        ir[n].fuse = FUSE_NONE;
+        if(n > 0 && (n < 2 || !ir[n - 2].fuse))
+            ir[n - 1].fuse = core_cpu_b__fusion(ir[n - 1].d, d);
+        a += d->len;
+        n += 1;
+        if(d->flags & DEC_ENDS_BLOCK)
+            break;
+    }
+    if(n == 0)
+        return NULL;
+    return core_cpu_b__add(cpu, start, a, bank, n);
+}
+
+/*
+ * Set up the block at an address in ROM from the instructions the code cache
+ * kept for it, as core_cpu_b__decode() would have, checking that the ROM as
+ * loaded holds each one. Returns NULL if it does not.
+ */
+static struct core_block *core_cpu_b__install(struct core_cpu *cpu,
+        uint16_t start, const struct core_codecache_ir *kept, int num)
+{
+    struct core_bcache *bc = cpu->bcache;
+    struct core_mmu *mmu = cpu->mmu;
+    struct core_instr_decoded *d;
+    struct core_ir *ir;
+    uint16_t base = start <= A_ROM_FIXED_END ? A_ROM_FIXED : A_ROM_SWAP;
+    uint16_t end = core_mmu_segment_end(start);
+    const uint8_t *rom;
+    uint32_t a = start;
+    int n;
+
+    if(start > A_ROM_SWAP_END || num > B_MAX_INSTRS)
+        return NULL;
+    rom = start <= A_ROM_FIXED_END ? mmu->rom_f : mmu->rom_s;
+    ir = &bc->ir[bc->num_ir];
+    for(n = 0; n < num; ++n) {
+        d = &core_cpu_dtab[kept[n].word];
+        if(a + 1 > end || a + d->len - 1 > end ||
+           rom[a - base] != B_LO(kept[n].word) ||
+           rom[a - base + 1] != B_HI(kept[n].word))
+            return NULL;
+        if((d->flags & DEC_HAS_DATA) &&
+           (rom[a - base + 2] != B_LO(kept[n].data) ||
+            ((d->flags & DEC_HAS_DW) &&
+             rom[a - base + 3] != B_HI(kept[n].data))))
+            return NULL;
+        ir[n].d = d;
+        ir[n].data = kept[n].data;
+        ir[n].fuse = kept[n].fuse;
+        a += d->len;
+    }
+    return core_cpu_b__add(cpu, start, a, core_mmu_bank_at(mmu, start), num);
+}
+
+/* Load an instruction's data bytes into the CPU, as fetching it does. */
+static inline void core_cpu_b__data(struct core_cpu *cpu, struct core_ir *ir)
+{
+    if(ir->d->flags & DEC_HAS_DATA) {
+        cpu->i->db0 = B_LO(ir->data);
+        if(ir->d->flags & DEC_HAS_DW)
+            cpu->i->db1 = B_HI(ir->data);
+    }
+}
+
+/*
+ * Execute the fused pair of instructions at ir, with the same effect as
+ * core_cpu_i_exec_d() on each in turn. Returns the cycles taken by both.
+ */
+static int core_cpu_b__exec_fused(struct core_cpu *cpu, struct core_ir *ir)
+{
+    struct core_instr_decoded *x = ir[0].d, *y = ir[1].d;
+    struct core_instr *i = cpu->i;
+    uint16_t *r = cpu->r, t = y - core_cpu_dtab, b;
+
+    cpu->bcache->fused[ir->fuse] += 1;
+
+    core_cpu_b__data(cpu, &ir[0]);
+    r[R_P] += x->len;
+    switch(ir->fuse) {
+        case FUSE_CMP_JCC:
+            b = (x->mode == AM_DR_DR) ? r[x->ry] :
+                (x->mode == AM_DR_DB) ? INSTR_D8(i) : INSTR_D16(i);
+            if(x->opcode == OP_CMP)
+                core_alu_cmp(&cpu->lf, r[x->rx], b);
+            else
+                core_alu_tst(&cpu->lf, r[x->rx], b);
+            break;
+        case FUSE_DEC_JCC:
+            r[x->rx] = core_alu_dec(&cpu->lf, r[x->rx], 0);
+            break;
+        case FUSE_MV_STORE:
+            b = (x->mode == AM_DR_DB) ? INSTR_D8(i) : INSTR_D16(i);
+            r[x->rx] = core_alu_mv(&cpu->lf, r[x->rx], b);
+            break;
+    }
+
+    core_cpu_b__data(cpu, &ir[1]);
+    r[R_P] += y->len;
+    if(ir->fuse == FUSE_MV_STORE) {
+        core_alu_mv(&cpu->lf, r[y->rx], INSTR_D16(i));
+        if(y->size == OP_16)
+            core_mmu_writew(cpu->mmu, INSTR_D16(i), r[y->ry]);
+        else
+            core_mmu_writeb(cpu->mmu, INSTR_D16(i), r[y->ry]);
+    } else {
+        core_alu_sync(&r[R_F], &cpu->lf);
+        if(r[R_F] & core_jump_flags[y->opcode])
+            r[R_P] = INSTR_D16(i);
+    }
+
+    i->ib0 = B_LO(t);
+    i->ib1 = B_HI(t);
+    cpu->d = y;
+    cpu->i_cycles = y->cycles;
+    cpu->i_done = 1;
+    return x->cycles + y->cycles;
+}
+
+/* Find or decode the block at an address. */
+static struct core_block *core_cpu_b__lookup(struct core_cpu *cpu,
+        uint16_t a)
+{
+    struct core_bcache *bc = cpu->bcache;
+    struct core_block *b;
+    uint8_t bank = core_mmu_bank_at(cpu->mmu, a);
+
+    if(bc->map[a]) {
+        b = &bc->blocks[bc->map[a] - 1];
+        if(b->valid && b->bank == bank)
+            return b;
+    }
+    return core_cpu_b__decode(cpu, a, bank);
+}
+
+static int core_cpu_b__init(struct core_cpu *cpu)
+{
+    cpu->bcache = calloc(1, sizeof(struct core_bcache));
+    if(cpu->bcache == NULL) {
+        LOGE("core.cpu: could not allocate block cache");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Set up the block at an address ahead of running it, for the persistent
+ * code cache: from the given instructions kept for it, if any and the ROM
+ * still holds them, or else by decoding it. Returns 0 once the cache has no
+ * more room, rather than flushing the blocks set up so far.
+ */
+int core_cpu_b_warm(struct core_cpu *cpu, uint16_t a,
+        const struct core_codecache_ir *kept, int num)
+{
+    struct core_bcache *bc;
+
+    if(cpu->bcache == NULL && !core_cpu_b__init(cpu))
+        return 0;
+    bc = cpu->bcache;
+    if(bc->num_ir + B_MAX_INSTRS > B_MAX_IR || bc->num_blocks == B_MAX_BLOCKS)
+        return 0;
+    if(bc->map[a] || kept == NULL || !core_cpu_b__install(cpu, a, kept, num))
+        core_cpu_b__lookup(cpu, a);
+    return 1;
+}
+
+/*
+ * Run a block, having run the given number of cycles out of the budget so
+ * far. The block is left at the first instruction boundary at or past the
+ * budget, with the program counter at the next instruction, so that an
+ * interrupt raised there is entered where the threaded engine enters it. A
+ * fused pair the budget runs out within has its first instruction run alone.
+ * Returns the cycles taken.
+ */
+static inline int core_cpu_b__exec_block(struct core_cpu *cpu,
+        struct core_block *b, int cycles, int budget)
+{
+    struct core_ir *ir, *end;
+    int n = 0;
+
+    cpu->block_exit = 0;
+    b->runs += 1;
+    ir = &cpu->bcache->ir[b->ir];
+    end = ir + b->num;
+    do {
+        if(ir->fuse && cycles + n + ir->d->cycles < budget) {
+            n += core_cpu_b__exec_fused(cpu, ir);
+            ++ir;
+        } else {
+            cpu->ahead = cycles + n;
+            n += core_cpu_i_exec_d(cpu, ir->d, ir->data);
+        }
+    } while(++ir < end && !cpu->block_exit && cycles + n < budget);
+    /* A block jumping back to its start may only be waiting. */
+    if(ir == end && cpu->r[R_P] == b->start) {
+        n += core_cpu_idle(cpu, cpu->r, &cpu->lf, b->end - ir[-1].d->len,
+                           cycles + n, budget);
+    }
+    return n;
+}
+
+/*
+ * Run cached blocks until at least the given number of cycles have been
+ * spent, entering interrupts between blocks. A block stops early if it
+ * overwrites cached code, switches banks or spends the budget. As with
+ * core_cpu_t_run(), returns the number of cycles the other devices must be
+ * caught up on.
+ */
+int core_cpu_b_run(struct core_cpu *cpu, int budget)
+{
+    struct core_block *b;
+    int cycles = 0;
+
+    if(cpu->bcache == NULL && !core_cpu_b__init(cpu)) {
+        LOGW("core.cpu: falling back to the threaded engine");
+        cpu->engine = CPU_ENGINE_THREADED;
+        return core_cpu_t_run(cpu, budget);
+    }
+
+    while(cycles < budget) {
+        cpu->ahead = cycles;
+        if(core_cpu_int_due(cpu, cpu->r[R_F])) {
+            cycles += core_cpu_i_interrupt(cpu);
+            continue;
+        }
+        b = core_cpu_b__lookup(cpu, cpu->r[R_P]);
+        if(b == NULL) {
+            cycles += core_cpu_i_exec(cpu);
+            continue;
+        }
+
+        cycles += core_cpu_b__exec_block(cpu, b, cycles, budget);
+    }
+
+    return cycles;
+}
+
+/*
+ * Run the one block at the program counter, for the tiered engine, having
+ * run the given number of cycles out of the budget so far. Returns the
+ * cycles taken, or -1 if the code there cannot be cached.
+ */
+int core_cpu_b_step(struct core_cpu *cpu, int cycles, int budget)
+{
+    struct core_block *b;
+
+    if(cpu->bcache == NULL && !core_cpu_b__init(cpu))
+        return -1;
+    b = core_cpu_b__lookup(cpu, cpu->r[R_P]);
+    if(b == NULL)
+        return -1;
+    return core_cpu_b__exec_block(cpu, b, cycles, budget);
+}
+
+/*
+ * Run the block at the program counter as core_cpu_b_run() would, for
+ * core_run_slice_probe(), passing each instruction to the given function as
+ * it is run. Fused pairs are run as two instructions, so that each is seen.
+ * Returns the cycles taken, or -1 if the code there cannot be cached.
+ */
+int core_cpu_b_probe(struct core_cpu *cpu, core_cpu_probe_fn fn, void *data)
+{
+    struct core_block *b;
+    struct core_ir *ir, *end;
+    uint16_t pc, s;
+    int n = 0, k, stop;
+
+    if(cpu->bcache == NULL && !core_cpu_b__init(cpu))
+        return -1;
+    b = core_cpu_b__lookup(cpu, cpu->r[R_P]);
+    if(b == NULL)
+        return -1;
+
+    cpu->block_exit = 0;
+    b->runs += 1;
+    ir = &cpu->bcache->ir[b->ir];
+    end = ir + b->num;
+    do {
+        pc = cpu->r[R_P];
+        s = cpu->r[R_S];
+        cpu->ahead = n;
+        k = core_cpu_i_exec_d(cpu, ir->d, ir->data);
+        n += k;
+        stop = fn(data, pc, s, k);
+    } while(++ir < end && !cpu->block_exit && !stop);
+    return n;
+}
+
+/* Drop the blocks covering the page of an address. */
+void core_cpu_b_invalidate(struct core_cpu *cpu, uint16_t a)
+{
+    struct core_bcache *bc = cpu->bcache;
+    struct core_block *b;
+    int page = a >> 8, i;
+
+    if(bc == NULL)
+        return;
+    for(i = 0; i < bc->num_blocks; ++i) {
+        b = &bc->blocks[i];
+        if(b->valid && (b->start >> 8) <= page && ((b->end - 1) >> 8) >= page)
+            b->valid = 0;
+    }
+    cpu->mmu->code_pages[page] &= ~CODE_BLOCK;
+}
+
+/* Hand the blocks held over to the persistent code cache, if kept. */
+void core_cpu_b_keep(struct core_cpu *cpu)
+{
+    struct core_codecache_ir kept[B_MAX_INSTRS];
+    struct core_bcache *bc = cpu->bcache;
+    struct core_block *b;
+    struct core_ir *ir;
+    int i, n;
+
+    if(bc == NULL || cpu->codecache == NULL)
+        return;
+    for(i = 0; i < bc->num_blocks; ++i) {
+        b = &bc->blocks[i];
+        if(b->valid) {
+            ir = &bc->ir[b->ir];
+            for(n = 0; n < b->num; ++n) {
+                kept[n].word = ir[n].d - core_cpu_dtab;
+                kept[n].data = ir[n].data;
+                kept[n].fuse = ir[n].fuse;
+            }
+            core_codecache_add(cpu->codecache, b->start, b->bank, b->runs,
+                               kept, b->num);
+        }
+        b->runs = 0;
+    }
+}
+
+void core_cpu_b_destroy(struct core_cpu *cpu)
+{
+    int k;
+
+    if(cpu->bcache != NULL) {
+        for(k = FUSE_NONE + 1; k < FUSE_NUM; ++k) {
+            LOGD("core.cpu: fused %s executed %lu times",
+                 core_fusion_names[k], cpu->bcache->fused[k]);
+        }
+    }
+    free(cpu->bcache);
+    cpu->bcache = NULL;
+}
@@ -0,0 +1,445 @@
+/*
+ * core/cpu/cfg.c -- Static control flow analysis.
+ *
+ * Code is found in one pass, which follows each path from an address until
+ * it leaves by a jump or return or meets code already found, marking the
+ * instructions and the addresses which start a block. A second pass then
+ * cuts the code found at those addresses into blocks. Instructions are
+ * decoded as the CPU decodes them, through core_cpu_dtab.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "core/cpu/cfg.h"
+#include "core/dbg/sym.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+/* Longest name of an address written. */
+#define CFG_NAME_LEN 80
+
+/* Grow an array of a core_cfg by half again when full. */
+static int core_cfg__grow(void **p, int *max, size_t size)
+{
+    int n = *max ? *max + *max / 2 : 256;
+    void *q = realloc(*p, n * size);
+
+    if(q == NULL) {
+        LOGE("Could not allocate control flow graph");
+        return 0;
+    }
+    *p = q;
+    *max = n;
+    return 1;
+}
+
+/* ROM byte at an address, in the given bank if in the swappable segment. */
+static uint8_t core_cfg__byte(struct core_cfg *cfg, uint16_t a, int bank)
+{
+    if(a <= A_ROM_FIXED_END)
+        return cfg->mmu->rom_f[a - A_ROM_FIXED];
+    return cfg->mmu->rom_s_banks[bank][a - A_ROM_SWAP];
+}
+
+/* Queue an address to follow, the first time it is found to start a block. */
+static int core_cfg__add(struct core_cfg *cfg, int32_t a, int bank)
+{
+    uint8_t *map;
+
+    if(a < 0)
+        return 1;
+    map = core_cfg_map(cfg, a, bank);
+    if(map == NULL) {
+        /* Code in RAM is only put there by the ROM as it runs. */
+        cfg->unresolved += 1;
+        return 1;
+    }
+    if(map[a & (CORE_CFG_BANK - 1)] & CFG_LEADER)
+        return 1;
+    map[a & (CORE_CFG_BANK - 1)] |= CFG_LEADER;
+
+    if(cfg->num_work == cfg->max_work &&
+       !core_cfg__grow((void **)&cfg->work, &cfg->max_work,
+                       sizeof(*cfg->work)))
+        return 0;
+    cfg->work[cfg->num_work].pc = a;
+    cfg->work[cfg->num_work].bank = bank;
+    cfg->num_work += 1;
+    return 1;
+}
+
+static int core_cfg__branch(struct core_cfg *cfg, uint16_t pc, int bank,
+        int32_t target, int target_bank)
+{
+    struct core_cfg_branch *br;
+
+    if(cfg->num_branches == cfg->max_branches &&
+       !core_cfg__grow((void **)&cfg->branches, &cfg->max_branches,
+                       sizeof(*cfg->branches)))
+        return 0;
+    br = &cfg->branches[cfg->num_branches++];
+    br->pc = pc;
+    br->bank = bank;
+    br->target = target;
+    br->target_bank = target_bank < 0 ? 0 : target_bank;
+    if(target < 0)
+        cfg->unresolved += 1;
+    return core_cfg__add(cfg, target, target_bank);
+}
+
+/* Does an instruction write to a register? */
+static int core_cfg__writes(struct core_instr_decoded *d, int r)
+{
+    if(d->flags & DEC_VOID)
+        return 0;
+    if((d->mode == AM_DR || (d->flags & DEC_OP1REG)) && d->rx == r)
+        return 1;
+    return d->mode == AM_DR_DR && d->ry == r;
+}
+
+/*
+ * Follow the path from a queued address, marking the code along it, until
+ * it leaves or meets code already found.
+ */
+static int core_cfg__follow(struct core_cfg *cfg, struct core_cfg_work *w)
+{
+    struct core_instr_decoded *d;
+    uint16_t pc = w->pc, end = core_mmu_segment_end(w->pc), data;
+    uint8_t *map = core_cfg_map(cfg, w->pc, w->bank), *m;
+    /* Bank the code is in, and the one selected for the segment. */
+    int here = w->pc >= A_ROM_SWAP ? w->bank : 0, bank = w->bank, r, op;
+    int32_t t;
+    /* Constants known to be in registers along this path. */
+    uint16_t known[NUM_REGS];
+    int valid = 0;
+
+    while(pc + 1 <= end && !(map[pc & (CORE_CFG_BANK - 1)] & CFG_OPCODE)) {
+        d = &core_cpu_dtab[core_cfg__byte(cfg, pc, here) |
+                           core_cfg__byte(cfg, pc + 1, here) << 8];
+        if(pc + d->len - 1 > end)
+            break;
+        if(!(d->flags & DEC_VOID) && d->mode == AM_RESERVED)
+            break;
+        data = 0;
+        if(d->flags & DEC_HAS_DATA) {
+            data = core_cfg__byte(cfg, pc + 2, here);
+            if(d->flags & DEC_HAS_DW)
+                data |= core_cfg__byte(cfg, pc + 3, here) << 8;
+        }
+        map[pc & (CORE_CFG_BANK - 1)] |= CFG_OPCODE;
+        for(r = 1; r < d->len; ++r)
+            map[(pc + r) & (CORE_CFG_BANK - 1)] |= CFG_OPERAND;
+
+        op = d->opcode;
+        if(op >= OP_JP && op <= OP_CN) {
+            t = -1;
+            if(d->mode == AM_DB || d->mode == AM_DW)
+                t = data;
+            else if(d->mode == AM_DR && (valid & (1 << d->rx)))
+                t = known[d->rx];
+            if(!core_cfg__branch(cfg, pc, here, t, bank))
+                return 0;
+        } else if(op == OP_MV && d->mode == AM_IW_DR &&
+                  (valid & (1 << d->ry))) {
+            /* Handlers installed in the interrupt vector. */
+            if(data >= A_INT_VEC && data <= A_INT_VEC_END) {
+                if(!core_cfg__add(cfg, known[d->ry], bank))
+                    return 0;
+                m = core_cfg_map(cfg, known[d->ry], bank);
+                if(m != NULL &&
+                   !(m[known[d->ry] & (CORE_CFG_BANK - 1)] & CFG_ENTRY)) {
+                    m[known[d->ry] & (CORE_CFG_BANK - 1)] |= CFG_ENTRY;
+                    cfg->entries += 1;
+                }
+            }
+            /* Code in the swappable segment cannot swap itself out. */
+            if(data == A_ROM_BANK_SELECT && pc < A_ROM_SWAP)
+                bank = (known[d->ry] & 0xff) < cfg->banks ?
+                       (known[d->ry] & 0xff) : -1;
+        } else if(op == OP_MV && d->mode == AM_IW_DR &&
+                  data == A_ROM_BANK_SELECT && pc < A_ROM_SWAP) {
+            bank = -1;
+        }
+
+        /* Writes to p other than by jumps go wherever p is set to. */
+        if(core_cfg__writes(d, R_P) && !(op >= OP_JP && op <= OP_CN)) {
+            t = -1;
+            if(op == OP_MV && d->mode == AM_DR_DW)
+                t = data;
+            else if(op == OP_MV && d->mode == AM_DR_DB)
+                t = data & 0xff;
+            if(!core_cfg__branch(cfg, pc, here, t, bank))
+                return 0;
+        }
+
+        for(r = 0; r < NUM_REGS; ++r) {
+            if(core_cfg__writes(d, r))
+                valid &= ~(1 << r);
+        }
+        if(op == OP_MV && (d->mode == AM_DR_DW || d->mode == AM_DR_DB)) {
+            known[d->rx] = d->mode == AM_DR_DW ? data : (data & 0xff);
+            valid |= 1 << d->rx;
+        }
+
+        if(op == OP_RTI || op == OP_RTS || op == OP_JP ||
+           (core_cfg__writes(d, R_P) && !(op >= OP_JP && op <= OP_CN)))
+            break;
+        if(((d->flags & DEC_ENDS_BLOCK) || op == OP_INT) &&
+           !core_cfg__add(cfg, pc + d->len, bank))
+            return 0;
+        pc += d->len;
+    }
+    return 1;
+}
+
+static int core_cfg__branch_cmp(const void *x, const void *y)
+{
+    const struct core_cfg_branch *a = x, *b = y;
+
+    if(a->bank != b->bank)
+        return a->bank - b->bank;
+    return a->pc - b->pc;
+}
+
+static struct core_cfg_branch *core_cfg__find_branch(struct core_cfg *cfg,
+        uint16_t pc, uint8_t bank)
+{
+    struct core_cfg_branch key;
+
+    key.pc = pc;
+    key.bank = bank;
+    return bsearch(&key, cfg->branches, cfg->num_branches,
+                   sizeof(*cfg->branches), core_cfg__branch_cmp);
+}
+
+/* Cut the code found in a segment of a bank into blocks. */
+static int core_cfg__blocks(struct core_cfg *cfg, uint16_t base, int bank)
+{
+    struct core_instr_decoded *d;
+    struct core_cfg_block *b;
+    struct core_cfg_branch *br;
+    uint8_t *map = core_cfg_map(cfg, base, bank);
+    uint32_t a, pc;
+    int k;
+
+    for(k = 0; k < CORE_CFG_BANK; ++k) {
+        if((map[k] & (CFG_LEADER | CFG_OPCODE)) !=
+           (CFG_LEADER | CFG_OPCODE))
+            continue;
+        if(cfg->num_blocks == cfg->max_blocks &&
+           !core_cfg__grow((void **)&cfg->blocks, &cfg->max_blocks,
+                           sizeof(*cfg->blocks)))
+            return 0;
+        b = &cfg->blocks[cfg->num_blocks++];
+        b->start = base + k;
+        b->bank = bank;
+        b->num = 0;
+        b->how = CFG_END_NONE;
+        b->target = -1;
+        b->target_bank = b->bank;
+        b->next = -1;
+
+        for(pc = base + k; ; pc = a) {
+            d = &core_cpu_dtab[core_cfg__byte(cfg, pc, bank) |
+                               core_cfg__byte(cfg, pc + 1, bank) << 8];
+            b->num += 1;
+            a = pc + d->len;
+            if(d->opcode >= OP_JP && d->opcode <= OP_CN) {
+                br = core_cfg__find_branch(cfg, pc, b->bank);
+                b->how = d->opcode == OP_JP ? CFG_END_JUMP :
+                         (d->opcode & 1) ? CFG_END_CALL : CFG_END_BRANCH;
+                if(br != NULL) {
+                    b->target = br->target;
+                    b->target_bank = br->target_bank;
+                }
+                if(d->opcode != OP_JP)
+                    b->next = a;
+                break;
+            }
+            if(d->opcode == OP_RTI || d->opcode == OP_RTS ||
+               core_cfg__writes(d, R_P)) {
+                b->how = CFG_END_RETURN;
+                br = core_cfg__find_branch(cfg, pc, b->bank);
+                if(br != NULL && br->target >= 0) {
+                    b->how = CFG_END_JUMP;
+                    b->target = br->target;
+                    b->target_bank = br->target_bank;
+                }
+                break;
+            }
+            if(a - base >= CORE_CFG_BANK ||
+               !(map[a - base] & CFG_OPCODE))
+                break;
+            if((d->flags & DEC_ENDS_BLOCK) || d->opcode == OP_INT ||
+               (map[a - base] & CFG_LEADER)) {
+                b->how = CFG_END_FALL;
+                b->next = a;
+                break;
+            }
+        }
+        b->end = a;
+    }
+    return 1;
+}
+
+/* Analyse the ROM loaded into an MMU. */
+int core_cfg_init(struct core_cfg **pcfg, struct core_mmu *mmu)
+{
+    struct core_cfg *cfg;
+    struct core_cfg_work w;
+    int bank;
+
+    cfg = *pcfg = calloc(1, sizeof(struct core_cfg));
+    if(cfg == NULL) {
+        LOGE("Could not allocate control flow graph");
+        return 0;
+    }
+    cfg->mmu = mmu;
+    cfg->banks = mmu->rom_s_total;
+    cfg->maps = calloc(1 + cfg->banks, CORE_CFG_BANK);
+    if(cfg->maps == NULL) {
+        LOGE("Could not allocate control flow maps");
+        core_cfg_destroy(cfg);
+        return 0;
+    }
+
+    /* Code is run from reset with the first swappable bank in. */
+    if(!core_cfg__add(cfg, A_ROM_FIXED, 0)) {
+        core_cfg_destroy(cfg);
+        return 0;
+    }
+    cfg->maps[0] |= CFG_ENTRY;
+    cfg->entries = 1;
+    while(cfg->num_work > 0) {
+        w = cfg->work[--cfg->num_work];
+        if(!core_cfg__follow(cfg, &w)) {
+            core_cfg_destroy(cfg);
+            return 0;
+        }
+    }
+
+    qsort(cfg->branches, cfg->num_branches, sizeof(*cfg->branches),
+          core_cfg__branch_cmp);
+    if(!core_cfg__blocks(cfg, A_ROM_FIXED, 0)) {
+        core_cfg_destroy(cfg);
+        return 0;
+    }
+    for(bank = 0; bank < cfg->banks; ++bank) {
+        if(!core_cfg__blocks(cfg, A_ROM_SWAP, bank)) {
+            core_cfg_destroy(cfg);
+            return 0;
+        }
+    }
+
+    LOGD("Found %d blocks from %d entry points; %d jumps not followed",
+         cfg->num_blocks, cfg->entries, cfg->unresolved);
+    return 1;
+}
+
+void core_cfg_destroy(struct core_cfg *cfg)
+{
+    free(cfg->maps);
+    free(cfg->blocks);
+    free(cfg->branches);
+    free(cfg->work);
+    free(cfg);
+}
+
+/* Name of an address, or '?' if it is not known. */
+static const char *core_cfg__name(struct core_syms *syms, int32_t a,
+        char *buf)
+{
+    if(a < 0)
+        return "?";
+    core_sym_format(syms, a, buf, CFG_NAME_LEN);
+    return buf;
+}
+
+/*
+ * Write out the runs of code and data in the map of a bank, mapped at the
+ * given address.
+ */
+static void core_cfg__ranges(uint8_t *map, uint16_t base, FILE *fp)
+{
+    int k, from = 0, code = (map[0] & (CFG_OPCODE | CFG_OPERAND)) != 0;
+
+    for(k = 1; k <= CORE_CFG_BANK; ++k) {
+        if(k < CORE_CFG_BANK &&
+           ((map[k] & (CFG_OPCODE | CFG_OPERAND)) != 0) == code)
+            continue;
+        fprintf(fp, "  %s $%04x-$%04x %5d bytes\n", code ? "code" : "data",
+                base + from, base + k - 1, k - from);
+        from = k;
+        code = !code;
+    }
+}
+
+/*
+ * Write out where the code and data of each bank lie, and the blocks the
+ * code splits into.
+ */
+void core_cfg_report(struct core_cfg *cfg, struct core_syms *syms, FILE *fp)
+{
+    struct core_cfg_block *b = cfg->blocks, *end = b + cfg->num_blocks;
+    char name[CFG_NAME_LEN], target[CFG_NAME_LEN], next[CFG_NAME_LEN];
+    uint8_t *map;
+    int bank, k, code, leaders;
+
+    fprintf(fp, "%d blocks from %d entry points; %d jumps and calls not "
+            "followed\n", cfg->num_blocks, cfg->entries, cfg->unresolved);
+
+    for(bank = -1; bank < cfg->banks; ++bank) {
+        map = cfg->maps + (1 + bank) * CORE_CFG_BANK;
+        code = leaders = 0;
+        for(k = 0; k < CORE_CFG_BANK; ++k) {
+            code += (map[k] & (CFG_OPCODE | CFG_OPERAND)) != 0;
+            leaders += (map[k] & (CFG_LEADER | CFG_OPCODE)) ==
+                       (CFG_LEADER | CFG_OPCODE);
+        }
+        if(bank < 0)
+            fprintf(fp, "\nFixed bank:");
+        else if(code == 0)
+            continue;
+        else
+            fprintf(fp, "\nBank %d:", bank);
+        fprintf(fp, " %d code bytes, %d data bytes, %d leaders\n",
+                code, CORE_CFG_BANK - code, leaders);
+        core_cfg__ranges(map, bank < 0 ? A_ROM_FIXED : A_ROM_SWAP, fp);
+        fprintf(fp, "\n");
+
+        for(; b < end && (bank < 0 ? b->start < A_ROM_SWAP :
+                          b->bank == bank); ++b) {
+            core_sym_format(syms, b->start, name, sizeof(name));
+            fprintf(fp, "  $%04x-$%04x %c %-24s %4d  ", b->start, b->end - 1,
+                    map[b->start & (CORE_CFG_BANK - 1)] & CFG_ENTRY ?
+                    '*' : ' ', name, b->num);
+            core_cfg__name(syms, b->target, target);
+            core_cfg__name(syms, b->next, next);
+            switch(b->how) {
+                case CFG_END_FALL:
+                    fprintf(fp, "falls to %s", next);
+                    break;
+                case CFG_END_JUMP:
+                    fprintf(fp, "jumps to %s", target);
+                    break;
+                case CFG_END_BRANCH:
+                    fprintf(fp, "branches to %s, else %s", target, next);
+                    break;
+                case CFG_END_CALL:
+                    fprintf(fp, "calls %s, returning to %s", target, next);
+                    break;
+                case CFG_END_RETURN:
+                    fprintf(fp, "returns");
+                    break;
+                case CFG_END_NONE:
+                    fprintf(fp, "runs out of code");
+                    break;
+            }
+            if(b->target >= A_ROM_SWAP && b->target <= A_ROM_SWAP_END &&
+               b->how != CFG_END_FALL && b->how != CFG_END_RETURN)
+                fprintf(fp, " in bank %d", b->target_bank);
+            fprintf(fp, "\n");
+        }
+    }
+}
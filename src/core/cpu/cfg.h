@@ -0,0 +1,132 @@
+/*
+ * core/cpu/cfg.h -- Static control flow analysis (header).
+ *
+ * Finds the code in a ROM without running it, by following control flow
+ * from the reset address and from the handlers stored into the interrupt
+ * vector, as aot.py does for the fixed bank, and splits it into basic
+ * blocks. Each ROM bank has a map with a byte for each address, telling
+ * the starts of instructions and of blocks from their other bytes; what
+ * is left is taken to be data.
+ *
+ * Jumps and calls are only followed to constant targets: immediates, and
+ * registers last loaded with one along the same path. Those into the
+ * swappable ROM segment are followed into the bank last selected by
+ * storing a constant to the bank select register, or the one in at reset.
+ *
+ */
+
+#ifndef QPRA_CORE_CFG_H
+#define QPRA_CORE_CFG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "core/cpu/cpu.h"
+
+struct core_mmu;
+struct core_syms;
+
+/* Bytes in a ROM bank. */
+#define CORE_CFG_BANK 0x4000
+
+/* Bits of each address's byte in a bank map. */
+#define CFG_OPCODE      0x01
+#define CFG_OPERAND     0x02
+#define CFG_LEADER      0x04
+/* Entered at reset or through the interrupt vector. */
+#define CFG_ENTRY       0x08
+
+/* How a block ends. */
+enum core_cfg_end
+{
+    /* Runs into the next block. */
+    CFG_END_FALL,
+    /* Jumps, always or on a condition. */
+    CFG_END_JUMP,
+    CFG_END_BRANCH,
+    CFG_END_CALL,
+    /* RTS, RTI, or a write to p of a value not known. */
+    CFG_END_RETURN,
+    /* Runs into bytes which are not code, such as the end of the bank. */
+    CFG_END_NONE
+};
+
+struct core_cfg_block
+{
+    /* Address range covered, end exclusive. */
+    uint16_t start;
+    uint32_t end;
+    /* Bank of the swappable segment it lies in; 0 in the fixed bank. */
+    uint8_t bank;
+    int num;
+    enum core_cfg_end how;
+    /* Constant target jumped or called to, or -1 if none or not known. */
+    int32_t target;
+    uint8_t target_bank;
+    /* Next instruction, if it can be reached by falling through, or -1. */
+    int32_t next;
+};
+
+/* A jump or call, with where it goes if known. */
+struct core_cfg_branch
+{
+    uint16_t pc;
+    uint8_t bank;
+    uint8_t target_bank;
+    int32_t target;
+};
+
+/* An address and bank yet to be followed. */
+struct core_cfg_work
+{
+    uint16_t pc;
+    /* Swappable ROM bank selected along the way there; -1 if not known. */
+    int bank;
+};
+
+struct core_cfg
+{
+    struct core_mmu *mmu;
+    /* Swappable ROM banks, which are mapped after the fixed one. */
+    int banks;
+    uint8_t *maps;
+
+    struct core_cfg_block *blocks;
+    int num_blocks;
+    int max_blocks;
+
+    struct core_cfg_branch *branches;
+    int num_branches;
+    int max_branches;
+
+    struct core_cfg_work *work;
+    int num_work;
+    int max_work;
+
+    /* Entry points: reset and handlers found. */
+    int entries;
+    /* Jumps and calls whose target, or bank, could not be worked out. */
+    int unresolved;
+};
+
+/*
+ * Map of the bank holding an address in ROM, taking the given swappable
+ * bank for the swappable segment, indexed by the address's offset into its
+ * segment. NULL outside ROM, or for a bank that is not there.
+ */
+static inline uint8_t *core_cfg_map(struct core_cfg *cfg, uint16_t a,
+        int bank)
+{
+    if(a < CORE_CFG_BANK)
+        return cfg->maps;
+    if(a < 2 * CORE_CFG_BANK && bank >= 0 && bank < cfg->banks)
+        return cfg->maps + (1 + bank) * CORE_CFG_BANK;
+    return NULL;
+}
+
+/* Function declarations. */
+int core_cfg_init(struct core_cfg **, struct core_mmu *);
+void core_cfg_report(struct core_cfg *, struct core_syms *, FILE *);
+void core_cfg_destroy(struct core_cfg *);
+
+#endif
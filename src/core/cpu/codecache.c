@@ -0,0 +1,381 @@
+/*
+ * core/cpu/codecache.c -- Persistent code cache.
+ *
+ * The engines hand over the blocks they hold when they flush them and at
+ * exit; see core_cpu_b_keep(). Counts loaded from the file are halved,
+ * rounding up, so that the latest runs weigh the most in which blocks are
+ * warmed first without any block seen being forgotten. The instructions
+ * kept for a block are those it was last decoded to.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "core/cpu/codecache.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+static const char core_codecache_magic[4] = { 'Q', 'C', 'C', 'H' };
+static const char core_codecache_dtab_magic[4] = { 'Q', 'C', 'P', 'D' };
+
+/* 32-bit FNV-1a of the build and file version. */
+static uint32_t core_codecache__build(void)
+{
+    const char *s = CORE_CODECACHE_BUILD;
+    uint32_t h = 0x811c9dc5u;
+
+    for(; *s != '\0'; ++s)
+        h = (h ^ (uint8_t)*s) * 0x01000193u;
+    return (h ^ CORE_CODECACHE_VERSION) * 0x01000193u;
+}
+
+/* Name of the file for a ROM's CRC, or 0 for the predecoded instructions. */
+static char *core_codecache__name(const char *dir, uint32_t crc32,
+        uint32_t build)
+{
+    size_t len = strlen(dir) + 32;
+    char *fn;
+
+    fn = malloc(len);
+    if(fn != NULL)
+        snprintf(fn, len, "%s/%08x-%08x.qcc", dir, (unsigned)crc32,
+                 (unsigned)build);
+    return fn;
+}
+
+/*
+ * Write a file, to one of its own first so that runs exiting at the same
+ * time each leave a whole one: the header, its records of the given size,
+ * then its kept instructions.
+ */
+static int core_codecache__save(const char *fn,
+        const struct core_codecache_file_header *hdr, const void *recs,
+        size_t size, const struct core_codecache_ir *ir)
+{
+    size_t len = strlen(fn) + 16;
+    char *tmp;
+    FILE *fp;
+    int ok;
+
+    tmp = malloc(len);
+    if(tmp == NULL) {
+        LOGE("Could not allocate code cache file name");
+        return 0;
+    }
+    snprintf(tmp, len, "%s.%ld", fn, (long)getpid());
+    fp = fopen(tmp, "wb");
+    if(fp == NULL) {
+        LOGE("Couldn't open code cache '%s' for writing", tmp);
+        free(tmp);
+        return 0;
+    }
+    ok = fwrite(hdr, sizeof(*hdr), 1, fp) == 1 &&
+         fwrite(recs, size, hdr->num, fp) == hdr->num &&
+         fwrite(ir, sizeof(*ir), hdr->num_ir, fp) == hdr->num_ir;
+    ok = fclose(fp) == 0 && ok;
+    if(!ok || rename(tmp, fn) != 0) {
+        LOGE("Couldn't write code cache '%s'", fn);
+        remove(tmp);
+        free(tmp);
+        return 0;
+    }
+    free(tmp);
+    return 1;
+}
+
+/*
+ * Fill in the predecoded instruction table from the file an earlier run of
+ * this build left in the directory, if there is one; called before the CPU
+ * is set up. Returns 1 if it was filled in.
+ */
+int core_codecache_read_dtab(const char *dir)
+{
+    struct core_codecache_file_header hdr;
+    uint32_t build = core_codecache__build();
+    char *fn;
+    FILE *fp;
+    int ok;
+
+    fn = core_codecache__name(dir, 0, build);
+    if(fn == NULL) {
+        LOGE("Could not allocate predecoded instruction file name");
+        return 0;
+    }
+    fp = fopen(fn, "rb");
+    if(fp == NULL) {
+        LOGD("No predecoded instructions in '%s' yet", fn);
+        free(fn);
+        return 0;
+    }
+    ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+         !memcmp(hdr.magic, core_codecache_dtab_magic, sizeof(hdr.magic)) &&
+         hdr.build == build && hdr.num == 65536 &&
+         fread(core_cpu_dtab, sizeof(core_cpu_dtab[0]), 65536, fp) == 65536;
+    fclose(fp);
+
+    if(ok) {
+        core_cpu_dtab_ready = 1;
+        LOGD("Read predecoded instructions from '%s'", fn);
+    } else {
+        LOGW("Ignoring predecoded instructions in '%s'", fn);
+    }
+    free(fn);
+    return ok;
+}
+
+/* Write out the predecoded instruction table, for later runs to read. */
+int core_codecache_write_dtab(const char *dir)
+{
+    struct core_codecache_file_header hdr;
+    char *fn;
+    int ok;
+
+    memcpy(hdr.magic, core_codecache_dtab_magic, sizeof(hdr.magic));
+    hdr.build = core_codecache__build();
+    hdr.crc32 = 0;
+    hdr.num = 65536;
+    hdr.num_ir = 0;
+    fn = core_codecache__name(dir, 0, hdr.build);
+    if(fn == NULL) {
+        LOGE("Could not allocate predecoded instruction file name");
+        return 0;
+    }
+    /* Batch jobs may all be pointed at a directory none of them made. */
+    mkdir(dir, 0777);
+    ok = core_codecache__save(fn, &hdr, core_cpu_dtab,
+                              sizeof(core_cpu_dtab[0]), NULL);
+    if(ok)
+        LOGD("Wrote predecoded instructions to '%s'", fn);
+    free(fn);
+    return ok;
+}
+
+/* Read in the file left by an earlier run, if there is one. */
+static void core_codecache__load(struct core_codecache *cc)
+{
+    struct core_codecache_file_header hdr;
+    struct core_codecache_entry *e;
+    uint32_t k, num;
+    FILE *fp;
+
+    fp = fopen(cc->fn, "rb");
+    if(fp == NULL) {
+        LOGD("No code cache in '%s' yet", cc->fn);
+        return;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+       memcmp(hdr.magic, core_codecache_magic, sizeof(hdr.magic)) ||
+       hdr.build != cc->build || hdr.crc32 != cc->crc32 ||
+       hdr.num > CORE_CODECACHE_MAX || hdr.num_ir > CORE_CODECACHE_MAX_IR) {
+        LOGW("Ignoring code cache '%s', which is for another ROM or build",
+             cc->fn);
+        fclose(fp);
+        return;
+    }
+    num = fread(cc->entries, sizeof(cc->entries[0]), hdr.num, fp);
+    if(num < hdr.num ||
+       fread(cc->ir, sizeof(cc->ir[0]), hdr.num_ir, fp) != hdr.num_ir)
+        hdr.num_ir = 0;
+    fclose(fp);
+
+    /* The entries are all different, so need only be linked up. */
+    for(k = 0; k < num; ++k) {
+        e = &cc->entries[k];
+        e->runs = e->runs / 2 + (e->runs & 1);
+        if(e->ir + e->num > hdr.num_ir)
+            e->num = 0;
+        cc->next[k] = cc->first[e->start];
+        cc->first[e->start] = k + 1;
+    }
+    cc->num = num;
+    cc->num_ir = hdr.num_ir;
+    LOGD("Read %d blocks from code cache '%s'", cc->num, cc->fn);
+}
+
+/* CRC-32 of a ROM file, for ROMs whose header leaves it out. */
+static uint32_t core_codecache__crc32(const char *rom)
+{
+    uint32_t c = 0xffffffffu;
+    FILE *fp;
+    int v, b;
+
+    fp = fopen(rom, "rb");
+    if(fp == NULL) {
+        LOGE("Couldn't open ROM file '%s'", rom);
+        return 0;
+    }
+    while((v = fgetc(fp)) != EOF) {
+        c ^= v;
+        for(b = 0; b < 8; ++b)
+            c = (c >> 1) ^ (0xedb88320u & -(c & 1));
+    }
+    fclose(fp);
+    return ~c;
+}
+
+/*
+ * Set up the cache for the ROM with the given CRC, reading in what earlier
+ * runs left in the directory. as.py leaves the CRC in the header as 0, in
+ * which case it is worked out from the ROM file.
+ */
+int core_codecache_init(struct core_codecache **pcc, const char *dir,
+        uint32_t crc32, const char *rom)
+{
+    struct core_codecache *cc;
+
+    cc = *pcc = calloc(1, sizeof(struct core_codecache));
+    if(cc == NULL) {
+        LOGE("Could not allocate code cache");
+        return 0;
+    }
+    cc->build = core_codecache__build();
+    cc->crc32 = crc32 != 0 ? crc32 : core_codecache__crc32(rom);
+    cc->fn = core_codecache__name(dir, cc->crc32, cc->build);
+    if(cc->fn == NULL) {
+        LOGE("Could not allocate code cache");
+        free(cc);
+        return 0;
+    }
+    mkdir(dir, 0777);
+
+    core_codecache__load(cc);
+    return 1;
+}
+
+void core_codecache_destroy(struct core_codecache *cc)
+{
+    free(cc->fn);
+    free(cc);
+}
+
+/* Keep the instructions a block was decoded to with its entry, room allowing. */
+static void core_codecache__keep(struct core_codecache *cc,
+        struct core_codecache_entry *e, const struct core_codecache_ir *ir,
+        int num)
+{
+    if(num == 0)
+        return;
+    if(num != e->num) {
+        e->num = 0;
+        if(cc->num_ir + num > CORE_CODECACHE_MAX_IR)
+            return;
+        e->ir = cc->num_ir;
+        e->num = num;
+        cc->num_ir += num;
+    }
+    memcpy(&cc->ir[e->ir], ir, num * sizeof(*ir));
+}
+
+/*
+ * Count runs of the block at an address, in the bank swapped in there, and
+ * keep the given instructions it was decoded to, if any. Only blocks in ROM
+ * are kept, as the code in RAM is only there once the ROM has put it there.
+ */
+void core_codecache_add(struct core_codecache *cc, uint16_t start,
+        uint8_t bank, uint32_t runs, const struct core_codecache_ir *ir,
+        int num)
+{
+    struct core_codecache_entry *e;
+    int k;
+
+    if(start > A_ROM_SWAP_END || runs == 0)
+        return;
+    for(k = cc->first[start]; k != 0; k = cc->next[k - 1]) {
+        e = &cc->entries[k - 1];
+        if(e->bank == bank) {
+            e->runs = runs > UINT32_MAX - e->runs ? UINT32_MAX :
+                                                    e->runs + runs;
+            core_codecache__keep(cc, e, ir, num);
+            return;
+        }
+    }
+    if(cc->num == CORE_CODECACHE_MAX)
+        return;
+
+    e = &cc->entries[cc->num];
+    e->start = start;
+    e->bank = bank;
+    e->num = 0;
+    e->ir = 0;
+    e->runs = runs;
+    core_codecache__keep(cc, e, ir, num);
+    cc->next[cc->num] = cc->first[start];
+    cc->first[start] = ++cc->num;
+}
+
+/*
+ * Install or translate the remembered blocks for the CPU's engine, hottest
+ * first, as the file keeps them, until it has no more room. Those in other
+ * ROM banks are read with their bank swapped in for the purpose.
+ */
+void core_codecache_warm(struct core_codecache *cc, struct core_cpu *cpu)
+{
+    struct core_codecache_entry *e;
+    struct core_mmu *mmu = cpu->mmu;
+    uint8_t bank = mmu->rom_s_bank;
+    int k, ok, warmed = 0;
+
+    if(cpu->engine != CPU_ENGINE_BLOCK && cpu->engine != CPU_ENGINE_JIT)
+        return;
+
+    for(k = 0; k < cc->num; ++k) {
+        e = &cc->entries[k];
+        if(e->start >= A_ROM_SWAP) {
+            if(e->bank >= mmu->rom_s_total)
+                continue;
+            if(e->bank != mmu->rom_s_bank)
+                core_mmu_bank_select(mmu, B_ROM_SWAP, e->bank);
+        }
+        if(cpu->engine == CPU_ENGINE_BLOCK)
+            ok = core_cpu_b_warm(cpu, e->start,
+                                 e->num > 0 ? &cc->ir[e->ir] : NULL, e->num);
+        else
+            ok = core_cpu_j_warm(cpu, e->start);
+        if(!ok)
+            break;
+        warmed += 1;
+    }
+    if(mmu->rom_s_bank != bank)
+        core_mmu_bank_select(mmu, B_ROM_SWAP, bank);
+
+    LOGD("Warmed %d of %d blocks from the code cache", warmed, cc->num);
+}
+
+static int core_codecache__hotter(const void *x, const void *y)
+{
+    const struct core_codecache_entry *a = x, *b = y;
+
+    return (a->runs < b->runs) - (a->runs > b->runs);
+}
+
+/* Write the cache out, hottest block first. */
+int core_codecache_write(struct core_codecache *cc)
+{
+    struct core_codecache_file_header hdr;
+    struct core_codecache_entry *order;
+    int ok;
+
+    order = malloc(cc->num * sizeof(*order) + 1);
+    if(order == NULL) {
+        LOGE("Could not allocate code cache order");
+        return 0;
+    }
+    memcpy(order, cc->entries, cc->num * sizeof(*order));
+    qsort(order, cc->num, sizeof(*order), core_codecache__hotter);
+
+    memcpy(hdr.magic, core_codecache_magic, sizeof(hdr.magic));
+    hdr.build = cc->build;
+    hdr.crc32 = cc->crc32;
+    hdr.num = cc->num;
+    hdr.num_ir = cc->num_ir;
+    ok = core_codecache__save(cc->fn, &hdr, order, sizeof(*order), cc->ir);
+    free(order);
+    if(ok)
+        LOGD("Wrote %d blocks to code cache '%s'", cc->num, cc->fn);
+    return ok;
+}
@@ -8,7 +8,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include "core/cpu/cpu.h"
+#include "core/cpu/alu.h"
 #include "core/cpu/hrc.h"
+#include "core/cpu/isa.h"
+#include "core/cpu/tier.h"
 #include "core/mmu/mmu.h"
 #include "log.h"
 
@@ -50,11 +53,46 @@ char *instrnam[NUM_INSTRS] = {
     "xor"  /* 1f */
 };
 
+/* Map of execution engines to the names accepted on the command line. */
+char *core_cpu_engine_names[CPU_ENGINE_NUM] = {
+    "cycle",
+    "instr",
+    "threaded",
+    "block",
+    "jit",
+    "aot",
+    "tiered"
+};
+
+/* Predecoded instruction table, indexed by opcode word. */
+struct core_instr_decoded core_cpu_dtab[65536];
+/* Set once the table is filled in, bar the op pointers; see core_cpu_init(). */
+int core_cpu_dtab_ready;
+
+/* Length and cycles taken by each addressing mode, from isa.h. */
+#define CORE_CPU_AM_LEN(mode, mn, len, cycles, ...)     len,
+#define CORE_CPU_AM_CYCLES(mode, mn, len, cycles, ...)  cycles,
+static const uint8_t core_cpu_am_len[16] = {
+    CORE_ISA_MODES(CORE_CPU_AM_LEN, 0)
+};
+static const uint8_t core_cpu_am_cycles[16] = {
+    CORE_ISA_MODES(CORE_CPU_AM_CYCLES, 0)
+};
+
+/* Address of each interrupt's handler. */
+static const uint16_t core_cpu_int_vectors[INT_NUM] = {
+    [INT_USER_IRQ] = 0xfffe, [INT_TIMER_IRQ] = 0xfffc,
+    [INT_VIDEO_IRQ] = 0xfffa, [INT_AUDIO_IRQ] = 0xfff8
+};
+
+static void core_cpu_i_decode_init(void);
+
 
 /* Initialize the CPU state. Sets up the opcode jump table. */
 int core_cpu_init(struct core_cpu **pcpu, struct core_mmu *mmu)
 {
     struct core_cpu *cpu;
+    int w;
     
     *pcpu = NULL;
     *pcpu = malloc(sizeof(struct core_cpu));
@@ -68,7 +106,24 @@ int core_cpu_init(struct core_cpu **pcpu, struct core_mmu *mmu)
     memset(cpu->r, 0, sizeof(cpu->r));
     cpu->r[R_S] = 0x9ffe;
     cpu->r[R_F] |= FLAG_I;
+    memset(&cpu->lf, 0, sizeof(cpu->lf));
     cpu->i_cycles = 0;
+    cpu->int_pending = 0;
+    cpu->int_ready = 0;
+    cpu->int_entering = INT_NONE;
+    cpu->total_cycles = 0;
+    cpu->ahead = 0;
+    cpu->lead = 0;
+    cpu->engine = CPU_ENGINE_CYCLE;
+    cpu->bcache = NULL;
+    cpu->jit = NULL;
+    cpu->block_exit = 0;
+    cpu->idle.base = (uint64_t)-1;
+    memset(&cpu->aot, 0, sizeof(cpu->aot));
+    cpu->hle = 0;
+    cpu->intstat = NULL;
+    cpu->codecache = NULL;
+    cpu->tier = NULL;
     cpu->i = malloc(sizeof(struct core_instr));
     if(cpu->i == NULL) {
         LOGE("Could not allocate cpu instruction; exiting");
@@ -76,38 +131,17 @@ int core_cpu_init(struct core_cpu **pcpu, struct core_mmu *mmu)
     }
     memset(cpu->i, 0, sizeof(*cpu->i));
 
-    core_cpu_ops[0x00] = core_cpu_i_op_nop;
-    core_cpu_ops[0x01] = core_cpu_i_op_int;
-    core_cpu_ops[0x02] = core_cpu_i_op_rti;
-    core_cpu_ops[0x03] = core_cpu_i_op_rts;
-    core_cpu_ops[0x04] = core_cpu_i_op_jp;
-    core_cpu_ops[0x05] = core_cpu_i_op_cl;
-    core_cpu_ops[0x06] = core_cpu_i_op_jz;
-    core_cpu_ops[0x07] = core_cpu_i_op_cz;
-    core_cpu_ops[0x08] = core_cpu_i_op_jc;
-    core_cpu_ops[0x09] = core_cpu_i_op_cc;
-    core_cpu_ops[0x0a] = core_cpu_i_op_jo;
-    core_cpu_ops[0x0b] = core_cpu_i_op_co;
-    core_cpu_ops[0x0c] = core_cpu_i_op_jn;
-    core_cpu_ops[0x0d] = core_cpu_i_op_cn;
-    core_cpu_ops[0x0e] = core_cpu_i_op_not;
-    core_cpu_ops[0x0f] = core_cpu_i_op_inc;
-    core_cpu_ops[0x10] = core_cpu_i_op_dec;
-    core_cpu_ops[0x11] = core_cpu_i_op_ind;
-    core_cpu_ops[0x12] = core_cpu_i_op_ded;
-    core_cpu_ops[0x13] = core_cpu_i_op_mv;
-    core_cpu_ops[0x14] = core_cpu_i_op_cmp;
-    core_cpu_ops[0x15] = core_cpu_i_op_tst;
-    core_cpu_ops[0x16] = core_cpu_i_op_add;
-    core_cpu_ops[0x17] = core_cpu_i_op_sub;
-    core_cpu_ops[0x18] = core_cpu_i_op_mul;
-    core_cpu_ops[0x19] = core_cpu_i_op_div;
-    core_cpu_ops[0x1a] = core_cpu_i_op_lsl;
-    core_cpu_ops[0x1b] = core_cpu_i_op_lsr;
-    core_cpu_ops[0x1c] = core_cpu_i_op_asr;
-    core_cpu_ops[0x1d] = core_cpu_i_op_and;
-    core_cpu_ops[0x1e] = core_cpu_i_op_or;
-    core_cpu_ops[0x1f] = core_cpu_i_op_not;
+#define CORE_CPU_OP(op, mn, kind, flag) core_cpu_ops[op] = core_cpu_i_op_##mn;
+    CORE_ISA_INSTRS(CORE_CPU_OP)
+#undef CORE_CPU_OP
+
+    /* Filled in once, or read from the code cache; only op is set each time. */
+    if(!core_cpu_dtab_ready)
+        core_cpu_i_decode_init();
+    for(w = 0; w < 65536; ++w)
+        core_cpu_dtab[w].op = core_cpu_ops[core_cpu_dtab[w].opcode];
+    core_cpu_hle_init();
+    cpu->d = &core_cpu_dtab[0];
 
     cpu->hrc = malloc(sizeof(struct core_hrc));
     if(cpu->hrc == NULL) {
@@ -120,14 +154,96 @@ int core_cpu_init(struct core_cpu **pcpu, struct core_mmu *mmu)
 }
 
 
+/*
+ * Fill in the predecoded instruction table, but for the implementations.
+ * Every possible opcode word is decoded once, here, so that executing an
+ * instruction only needs a single table lookup.
+ */
+static void core_cpu_i_decode_init(void)
+{
+    int w;
+    struct core_instr i;
+
+    memset(&i, 0, sizeof(i));
+    for(w = 0; w < 65536; ++w) {
+        struct core_instr_decoded *d = &core_cpu_dtab[w];
+
+        i.ib0 = B_LO(w);
+        i.ib1 = B_HI(w);
+
+        d->opcode = INSTR_OP(&i);
+        d->mode = INSTR_AM(&i);
+        d->rx = INSTR_RX(&i);
+        d->ry = INSTR_RY(&i);
+        d->size = INSTR_OPSZ(&i);
+        d->flags = (instr_is_void(&i)       ? DEC_VOID : 0) |
+                   (instr_is_1op(&i)        ? DEC_1OP : 0) |
+                   (instr_dr_only(&i)       ? DEC_DR_ONLY : 0) |
+                   (instr_has_data(&i)      ? DEC_HAS_DATA : 0) |
+                   (instr_has_dw(&i)        ? DEC_HAS_DW : 0) |
+                   (instr_is_srcptr(&i)     ? DEC_SRCPTR : 0) |
+                   (instr_is_dstptr(&i)     ? DEC_DSTPTR : 0) |
+                   (instr_is_op1data(&i)    ? DEC_OP1DATA : 0) |
+                   (instr_is_op1reg(&i)     ? DEC_OP1REG : 0) |
+                   (instr_has_spderef(&i)   ? DEC_SPDEREF : 0) |
+                   (instr_ends_block(&i)    ? DEC_ENDS_BLOCK : 0) |
+                   (instr_reads_f(&i)       ? DEC_READS_F : 0) |
+                   (instr_writes_f(&i)      ? DEC_WRITES_F : 0);
+
+        if(d->flags & DEC_VOID) {
+            /*
+             * The mode bits come from the next byte, which is not part of
+             * the instruction, so there are no operands to fetch or write
+             * back after it.
+             */
+            d->flags &= ~(DEC_HAS_DATA | DEC_HAS_DW | DEC_DR_ONLY |
+                          DEC_SRCPTR | DEC_DSTPTR | DEC_OP1DATA | DEC_OP1REG);
+            d->len = 1;
+            switch(d->opcode) {
+                case OP_INT: d->cycles = 5; break;
+                case OP_RTI: d->cycles = 4; break;
+                case OP_RTS: d->cycles = 3; break;
+                default:     d->cycles = 2; break;
+            }
+        } else {
+            d->len = core_cpu_am_len[d->mode];
+            /* Calls through a register wait for the stack write. */
+            if((d->flags & DEC_DR_ONLY) && (d->flags & DEC_SPDEREF))
+                d->cycles = 3;
+            else
+                d->cycles = core_cpu_am_cycles[d->mode];
+        }
+    }
+    core_cpu_dtab_ready = 1;
+}
+
+
 /* Destroys the core_cpu structure, freeing its memory. */ 
 void core_cpu_destroy(struct core_cpu *cpu)
 {
+    core_cpu_b_destroy(cpu);
+    core_cpu_j_destroy(cpu);
+    if(cpu->tier != NULL)
+        core_tier_destroy(cpu->tier);
     free(cpu->hrc);
     free(cpu);
 }
 
 
+/*
+ * Called by the MMU when a write lands in a page holding cached code. Drops
+ * the affected blocks and stops the running block, which may be one of them.
+ */
+void core_cpu_code_written(struct core_cpu *cpu, uint16_t a)
+{
+    core_cpu_b_invalidate(cpu, a);
+    core_cpu_j_invalidate(cpu, a);
+    core_cpu_a_invalidate(cpu, a);
+    core_cpu_tier_invalidate(cpu, a);
+    cpu->block_exit = 1;
+}
+
+
 /*
  * Execute one cycle of the current instruction.
  *
@@ -137,19 +253,24 @@ void core_cpu_destroy(struct core_cpu *cpu)
  * 
  * Instructions are thus mostly shielded from these details, and can just focus
  * on the execution steps, rather than how to access the operands.
+ *
+ * The addressing mode class of the instruction comes from the predecoded
+ * table, looked up once when the opcode word arrives in cycle 1.
  */
 void core_cpu_i_cycle(struct core_cpu *cpu)
 {
     static struct core_instr_params p;
     static void (*i)(struct core_cpu *, struct core_instr_params *);
+    struct core_instr_decoded *d = cpu->d;
     int *c = &cpu->i_cycles;
 
     core_cpu_hrc_step(cpu);
     cpu->total_cycles += 1;
         
     /* Handle interrupt if pending. */
-    if(cpu->interrupt != INT_NONE && (cpu->r[R_F] & FLAG_I) && !cpu->i_middle) {
+    if(cpu->int_ready) {
         if(*c == 0) {
+            core_alu_sync(&cpu->r[R_F], &cpu->lf);
             cpu->r[R_S] -= 2;
             core_mmu_ww_send_cpu(cpu->mmu, cpu->r[R_S], cpu->r[R_F]);
             *c += 1;
@@ -158,25 +279,18 @@ void core_cpu_i_cycle(struct core_cpu *cpu)
             core_mmu_ww_send_cpu(cpu->mmu, cpu->r[R_S], cpu->r[R_P]);
             *c += 1;
         } else if(*c == 2) {
-            switch(cpu->interrupt) {
-                case INT_USER_IRQ:
-                    core_mmu_rw_send_cpu(cpu->mmu, 0xfffe);
-                    break;
-                case INT_TIMER_IRQ:
-                    core_mmu_rw_send_cpu(cpu->mmu, 0xfffc);
-                    break;
-                case INT_VIDEO_IRQ:
-                    core_mmu_rw_send_cpu(cpu->mmu, 0xfffa);
-                    break;
-                case INT_AUDIO_IRQ:
-                    core_mmu_rw_send_cpu(cpu->mmu, 0xfff8);
-                    break;
-            }
+            /* Later requests wait, even if they come first in priority. */
+            cpu->int_entering = core_cpu_int_next(cpu);
+            core_mmu_rw_send_cpu(cpu->mmu,
+                                 core_cpu_int_vectors[cpu->int_entering]);
             *c += 1;
 
         } else if(*c == 3) {
             cpu->r[R_P] = core_mmu_rw_fetch_cpu(cpu->mmu);
-            cpu->interrupt = INT_NONE;
+            if(cpu->intstat != NULL)
+                core_cpu_intstat_enter(cpu, cpu->int_entering, 0);
+            cpu->int_pending &= ~(1 << cpu->int_entering);
+            core_cpu_int_update(cpu);
             *c = 0;
         }
         return;
@@ -185,6 +299,7 @@ void core_cpu_i_cycle(struct core_cpu *cpu)
     /* Each cycle has a state machine for every type of instruction. */
     if(*c == 0) {
         cpu->i_middle = 1;
+        cpu->int_ready = 0;
         memset(&p, 0, sizeof(p));
 
         core_mmu_rw_send_cpu(cpu->mmu, cpu->r[R_P]);
@@ -199,60 +314,63 @@ void core_cpu_i_cycle(struct core_cpu *cpu)
         /* Instruction opcode read completed. */
         cpu->i->ib0 = B_LO(t);
         cpu->i->ib1 = B_HI(t);
-        i = core_cpu_ops[INSTR_OP(cpu->i)];
+        d = cpu->d = &core_cpu_dtab[t];
+        i = d->op;
+        /*
+         * Also apply flags before instructions which may write F, as not all
+         * of them do on every path.
+         */
+        if(d->flags & (DEC_READS_F | DEC_WRITES_F)) {
+            core_alu_sync(&cpu->r[R_F], &cpu->lf);
+            p.f = cpu->r[R_F];
+        }
         //LOGW("core.cpu: op = %02x %02x", cpu->i->ib0, cpu->i->ib1);
         
         /* Nothing else to fetch. */
-        if(instr_is_void(cpu->i)) {
+        if(d->flags & DEC_VOID) {
             cpu->r[R_P] -= 1;
             p.p = cpu->r[R_P];
             i(cpu, &p);
-            if(INSTR_OP(cpu->i) == OP_NOP)
+            if(d->opcode == OP_NOP)
                 cpu->i_done = 1;
         /* Nothing else to fetch. */
-        } else if(instr_dr_only(cpu->i)) {
-            p.op1 = cpu->r[INSTR_RX(cpu->i)];
-            p.op2 = cpu->r[INSTR_RY(cpu->i)];
+        } else if(d->flags & DEC_DR_ONLY) {
+            p.op1 = cpu->r[d->rx];
+            p.op2 = cpu->r[d->ry];
             i(cpu, &p);
-            cpu->r[INSTR_RX(cpu->i)] = p.op1;
-            if(instr_is_2op(cpu->i))
-                cpu->r[INSTR_RY(cpu->i)] = p.op2;
-            if(!instr_has_spderef(cpu->i))
+            cpu->r[d->rx] = p.op1;
+            if(!(d->flags & DEC_1OP))
+                cpu->r[d->ry] = p.op2;
+            if(!(d->flags & DEC_SPDEREF))
                 cpu->i_done = 1;
         /* Fetch data byte/word after instruction. */
-        } else if(instr_has_data(cpu->i)) {
+        } else if(d->flags & DEC_HAS_DATA) {
             /* Post read request for data bytes */
             core_mmu_rw_send_cpu(cpu->mmu, cpu->r[R_P]);
-            cpu->r[R_P] += instr_has_dw(cpu->i) ? 2 : 1;
+            cpu->r[R_P] += (d->flags & DEC_HAS_DW) ? 2 : 1;
             p.p = cpu->r[R_P];
         /* Fetch memory operand from source register. */
-        } else if(instr_is_srcptr(cpu->i)) {
-            if(instr_is_1op(cpu->i)) {
-                if(INSTR_OPSZ(cpu->i) == OP_16)
-                    core_mmu_rw_send_cpu(cpu->mmu, cpu->r[INSTR_RY(cpu->i)]);
-                else
-                    core_mmu_rb_send_cpu(cpu->mmu, cpu->r[INSTR_RY(cpu->i)]);
-            } else {
-                if(INSTR_OPSZ(cpu->i) == OP_16)
-                    core_mmu_rw_send_cpu(cpu->mmu, cpu->r[INSTR_RY(cpu->i)]);
-                else
-                    core_mmu_rb_send_cpu(cpu->mmu, cpu->r[INSTR_RY(cpu->i)]);
-            }
+        } else if(d->flags & DEC_SRCPTR) {
+            if(d->size == OP_16)
+                core_mmu_rw_send_cpu(cpu->mmu, cpu->r[d->ry]);
+            else
+                core_mmu_rb_send_cpu(cpu->mmu, cpu->r[d->ry]);
         } else {
             LOGE("core.cpu: invalid state reached (cycle 2)");
         }
 
     } else if(*c == 2) {
-        if(instr_is_void(cpu->i) || instr_dr_only(cpu->i)) {
+        if(d->flags & (DEC_VOID | DEC_DR_ONLY)) {
             /* TODO: load memory operands when necessary. */
             i(cpu, &p);
-            if(INSTR_OP(cpu->i) == OP_RTS)
+            /* Register calls have finished pushing the return address. */
+            if(d->opcode == OP_RTS || (d->flags & DEC_DR_ONLY))
                 cpu->i_done = 1;
-        } else if(instr_has_data(cpu->i)) {
+        } else if(d->flags & DEC_HAS_DATA) {
             /* Data bytes have been read from memory */
             uint16_t t = core_mmu_rw_fetch_cpu(cpu->mmu);
             cpu->i->db0 = B_LO(t);
-            if(instr_has_dw(cpu->i)) {
+            if(d->flags & DEC_HAS_DW) {
                 cpu->i->db1 = B_HI(t);
 #ifdef _DEBUG
                 LOGV("core.cpu: data = %02x %02x", cpu->i->db0, cpu->i->db1);
@@ -262,54 +380,49 @@ void core_cpu_i_cycle(struct core_cpu *cpu)
                 LOGV("core.cpu: data = %02x", cpu->i->db0);
 #endif
             }
-            if(instr_is_op1data(cpu->i)) {
-                p.op1 = (INSTR_AM(cpu->i) == AM_DB) ?
+            if(d->flags & DEC_OP1DATA) {
+                p.op1 = (d->mode == AM_DB) ?
                     INSTR_D8(cpu->i) : INSTR_D16(cpu->i);
-                if(instr_is_2op(cpu->i))
-                    p.op2 = cpu->r[INSTR_RY(cpu->i)];
+                if(!(d->flags & DEC_1OP))
+                    p.op2 = cpu->r[d->ry];
             } else {
-                p.op1 = cpu->r[INSTR_RX(cpu->i)];
-                p.op2 = (INSTR_AM(cpu->i) == AM_DR_DB) ?
+                p.op1 = cpu->r[d->rx];
+                p.op2 = (d->mode == AM_DR_DB) ?
                     INSTR_D8(cpu->i) : INSTR_D16(cpu->i);
             }
 
             /* Fetch memory operand for pointer. */
-            if(instr_is_srcptr(cpu->i)) {
-                if(instr_is_1op(cpu->i))
-                    if(INSTR_OPSZ(cpu->i) == OP_16)
-                        core_mmu_rw_send_cpu(cpu->mmu, p.op1);//cpu->r[INSTR_RX(cpu->i)]);
-                    else
-                        core_mmu_rb_send_cpu(cpu->mmu, p.op1);//cpu->r[INSTR_RX(cpu->i)]);
+            if(d->flags & DEC_SRCPTR) {
+                uint16_t a = (d->flags & DEC_1OP) ? p.op1 : p.op2;
+                if(d->size == OP_16)
+                    core_mmu_rw_send_cpu(cpu->mmu, a);
                 else
-                    if(INSTR_OPSZ(cpu->i) == OP_16)
-                        core_mmu_rw_send_cpu(cpu->mmu, p.op2);//cpu->r[INSTR_RY(cpu->i)]);
-                    else
-                        core_mmu_rb_send_cpu(cpu->mmu, p.op2);//cpu->r[INSTR_RY(cpu->i)]);
+                    core_mmu_rb_send_cpu(cpu->mmu, a);
             /* Operate directly on data; nothing further to fetch. */
             } else {
                 i(cpu, &p);
-                if(!instr_is_dstptr(cpu->i)) {
-                    if(instr_is_op1reg(cpu->i))
-                        cpu->r[INSTR_RX(cpu->i)] = p.op1;
+                if(!(d->flags & DEC_DSTPTR)) {
+                    if(d->flags & DEC_OP1REG)
+                        cpu->r[d->rx] = p.op1;
                     cpu->i_done = 1;
                 }
             }
-        } else if(instr_is_srcptr(cpu->i)) {
+        } else if(d->flags & DEC_SRCPTR) {
             /* Data has arrived from memory, read back */
-            if(instr_is_1op(cpu->i)) {
-                p.op1 = (INSTR_OPSZ(cpu->i) == OP_16) ? 
+            if(d->flags & DEC_1OP) {
+                p.op1 = (d->size == OP_16) ? 
                     core_mmu_rw_fetch_cpu(cpu->mmu) :
                     core_mmu_rb_fetch_cpu(cpu->mmu);
             } else {
-                p.op1 = cpu->r[INSTR_RX(cpu->i)];
-                p.op2 = (INSTR_OPSZ(cpu->i) == OP_16) ? 
+                p.op1 = cpu->r[d->rx];
+                p.op2 = (d->size == OP_16) ? 
                     core_mmu_rw_fetch_cpu(cpu->mmu) :
                     core_mmu_rb_fetch_cpu(cpu->mmu);
             }
 
             i(cpu, &p);
-            if(!instr_is_dstptr(cpu->i)) {
-                cpu->r[INSTR_RX(cpu->i)] = p.op1;
+            if(!(d->flags & DEC_DSTPTR)) {
+                cpu->r[d->rx] = p.op1;
                 cpu->i_done = 1;
             }
         } else {
@@ -317,101 +430,339 @@ void core_cpu_i_cycle(struct core_cpu *cpu)
         }
 
     } else if(*c == 3) {
-        if(instr_is_void(cpu->i) || instr_dr_only(cpu->i)) {
+        if(d->flags & (DEC_VOID | DEC_DR_ONLY)) {
             /* TODO: load memory operands when necessary. */
             i(cpu, &p);
-            if(INSTR_OP(cpu->i) == OP_RTI)
+            if(d->opcode == OP_RTI)
                 cpu->i_done = 1;
-        } else if(instr_has_data(cpu->i)) {
-            if(instr_is_srcptr(cpu->i)) {
-                if(instr_is_1op(cpu->i))
-                    p.op1 = (INSTR_OPSZ(cpu->i) == OP_16) ?
+        } else if(d->flags & DEC_HAS_DATA) {
+            if(d->flags & DEC_SRCPTR) {
+                if(d->flags & DEC_1OP)
+                    p.op1 = (d->size == OP_16) ?
                         core_mmu_rw_fetch_cpu(cpu->mmu) :
                         core_mmu_rb_fetch_cpu(cpu->mmu);
                 else {
-                    p.op1 = cpu->r[INSTR_RX(cpu->i)];
-                    p.op2 = (INSTR_OPSZ(cpu->i) == OP_16) ?
+                    p.op1 = cpu->r[d->rx];
+                    p.op2 = (d->size == OP_16) ?
                         core_mmu_rw_fetch_cpu(cpu->mmu) :
                         core_mmu_rb_fetch_cpu(cpu->mmu);
                 }
 
                 i(cpu, &p);
-                if(!instr_is_dstptr(cpu->i)) {
-                    cpu->r[INSTR_RX(cpu->i)] = p.op1;
+                if(!(d->flags & DEC_DSTPTR)) {
+                    cpu->r[d->rx] = p.op1;
                     cpu->i_done = 1;
                 }
-            } else if(instr_is_dstptr(cpu->i)) {
-                (INSTR_OPSZ(cpu->i) == OP_16) ?
+            } else if(d->flags & DEC_DSTPTR) {
+                (d->size == OP_16) ?
                     core_mmu_ww_send_cpu(cpu->mmu, INSTR_D16(cpu->i),
-                            cpu->r[INSTR_RY(cpu->i)]) :
+                            cpu->r[d->ry]) :
                     core_mmu_wb_send_cpu(cpu->mmu, INSTR_D16(cpu->i),
-                            cpu->r[INSTR_RY(cpu->i)]);
+                            cpu->r[d->ry]);
             }
-        } else if(instr_is_srcptr(cpu->i)) {
-            if(instr_is_dstptr(cpu->i)) {
-                (INSTR_OPSZ(cpu->i) == OP_16) ?
-                    core_mmu_ww_send_cpu(cpu->mmu, cpu->r[INSTR_RX(cpu->i)], p.op1) :
-                    core_mmu_wb_send_cpu(cpu->mmu, cpu->r[INSTR_RX(cpu->i)], p.op1);
+        } else if(d->flags & DEC_SRCPTR) {
+            if(d->flags & DEC_DSTPTR) {
+                (d->size == OP_16) ?
+                    core_mmu_ww_send_cpu(cpu->mmu, cpu->r[d->rx], p.op1) :
+                    core_mmu_wb_send_cpu(cpu->mmu, cpu->r[d->rx], p.op1);
             }
         } else {
             LOGE("core.cpu: reached error state (cycle 4)");
         }
 
     } else if(*c == 4) {
-        if(instr_is_void(cpu->i) || instr_dr_only(cpu->i)) {
+        if(d->flags & (DEC_VOID | DEC_DR_ONLY)) {
             /* TODO: load memory operands when necessary. */
             i(cpu, &p);
-            if(INSTR_OP(cpu->i) == OP_INT)
+            if(d->opcode == OP_INT)
                 cpu->i_done = 1;
-        } else if(instr_has_data(cpu->i)) {
-            if(instr_is_srcptr(cpu->i)) {
-                if(instr_is_dstptr(cpu->i)) {
-                    (INSTR_OPSZ(cpu->i) == OP_16) ?
-                        core_mmu_ww_send_cpu(cpu->mmu, cpu->r[INSTR_RX(cpu->i)], p.op1) :
-                        core_mmu_wb_send_cpu(cpu->mmu, cpu->r[INSTR_RX(cpu->i)], p.op1);
+        } else if(d->flags & DEC_HAS_DATA) {
+            if(d->flags & DEC_SRCPTR) {
+                if(d->flags & DEC_DSTPTR) {
+                    (d->size == OP_16) ?
+                        core_mmu_ww_send_cpu(cpu->mmu, cpu->r[d->rx], p.op1) :
+                        core_mmu_wb_send_cpu(cpu->mmu, cpu->r[d->rx], p.op1);
                     cpu->i_done = 1;
                 }
-            } else if(instr_is_dstptr(cpu->i)) {
+            } else if(d->flags & DEC_DSTPTR) {
                 /* Write request completed */
                 cpu->i_done = 1;
             }
-        } else if(instr_is_srcptr(cpu->i)) {
-            if(instr_is_dstptr(cpu->i))
+        } else if(d->flags & DEC_SRCPTR) {
+            if(d->flags & DEC_DSTPTR)
                 /* Write request completed */
                 cpu->i_done = 1;
         } else {
             LOGE("core.cpu: reached error state (cycle 5)");
         }
     } else if(*c == 5) {
-        if(instr_has_data(cpu->i) &&
-                instr_is_srcptr(cpu->i) && instr_is_dstptr(cpu->i))
+        if((d->flags & (DEC_HAS_DATA | DEC_SRCPTR | DEC_DSTPTR)) ==
+                (DEC_HAS_DATA | DEC_SRCPTR | DEC_DSTPTR))
             cpu->i_done = 1;
     } else {
         LOGE("core.cpu: reached cycle 6, error");
         cpu->i_done = 1;
     }
 
+    /* Flags set before F was written are stale. */
+    if(cpu->i_done && (d->flags & DEC_WRITES_F))
+        cpu->lf.mask = 0;
+    /* RTI is done here before the cycle which would restore F runs. */
+    if(cpu->i_done && d->opcode == OP_RTI && cpu->intstat != NULL)
+        core_cpu_intstat_leave(cpu, 0);
     *c += 1;
 }
 
+/* Flag tested by each of the conditional call instructions. */
+static const int core_cpu_call_flags[NUM_INSTRS] = {
+    [OP_CL] = 0, [OP_CZ] = FLAG_Z, [OP_CC] = FLAG_C, [OP_CO] = FLAG_O,
+    [OP_CN] = FLAG_N
+};
+
+/* Read an operand of the given size directly from memory. */
+static inline uint16_t core_cpu_i__read(struct core_cpu *cpu, int size,
+                                        uint16_t a)
+{
+    return (size == OP_16) ? core_mmu_readw(cpu->mmu, a) :
+                             core_mmu_readb(cpu->mmu, a);
+}
+
+/* Write an operand of the given size directly to memory. */
+static inline void core_cpu_i__write(struct core_cpu *cpu, int size,
+                                     uint16_t a, uint16_t v)
+{
+    if(size == OP_16)
+        core_mmu_writew(cpu->mmu, a, v);
+    else
+        core_mmu_writeb(cpu->mmu, a, v);
+}
+
+/* Is a call instruction taken, given the flags it started with? */
+static inline int core_cpu_i__call_taken(struct core_instr_decoded *d,
+                                         struct core_instr_params *p)
+{
+    int flag = core_cpu_call_flags[d->opcode];
+
+    return p->f & flag || !flag;
+}
+
+/* Execute the operation itself, once the operands have been gathered. */
+static inline void core_cpu_i__exec(struct core_cpu *cpu,
+                                    struct core_instr_decoded *d,
+                                    struct core_instr_params *p)
+{
+    if(d->flags & DEC_SPDEREF) {
+        if(core_cpu_i__call_taken(d, p)) {
+            cpu->r[R_S] -= 2;
+            core_mmu_writew(cpu->mmu, cpu->r[R_S], p->p);
+            cpu->r[R_P] = p->op1;
+        }
+    } else {
+        d->op(cpu, p);
+    }
+}
+
 /*
- * Execute all the cycles for the current instruction.
+ * Enter the highest priority pending interrupt's handler, as the per-cycle
+ * state machine does between two instructions. Any others stay pending.
+ * Returns the number of cycles taken.
  */
-void core_cpu_i_instr(struct core_cpu *cpu)
+int core_cpu_i_interrupt(struct core_cpu *cpu)
 {
-    uint16_t pc = cpu->r[R_P];
-    cpu->i_cycles = 0;
-    cpu->i_done = 0;
-    cpu->i_middle = 0;
+    enum core_interrupt n = core_cpu_int_next(cpu);
+
+    core_alu_sync(&cpu->r[R_F], &cpu->lf);
+    cpu->r[R_S] -= 2;
+    core_mmu_writew(cpu->mmu, cpu->r[R_S], cpu->r[R_F]);
+    cpu->r[R_S] -= 2;
+    core_mmu_writew(cpu->mmu, cpu->r[R_S], cpu->r[R_P]);
+    cpu->r[R_P] = core_mmu_readw(cpu->mmu, core_cpu_int_vectors[n]);
+    if(cpu->intstat != NULL)
+        core_cpu_intstat_enter(cpu, n, cpu->ahead + 4);
+    cpu->int_pending &= ~(1 << n);
+    core_cpu_int_update(cpu);
+
+    return 4;
+}
+
+/*
+ * Execute the current instruction in one go.
+ *
+ * Memory is accessed immediately rather than through the request/fetch
+ * protocol, and the caller is expected to catch the other devices up on the
+ * returned number of cycles, which matches what core_cpu_i_cycle() would have
+ * taken. A pending interrupt is entered instead, as a separate step.
+ */
+int core_cpu_i_instr(struct core_cpu *cpu)
+{
+    if(core_cpu_int_due(cpu, cpu->r[R_F]))
+        return core_cpu_i_interrupt(cpu);
 
-    do {
-        core_cpu_i_cycle(cpu);
-        LOGV("core.cpu: ... cycle %d", cpu->i_cycles);
-        cpu->i_middle = 0;
-    } while(!cpu->i_done);
+    return core_cpu_i_exec(cpu);
+}
+
+/*
+ * Execute the instruction at the program counter, without checking for
+ * interrupts. Returns the number of cycles taken.
+ */
+int core_cpu_i_exec(struct core_cpu *cpu)
+{
+    struct core_instr_decoded *d;
+    uint16_t data = 0;
+
+    d = &core_cpu_dtab[core_mmu_readw(cpu->mmu, cpu->r[R_P])];
+    if(d->flags & DEC_HAS_DATA)
+        data = core_mmu_readw(cpu->mmu, cpu->r[R_P] + 2);
+
+    return core_cpu_i_exec_d(cpu, d, data);
+}
+
+/*
+ * Latch an instruction and its data bytes as core_cpu_i_exec_d() would, for
+ * an engine about to run it from code of its own, so that it can be recorded
+ * as the interpreter's is; see core_run_slice_probe().
+ */
+void core_cpu_i_latch(struct core_cpu *cpu, struct core_instr_decoded *d,
+                      uint16_t data)
+{
+    uint16_t t = d - core_cpu_dtab;
+
+    cpu->i->ib0 = B_LO(t);
+    cpu->i->ib1 = B_HI(t);
+    cpu->d = d;
+    cpu->i_cycles = d->cycles;
+    cpu->i_done = 1;
+    if(d->flags & DEC_HAS_DATA) {
+        cpu->i->db0 = B_LO(data);
+        if(d->flags & DEC_HAS_DW)
+            cpu->i->db1 = B_HI(data);
+    }
+}
+
+/*
+ * Execute an instruction already fetched from the program counter, given its
+ * predecoded form and the word following the opcode (only used if the
+ * instruction has data). Returns the number of cycles taken.
+ */
+int core_cpu_i_exec_d(struct core_cpu *cpu, struct core_instr_decoded *d,
+                      uint16_t data)
+{
+    struct core_instr_params p;
+    uint16_t t = d - core_cpu_dtab, a;
+
+    cpu->i->ib0 = B_LO(t);
+    cpu->i->ib1 = B_HI(t);
+    cpu->d = d;
+    cpu->i_cycles = d->cycles;
+    cpu->i_done = 1;
+
+    if(d->flags & DEC_READS_F)
+        core_alu_sync(&cpu->r[R_F], &cpu->lf);
+    memset(&p, 0, sizeof(p));
+    p.s = cpu->r[R_S];
+    p.f = cpu->r[R_F];
+
+    if(d->flags & DEC_VOID) {
+        p.p = cpu->r[R_P] += 1;
+        switch(d->opcode) {
+            case OP_INT:
+                cpu->r[R_S] -= 2;
+                core_mmu_writew(cpu->mmu, cpu->r[R_S], cpu->r[R_P]);
+                core_cpu_int_raise(cpu, INT_USER_IRQ);
+                cpu->r[R_S] -= 2;
+                core_mmu_writew(cpu->mmu, cpu->r[R_S], cpu->r[R_F]);
+                cpu->r[R_P] = core_mmu_readw(cpu->mmu, 0xfffe);
+                break;
+            case OP_RTI:
+                cpu->r[R_P] = core_mmu_readw(cpu->mmu, cpu->r[R_S]);
+                cpu->r[R_S] += 2;
+                cpu->r[R_F] = core_mmu_readw(cpu->mmu, cpu->r[R_S]);
+                cpu->lf.mask = 0;
+                cpu->r[R_S] += 2;
+                if(cpu->intstat != NULL)
+                    core_cpu_intstat_leave(cpu, cpu->ahead + d->cycles);
+                break;
+            case OP_RTS:
+                cpu->r[R_P] = core_mmu_readw(cpu->mmu, cpu->r[R_S]);
+                cpu->r[R_S] += 2;
+                break;
+        }
+        return d->cycles;
+    }
+
+    if(d->flags & DEC_HAS_DATA) {
+        cpu->i->db0 = B_LO(data);
+        if(d->flags & DEC_HAS_DW)
+            cpu->i->db1 = B_HI(data);
+    }
+    p.p = cpu->r[R_P] += d->len;
+
+    switch(d->mode) {
+        case AM_DR:
+        case AM_DR_DR:
+            p.op1 = cpu->r[d->rx];
+            p.op2 = cpu->r[d->ry];
+            core_cpu_i__exec(cpu, d, &p);
+            cpu->r[d->rx] = p.op1;
+            if(d->mode == AM_DR_DR)
+                cpu->r[d->ry] = p.op2;
+            break;
+        case AM_IR:
+            p.op1 = core_cpu_i__read(cpu, d->size, cpu->r[d->ry]);
+            core_cpu_i__exec(cpu, d, &p);
+            core_cpu_i__write(cpu, d->size, cpu->r[d->rx], p.op1);
+            break;
+        case AM_DB:
+        case AM_DW:
+            p.op1 = (d->mode == AM_DB) ? INSTR_D8(cpu->i) : INSTR_D16(cpu->i);
+            core_cpu_i__exec(cpu, d, &p);
+            break;
+        case AM_IB:
+        case AM_IW:
+            p.op2 = INSTR_D16(cpu->i);
+            p.op1 = core_cpu_i__read(cpu, d->size, cpu->r[d->rx]);
+            core_cpu_i__exec(cpu, d, &p);
+            core_cpu_i__write(cpu, d->size, cpu->r[d->rx], p.op1);
+            break;
+        case AM_DR_IR:
+            p.op1 = cpu->r[d->rx];
+            p.op2 = core_cpu_i__read(cpu, d->size, cpu->r[d->ry]);
+            core_cpu_i__exec(cpu, d, &p);
+            cpu->r[d->rx] = p.op1;
+            break;
+        case AM_DR_DB:
+        case AM_DR_DW:
+            p.op1 = cpu->r[d->rx];
+            p.op2 = (d->mode == AM_DR_DB) ? INSTR_D8(cpu->i) : INSTR_D16(cpu->i);
+            core_cpu_i__exec(cpu, d, &p);
+            cpu->r[d->rx] = p.op1;
+            break;
+        case AM_DR_IB:
+        case AM_DR_IW:
+            a = INSTR_D16(cpu->i);
+            p.op1 = cpu->r[d->rx];
+            p.op2 = core_cpu_i__read(cpu, d->size, a);
+            core_cpu_i__exec(cpu, d, &p);
+            cpu->r[d->rx] = p.op1;
+            break;
+        case AM_IB_DR:
+        case AM_IW_DR:
+            p.op1 = cpu->r[d->rx];
+            p.op2 = INSTR_D16(cpu->i);
+            core_cpu_i__exec(cpu, d, &p);
+            core_cpu_i__write(cpu, d->size, INSTR_D16(cpu->i), cpu->r[d->ry]);
+            break;
+        default:
+            /* The per-cycle state machine cannot execute these either. */
+            LOGE("core.cpu: invalid addressing mode %d", d->mode);
+            break;
+    }
+    if(d->flags & DEC_WRITES_F)
+        cpu->lf.mask = 0;
+    if((d->flags & DEC_SPDEREF) && cpu->hle && core_cpu_i__call_taken(d, &p))
+        return d->cycles + core_cpu_hle(cpu, cpu->r, &cpu->lf);
 
-    LOGV("core.cpu: %04x: %s (%d cycles)",
-         pc, instrnam[INSTR_OP(cpu->i)], cpu->i_cycles);
+    return d->cycles;
 }
 
 /*
@@ -440,7 +791,7 @@ void core_cpu_i_op_int(struct core_cpu *cpu, struct core_instr_params *p)
     if(cpu->i_cycles == 1) {
         cpu->r[R_S] -= 2;
         core_mmu_ww_send_cpu(cpu->mmu, cpu->r[R_S], cpu->r[R_P]);
-        cpu->interrupt = INT_USER_IRQ;
+        core_cpu_int_raise(cpu, INT_USER_IRQ);
     } else if(cpu->i_cycles == 2) {
         cpu->r[R_S] -= 2;
         core_mmu_ww_send_cpu(cpu->mmu, cpu->r[R_S], cpu->r[R_F]);
@@ -498,10 +849,12 @@ void core_cpu_i__call(struct core_cpu *cpu,
                       struct core_instr_params *p,
                       int flag)
 {
-    if(cpu->i_cycles == p->start_cycle) {
+    /* Handlers may be invoked on several cycles; only act on the first. */
+    if(!p->start_cycle) {
+        p->start_cycle = cpu->i_cycles;
         if(p->f & flag || !flag) {
-            core_mmu_ww_send_cpu(cpu->mmu, p->s, p->p);
             cpu->r[R_S] -= 2;
+            core_mmu_ww_send_cpu(cpu->mmu, cpu->r[R_S], p->p);
             cpu->r[R_P] = p->op1;
         }
 
@@ -617,7 +970,7 @@ void core_cpu_i_op_cn(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_not(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    p->op1 = ~p->op1;
+    p->op1 = core_alu_not(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -627,7 +980,7 @@ void core_cpu_i_op_not(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_inc(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    p->op1 += 1;
+    p->op1 = core_alu_inc(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -637,7 +990,7 @@ void core_cpu_i_op_inc(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_dec(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    p->op1 -= 1;
+    p->op1 = core_alu_dec(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -647,7 +1000,7 @@ void core_cpu_i_op_dec(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_ind(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    p->op1 += 2;
+    p->op1 = core_alu_ind(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -657,7 +1010,7 @@ void core_cpu_i_op_ind(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_ded(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    p->op1 -= 2;
+    p->op1 = core_alu_ded(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -667,9 +1020,7 @@ void core_cpu_i_op_ded(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_mv(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    p->op1 = p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N);
-    cpu->r[R_F] |= !p->op1 | ((p->op1 < 0) << 3);
+    p->op1 = core_alu_mv(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -679,13 +1030,7 @@ void core_cpu_i_op_mv(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_cmp(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 - p->op2;
-    int32_t itemp = (int32_t)p->op1 - (int32_t)p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||             /* Z */
-            ((itemp > 0xffff) << 1) ||  /* C */
-            ((itemp > 0x7fff) << 2) ||  /* O */
-            ((temp < 0) << 3);          /* N */
+    core_alu_cmp(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -695,9 +1040,7 @@ void core_cpu_i_op_cmp(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_tst(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 & p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N);
-    cpu->r[R_F] |= !temp || ((temp < 0) << 3);
+    core_alu_tst(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -707,14 +1050,7 @@ void core_cpu_i_op_tst(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_add(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 + p->op2;
-    int32_t itemp = (int32_t)p->op1 + (int32_t)p->op2;
-    p->op1 += p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||            /* Z */
-        ((itemp > 0xffff) << 1) ||     /* C */
-        ((itemp > 0x7fff) << 2) ||     /* O */
-        ((temp < 0) << 3);             /* N */
+    p->op1 = core_alu_add(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -724,14 +1060,7 @@ void core_cpu_i_op_add(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_sub(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 - p->op2;
-    int32_t itemp = (int32_t)p->op1 - (int32_t)p->op2;
-    p->op1 -= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||            /* Z */
-        ((itemp > 0xffff) << 1) ||     /* C */
-        ((itemp > 0x7fff) << 2) ||     /* O */
-        ((temp < 0) << 3);             /* N */
+    p->op1 = core_alu_sub(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -741,14 +1070,7 @@ void core_cpu_i_op_sub(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_mul(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 * p->op2;
-    int32_t itemp = (int32_t)p->op1 * (int32_t)p->op2;
-    p->op1 *= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||            /* Z */
-        ((itemp > 0xffff) << 1) ||     /* C */
-        ((itemp > 0x7fff) << 2) ||     /* O */
-        ((temp < 0) << 3);             /* N */
+    p->op1 = core_alu_mul(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -758,14 +1080,7 @@ void core_cpu_i_op_mul(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_div(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 / p->op2;
-    int32_t itemp = (int32_t)p->op1 / (int32_t)p->op2;
-    p->op1 /= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||            /* Z */
-        ((itemp > 0xffff) << 1) ||     /* C */
-        ((itemp > 0x7fff) << 2) ||     /* O */
-        ((temp < 0) << 3);             /* N */
+    p->op1 = core_alu_div(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -775,14 +1090,7 @@ void core_cpu_i_op_div(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_lsl(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 << p->op2;
-    int32_t itemp = (int32_t)p->op1 << (int32_t)p->op2;
-    p->op1 <<= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||             /* Z */
-            ((itemp > 0xffff) << 1) ||  /* C */
-            ((itemp > 0x7fff) << 2) ||  /* O */
-            ((temp < 0) << 3);          /* N */
+    p->op1 = core_alu_lsl(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -792,14 +1100,7 @@ void core_cpu_i_op_lsl(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_lsr(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 >> p->op2;
-    uint32_t utemp = (uint32_t)p->op1 >> (uint32_t)p->op2;
-    p->op1 >>= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||             /* Z */
-            ((utemp > 0xffff) << 1) ||  /* C */
-            ((utemp > 0x7fff) << 2) ||  /* O */
-            ((temp < 0) << 3);          /* N */
+    p->op1 = core_alu_lsr(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -809,14 +1110,7 @@ void core_cpu_i_op_lsr(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_asr(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    int16_t temp = *(int16_t *)&p->op1 >> *(int16_t *)&p->op2;
-    int32_t itemp = *(int32_t *)&p->op1 >> *(int32_t *)&p->op2;
-    *(int16_t *)&p->op1 >>= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||             /* Z */
-            ((itemp > 0xffff) << 1) ||  /* C */
-            ((itemp > 0x7fff) << 2) ||  /* O */
-            ((temp < 0) << 3);          /* N */
+    p->op1 = core_alu_asr(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -826,14 +1120,7 @@ void core_cpu_i_op_asr(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_and(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 & p->op2;
-    int32_t itemp = (int32_t)p->op1 & (int32_t)p->op2;
-    p->op1 &= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||             /* Z */
-            ((itemp > 0xffff) << 1) ||  /* C */
-            ((itemp > 0x7fff) << 2) ||  /* O */
-            ((temp < 0) << 3);          /* N */
+    p->op1 = core_alu_and(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -843,14 +1130,7 @@ void core_cpu_i_op_and(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_or(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 | p->op2;
-    int32_t itemp = (int32_t)p->op1 | (int32_t)p->op2;
-    p->op1 |= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||             /* Z */
-            ((itemp > 0xffff) << 1) ||  /* C */
-            ((itemp > 0x7fff) << 2) ||  /* O */
-            ((temp < 0) << 3);          /* N */
+    p->op1 = core_alu_or(&cpu->lf, p->op1, p->op2);
 }
 
 /*
@@ -860,13 +1140,6 @@ void core_cpu_i_op_or(struct core_cpu *cpu, struct core_instr_params *p)
  */
 void core_cpu_i_op_xor(struct core_cpu *cpu, struct core_instr_params *p)
 {
-    uint16_t temp = p->op1 ^ p->op2;
-    int32_t itemp = (int32_t)p->op1 ^ (int32_t)p->op2;
-    p->op1 ^= p->op2;
-    cpu->r[R_F] &= ~(FLAG_Z | FLAG_N | FLAG_C | FLAG_O);
-    cpu->r[R_F] |= !temp ||             /* Z */
-            ((itemp > 0xffff) << 1) ||  /* C */
-            ((itemp > 0x7fff) << 2) ||  /* O */
-            ((temp < 0) << 3);          /* N */
+    p->op1 = core_alu_xor(&cpu->lf, p->op1, p->op2);
 }
 
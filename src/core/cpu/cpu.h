@@ -34,10 +34,66 @@ struct core_instr
 
 struct core_mmu;
 struct core_hrc;
+struct core_bcache;
+struct core_jit;
+struct core_codecache;
+struct core_codecache_ir;
+struct core_tier;
 
+/* Interrupt sources, in order of priority from highest to lowest. */
 enum core_interrupt
 {
-    INT_NONE, INT_USER_IRQ, INT_TIMER_IRQ, INT_VIDEO_IRQ, INT_AUDIO_IRQ
+    INT_NONE, INT_USER_IRQ, INT_TIMER_IRQ, INT_VIDEO_IRQ, INT_AUDIO_IRQ,
+    INT_NUM
+};
+
+/* Execution engines, selectable at startup. */
+enum core_cpu_engine
+{
+    CPU_ENGINE_CYCLE, CPU_ENGINE_INSTR, CPU_ENGINE_THREADED, CPU_ENGINE_BLOCK,
+    CPU_ENGINE_JIT, CPU_ENGINE_AOT, CPU_ENGINE_TIERED, CPU_ENGINE_NUM
+};
+
+/*
+ * The condition flags as last set by an arithmetic or logic operation, kept
+ * as the operation and its operands until something needs them; see alu.h.
+ */
+struct core_lazy_flags
+{
+    /* Flags cleared by the pending operations; 0 if nothing is pending. */
+    uint16_t mask;
+    uint8_t op;
+    uint16_t a;
+    uint16_t b;
+};
+
+/*
+ * The last loop seen by the idle loop detector, and the state it was in at
+ * the start of its last iteration; see idle.c.
+ */
+struct core_idle
+{
+    /* Start of the loop and address of the jump closing it. */
+    uint16_t pc;
+    uint16_t end;
+    /* Cycles an iteration takes; 0 if the loop may do more than wait. */
+    int period;
+    /* CPU cycle count at the start of the slice the loop was seen in. */
+    uint64_t base;
+    /* Cycles into the slice, registers and flags at the start of the loop. */
+    int at;
+    uint16_t r[NUM_REGS];
+    struct core_lazy_flags lf;
+};
+
+/* State of the ahead-of-time translated ROM for a CPU; see aot.c. */
+struct core_aot
+{
+    /* Has the translation been checked against the ROM, and did it match? */
+    int checked;
+    int usable;
+    /* Pages whose translated code has been overwritten. */
+    uint8_t dirty[256];
 };
 
 /* CPU state structure. */
@@ -45,15 +101,28 @@ struct core_cpu
 {
     /* Register file. Indexed using enum core_rid. */
     uint16_t r[NUM_REGS];
+    /* Flags not yet applied to r[R_F]. */
+    struct core_lazy_flags lf;
     /* Pointer to address space manager. */
     struct core_mmu *mmu;
     /* Pointer to high resolution counter. */
     struct core_hrc *hrc;
 
-    enum core_interrupt interrupt;
+    /* Interrupts requested and not yet entered; bit n for interrupt n. */
+    uint8_t int_pending;
+    /*
+     * Can the per-cycle state machine enter an interrupt this cycle? Only
+     * changes with the pending mask, FLAG_I and instruction boundaries; see
+     * core_cpu_int_update().
+     */
+    int int_ready;
+    /* Interrupt the per-cycle state machine is entering. */
+    enum core_interrupt int_entering;
 
     /* Pointer to current instruction. */
     struct core_instr *i;
+    /* Predecoded form of the current instruction. */
+    struct core_instr_decoded *d;
     /* Instruction timer; how many cycles the current instruction has used. */
     int i_cycles;
     /* Instruction done state. */
@@ -62,6 +131,37 @@ struct core_cpu
     int i_middle;
 
     uint64_t total_cycles;
+    /*
+     * Cycles the CPU has run since the engine running it was entered, as of
+     * the start of the instruction or interrupt entry being run, and cycles
+     * the other devices were ahead of it then: 1 after core_run_ahead(),
+     * negative while core_run_slice_probe() enters an engine for each
+     * instruction of a slice. The engines running several instructions
+     * between catch-ups set the first before going through the interpreter,
+     * so that the interrupt statistics can time what the CPU does.
+     */
+    int ahead;
+    int lead;
+
+    /* Execution engine driving this CPU. */
+    enum core_cpu_engine engine;
+    /* Block cache and recompiler state, allocated on first use. */
+    struct core_bcache *bcache;
+    struct core_jit *jit;
+    /* Set when the running cached block must stop after this access. */
+    int block_exit;
+    /* Idle loop detector state. */
+    struct core_idle idle;
+    /* Ahead-of-time translation state. */
+    struct core_aot aot;
+    /* Run library routines natively when called? See hle.c. */
+    int hle;
+    /* Interrupt latency statistics, if kept; see intstat.c. */
+    struct core_intstat *intstat;
+    /* Blocks remembered between runs, if kept; see codecache.c. */
+    struct core_codecache *codecache;
+    /* Tier each block has reached in the tiered engine; see tier.c. */
+    struct core_tier *tier;
 };
 
 /* Enum for symbolic register file access. */
@@ -247,13 +347,188 @@ static inline int instr_has_spderef(struct core_instr *i)
             || op == OP_CZ || op == OP_CC || op == OP_CO || op == OP_CN);
 }
 
+/*
+ * Does the instruction end a translated block? Control transfers do, as do
+ * register writes to P or F; the latter may unmask a pending interrupt.
+ */
+static inline int instr_ends_block(struct core_instr *i)
+{
+    int op = INSTR_OP(i);
+    int rx = INSTR_RX(i), ry = INSTR_RY(i);
+
+    if(op != OP_NOP && op <= OP_CN)
+        return 1;
+    if((INSTR_AM(i) == AM_DR || instr_is_op1reg(i)) &&
+            (rx == R_P || rx == R_F))
+        return 1;
+    return INSTR_AM(i) == AM_DR_DR && (ry == R_P || ry == R_F);
+}
+
+/*
+ * Does the instruction need the flags worked out before it runs? Conditional
+ * control transfers test them, INT pushes them, and any instruction naming F
+ * as a register may read it.
+ */
+static inline int instr_reads_f(struct core_instr *i)
+{
+    int op = INSTR_OP(i);
+
+    if(op == OP_INT || (op >= OP_JZ && op <= OP_CN))
+        return 1;
+    if(instr_is_void(i))
+        return 0;
+    return INSTR_RX(i) == R_F || INSTR_RY(i) == R_F;
+}
+
+/* Does the instruction overwrite F, discarding any flags still pending? */
+static inline int instr_writes_f(struct core_instr *i)
+{
+    if(INSTR_OP(i) == OP_RTI)
+        return 1;
+    if(instr_is_void(i))
+        return 0;
+    if((INSTR_AM(i) == AM_DR || instr_is_op1reg(i)) && INSTR_RX(i) == R_F)
+        return 1;
+    return INSTR_AM(i) == AM_DR_DR && INSTR_RY(i) == R_F;
+}
+
+/* Interrupt latency statistics; see intstat.c. */
+void core_cpu_intstat_raise(struct core_cpu *, enum core_interrupt);
+void core_cpu_intstat_enter(struct core_cpu *, enum core_interrupt, int);
+void core_cpu_intstat_leave(struct core_cpu *, int);
+
+/*
+ * Work out whether the per-cycle state machine can enter an interrupt, after
+ * the pending mask, F or the instruction boundary has changed.
+ */
+static inline void core_cpu_int_update(struct core_cpu *cpu)
+{
+    cpu->int_ready = cpu->int_pending && (cpu->r[R_F] & FLAG_I) &&
+                     !cpu->i_middle;
+}
+
+/* Request an interrupt. It stays pending until entered. */
+static inline void core_cpu_int_raise(struct core_cpu *cpu,
+        enum core_interrupt n)
+{
+    if(cpu->intstat != NULL)
+        core_cpu_intstat_raise(cpu, n);
+    cpu->int_pending |= 1 << n;
+    core_cpu_int_update(cpu);
+}
+
+/*
+ * Can an interrupt be entered between instructions, given the flags? For
+ * the engines which keep F out of the CPU state while running.
+ */
+static inline int core_cpu_int_due(struct core_cpu *cpu, uint16_t f)
+{
+    return cpu->int_pending && (f & FLAG_I);
+}
+
+/* The highest priority pending interrupt, or INT_NONE. */
+static inline enum core_interrupt core_cpu_int_next(struct core_cpu *cpu)
+{
+    int n;
+
+    for(n = INT_USER_IRQ; n < INT_NUM; ++n) {
+        if(cpu->int_pending & (1 << n))
+            return n;
+    }
+    return INT_NONE;
+}
+
+/*
+ * Predecoded instruction classes. Each bit caches the result of one of the
+ * instr_* predicates above, so the hot path tests a bit instead of
+ * re-extracting the addressing mode.
+ */
+#define DEC_VOID        0x0001
+#define DEC_1OP         0x0002
+#define DEC_DR_ONLY     0x0004
+#define DEC_HAS_DATA    0x0008
+#define DEC_HAS_DW      0x0010
+#define DEC_SRCPTR      0x0020
+#define DEC_DSTPTR      0x0040
+#define DEC_OP1DATA     0x0080
+#define DEC_OP1REG      0x0100
+#define DEC_SPDEREF     0x0200
+#define DEC_ENDS_BLOCK  0x0400
+#define DEC_READS_F     0x0800
+#define DEC_WRITES_F    0x1000
+
+/*
+ * Predecoded instruction, indexed by the 16-bit opcode word as fetched from
+ * memory (ib0 in the low byte, ib1 in the high byte).
+ */
+struct core_instr_decoded
+{
+    /* Instruction implementation, as found in core_cpu_ops. */
+    void (*op)(struct core_cpu *, struct core_instr_params *);
+    uint16_t flags;
+    uint8_t opcode;
+    uint8_t mode;
+    uint8_t rx;
+    uint8_t ry;
+    uint8_t size;
+    /* Length in bytes, including data bytes. */
+    uint8_t len;
+    /* Cycles taken by the per-cycle state machine, excluding interrupts. */
+    uint8_t cycles;
+};
+
+extern struct core_instr_decoded core_cpu_dtab[65536];
+extern int core_cpu_dtab_ready;
+
+/*
+ * Called by an engine running a block for core_run_slice_probe(), after each
+ * instruction, with the address it was run from, the stack pointer before it
+ * and the cycles it took. Returns non-zero to end the block there.
+ */
+typedef int (*core_cpu_probe_fn)(void *, uint16_t, uint16_t, int);
+
 
 /* Function declarations. */
 int core_cpu_init(struct core_cpu **, struct core_mmu *);
 void core_cpu_destroy(struct core_cpu *);
 
 void core_cpu_i_cycle(struct core_cpu *);
-void core_cpu_i_instr(struct core_cpu *);
+int core_cpu_i_instr(struct core_cpu *);
+int core_cpu_i_exec(struct core_cpu *);
+int core_cpu_i_exec_d(struct core_cpu *, struct core_instr_decoded *,
+                      uint16_t);
+void core_cpu_i_latch(struct core_cpu *, struct core_instr_decoded *,
+                      uint16_t);
+int core_cpu_i_interrupt(struct core_cpu *);
+int core_cpu_t_run(struct core_cpu *, int);
+int core_cpu_b_run(struct core_cpu *, int);
+void core_cpu_b_invalidate(struct core_cpu *, uint16_t);
+int core_cpu_b_warm(struct core_cpu *, uint16_t,
+                    const struct core_codecache_ir *, int);
+int core_cpu_b_step(struct core_cpu *, int, int);
+int core_cpu_b_probe(struct core_cpu *, core_cpu_probe_fn, void *);
+void core_cpu_b_keep(struct core_cpu *);
+void core_cpu_b_destroy(struct core_cpu *);
+int core_cpu_j_run(struct core_cpu *, int);
+void core_cpu_j_flush(struct core_cpu *);
+void core_cpu_j_invalidate(struct core_cpu *, uint16_t);
+int core_cpu_j_warm(struct core_cpu *, uint16_t);
+int core_cpu_j_step(struct core_cpu *, int, int);
+int core_cpu_j_probe(struct core_cpu *, core_cpu_probe_fn, void *);
+void core_cpu_j_keep(struct core_cpu *);
+void core_cpu_j_destroy(struct core_cpu *);
+int core_cpu_a_run(struct core_cpu *, int);
+int core_cpu_a_single(struct core_cpu *);
+void core_cpu_a_invalidate(struct core_cpu *, uint16_t);
+int core_cpu_tier_run(struct core_cpu *, int);
+int core_cpu_tier_probe(struct core_cpu *, core_cpu_probe_fn, void *);
+void core_cpu_tier_invalidate(struct core_cpu *, uint16_t);
+void core_cpu_code_written(struct core_cpu *, uint16_t);
+int core_cpu_idle(struct core_cpu *, uint16_t *, struct core_lazy_flags *,
+                  uint16_t, int, int);
+int core_cpu_idle_self(struct core_cpu *, uint16_t);
+void core_cpu_hle_init(void);
+int core_cpu_hle(struct core_cpu *, uint16_t *, struct core_lazy_flags *);
 void core_cpu_i_op_nop(struct core_cpu *, struct core_instr_params *);
 void core_cpu_i_op_int(struct core_cpu *, struct core_instr_params *);
 void core_cpu_i_op_rti(struct core_cpu *, struct core_instr_params *);
@@ -290,5 +565,6 @@ void core_cpu_i_op_xor(struct core_cpu *, struct core_instr_params *);
 static void (*core_cpu_ops[32])(struct core_cpu *, struct core_instr_params *);
 
 extern char *instrnam[NUM_INSTRS];
+extern char *core_cpu_engine_names[CPU_ENGINE_NUM];
 
 #endif
@@ -0,0 +1,303 @@
+/*
+ * core/cpu/hle.c -- High-level emulation of library routines.
+ *
+ * ROMs built against asm/library.s call its helpers many times a frame, each
+ * a dozen instructions spent around one or two register writes. When enabled,
+ * a taken call is checked for landing on one of them, recognized by a hash of
+ * its code, and the routine is run natively through to its return instead:
+ * the same memory accesses, registers, pending flags and data bytes as the
+ * interpreters would leave behind, for the cycles they would have taken.
+ *
+ * Routines are recognized by their encoding as the CPU decodes it (isa.h),
+ * which is what as.py emits for asm/library.s.
+ * Each runs as one step, so interrupts and the end of a slice come between
+ * routines rather than inside them, which is why this is off by default.
+ *
+ */
+
+#include <stddef.h>
+
+#include "core/cpu/cpu.h"
+#include "core/cpu/alu.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+/* 32-bit FNV-1a, over the code of a routine. */
+#define HLE_FNV_BASIS   0x811c9dc5u
+#define HLE_FNV_PRIME   0x01000193u
+
+/* Bytes of an instruction, laid out as the INSTR_ accessors read them. */
+#define HLE_I(op, mode, rx, ry)     HLE_I_W(op, mode, 1, rx, ry)
+#define HLE_I_W(op, mode, w, rx, ry)                                        \
+    (OP_##op << 3 | (w) << 2 | AM_##mode >> 2),                             \
+    ((AM_##mode & 3) << 6 | R_##rx << 3 | R_##ry)
+#define HLE_VOID(op)                (OP_##op << 3 | 1 << 2)
+#define HLE_D16(x)                  ((x) & 0xff), ((x) >> 8)
+
+/* Prologue and epilogue shared by the routines, which save s in c. */
+#define HLE_ENTER                                                           \
+    HLE_I(MV, DR_DR, C, S),                 /* mv c, s */                   \
+    HLE_I(IND, DR, S, A),                   /* ind s */                     \
+    HLE_I(MV, DR_IR, A, S)                  /* mv a, [s] */
+#define HLE_LEAVE                                                           \
+    HLE_I(MV, DR_DR, S, C),                 /* mv s, c */                   \
+    HLE_VOID(RTS)                           /* rts */
+
+static const uint8_t core_hle_set_sprite_pi[] = {
+    HLE_ENTER,
+    HLE_I(MV, IW_DR, A, A), HLE_D16(0xeb81),    /* mv [$eb81], a */
+    HLE_LEAVE
+};
+
+static const uint8_t core_hle_enable_sprite[] = {
+    HLE_ENTER,
+    HLE_I(LSL, DR_DB, A, A), 2,                 /* lsl a, 2 */
+    HLE_I(ADD, DR_DW, A, A), HLE_D16(0xea00),   /* add a, $ea00 */
+    HLE_I_W(MV, DR_IR, 0, B, A),                /* mv.b b, [a] */
+    HLE_I(OR, DR_DB, B, A), 0x80,               /* or b, $80 */
+    HLE_I(MV, IR_DR, A, B),                     /* mv [a], b */
+    HLE_LEAVE
+};
+
+static const uint8_t core_hle_disable_sprite[] = {
+    HLE_ENTER,
+    HLE_I(LSL, DR_DB, A, A), 2,                 /* lsl a, 2 */
+    HLE_I(ADD, DR_DW, A, A), HLE_D16(0xea00),   /* add a, $ea00 */
+    HLE_I_W(MV, DR_IR, 0, B, A),                /* mv.b b, [a] */
+    HLE_I(AND, DR_DB, B, A), 0x7f,              /* and b, $7f */
+    HLE_I(MV, IR_DR, A, B),                     /* mv [a], b */
+    HLE_LEAVE
+};
+
+static const uint8_t core_hle_set_layer1_pi[] = {
+    HLE_ENTER,
+    HLE_I(MV, DR_IW, B, A), HLE_D16(0xeb80),    /* mv b, [$eb80] */
+    HLE_I(AND, DR_DB, B, A), 0x0f,              /* and b, $0f */
+    HLE_I(LSL, DR_DB, A, A), 4,                 /* lsl a, 4 */
+    HLE_I(OR, DR_DR, A, B),                     /* or a, b */
+    HLE_I(MV, IW_DR, A, A), HLE_D16(0xeb80),    /* mv [$eb80], a */
+    HLE_LEAVE
+};
+
+static const uint8_t core_hle_set_layer2_pi[] = {
+    HLE_ENTER,
+    HLE_I(MV, DR_IW, B, A), HLE_D16(0xeb80),    /* mv b, [$eb80] */
+    HLE_I(AND, DR_DB, B, A), 0xf0,              /* and b, $f0 */
+    HLE_I(AND, DR_DB, A, A), 0x0f,              /* and a, $0f */
+    HLE_I(OR, DR_DR, A, B),                     /* or a, b */
+    HLE_I(MV, IW_DR, A, A), HLE_D16(0xeb80),    /* mv [$eb80], a */
+    HLE_LEAVE
+};
+
+static const uint8_t core_hle_setup_iv[] = {
+    HLE_ENTER,
+    HLE_I(MV, IW_DR, A, A), HLE_D16(0xfffe),    /* mv [$fffe], a */
+    HLE_I(IND, DR, S, A),                       /* ind s */
+    HLE_I(MV, DR_IR, A, S),                     /* mv a, [s] */
+    HLE_I(MV, IW_DR, A, A), HLE_D16(0xfffc),    /* mv [$fffc], a */
+    HLE_I(IND, DR, S, A),                       /* ind s */
+    HLE_I(MV, DR_IR, A, S),                     /* mv a, [s] */
+    HLE_I(MV, IW_DR, A, A), HLE_D16(0xfffa),    /* mv [$fffa], a */
+    HLE_I(IND, DR, S, A),                       /* ind s */
+    HLE_I(MV, DR_IR, A, S),                     /* mv a, [s] */
+    HLE_I(MV, IW_DR, A, A), HLE_D16(0xfff8),    /* mv [$fff8], a */
+    HLE_LEAVE
+};
+
+/*
+ * The native versions, from just after the call to just after the return.
+ * Each instruction goes through the same ALU operation, with the same
+ * operands, as it does when interpreted, so that the pending flags match.
+ */
+
+static void core_hle__enter(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf)
+{
+    r[R_C] = core_alu_mv(lf, r[R_C], r[R_S]);
+    r[R_S] = core_alu_ind(lf, r[R_S], r[R_A]);
+    r[R_A] = core_alu_mv(lf, r[R_A], core_mmu_readw(cpu->mmu, r[R_S]));
+}
+
+static void core_hle__leave(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf)
+{
+    r[R_S] = core_alu_mv(lf, r[R_S], r[R_C]);
+    r[R_P] = core_mmu_readw(cpu->mmu, r[R_S]);
+    r[R_S] += 2;
+}
+
+/* mv [a16], a */
+static void core_hle__store_a(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf, uint16_t a16)
+{
+    core_alu_mv(lf, r[R_A], a16);
+    core_mmu_writew(cpu->mmu, a16, r[R_A]);
+}
+
+static void core_hle_set_sprite_pi_fn(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf)
+{
+    core_hle__enter(cpu, r, lf);
+    core_hle__store_a(cpu, r, lf, 0xeb81);
+    core_hle__leave(cpu, r, lf);
+}
+
+/*
+ * The sprite register is written back with an IR_DR instruction, which the
+ * CPU does not execute (see core_cpu_i_exec_d()), so it is not written here
+ * either.
+ */
+static void core_hle_enable_sprite_fn(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf)
+{
+    core_hle__enter(cpu, r, lf);
+    r[R_A] = core_alu_lsl(lf, r[R_A], 2);
+    r[R_A] = core_alu_add(lf, r[R_A], 0xea00);
+    r[R_B] = core_alu_mv(lf, r[R_B], core_mmu_readb(cpu->mmu, r[R_A]));
+    r[R_B] = core_alu_or(lf, r[R_B], 0x80);
+    core_hle__leave(cpu, r, lf);
+}
+
+static void core_hle_disable_sprite_fn(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf)
+{
+    core_hle__enter(cpu, r, lf);
+    r[R_A] = core_alu_lsl(lf, r[R_A], 2);
+    r[R_A] = core_alu_add(lf, r[R_A], 0xea00);
+    r[R_B] = core_alu_mv(lf, r[R_B], core_mmu_readb(cpu->mmu, r[R_A]));
+    r[R_B] = core_alu_and(lf, r[R_B], 0x7f);
+    core_hle__leave(cpu, r, lf);
+}
+
+static void core_hle_set_layer1_pi_fn(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf)
+{
+    core_hle__enter(cpu, r, lf);
+    r[R_B] = core_alu_mv(lf, r[R_B], core_mmu_readw(cpu->mmu, 0xeb80));
+    r[R_B] = core_alu_and(lf, r[R_B], 0x0f);
+    r[R_A] = core_alu_lsl(lf, r[R_A], 4);
+    r[R_A] = core_alu_or(lf, r[R_A], r[R_B]);
+    core_hle__store_a(cpu, r, lf, 0xeb80);
+    core_hle__leave(cpu, r, lf);
+}
+
+static void core_hle_set_layer2_pi_fn(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf)
+{
+    core_hle__enter(cpu, r, lf);
+    r[R_B] = core_alu_mv(lf, r[R_B], core_mmu_readw(cpu->mmu, 0xeb80));
+    r[R_B] = core_alu_and(lf, r[R_B], 0xf0);
+    r[R_A] = core_alu_and(lf, r[R_A], 0x0f);
+    r[R_A] = core_alu_or(lf, r[R_A], r[R_B]);
+    core_hle__store_a(cpu, r, lf, 0xeb80);
+    core_hle__leave(cpu, r, lf);
+}
+
+static void core_hle_setup_iv_fn(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf)
+{
+    static const uint16_t vectors[] = { 0xfffe, 0xfffc, 0xfffa, 0xfff8 };
+    int k;
+
+    core_hle__enter(cpu, r, lf);
+    for(k = 0; k < 4; ++k) {
+        if(k > 0) {
+            r[R_S] = core_alu_ind(lf, r[R_S], r[R_A]);
+            r[R_A] = core_alu_mv(lf, r[R_A],
+                                 core_mmu_readw(cpu->mmu, r[R_S]));
+        }
+        core_hle__store_a(cpu, r, lf, vectors[k]);
+    }
+    core_hle__leave(cpu, r, lf);
+}
+
+struct core_hle_routine
+{
+    const char *name;
+    const uint8_t *code;
+    int len;
+    void (*fn)(struct core_cpu *, uint16_t *, struct core_lazy_flags *);
+
+    /* Worked out from the code by core_cpu_hle_init(). */
+    uint32_t hash;
+    uint16_t first;
+    int cycles;
+    /* Data bytes left behind by the last instructions which had them. */
+    uint8_t db0;
+    uint8_t db1;
+};
+
+#define HLE_ROUTINE(mn)                                                     \
+    { "lib_" #mn, core_hle_##mn, sizeof(core_hle_##mn), core_hle_##mn##_fn }
+
+/* In order of length, so that their hashes can be worked out in one pass. */
+static struct core_hle_routine core_hle_routines[] = {
+    HLE_ROUTINE(set_sprite_pi),
+    HLE_ROUTINE(enable_sprite),
+    HLE_ROUTINE(disable_sprite),
+    HLE_ROUTINE(set_layer1_pi),
+    HLE_ROUTINE(set_layer2_pi),
+    HLE_ROUTINE(setup_iv),
+    { NULL }
+};
+
+
+/* Work out what each routine costs and how to recognize it. */
+void core_cpu_hle_init(void)
+{
+    struct core_hle_routine *h;
+    struct core_instr_decoded *d;
+    uint32_t hash;
+    int k;
+
+    for(h = core_hle_routines; h->name != NULL; ++h) {
+        hash = HLE_FNV_BASIS;
+        for(k = 0; k < h->len; ++k)
+            hash = (hash ^ h->code[k]) * HLE_FNV_PRIME;
+        h->hash = hash;
+        h->first = h->code[0] | (h->code[1] << 8);
+
+        h->cycles = 0;
+        for(k = 0; k < h->len; k += d->len) {
+            d = &core_cpu_dtab[h->code[k] |
+                               (k + 1 < h->len ? h->code[k + 1] << 8 : 0)];
+            h->cycles += d->cycles;
+            if(d->flags & DEC_HAS_DATA) {
+                h->db0 = h->code[k + 2];
+                if(d->flags & DEC_HAS_DW)
+                    h->db1 = h->code[k + 3];
+            }
+        }
+    }
+}
+
+/*
+ * Called by the engines just after taking a call, with r[R_P] at its target.
+ * r and lf are the registers and pending flags, which an engine may keep out
+ * of the CPU state while running. If the target is a known library routine,
+ * runs it through to its return and returns the cycles it took; otherwise
+ * returns 0 and leaves everything alone.
+ */
+int core_cpu_hle(struct core_cpu *cpu, uint16_t *r, struct core_lazy_flags *lf)
+{
+    struct core_hle_routine *h;
+    uint16_t a = r[R_P], w = core_mmu_readw(cpu->mmu, a);
+    uint32_t hash = HLE_FNV_BASIS;
+    int n = 0;
+
+    for(h = core_hle_routines; h->name != NULL; ++h) {
+        if(h->first != w)
+            continue;
+        for(; n < h->len; ++n)
+            hash = (hash ^ core_mmu_readb(cpu->mmu, a + n)) * HLE_FNV_PRIME;
+        if(hash != h->hash)
+            continue;
+
+        LOGV("core.cpu: running %s natively", h->name);
+        h->fn(cpu, r, lf);
+        cpu->i->db0 = h->db0;
+        cpu->i->db1 = h->db1;
+        return h->cycles;
+    }
+    return 0;
+}
@@ -4,6 +4,7 @@
  *
  */
 
+#include <limits.h>
 #include <string.h>
 
 #include "core/cpu/hrc.h"
@@ -13,7 +14,7 @@
 /* Signal an interrupt request (IRQ) for the next instruction. */
 static inline void core_cpu_hrc__trigger_int(struct core_cpu *cpu)
 {
-    cpu->interrupt = INT_TIMER_IRQ;
+    core_cpu_int_raise(cpu, INT_TIMER_IRQ);
 }
 
 
@@ -64,6 +65,30 @@ void core_cpu_hrc_step(struct core_cpu *cpu)
 }
 
 
+/*
+ * Number of steps, from the next on, up to and including the one which fires
+ * the counter's interrupt, or INT_MAX if it is not going to.
+ */
+int core_cpu_hrc_next(struct core_cpu *cpu)
+{
+    struct core_hrc *hrc = cpu->hrc;
+    int total = hrc->total_cycles, elapsed = hrc->elapsed_cycles;
+
+    if(!(hrc->v & 1))
+        return INT_MAX;
+    /* It will be started on the next step, as core_cpu_hrc_step() does. */
+    if(!hrc->enabled) {
+        if(hrc->v & 2)
+            total = VPU_SCANLINE_CYCLES -
+                    (cpu->total_cycles % VPU_SCANLINE_CYCLES);
+        else
+            total = (hrc->v & 0xfffc) << 2;
+        elapsed = 0;
+    }
+    return total > elapsed ? total - elapsed : INT_MAX;
+}
+
+
 void core_cpu_hrc_sethib(struct core_hrc *hrc, int v)
 {
     hrc->v |= v << 8;
@@ -37,6 +37,7 @@ struct core_hrc {
 /* Function declarations. */
 void core_cpu_hrc_init(struct core_cpu *);
 void core_cpu_hrc_step(struct core_cpu *);
+int core_cpu_hrc_next(struct core_cpu *);
 void core_cpu_hrc_setlob(struct core_hrc *, int);
 void core_cpu_hrc_sethib(struct core_hrc *, int);
 int core_cpu_hrc_getlob(struct core_hrc *);
@@ -0,0 +1,119 @@
+/*
+ * core/cpu/idle.c -- Idle loop detection.
+ *
+ * Spots loops which wait on something without changing any state: a jump to
+ * itself, or a short run of instructions which only read memory and jump back
+ * to its start. While the CPU runs ahead of the other devices, nothing they
+ * read can change, so once one iteration has left the registers and flags
+ * as it found them, every following iteration would too. The engines then
+ * skip straight to the end of their budget instead of spinning through it.
+ *
+ * Only the CPU's work is saved: emulated time still passes at the same
+ * rate, the VPU and the HRC being caught up cycle by cycle over the skipped
+ * iterations as over any others, and the VPU drawing its lines dominates
+ * what is left.
+ *
+ */
+
+#include <string.h>
+
+#include "core/cpu/cpu.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+/* Longest loop body considered, in instructions. */
+#define IDLE_MAX_INSTRS 16
+
+
+/*
+ * Can the straight-line code from a up to and including the jump at end run
+ * without writing to memory or leaving the loop? Returns the cycles it takes
+ * if so, or 0.
+ */
+static int core_cpu_idle__period(struct core_cpu *cpu, uint16_t a,
+        uint16_t end)
+{
+    struct core_instr_decoded *d;
+    int n, period = 0;
+
+    for(n = 0; n < IDLE_MAX_INSTRS; ++n) {
+        d = &core_cpu_dtab[core_mmu_readw(cpu->mmu, a)];
+        period += d->cycles;
+        if(a == end) {
+            if(d->opcode < OP_JP || d->opcode > OP_CN || (d->opcode & 1) ||
+                    (d->flags & DEC_DSTPTR))
+                return 0;
+            return period;
+        }
+        if(d->opcode != OP_NOP &&
+                (d->flags & (DEC_VOID | DEC_DSTPTR | DEC_ENDS_BLOCK)))
+            return 0;
+        if(d->mode == AM_RESERVED)
+            return 0;
+        if((uint16_t)(a + d->len) < a)
+            return 0;
+        a += d->len;
+    }
+    return 0;
+}
+
+static int core_cpu_idle__same_flags(struct core_lazy_flags *x,
+        struct core_lazy_flags *y)
+{
+    if(x->mask != y->mask)
+        return 0;
+    return !x->mask || (x->op == y->op && x->a == y->a && x->b == y->b);
+}
+
+/*
+ * Called by the engines when the jump at end has just gone back to r[R_P],
+ * having run the given number of cycles out of the budget so far. r and lf
+ * are the registers and pending flags, which an engine may keep out of the
+ * CPU state while running.
+ *
+ * Returns a number of cycles the caller should count as spent, as a whole
+ * number of iterations of the loop, leaving it short of the budget so that
+ * it can finish the slice exactly as it would have by running them.
+ */
+int core_cpu_idle(struct core_cpu *cpu, uint16_t *r,
+        struct core_lazy_flags *lf, uint16_t end, int cycles, int budget)
+{
+    struct core_idle *id = &cpu->idle;
+    int n;
+
+    /* The devices may have moved on since the loop was last seen. */
+    if(r[R_P] != id->pc || end != id->end || cpu->total_cycles != id->base) {
+        id->pc = r[R_P];
+        id->end = end;
+        id->base = cpu->total_cycles;
+        id->period = core_cpu_idle__period(cpu, r[R_P], end);
+    } else if(id->period && cycles - id->at == id->period &&
+              !memcmp(r, id->r, sizeof(id->r)) &&
+              core_cpu_idle__same_flags(lf, &id->lf) &&
+              !core_cpu_int_due(cpu, r[R_F])) {
+        /* Nothing changed over an iteration, so nothing will. */
+        n = cycles < budget ? (budget - cycles - 1) / id->period : 0;
+        id->at = cycles + n * id->period;
+        return n * id->period;
+    }
+
+    if(id->period) {
+        memcpy(id->r, r, sizeof(id->r));
+        id->lf = *lf;
+        id->at = cycles;
+    }
+    return 0;
+}
+
+/*
+ * Is the instruction just executed by the CPU a jump to itself? Only an
+ * interrupt can get it out.
+ */
+int core_cpu_idle_self(struct core_cpu *cpu, uint16_t pc)
+{
+    struct core_instr_decoded *d = cpu->d;
+
+    return cpu->r[R_P] == pc && d->opcode >= OP_JP && d->opcode <= OP_CN &&
+           !(d->opcode & 1) && !(d->flags & DEC_DSTPTR) &&
+           d == &core_cpu_dtab[core_mmu_readw(cpu->mmu, pc)];
+}
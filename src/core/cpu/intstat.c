@@ -0,0 +1,197 @@
+/*
+ * core/cpu/intstat.c -- Interrupt latency statistics.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/cpu/cpu.h"
+#include "core/cpu/intstat.h"
+#include "log.h"
+
+static const char *core_intstat_names[INT_NUM] = {
+    [INT_NONE] = "none", [INT_USER_IRQ] = "user", [INT_TIMER_IRQ] = "timer",
+    [INT_VIDEO_IRQ] = "video", [INT_AUDIO_IRQ] = "audio"
+};
+
+int core_intstat_init(struct core_intstat **pstat)
+{
+    int n;
+
+    *pstat = calloc(1, sizeof(struct core_intstat));
+    if(*pstat == NULL) {
+        LOGE("Could not allocate interrupt statistics");
+        return 0;
+    }
+    for(n = 0; n < INT_NUM; ++n) {
+        (*pstat)->sources[n].latency.min = UINT64_MAX;
+        (*pstat)->sources[n].handler.min = UINT64_MAX;
+    }
+    return 1;
+}
+
+void core_intstat_destroy(struct core_intstat *stat)
+{
+    free(stat);
+}
+
+static int core_intstat__bucket(uint64_t v)
+{
+    int k = 0;
+
+    if(v < CORE_INTSTAT_EXACT)
+        return v;
+    while(v >> (k + 1))
+        ++k;
+    return CORE_INTSTAT_EXACT + k - 4;
+}
+
+/* Lowest number of cycles counted in a bucket. */
+static uint64_t core_intstat__bucket_min(int b)
+{
+    if(b < CORE_INTSTAT_EXACT)
+        return b;
+    return (uint64_t)1 << (b - CORE_INTSTAT_EXACT + 4);
+}
+
+static void core_intstat__add(struct core_intstat_hist *h, uint64_t v)
+{
+    h->count += 1;
+    h->sum += v;
+    if(v < h->min)
+        h->min = v;
+    if(v > h->max)
+        h->max = v;
+    h->buckets[core_intstat__bucket(v)] += 1;
+}
+
+/*
+ * The CPU's cycle count the given number of cycles after the engine running
+ * it was entered, which the engines running several instructions between
+ * catch-ups only bring total_cycles up to afterwards.
+ */
+static uint64_t core_intstat__now(struct core_cpu *cpu, int cycles)
+{
+    return cpu->total_cycles + cycles - cpu->lead;
+}
+
+/* Called by core_cpu_int_raise(), before the request is marked pending. */
+void core_cpu_intstat_raise(struct core_cpu *cpu, enum core_interrupt n)
+{
+    struct core_intstat_source *src = &cpu->intstat->sources[n];
+
+    src->raised += 1;
+    if(cpu->int_pending & (1 << n)) {
+        src->lost += 1;
+        src->frame_lost += 1;
+    } else {
+        src->raised_at = core_intstat__now(cpu, cpu->ahead);
+    }
+}
+
+/*
+ * Called on entering the handler of an interrupt, before it runs, with the
+ * cycles run since the last catch-up by the end of the entry.
+ */
+void core_cpu_intstat_enter(struct core_cpu *cpu, enum core_interrupt n,
+        int cycles)
+{
+    struct core_intstat *stat = cpu->intstat;
+    struct core_intstat_source *src = &stat->sources[n];
+    uint64_t now = core_intstat__now(cpu, cycles);
+
+    core_intstat__add(&src->latency, now - src->raised_at);
+    if(stat->depth < CORE_INTSTAT_MAX_DEPTH) {
+        stat->stack[stat->depth].n = n;
+        stat->stack[stat->depth].entered_at = now;
+    }
+    stat->depth += 1;
+}
+
+/* Called on an RTI, likewise with the cycles run by its end. */
+void core_cpu_intstat_leave(struct core_cpu *cpu, int cycles)
+{
+    struct core_intstat *stat = cpu->intstat;
+
+    if(stat->depth == 0 || stat->depth > CORE_INTSTAT_MAX_DEPTH) {
+        stat->unmatched += 1;
+    } else {
+        core_intstat__add(
+            &stat->sources[stat->stack[stat->depth - 1].n].handler,
+            core_intstat__now(cpu, cycles) -
+            stat->stack[stat->depth - 1].entered_at);
+    }
+    if(stat->depth > 0)
+        stat->depth -= 1;
+}
+
+/* Called at the end of each frame. */
+void core_intstat_frame(struct core_intstat *stat)
+{
+    struct core_intstat_source *src;
+    int n;
+
+    for(n = 0; n < INT_NUM; ++n) {
+        src = &stat->sources[n];
+        src->frames_lost[src->frame_lost < CORE_INTSTAT_MAX_LOST ?
+                         src->frame_lost : CORE_INTSTAT_MAX_LOST] += 1;
+        src->frame_lost = 0;
+    }
+    stat->frames += 1;
+}
+
+static void core_intstat__hist(struct core_intstat_hist *h, const char *what,
+        FILE *fp)
+{
+    int b;
+
+    if(h->count == 0) {
+        fprintf(fp, "  %s: none\n", what);
+        return;
+    }
+    fprintf(fp, "  %s: min %llu, mean %.1f, max %llu cycles\n", what,
+            (unsigned long long)h->min, (double)h->sum / h->count,
+            (unsigned long long)h->max);
+    fprintf(fp, "  %12s %12s\n", "cycles", "count");
+    for(b = 0; b < CORE_INTSTAT_BUCKETS; ++b) {
+        if(h->buckets[b] == 0)
+            continue;
+        if(b < CORE_INTSTAT_EXACT)
+            fprintf(fp, "  %12llu", (unsigned long long)b);
+        else
+            fprintf(fp, "  %11llu+", (unsigned long long)
+                    core_intstat__bucket_min(b));
+        fprintf(fp, " %12llu\n", (unsigned long long)h->buckets[b]);
+    }
+}
+
+void core_intstat_report(struct core_intstat *stat, FILE *fp)
+{
+    struct core_intstat_source *src;
+    int n, k;
+
+    fprintf(fp, "%llu frames; %llu RTIs outside a handler\n",
+            (unsigned long long)stat->frames,
+            (unsigned long long)stat->unmatched);
+    for(n = INT_USER_IRQ; n < INT_NUM; ++n) {
+        src = &stat->sources[n];
+        if(src->raised == 0)
+            continue;
+        fprintf(fp, "\n%s: raised %llu times, %llu lost to a request still "
+                "pending\n", core_intstat_names[n],
+                (unsigned long long)src->raised,
+                (unsigned long long)src->lost);
+        core_intstat__hist(&src->latency, "raise to entry", fp);
+        core_intstat__hist(&src->handler, "entry to RTI", fp);
+        if(src->lost == 0)
+            continue;
+        fprintf(fp, "  %12s %12s\n", "lost", "frames");
+        for(k = 0; k <= CORE_INTSTAT_MAX_LOST; ++k) {
+            if(src->frames_lost[k] != 0)
+                fprintf(fp, "  %11d%c %12llu\n", k,
+                        k == CORE_INTSTAT_MAX_LOST ? '+' : ' ',
+                        (unsigned long long)src->frames_lost[k]);
+        }
+    }
+}
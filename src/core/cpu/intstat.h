@@ -0,0 +1,82 @@
+/*
+ * core/cpu/intstat.h -- Interrupt latency statistics (header).
+ *
+ * For each interrupt source, histograms of the cycles from the interrupt
+ * being raised to its handler being entered, and from there to the RTI
+ * leaving it, along with how many times in a frame it was raised again while
+ * still pending, which loses the second request. The CPU only calls in here
+ * on raising, entering and returning from interrupts, and only when
+ * cpu->intstat is set.
+ *
+ * Times are the CPU's cycle count. The engines running slices of several
+ * instructions only bring that up to date between slices, so they pass
+ * in, or leave in cpu->ahead, the cycles run since. Handlers are timed from
+ * the end of their entry to the end of the RTI, as the per-cycle state
+ * machine reaches both.
+ *
+ */
+
+#ifndef QPRA_CORE_INTSTAT_H
+#define QPRA_CORE_INTSTAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "core/cpu/cpu.h"
+
+/*
+ * Histogram buckets: one for each count of cycles below CORE_INTSTAT_EXACT,
+ * then one for each power of two.
+ */
+#define CORE_INTSTAT_EXACT 16
+#define CORE_INTSTAT_BUCKETS (CORE_INTSTAT_EXACT + 64 - 4)
+/* Handlers entered inside others that are followed. */
+#define CORE_INTSTAT_MAX_DEPTH 8
+/* Frames are counted by lost requests up to this many. */
+#define CORE_INTSTAT_MAX_LOST 8
+
+struct core_intstat_hist
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[CORE_INTSTAT_BUCKETS];
+};
+
+struct core_intstat_source
+{
+    /* Cycle count at which the pending request was first raised. */
+    uint64_t raised_at;
+    uint64_t raised;
+    uint64_t lost;
+    struct core_intstat_hist latency;
+    struct core_intstat_hist handler;
+
+    /* Requests lost in this frame, and frames by how many were. */
+    int frame_lost;
+    uint64_t frames_lost[CORE_INTSTAT_MAX_LOST + 1];
+};
+
+struct core_intstat
+{
+    struct core_intstat_source sources[INT_NUM];
+    uint64_t frames;
+
+    /* Handlers being run, innermost last. */
+    struct {
+        enum core_interrupt n;
+        uint64_t entered_at;
+    } stack[CORE_INTSTAT_MAX_DEPTH];
+    int depth;
+    /* RTIs with no handler being run, or one too deep to follow. */
+    uint64_t unmatched;
+};
+
+/* Function declarations. */
+int core_intstat_init(struct core_intstat **);
+void core_intstat_frame(struct core_intstat *);
+void core_intstat_report(struct core_intstat *, FILE *);
+void core_intstat_destroy(struct core_intstat *);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * core/cpu/isa.h -- Instruction set description.
+ *
+ * X-macro tables of the Khepra instructions and addressing modes, in
+ * encoding order. The predecode tables and the threaded interpreter's
+ * specialized handlers are generated from these, and as.py --check-isa
+ * compares the assembler's tables against them.
+ *
+ */
+
+#ifndef QPRA_CORE_ISA_H
+#define QPRA_CORE_ISA_H
+
+/*
+ * X(opcode, mnemonic, kind, flag)
+ *
+ * kind is VOID for instructions without operands, JUMP or CALL for control
+ * transfers taken when flag is set in F (always if 0), and ALU for those
+ * computed by core_alu_<mnemonic>() and written back to their destination.
+ */
+#define CORE_ISA_INSTRS(X)                                                  \
+    X(OP_NOP, nop, VOID, 0)                                                 \
+    X(OP_INT, int, VOID, 0)                                                 \
+    X(OP_RTI, rti, VOID, 0)                                                 \
+    X(OP_RTS, rts, VOID, 0)                                                 \
+    X(OP_JP,  jp,  JUMP, 0)                                                 \
+    X(OP_CL,  cl,  CALL, 0)                                                 \
+    X(OP_JZ,  jz,  JUMP, FLAG_Z)                                            \
+    X(OP_CZ,  cz,  CALL, FLAG_Z)                                            \
+    X(OP_JC,  jc,  JUMP, FLAG_C)                                            \
+    X(OP_CC,  cc,  CALL, FLAG_C)                                            \
+    X(OP_JO,  jo,  JUMP, FLAG_O)                                            \
+    X(OP_CO,  co,  CALL, FLAG_O)                                            \
+    X(OP_JN,  jn,  JUMP, FLAG_N)                                            \
+    X(OP_CN,  cn,  CALL, FLAG_N)                                            \
+    X(OP_NOT, not, ALU,  0)                                                 \
+    X(OP_INC, inc, ALU,  0)                                                 \
+    X(OP_DEC, dec, ALU,  0)                                                 \
+    X(OP_IND, ind, ALU,  0)                                                 \
+    X(OP_DED, ded, ALU,  0)                                                 \
+    X(OP_MV,  mv,  ALU,  0)                                                 \
+    X(OP_CMP, cmp, ALU,  0)                                                 \
+    X(OP_TST, tst, ALU,  0)                                                 \
+    X(OP_ADD, add, ALU,  0)                                                 \
+    X(OP_SUB, sub, ALU,  0)                                                 \
+    X(OP_MUL, mul, ALU,  0)                                                 \
+    X(OP_DIV, div, ALU,  0)                                                 \
+    X(OP_LSL, lsl, ALU,  0)                                                 \
+    X(OP_LSR, lsr, ALU,  0)                                                 \
+    X(OP_ASR, asr, ALU,  0)                                                 \
+    X(OP_AND, and, ALU,  0)                                                 \
+    X(OP_OR,  or,  ALU,  0)                                                 \
+    X(OP_XOR, xor, ALU,  0)
+
+/*
+ * X(mode, mnemonic, length, cycles, a, b, dest, sizes, ...)
+ *
+ * length is in bytes including data, and cycles is as taken by the per-cycle
+ * state machine. a and b say where the operands come from, and dest where
+ * the result goes:
+ *
+ *   RX, RY     register rx or ry
+ *   MRX, MRY   memory at the address in register rx or ry
+ *   D8, D16    the data byte or word
+ *   MD16       memory at the data word
+ *   ZERO       nothing; reads as 0
+ *   RXY        a to rx and b to ry
+ *   MD16_RY    ry to memory at the data word
+ *   NONE       nowhere
+ *
+ * sizes is BOTH if the operand size changes what the mode does, ANY if not,
+ * and NONE for modes which do not execute. Any further arguments are passed
+ * on to X.
+ */
+#define CORE_ISA_MODES(X, ...)                                              \
+    X(AM_DR,       dr,       2, 2, RX,  RY,   RX,      ANY,  __VA_ARGS__)   \
+    X(AM_IR,       ir,       2, 5, MRY, ZERO, MRX,     BOTH, __VA_ARGS__)   \
+    X(AM_DB,       db,       3, 3, D8,  ZERO, NONE,    ANY,  __VA_ARGS__)   \
+    X(AM_IB,       ib,       3, 5, MRX, D16,  MRX,     BOTH, __VA_ARGS__)   \
+    X(AM_DW,       dw,       4, 3, D16, ZERO, NONE,    ANY,  __VA_ARGS__)   \
+    X(AM_IW,       iw,       4, 5, MRX, D16,  MRX,     BOTH, __VA_ARGS__)   \
+    X(AM_DR_DR,    dr_dr,    2, 2, RX,  RY,   RXY,     ANY,  __VA_ARGS__)   \
+    X(AM_DR_IR,    dr_ir,    2, 3, RX,  MRY,  RX,      BOTH, __VA_ARGS__)   \
+    X(AM_IR_DR,    ir_dr,    2, 7, RX,  RY,   NONE,    NONE, __VA_ARGS__)   \
+    X(AM_DR_DB,    dr_db,    3, 3, RX,  D8,   RX,      ANY,  __VA_ARGS__)   \
+    X(AM_DR_IB,    dr_ib,    3, 4, RX,  MD16, RX,      BOTH, __VA_ARGS__)   \
+    X(AM_DR_DW,    dr_dw,    4, 3, RX,  D16,  RX,      ANY,  __VA_ARGS__)   \
+    X(AM_DR_IW,    dr_iw,    4, 4, RX,  MD16, RX,      BOTH, __VA_ARGS__)   \
+    X(AM_IB_DR,    ib_dr,    3, 5, RX,  D16,  MD16_RY, BOTH, __VA_ARGS__)   \
+    X(AM_IW_DR,    iw_dr,    4, 5, RX,  D16,  MD16_RY, BOTH, __VA_ARGS__)   \
+    X(AM_RESERVED, reserved, 2, 7, RX,  RY,   NONE,    NONE, __VA_ARGS__)
+
+/* Index of the handler for an opcode, addressing mode and operand size. */
+#define CORE_ISA_HANDLER(op, mode, size)                                    \
+    (((op) << 5) | ((mode) << 1) | (size))
+#define CORE_ISA_NUM_HANDLERS   (32 * 16 * 2)
+
+#endif
@@ -0,0 +1,861 @@
+/*
+ * core/cpu/jit.c -- Dynamic recompiler for x86-64 hosts.
+ *
+ * Translates basic blocks of Khepra code into native functions, cached by
+ * address and swappable bank. Register and immediate operations, jumps and
+ * constant accesses to the fixed RAM and ROM banks are emitted inline; all
+ * other instructions call back into core_cpu_i_exec(), which goes through the
+ * MMU handlers. Other hosts fall back to the threaded interpreter. Before
+ * each instruction after the first, a block checks whether the budget is
+ * spent, and leaves there if so, as the threaded engine would stop.
+ *
+ * Generated code keeps the core_cpu pointer in rbx and the current core_instr
+ * in r12, and addresses the register file relative to rbx. It computes flags
+ * eagerly, so lazily evaluated flags are applied before entering a block and
+ * after each instruction executed out of line.
+ *
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/cpu/cpu.h"
+#include "core/cpu/alu.h"
+#include "core/cpu/codecache.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+#if defined(__x86_64__) && !defined(CORE_CPU_NO_JIT)
+
+#include <sys/mman.h>
+
+#define J_CODE_SIZE     (4*1024*1024)
+#define J_MAX_BLOCKS    16384
+#ifndef J_MAX_INSTRS
+#define J_MAX_INSTRS    64
+#endif
+/* Upper bound on the code emitted for one instruction. */
+#define J_INSTR_ROOM    160
+#define J_BLOCK_ROOM    (J_MAX_INSTRS * J_INSTR_ROOM + 64)
+/* Scratch room past the code buffer, for instructions translated alone. */
+#define J_SINGLE_ROOM   (J_INSTR_ROOM + 64)
+
+/* Displacements from rbx and r12 used by the generated code. */
+#define J_REG(x)        (offsetof(struct core_cpu, r) + 2 * (x))
+#define J_DB1           offsetof(struct core_instr, db1)
+
+typedef int (*core_jit_fn)(struct core_cpu *, struct core_instr *);
+
+/* A translated block. */
+struct core_jit_block
+{
+    core_jit_fn fn;
+    /* Address range covered, end exclusive. */
+    uint16_t start;
+    uint32_t end;
+    /* Address of the last instruction. */
+    uint16_t last;
+    /* Bank swapped in at the start address when translated. */
+    uint8_t bank;
+    uint8_t valid;
+    /* Times run, for the persistent code cache. */
+    uint32_t runs;
+};
+
+/* Recompiler state. */
+struct core_jit
+{
+    uint8_t *code;
+    uint8_t *pos;
+    size_t used;
+
+    struct core_jit_block blocks[J_MAX_BLOCKS];
+    int num_blocks;
+    /* Latest block translated at each address, plus one; 0 if none. */
+    uint16_t map[65536];
+    /*
+     * Cycles taken by instructions executed out of line beyond what the
+     * block counted for them, by calls to library routines run natively.
+     */
+    int extra;
+    /* Cycles run past cpu->total_cycles before the running block. */
+    int base;
+    /*
+     * Cycles left of the budget when the running block was entered, less
+     * extra; it leaves before the first instruction which would start past
+     * them.
+     */
+    int left;
+};
+
+/* Code emission. */
+static inline void j_b(struct core_jit *j, uint8_t b)
+{
+    *j->pos++ = b;
+}
+
+static inline void j_w(struct core_jit *j, uint16_t w)
+{
+    memcpy(j->pos, &w, 2);
+    j->pos += 2;
+}
+
+static inline void j_d(struct core_jit *j, uint32_t d)
+{
+    memcpy(j->pos, &d, 4);
+    j->pos += 4;
+}
+
+static inline void j_q(struct core_jit *j, const void *q)
+{
+    uint64_t v = (uint64_t)(uintptr_t)q;
+    memcpy(j->pos, &v, 8);
+    j->pos += 8;
+}
+
+/* movzx eax, word [rbx + r] */
+static void j_load_eax(struct core_jit *j, int r)
+{
+    j_b(j, 0x0f); j_b(j, 0xb7); j_b(j, 0x43); j_b(j, J_REG(r));
+}
+
+/* movzx ecx, word [rbx + r] */
+static void j_load_ecx(struct core_jit *j, int r)
+{
+    j_b(j, 0x0f); j_b(j, 0xb7); j_b(j, 0x4b); j_b(j, J_REG(r));
+}
+
+/* mov word [rbx + r], ax */
+static void j_store_eax(struct core_jit *j, int r)
+{
+    j_b(j, 0x66); j_b(j, 0x89); j_b(j, 0x43); j_b(j, J_REG(r));
+}
+
+/* mov word [rbx + r], cx */
+static void j_store_ecx(struct core_jit *j, int r)
+{
+    j_b(j, 0x66); j_b(j, 0x89); j_b(j, 0x4b); j_b(j, J_REG(r));
+}
+
+/* mov word [rbx + r], imm16 */
+static void j_store_imm(struct core_jit *j, int r, uint16_t v)
+{
+    j_b(j, 0x66); j_b(j, 0xc7); j_b(j, 0x43); j_b(j, J_REG(r)); j_w(j, v);
+}
+
+/* Load a constant address in the fixed banks into ecx. */
+static void j_load_flat_ecx(struct core_jit *j, uint8_t *host, int size)
+{
+    j_b(j, 0x48); j_b(j, 0xb9); j_q(j, host);           /* mov rcx, host */
+    j_b(j, 0x0f); j_b(j, size == OP_16 ? 0xb7 : 0xb6);  /* movzx ecx, [rcx] */
+    j_b(j, 0x09);
+}
+
+/* Call a C function; rdi must already hold its first argument. */
+static void j_call(struct core_jit *j, const void *fn)
+{
+    j_b(j, 0x48); j_b(j, 0xb8); j_q(j, fn);             /* mov rax, fn */
+    j_b(j, 0xff); j_b(j, 0xd0);                         /* call rax */
+}
+
+static void j_prologue(struct core_jit *j)
+{
+    j_b(j, 0x53);                                       /* push rbx */
+    j_b(j, 0x41); j_b(j, 0x54);                         /* push r12 */
+    j_b(j, 0x48); j_b(j, 0x83); j_b(j, 0xec); j_b(j, 0x08); /* sub rsp, 8 */
+    j_b(j, 0x48); j_b(j, 0x89); j_b(j, 0xfb);           /* mov rbx, rdi */
+    j_b(j, 0x49); j_b(j, 0x89); j_b(j, 0xf4);           /* mov r12, rsi */
+}
+
+/* Return from the block, having used the given number of cycles. 13 bytes. */
+static void j_exit(struct core_jit *j, int cycles)
+{
+    j_b(j, 0xb8); j_d(j, cycles);                       /* mov eax, cycles */
+    j_b(j, 0x48); j_b(j, 0x83); j_b(j, 0xc4); j_b(j, 0x08); /* add rsp, 8 */
+    j_b(j, 0x41); j_b(j, 0x5c);                         /* pop r12 */
+    j_b(j, 0x5b);                                       /* pop rbx */
+    j_b(j, 0xc3);                                       /* ret */
+}
+
+/* F = (F & (int8_t)mask) | esi */
+static void j_flags_apply(struct core_jit *j, uint8_t mask)
+{
+    j_b(j, 0x0f); j_b(j, 0xb7); j_b(j, 0x7b); j_b(j, J_REG(R_F));
+    j_b(j, 0x83); j_b(j, 0xe7); j_b(j, mask);           /* and edi, mask */
+    j_b(j, 0x09); j_b(j, 0xf7);                         /* or edi, esi */
+    j_b(j, 0x66); j_b(j, 0x89); j_b(j, 0x7b); j_b(j, J_REG(R_F));
+}
+
+/*
+ * Z only, set if the 16-bit register given by its ModRM encoding is zero.
+ * Matches the flags of MV and TST in core_alu_sync().
+ */
+static void j_flags_zn(struct core_jit *j, uint8_t modrm)
+{
+    j_b(j, 0x31); j_b(j, 0xf6);                         /* xor esi, esi */
+    j_b(j, 0x66); j_b(j, 0x85); j_b(j, modrm);          /* test r16, r16 */
+    j_b(j, 0x40); j_b(j, 0x0f); j_b(j, 0x94); j_b(j, 0xc6); /* sete sil */
+    j_flags_apply(j, 0xf6);
+}
+
+/*
+ * Flags as core_alu__flags() works them out, given the 32-bit result in eax (edx if
+ * use_edx): Z is set if the low 16 bits are zero or the result is above
+ * 0x7fff.
+ */
+static void j_flags_arith(struct core_jit *j, int use_edx)
+{
+    j_b(j, 0x31); j_b(j, 0xf6);                         /* xor esi, esi */
+    j_b(j, 0x31); j_b(j, 0xff);                         /* xor edi, edi */
+    j_b(j, 0x66); j_b(j, 0x85); j_b(j, use_edx ? 0xd2 : 0xc0);
+    j_b(j, 0x40); j_b(j, 0x0f); j_b(j, 0x94); j_b(j, 0xc6); /* sete sil */
+    if(use_edx) {
+        j_b(j, 0x81); j_b(j, 0xfa);                     /* cmp edx, 0x7fff */
+    } else
+        j_b(j, 0x3d);                                   /* cmp eax, 0x7fff */
+    j_d(j, 0x7fff);
+    j_b(j, 0x40); j_b(j, 0x0f); j_b(j, 0x9f); j_b(j, 0xc7); /* setg dil */
+    j_b(j, 0x09); j_b(j, 0xfe);                         /* or esi, edi */
+    j_flags_apply(j, 0xf0);
+}
+
+
+/*
+ * Execute one instruction out of line, the block having counted the given
+ * number of cycles before it. Returns non-zero to leave the block.
+ */
+static int core_cpu_j__exec(struct core_cpu *cpu, int at)
+{
+    int cycles;
+
+    cpu->ahead = cpu->jit->base + at + cpu->jit->extra;
+    cycles = core_cpu_i_exec(cpu);
+
+    cpu->jit->extra += cycles - cpu->d->cycles;
+    cpu->jit->left -= cycles - cpu->d->cycles;
+    core_alu_sync(&cpu->r[R_F], &cpu->lf);
+    return cpu->block_exit;
+}
+
+/*
+ * Host address of a constant operand lying entirely in a fixed bank, or NULL.
+ * Operands to be written must also lie in a single page. Pages with accesses
+ * being watched are left to the MMU, which reports them; while the code/data
+ * logger is on that is every page, so nothing it should see is inlined.
+ */
+static uint8_t *core_cpu_j__flat(struct core_mmu *mmu, uint16_t a, int size,
+        int write)
+{
+    int last = a + (size == OP_16);
+
+    if(write && (a >> 8) != (last >> 8))
+        return NULL;
+    if(mmu->watch_pages[a >> 8] || mmu->watch_pages[(last >> 8) & 0xff])
+        return NULL;
+    if(last <= A_ROM_FIXED_END)
+        return mmu->rom_f + (a - A_ROM_FIXED);
+    if(a >= A_RAM_FIXED && last <= A_RAM_FIXED_END)
+        return mmu->ram_f + (a - A_RAM_FIXED);
+    return NULL;
+}
+
+/*
+ * Emit an instruction inline, if it is one of the simple forms. Returns 0 if
+ * it must be executed out of line instead.
+ */
+static int core_cpu_j__native(struct core_jit *j, struct core_mmu *mmu,
+        struct core_instr_decoded *d, uint16_t next, uint16_t data, int term,
+        int cycles)
+{
+    uint8_t *flat = NULL;
+    int rdx = 0, rdy = 0, flag = 0;
+    int jump = d->opcode >= OP_JP && d->opcode <= OP_CN;
+
+    if(d->opcode == OP_NOP)
+        return 1;
+    if(jump && (d->opcode & 1))         /* Calls */
+        return 0;
+    if(!jump && (d->opcode < OP_NOT || d->opcode == OP_MUL ||
+                 d->opcode == OP_DIV || (d->opcode >= OP_LSL &&
+                                         d->opcode <= OP_ASR)))
+        return 0;
+
+    switch(d->mode) {
+        case AM_DR: case AM_DR_DR:
+            rdx = rdy = 1;
+            break;
+        case AM_DB: case AM_DW:
+            break;
+        case AM_DR_DB: case AM_DR_DW:
+            rdx = 1;
+            break;
+        case AM_DR_IW:
+            flat = core_cpu_j__flat(mmu, data, d->size, 0);
+            if(flat == NULL)
+                return 0;
+            rdx = 1;
+            break;
+        case AM_IW_DR:
+            if(d->opcode != OP_MV)
+                return 0;
+            flat = core_cpu_j__flat(mmu, data, d->size, 1);
+            if(flat == NULL)
+                return 0;
+            rdy = 1;
+            break;
+        default:
+            return 0;
+    }
+    if(jump && d->mode != AM_DR && d->mode != AM_DB && d->mode != AM_DW)
+        return 0;
+
+    /* The program counter is only kept up to date where it is observed. */
+    if(term || (rdx && d->rx == R_P) || (rdy && d->ry == R_P))
+        j_store_imm(j, R_P, next);
+    /* Later byte-addressed instructions see this high data byte. */
+    if(d->flags & DEC_HAS_DW) {
+        j_b(j, 0x41); j_b(j, 0xc6); j_b(j, 0x44); j_b(j, 0x24);
+        j_b(j, J_DB1); j_b(j, B_HI(data));              /* mov [r12+db1] */
+    }
+
+    if(jump) {
+        switch(d->opcode) {
+            case OP_JZ: flag = FLAG_Z; break;
+            case OP_JC: flag = FLAG_C; break;
+            case OP_JO: flag = FLAG_O; break;
+            case OP_JN: flag = FLAG_N; break;
+        }
+        if(flag) {
+            j_b(j, 0x66); j_b(j, 0xf7); j_b(j, 0x43); j_b(j, J_REG(R_F));
+            j_w(j, flag);                               /* test [F], flag */
+            j_b(j, 0x74);                               /* jz */
+            j_b(j, d->mode == AM_DR ? 8 : 6);
+        }
+        if(d->mode == AM_DR) {
+            j_load_eax(j, d->rx);
+            j_store_eax(j, R_P);
+        } else
+            j_store_imm(j, R_P, d->mode == AM_DB ? B_LO(data) : data);
+        return 1;
+    }
+
+    if(d->mode == AM_IW_DR) {
+        /* MV only; the flags come from the constant address. */
+        j_b(j, 0x0f); j_b(j, 0xb7); j_b(j, 0x7b); j_b(j, J_REG(R_F));
+        j_b(j, 0x83); j_b(j, 0xe7); j_b(j, 0xf6);       /* and edi, ~(Z|N) */
+        if(data == 0) {
+            j_b(j, 0x83); j_b(j, 0xcf); j_b(j, FLAG_Z); /* or edi, Z */
+        }
+        j_b(j, 0x66); j_b(j, 0x89); j_b(j, 0x7b); j_b(j, J_REG(R_F));
+
+        j_load_eax(j, d->ry);
+        j_b(j, 0x48); j_b(j, 0xba); j_q(j, flat);       /* mov rdx, host */
+        if(d->size == OP_16) {
+            j_b(j, 0x66); j_b(j, 0x89); j_b(j, 0x02);   /* mov [rdx], ax */
+        } else {
+            j_b(j, 0x88); j_b(j, 0x02);                 /* mov [rdx], al */
+        }
+
+        /* Leave through the MMU hook if this overwrote any engine's code. */
+        j_b(j, 0x48); j_b(j, 0xb8); j_q(j, &mmu->code_pages[data >> 8]);
+        j_b(j, 0x80); j_b(j, 0x38); j_b(j, 0x00);       /* cmp byte [rax], 0 */
+        j_b(j, 0x74); j_b(j, 39);                       /* je */
+        j_store_imm(j, R_P, next);
+        j_b(j, 0x48); j_b(j, 0x89); j_b(j, 0xdf);       /* mov rdi, rbx */
+        j_b(j, 0xbe); j_d(j, data);                     /* mov esi, data */
+        j_call(j, (const void *)core_cpu_code_written);
+        j_exit(j, cycles);
+        return 1;
+    }
+
+    /* First operand in eax, second in ecx. */
+    switch(d->mode) {
+        case AM_DB:
+            j_b(j, 0xb8); j_d(j, B_LO(data));
+            break;
+        case AM_DW:
+            j_b(j, 0xb8); j_d(j, data);
+            break;
+        default:
+            j_load_eax(j, d->rx);
+            break;
+    }
+    switch(d->mode) {
+        case AM_DR: case AM_DR_DR:
+            j_load_ecx(j, d->ry);
+            break;
+        case AM_DR_DB:
+            j_b(j, 0xb9); j_d(j, B_LO(data));
+            break;
+        case AM_DR_DW:
+            j_b(j, 0xb9); j_d(j, data);
+            break;
+        case AM_DR_IW:
+            j_load_flat_ecx(j, flat, d->size);
+            break;
+        default:
+            j_b(j, 0x31); j_b(j, 0xc9);                 /* xor ecx, ecx */
+            break;
+    }
+
+    switch(d->opcode) {
+        case OP_NOT:
+            j_b(j, 0xf7); j_b(j, 0xd0);
+            break;
+        case OP_INC: case OP_IND:
+            j_b(j, 0x83); j_b(j, 0xc0);
+            j_b(j, d->opcode == OP_INC ? 1 : 2);
+            break;
+        case OP_DEC: case OP_DED:
+            j_b(j, 0x83); j_b(j, 0xe8);
+            j_b(j, d->opcode == OP_DEC ? 1 : 2);
+            break;
+        case OP_MV:
+            j_flags_zn(j, 0xc9);                        /* test cx, cx */
+            j_b(j, 0x89); j_b(j, 0xc8);                 /* mov eax, ecx */
+            break;
+        case OP_TST:
+            j_b(j, 0x89); j_b(j, 0xc2);                 /* mov edx, eax */
+            j_b(j, 0x21); j_b(j, 0xca);                 /* and edx, ecx */
+            j_flags_zn(j, 0xd2);                        /* test dx, dx */
+            break;
+        case OP_CMP:
+            j_b(j, 0x89); j_b(j, 0xc2);                 /* mov edx, eax */
+            j_b(j, 0x29); j_b(j, 0xca);                 /* sub edx, ecx */
+            j_flags_arith(j, 1);
+            break;
+        default:
+            switch(d->opcode) {
+                case OP_ADD: j_b(j, 0x01); break;
+                case OP_SUB: j_b(j, 0x29); break;
+                case OP_AND: j_b(j, 0x21); break;
+                case OP_OR:  j_b(j, 0x09); break;
+                case OP_XOR: j_b(j, 0x31); break;
+            }
+            j_b(j, 0xc8);                               /* op eax, ecx */
+            j_flags_arith(j, 0);
+            break;
+    }
+
+    switch(d->mode) {
+        case AM_DB: case AM_DW:
+            break;
+        case AM_DR_DR:
+            j_store_eax(j, d->rx);
+            j_store_ecx(j, d->ry);
+            break;
+        default:
+            j_store_eax(j, d->rx);
+            break;
+    }
+    return 1;
+}
+
+/* Drop every translation, when the code buffer or block table is full. */
+static void core_cpu_j__flush(struct core_cpu *cpu)
+{
+    struct core_jit *j = cpu->jit;
+    int page;
+
+    LOGD("core.cpu: flushing %d translated blocks", j->num_blocks);
+    core_cpu_j_keep(cpu);
+    j->used = 0;
+    j->num_blocks = 0;
+    memset(j->map, 0, sizeof(j->map));
+    for(page = 0; page < 256; ++page)
+        cpu->mmu->code_pages[page] &= ~CODE_JIT;
+}
+
+/*
+ * Leave the block before the instruction at a, the block having counted the
+ * given cycles before it, if the budget is spent. 37 bytes.
+ */
+static void j_budget(struct core_jit *j, uint16_t a, int cycles)
+{
+    j_b(j, 0x48); j_b(j, 0xb8); j_q(j, &j->left);       /* mov rax, &left */
+    j_b(j, 0x81); j_b(j, 0x38); j_d(j, cycles);         /* cmp [rax], at */
+    j_b(j, 0x7f); j_b(j, 19);                           /* jg */
+    j_store_imm(j, R_P, a);
+    j_exit(j, cycles);
+}
+
+/*
+ * Translate one instruction of a block, at a and with the given data word,
+ * the instructions of the block up to and including it taking the given
+ * cycles.
+ */
+static void core_cpu_j__emit(struct core_jit *j, struct core_mmu *mmu,
+        struct core_instr_decoded *d, uint16_t a, uint16_t data, int cycles)
+{
+    int term = d->flags & DEC_ENDS_BLOCK;
+
+    if(!core_cpu_j__native(j, mmu, d, a + d->len, data, term, cycles)) {
+        j_store_imm(j, R_P, a);
+        j_b(j, 0x48); j_b(j, 0x89); j_b(j, 0xdf);       /* mov rdi, rbx */
+        j_b(j, 0xbe); j_d(j, cycles - d->cycles);       /* mov esi, at */
+        j_call(j, (const void *)core_cpu_j__exec);
+        if(!term) {
+            j_b(j, 0x85); j_b(j, 0xc0);                 /* test eax, eax */
+            j_b(j, 0x74); j_b(j, 13);                   /* jz */
+            j_exit(j, cycles);
+        }
+    }
+}
+
+/* Translate the block at an address. Returns NULL if it cannot be. */
+static struct core_jit_block *core_cpu_j__translate(struct core_cpu *cpu,
+        uint16_t start, uint8_t bank)
+{
+    struct core_jit *j = cpu->jit;
+    struct core_mmu *mmu = cpu->mmu;
+    struct core_instr_decoded *d;
+    struct core_jit_block *b;
+    uint16_t end = core_mmu_segment_end(start);
+    uint16_t data, last = start;
+    uint32_t a = start;
+    int n, cycles = 0, term = 0;
+
+    if(end == 0)
+        return NULL;
+    if(j->used + J_BLOCK_ROOM > J_CODE_SIZE || j->num_blocks == J_MAX_BLOCKS)
+        core_cpu_j__flush(cpu);
+
+    j->pos = j->code + j->used;
+    j_prologue(j);
+
+    for(n = 0; n < J_MAX_INSTRS && !term; ++n) {
+        if(a + 1 > end)
+            break;
+        d = &core_cpu_dtab[core_mmu_readw(mmu, a)];
+        if(a + d->len - 1 > end)
+            break;
+        data = (d->flags & DEC_HAS_DATA) ? core_mmu_readw(mmu, a + 2) : 0;
+        cycles += d->cycles;
+        term = d->flags & DEC_ENDS_BLOCK;
+        if(n > 0)
+            j_budget(j, a, cycles - d->cycles);
+        core_cpu_j__emit(j, mmu, d, a, data, cycles);
+        last = a;
+        a += d->len;
+    }
+    if(n == 0)
+        return NULL;
+
+    if(!term)
+        j_store_imm(j, R_P, a);
+    j_exit(j, cycles);
+
+    b = &j->blocks[j->num_blocks++];
+    b->fn = (core_jit_fn)(void *)(j->code + j->used);
+    b->start = start;
+    b->end = a;
+    b->last = last;
+    b->bank = bank;
+    b->valid = 1;
+    b->runs = 0;
+    j->map[start] = j->num_blocks;
+    j->used = j->pos - j->code;
+
+    for(a = start >> 8; a <= (b->end - 1) >> 8; ++a)
+        mmu->code_pages[a] |= CODE_JIT;
+
+    return b;
+}
+
+/* Find or make the translation of the block at an address. */
+static struct core_jit_block *core_cpu_j__lookup(struct core_cpu *cpu,
+        uint16_t a)
+{
+    struct core_jit *j = cpu->jit;
+    struct core_jit_block *b;
+    uint8_t bank = core_mmu_bank_at(cpu->mmu, a);
+
+    if(j->map[a]) {
+        b = &j->blocks[j->map[a] - 1];
+        if(b->valid && b->bank == bank)
+            return b;
+    }
+    return core_cpu_j__translate(cpu, a, bank);
+}
+
+static int core_cpu_j__init(struct core_cpu *cpu)
+{
+    struct core_jit *j = calloc(1, sizeof(struct core_jit));
+
+    if(j == NULL) {
+        LOGE("core.cpu: could not allocate recompiler state");
+        return 0;
+    }
+    j->code = mmap(NULL, J_CODE_SIZE + J_SINGLE_ROOM, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(j->code == MAP_FAILED) {
+        LOGE("core.cpu: could not map executable memory for recompiler");
+        free(j);
+        return 0;
+    }
+    cpu->jit = j;
+    return 1;
+}
+
+/*
+ * Translate the block at an address ahead of running it, for the persistent
+ * code cache. Returns 0 once the code buffer has no more room, rather than
+ * flushing the blocks translated so far.
+ */
+int core_cpu_j_warm(struct core_cpu *cpu, uint16_t a)
+{
+    struct core_jit *j;
+
+    if(cpu->jit == NULL && !core_cpu_j__init(cpu))
+        return 0;
+    j = cpu->jit;
+    if(j->used + J_BLOCK_ROOM > J_CODE_SIZE || j->num_blocks == J_MAX_BLOCKS)
+        return 0;
+    core_cpu_j__lookup(cpu, a);
+    return 1;
+}
+
+/*
+ * Run a translated block, having run the given number of cycles out of the
+ * budget so far. Returns the cycles taken.
+ */
+static inline int core_cpu_j__exec_block(struct core_cpu *cpu,
+        struct core_jit_block *b, int cycles, int budget)
+{
+    int n;
+
+    cpu->block_exit = 0;
+    b->runs += 1;
+    cpu->jit->base = cycles;
+    cpu->jit->left = budget - cycles;
+    n = b->fn(cpu, cpu->i) + cpu->jit->extra;
+    cpu->jit->extra = 0;
+    /* A block jumping back to its start may only be waiting. */
+    if(cpu->r[R_P] == b->start) {
+        n += core_cpu_idle(cpu, cpu->r, &cpu->lf, b->last, cycles + n,
+                           budget);
+    }
+    return n;
+}
+
+/*
+ * Run translated blocks until at least the given number of cycles have been
+ * spent, entering interrupts between blocks. A block is left at the first
+ * instruction boundary at or past the budget, so that an interrupt raised
+ * there is entered where the threaded engine enters it. As with
+ * core_cpu_t_run(), returns the number of cycles the other devices must be
+ * caught up on.
+ */
+int core_cpu_j_run(struct core_cpu *cpu, int budget)
+{
+    struct core_jit_block *b;
+    int cycles = 0;
+
+    if(cpu->jit == NULL && !core_cpu_j__init(cpu)) {
+        LOGW("core.cpu: falling back to the threaded engine");
+        cpu->engine = CPU_ENGINE_THREADED;
+        return core_cpu_t_run(cpu, budget);
+    }
+
+    core_alu_sync(&cpu->r[R_F], &cpu->lf);
+    while(cycles < budget) {
+        cpu->ahead = cycles;
+        if(core_cpu_int_due(cpu, cpu->r[R_F])) {
+            cycles += core_cpu_i_interrupt(cpu);
+            continue;
+        }
+        b = core_cpu_j__lookup(cpu, cpu->r[R_P]);
+        if(b == NULL) {
+            cycles += core_cpu_i_exec(cpu);
+            core_alu_sync(&cpu->r[R_F], &cpu->lf);
+            continue;
+        }
+        cycles += core_cpu_j__exec_block(cpu, b, cycles, budget);
+    }
+
+    return cycles;
+}
+
+/*
+ * Run the one block at the program counter, for the tiered engine, having
+ * run the given number of cycles out of the budget so far. Returns the
+ * cycles taken, or -1 if the code there cannot be translated.
+ */
+int core_cpu_j_step(struct core_cpu *cpu, int cycles, int budget)
+{
+    struct core_jit_block *b;
+
+    if(cpu->jit == NULL && !core_cpu_j__init(cpu))
+        return -1;
+    b = core_cpu_j__lookup(cpu, cpu->r[R_P]);
+    if(b == NULL)
+        return -1;
+    /* Translated code expects the flags applied, as they are in j_run. */
+    core_alu_sync(&cpu->r[R_F], &cpu->lf);
+    return core_cpu_j__exec_block(cpu, b, cycles, budget);
+}
+
+/*
+ * Run the one instruction at a, with the given data word, through code
+ * translated for it alone into the scratch room past the code buffer, the
+ * block it is in having taken the given cycles so far. Returns the cycles
+ * taken.
+ */
+static int core_cpu_j__single(struct core_cpu *cpu,
+        struct core_instr_decoded *d, uint16_t a, uint16_t data, int cycles)
+{
+    struct core_jit *j = cpu->jit;
+    int n;
+
+    j->pos = j->code + J_CODE_SIZE;
+    j_prologue(j);
+    core_cpu_j__emit(j, cpu->mmu, d, a, data, d->cycles);
+    if(!(d->flags & DEC_ENDS_BLOCK))
+        j_store_imm(j, R_P, a + d->len);
+    j_exit(j, d->cycles);
+
+    core_cpu_i_latch(cpu, d, data);
+    j->base = cycles;
+    n = ((core_jit_fn)(void *)(j->code + J_CODE_SIZE))(cpu, cpu->i) +
+        j->extra;
+    j->extra = 0;
+    return n;
+}
+
+/*
+ * Run the block at the program counter, as far as core_cpu_j__translate()
+ * would take it, for core_run_slice_probe(), passing each instruction to the
+ * given function as it is run. Each goes through code translated for it
+ * alone, which is not kept. Returns the cycles taken, or -1 if the code there
+ * cannot be translated.
+ */
+int core_cpu_j_probe(struct core_cpu *cpu, core_cpu_probe_fn fn, void *data)
+{
+    struct core_mmu *mmu = cpu->mmu;
+    struct core_instr_decoded *d;
+    uint16_t end = core_mmu_segment_end(cpu->r[R_P]), w, s;
+    uint32_t a;
+    int n = 0, k, i, stop = 0;
+
+    if(cpu->jit == NULL && !core_cpu_j__init(cpu))
+        return -1;
+    if(end == 0)
+        return -1;
+
+    /* Translated code expects the flags applied, as they are in j_run. */
+    core_alu_sync(&cpu->r[R_F], &cpu->lf);
+    cpu->block_exit = 0;
+    for(i = 0; i < J_MAX_INSTRS && !stop; ++i) {
+        a = cpu->r[R_P];
+        if(a + 1 > end)
+            break;
+        d = &core_cpu_dtab[core_mmu_readw(mmu, a)];
+        if(a + d->len - 1 > end)
+            break;
+        w = (d->flags & DEC_HAS_DATA) ? core_mmu_readw(mmu, a + 2) : 0;
+        s = cpu->r[R_S];
+        k = core_cpu_j__single(cpu, d, a, w, n);
+        n += k;
+        stop = fn(data, a, s, k) || (d->flags & DEC_ENDS_BLOCK) ||
+               cpu->block_exit || cpu->r[R_P] != a + d->len;
+    }
+    return i > 0 ? n : -1;
+}
+
+/*
+ * Drop every translation, when a watchpoint is set; those made before may
+ * access its page without the MMU.
+ */
+void core_cpu_j_flush(struct core_cpu *cpu)
+{
+    if(cpu->jit != NULL)
+        core_cpu_j__flush(cpu);
+}
+
+/* Drop the translations covering the page of an address. */
+void core_cpu_j_invalidate(struct core_cpu *cpu, uint16_t a)
+{
+    struct core_jit *j = cpu->jit;
+    struct core_jit_block *b;
+    int page = a >> 8, i;
+
+    if(j == NULL)
+        return;
+    for(i = 0; i < j->num_blocks; ++i) {
+        b = &j->blocks[i];
+        if(b->valid && (b->start >> 8) <= page && ((b->end - 1) >> 8) >= page)
+            b->valid = 0;
+    }
+    cpu->mmu->code_pages[page] &= ~CODE_JIT;
+}
+
+/* Hand the blocks held over to the persistent code cache, if kept. */
+void core_cpu_j_keep(struct core_cpu *cpu)
+{
+    struct core_jit *j = cpu->jit;
+    struct core_jit_block *b;
+    int i;
+
+    if(j == NULL || cpu->codecache == NULL)
+        return;
+    for(i = 0; i < j->num_blocks; ++i) {
+        b = &j->blocks[i];
+        if(b->valid)
+            core_codecache_add(cpu->codecache, b->start, b->bank, b->runs,
+                               NULL, 0);
+        b->runs = 0;
+    }
+}
+
+void core_cpu_j_destroy(struct core_cpu *cpu)
+{
+    if(cpu->jit == NULL)
+        return;
+    munmap(cpu->jit->code, J_CODE_SIZE + J_SINGLE_ROOM);
+    free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+#else
+
+/* No recompiler for this host; run the threaded interpreter instead. */
+int core_cpu_j_run(struct core_cpu *cpu, int budget)
+{
+    return core_cpu_t_run(cpu, budget);
+}
+
+void core_cpu_j_flush(struct core_cpu *cpu)
+{
+}
+
+void core_cpu_j_invalidate(struct core_cpu *cpu, uint16_t a)
+{
+}
+
+int core_cpu_j_warm(struct core_cpu *cpu, uint16_t a)
+{
+    return 0;
+}
+
+int core_cpu_j_step(struct core_cpu *cpu, int cycles, int budget)
+{
+    return -1;
+}
+
+int core_cpu_j_probe(struct core_cpu *cpu, core_cpu_probe_fn fn, void *data)
+{
+    return -1;
+}
+
+void core_cpu_j_keep(struct core_cpu *cpu)
+{
+}
+
+void core_cpu_j_destroy(struct core_cpu *cpu)
+{
+}
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * core/cpu/prof.c -- Guest code profiler.
+ *
+ * Holds the counters recorded through prof.h, and writes them out as a
+ * report sorted by the cycles spent, hottest first. Also keeps the calling
+ * context tree the call stack samples are counted in.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/cpu/prof.h"
+#include "core/cpu/isa.h"
+#include "core/dbg/sym.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+#define CORE_PROF_AM_NAME(mode, mn, ...)    #mn,
+static const char *core_prof_am_names[16] = {
+    CORE_ISA_MODES(CORE_PROF_AM_NAME, 0)
+};
+
+/* Counters being sorted by core_prof__cmp(). */
+static const uint64_t *core_prof__cycles;
+
+
+/*
+ * Set up the profiler. Samples the call stack every so many cycles, or not
+ * at all if that is 0.
+ */
+int core_prof_init(struct core_prof **pprof, int sample_cycles)
+{
+    struct core_prof *prof;
+
+    prof = *pprof = calloc(1, sizeof(struct core_prof));
+    if(prof == NULL) {
+        LOGE("Could not allocate profiler");
+        return 0;
+    }
+    if(sample_cycles) {
+        prof->max_nodes = 1024;
+        prof->nodes = calloc(prof->max_nodes, sizeof(struct core_prof_node));
+        if(prof->nodes == NULL) {
+            LOGE("Could not allocate profiler call stacks");
+            free(prof);
+            return 0;
+        }
+        prof->num_nodes = 1;
+        prof->sample_cycles = prof->sample_left = sample_cycles;
+    }
+    return 1;
+}
+
+void core_prof_destroy(struct core_prof *prof)
+{
+    free(prof->nodes);
+    free(prof);
+}
+
+/* Count the cycles run in the current stack, sampling it when they are due. */
+static void core_prof__tick(struct core_prof *prof, int cycles)
+{
+    prof->sample_left -= cycles;
+    while(prof->sample_left <= 0) {
+        prof->nodes[prof->cur].samples += 1;
+        prof->sample_left += prof->sample_cycles;
+    }
+}
+
+/* Go down into the given frame from the current one. */
+static void core_prof__enter(struct core_prof *prof, uint32_t frame)
+{
+    struct core_prof_node *n, *cur = &prof->nodes[prof->cur];
+    int k;
+
+    if(prof->lost || cur->depth == CORE_PROF_MAX_DEPTH) {
+        prof->lost += 1;
+        return;
+    }
+    for(k = cur->child; k; k = prof->nodes[k].sibling) {
+        if(prof->nodes[k].frame == frame) {
+            prof->cur = k;
+            return;
+        }
+    }
+
+    if(prof->num_nodes == prof->max_nodes) {
+        n = NULL;
+        if(prof->max_nodes < CORE_PROF_MAX_NODES)
+            n = realloc(prof->nodes,
+                        2 * prof->max_nodes * sizeof(struct core_prof_node));
+        if(n == NULL) {
+            prof->lost += 1;
+            return;
+        }
+        prof->nodes = n;
+        prof->max_nodes *= 2;
+        cur = &prof->nodes[prof->cur];
+    }
+    k = prof->num_nodes++;
+    n = &prof->nodes[k];
+    n->frame = frame;
+    n->depth = cur->depth + 1;
+    n->parent = prof->cur;
+    n->child = 0;
+    n->sibling = cur->child;
+    n->samples = 0;
+    cur->child = k;
+    prof->cur = k;
+}
+
+/* Go back up to the caller of the current frame. Returns from the root stay. */
+static void core_prof__leave(struct core_prof *prof)
+{
+    if(prof->lost)
+        prof->lost -= 1;
+    else if(prof->cur)
+        prof->cur = prof->nodes[prof->cur].parent;
+}
+
+/*
+ * Follow the call stack through the instruction just run; see
+ * core_prof_instr(). A call counts as taken if it pushed a return address,
+ * which one run natively (see hle.c) does not.
+ */
+void core_prof_track(struct core_prof *prof, struct core_cpu *cpu, uint16_t s,
+        int cycles)
+{
+    core_prof__tick(prof, cycles);
+    switch(cpu->d->opcode) {
+        case OP_INT:
+            core_prof__enter(prof, cpu->r[R_P] | CORE_PROF_INT);
+            break;
+        case OP_RTI:
+        case OP_RTS:
+            core_prof__leave(prof);
+            break;
+        case OP_CL:
+        case OP_CZ:
+        case OP_CC:
+        case OP_CO:
+        case OP_CN:
+            if(cpu->r[R_S] == (uint16_t)(s - 2))
+                core_prof__enter(prof, cpu->r[R_P]);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Follow the call stack into the interrupt just entered. */
+void core_prof_track_interrupt(struct core_prof *prof, struct core_cpu *cpu,
+        int cycles)
+{
+    core_prof__tick(prof, cycles);
+    core_prof__enter(prof, cpu->r[R_P] | CORE_PROF_INT);
+}
+
+/* Write the name of a frame in a folded stack. */
+static void core_prof__frame(FILE *fp, struct core_syms *syms, uint32_t frame)
+{
+    char name[CORE_PROF_NAME_LEN];
+
+    core_sym_format(syms, frame & 0xffff, name, sizeof(name));
+    fprintf(fp, "%s%s", (frame & CORE_PROF_INT) ? "int:" : "", name);
+}
+
+/*
+ * Write the call stack samples as folded stacks, one line per stack with
+ * its frames outermost first and separated by semicolons, then the number
+ * of samples; the format flamegraph.pl and compatible tools read. Frames are
+ * named from the symbol map if there is one (syms may be NULL).
+ */
+void core_prof_folded(struct core_prof *prof, struct core_syms *syms, FILE *fp)
+{
+    int path[CORE_PROF_MAX_DEPTH + 1];
+    int k, n, depth;
+
+    for(k = 0; k < prof->num_nodes; ++k) {
+        if(!prof->nodes[k].samples)
+            continue;
+        depth = 0;
+        for(n = k; n; n = prof->nodes[n].parent)
+            path[depth++] = n;
+        path[depth++] = 0;
+        while(depth--) {
+            core_prof__frame(fp, syms, prof->nodes[path[depth]].frame);
+            fputc(depth ? ';' : ' ', fp);
+        }
+        fprintf(fp, "%llu\n", (unsigned long long)prof->nodes[k].samples);
+    }
+}
+
+/* Order indices by decreasing cycles, then by increasing index. */
+static int core_prof__cmp(const void *x, const void *y)
+{
+    int a = *(const int *)x, b = *(const int *)y;
+
+    if(core_prof__cycles[a] != core_prof__cycles[b])
+        return core_prof__cycles[a] < core_prof__cycles[b] ? 1 : -1;
+    return a - b;
+}
+
+/*
+ * Fill idx with the indices of the non-zero counts, sorted hottest first.
+ * Returns how many there are.
+ */
+static int core_prof__sort(int *idx, const uint64_t *count,
+        const uint64_t *cycles, int n)
+{
+    int k, num = 0;
+
+    for(k = 0; k < n; ++k) {
+        if(count[k])
+            idx[num++] = k;
+    }
+    core_prof__cycles = cycles;
+    qsort(idx, num, sizeof(int), core_prof__cmp);
+    return num;
+}
+
+static double core_prof__percent(uint64_t part, uint64_t total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+/*
+ * Write the report, naming addresses from the symbol map if there is one
+ * (syms may be NULL). The instruction shown at each address is the one there
+ * now, which self-modifying code or bank switching may have changed.
+ */
+void core_prof_report(struct core_prof *prof, struct core_cpu *cpu,
+        struct core_syms *syms, FILE *fp)
+{
+    struct core_instr_decoded *d;
+    char name[CORE_PROF_NAME_LEN];
+    uint64_t instrs = 0, cycles = prof->int_cycles;
+    int *idx, k, n, line;
+
+    idx = malloc(65536 * sizeof(int));
+    if(idx == NULL) {
+        LOGE("Could not allocate profiler report");
+        return;
+    }
+    for(k = 0; k < NUM_INSTRS; ++k) {
+        instrs += prof->op_count[k];
+        cycles += prof->op_cycles[k];
+    }
+
+    fprintf(fp, "%llu instructions in %llu cycles; "
+            "%llu interrupts entered in %llu cycles (%.2f%%)\n",
+            (unsigned long long)instrs, (unsigned long long)cycles,
+            (unsigned long long)prof->int_count,
+            (unsigned long long)prof->int_cycles,
+            core_prof__percent(prof->int_cycles, cycles));
+
+    fprintf(fp, "\nBy opcode:\n%12s %7s %12s  %s\n",
+            "cycles", "%", "count", "opcode");
+    n = core_prof__sort(idx, prof->op_count, prof->op_cycles, NUM_INSTRS);
+    for(k = 0; k < n; ++k) {
+        fprintf(fp, "%12llu %6.2f%% %12llu  %s\n",
+                (unsigned long long)prof->op_cycles[idx[k]],
+                core_prof__percent(prof->op_cycles[idx[k]], cycles),
+                (unsigned long long)prof->op_count[idx[k]],
+                instrnam[idx[k]]);
+    }
+
+    fprintf(fp, "\nBy addressing mode:\n%12s %7s %12s  %s\n",
+            "cycles", "%", "count", "mode");
+    n = core_prof__sort(idx, prof->am_count, prof->am_cycles, 16);
+    for(k = 0; k < n; ++k) {
+        fprintf(fp, "%12llu %6.2f%% %12llu  %s\n",
+                (unsigned long long)prof->am_cycles[idx[k]],
+                core_prof__percent(prof->am_cycles[idx[k]], cycles),
+                (unsigned long long)prof->am_count[idx[k]],
+                core_prof_am_names[idx[k]]);
+    }
+
+    fprintf(fp, "\nBy address (top %d):\n%12s %7s %12s  %s\n",
+            CORE_PROF_TOP_PCS, "cycles", "%", "count", "address");
+    n = core_prof__sort(idx, prof->pc_count, prof->pc_cycles, 65536);
+    for(k = 0; k < n && k < CORE_PROF_TOP_PCS; ++k) {
+        d = &core_cpu_dtab[core_mmu_readw(cpu->mmu, idx[k])];
+        name[0] = '\0';
+        if(syms != NULL)
+            core_sym_format(syms, idx[k], name, sizeof(name));
+        line = syms != NULL ? core_sym_line(syms, idx[k]) : 0;
+        fprintf(fp, "%12llu %6.2f%% %12llu  %04x  %-5s %-10s %s",
+                (unsigned long long)prof->pc_cycles[idx[k]],
+                core_prof__percent(prof->pc_cycles[idx[k]], cycles),
+                (unsigned long long)prof->pc_count[idx[k]],
+                idx[k], instrnam[d->opcode],
+                (d->flags & DEC_VOID) ? "" : core_prof_am_names[d->mode],
+                name);
+        if(line)
+            fprintf(fp, " (%s:%d)", syms->source ? syms->source : "", line);
+        fputc('\n', fp);
+    }
+
+    free(idx);
+}
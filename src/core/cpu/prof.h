@@ -0,0 +1,116 @@
+/*
+ * core/cpu/prof.h -- Guest code profiler (header).
+ *
+ * Counts the instructions executed and the cycles they took, by opcode, by
+ * addressing mode and by address. Can also sample the guest's call stack
+ * every so many cycles, following calls, returns and interrupts, and write
+ * the samples out as folded stacks for flame graph tools. Only the profiling
+ * run functions in core.c record anything, so the engines pay nothing for it
+ * when it is off.
+ *
+ */
+
+#ifndef QPRA_CORE_PROF_H
+#define QPRA_CORE_PROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "core/cpu/cpu.h"
+
+struct core_syms;
+
+/* Number of addresses listed in a report. */
+#define CORE_PROF_TOP_PCS 64
+/* Longest name of an address written. */
+#define CORE_PROF_NAME_LEN 80
+
+/* Cycles between call stack samples, unless given on the command line. */
+#define CORE_PROF_SAMPLE_CYCLES 1000
+/* Calls deeper than this, or past this many distinct stacks, go unsampled. */
+#define CORE_PROF_MAX_DEPTH 256
+#define CORE_PROF_MAX_NODES (1 << 20)
+/* Set in a frame entered through an interrupt rather than a call. */
+#define CORE_PROF_INT 0x10000
+
+/*
+ * A node of the calling context tree, which has one node for each distinct
+ * call stack seen. Node 0 is the root, the code run from reset.
+ */
+struct core_prof_node
+{
+    /* Address entered, with CORE_PROF_INT if through an interrupt. */
+    uint32_t frame;
+    int depth;
+    /* Indices of the caller, first callee and next sibling; 0 if none. */
+    int parent;
+    int child;
+    int sibling;
+    uint64_t samples;
+};
+
+struct core_prof
+{
+    uint64_t op_count[NUM_INSTRS];
+    uint64_t op_cycles[NUM_INSTRS];
+    uint64_t am_count[16];
+    uint64_t am_cycles[16];
+    uint64_t pc_count[65536];
+    uint64_t pc_cycles[65536];
+    /* Interrupts entered, and the cycles spent entering them. */
+    uint64_t int_count;
+    uint64_t int_cycles;
+
+    /* Cycles between call stack samples, or 0 not to sample. */
+    int sample_cycles;
+    /* Cycles left until the next sample. */
+    int sample_left;
+    struct core_prof_node *nodes;
+    int num_nodes;
+    int max_nodes;
+    /* Node of the code now running. */
+    int cur;
+    /* Frames entered which had no room in the tree, and are not yet left. */
+    int lost;
+};
+
+void core_prof_track(struct core_prof *, struct core_cpu *, uint16_t, int);
+void core_prof_track_interrupt(struct core_prof *, struct core_cpu *, int);
+
+/*
+ * Record the instruction just run by the CPU from pc, which took the given
+ * number of cycles; s is the stack pointer it started with.
+ */
+static inline void core_prof_instr(struct core_prof *prof,
+        struct core_cpu *cpu, uint16_t pc, uint16_t s, int cycles)
+{
+    struct core_instr_decoded *d = cpu->d;
+
+    prof->op_count[d->opcode] += 1;
+    prof->op_cycles[d->opcode] += cycles;
+    prof->am_count[d->mode] += 1;
+    prof->am_cycles[d->mode] += cycles;
+    prof->pc_count[pc] += 1;
+    prof->pc_cycles[pc] += cycles;
+    if(prof->sample_cycles)
+        core_prof_track(prof, cpu, s, cycles);
+}
+
+/* Record the interrupt the CPU has just entered, in the given cycles. */
+static inline void core_prof_interrupt(struct core_prof *prof,
+        struct core_cpu *cpu, int cycles)
+{
+    prof->int_count += 1;
+    prof->int_cycles += cycles;
+    if(prof->sample_cycles)
+        core_prof_track_interrupt(prof, cpu, cycles);
+}
+
+/* Function declarations. */
+int core_prof_init(struct core_prof **, int);
+void core_prof_report(struct core_prof *, struct core_cpu *,
+        struct core_syms *, FILE *);
+void core_prof_folded(struct core_prof *, struct core_syms *, FILE *);
+void core_prof_destroy(struct core_prof *);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * core/cpu/threaded.c -- Threaded-code CPU interpreter.
+ *
+ * Executes instructions back to back for a budget of cycles. Each handler
+ * ends by dispatching directly to the next instruction's, using GCC's
+ * labels-as-values where available and a plain switch otherwise. The
+ * register file and pending flags are kept in locals for the duration of a
+ * run.
+ *
+ */
+
+#include <string.h>
+
+#include "core/cpu/cpu.h"
+#include "core/cpu/alu.h"
+#include "core/cpu/isa.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+#if defined(__GNUC__) && !defined(CORE_CPU_NO_COMPUTED_GOTO)
+#define CORE_CPU_THREADED
+#endif
+
+/*
+ * Each non-void instruction has a handler specialized for its addressing
+ * mode and, where it matters, operand size, generated from the tables in
+ * isa.h. Dispatch goes by CORE_ISA_HANDLER() of the decoded instruction.
+ */
+#ifdef CORE_CPU_THREADED
+#define T_DISPATCH()                                                        \
+    goto *labels[CORE_ISA_HANDLER(d->opcode, d->mode, d->size)]
+#define T_ENTRY(op)                     l_##op:
+#define T_ENTRY_ANY(op, mode)           l_##op##_##mode:
+#define T_ENTRY_SIZED(op, mode, size)   l_##op##_##mode##_##size:
+#else
+#define T_DISPATCH()    goto l_switch
+#define T_ENTRY(op)     CORE_ISA_MODES(T_CASES, op)
+#define T_ENTRY_ANY(op, mode)                                               \
+    case CORE_ISA_HANDLER(op, mode, OP_16):                                 \
+    case CORE_ISA_HANDLER(op, mode, OP_8):
+#define T_ENTRY_SIZED(op, mode, size)                                       \
+    case CORE_ISA_HANDLER(op, mode, size):
+#define T_CASES(mode, mn, len, cyc, sa, sb, dst, sz, op)                    \
+    T_ENTRY_ANY(op, mode)
+#endif
+
+/* Memory operand access, by operand size. */
+#define T_READ(size, a)     ((size) == OP_16 ? core_mmu_readw(mmu, (a)) :  \
+                                               core_mmu_readb(mmu, (a)))
+#define T_WRITE(size, a, v) ((size) == OP_16 ?                              \
+                             core_mmu_writew(mmu, (a), (v)) :               \
+                             core_mmu_writeb(mmu, (a), (v)))
+
+/*
+ * Decode the next instruction and go to its handler, unless the budget is
+ * spent or an interrupt needs entering first.
+ */
+#define T_NEXT()                                                            \
+    do {                                                                    \
+        if(cycles >= budget)                                                \
+            goto l_exit;                                                    \
+        if(core_cpu_int_due(cpu, r[R_F]))                                   \
+            goto l_interrupt;                                               \
+        op = core_mmu_readw(mmu, r[R_P]);                                   \
+        d = &core_cpu_dtab[op];                                             \
+        if(d->flags & DEC_HAS_DATA) {                                       \
+            t = core_mmu_readw(mmu, r[R_P] + 2);                            \
+            i->db0 = B_LO(t);                                               \
+            if(d->flags & DEC_HAS_DW)                                       \
+                i->db1 = B_HI(t);                                           \
+        }                                                                   \
+        r[R_P] += d->len;                                                   \
+        cycles += d->cycles;                                                \
+        if(d->flags & DEC_READS_F)                                          \
+            core_alu_sync(&r[R_F], &lf);                                    \
+        T_DISPATCH();                                                       \
+    } while(0)
+
+/* Operand sources and result destinations, as named in CORE_ISA_MODES. */
+#define T_SRC_RX(v, size)       v = r[d->rx];
+#define T_SRC_RY(v, size)       v = r[d->ry];
+#define T_SRC_MRX(v, size)      v = T_READ(size, r[d->rx]);
+#define T_SRC_MRY(v, size)      v = T_READ(size, r[d->ry]);
+#define T_SRC_D8(v, size)       v = INSTR_D8(i);
+#define T_SRC_D16(v, size)      v = INSTR_D16(i);
+#define T_SRC_MD16(v, size)     v = T_READ(size, INSTR_D16(i));
+#define T_SRC_ZERO(v, size)     v = 0;
+
+#define T_DST_RX(size)          r[d->rx] = a;
+#define T_DST_RXY(size)         r[d->rx] = a; r[d->ry] = b;
+#define T_DST_MRX(size)         T_WRITE(size, r[d->rx], a);
+#define T_DST_MD16_RY(size)     T_WRITE(size, INSTR_D16(i), r[d->ry]);
+#define T_DST_NONE(size)
+
+/*
+ * Write the result back to the destination. Flags still pending are dropped
+ * if that overwrote F.
+ */
+#define T_STORE(dst, size)                                                  \
+    T_DST_##dst(size)                                                       \
+    if(d->flags & DEC_WRITES_F)                                             \
+        lf.mask = 0;
+
+#define T_KIND_ALU(mn, flag, dst, size)                                     \
+    a = core_alu_##mn(&lf, a, b);                                           \
+    T_STORE(dst, size)
+
+/* A jump taken backwards may close a loop which only waits; see idle.c. */
+#define T_KIND_JUMP(mn, flag, dst, size)                                    \
+    if(r[R_F] & (flag) || !(flag)) {                                        \
+        t = r[R_P] - d->len;                                                \
+        r[R_P] = a;                                                         \
+        T_STORE(dst, size)                                                  \
+        if(r[R_P] <= t)                                                     \
+            cycles += core_cpu_idle(cpu, r, &lf, t, cycles, budget);        \
+    } else {                                                                \
+        T_STORE(dst, size)                                                  \
+    }
+
+/* A call taken may be to a library routine run natively; see hle.c. */
+#define T_KIND_CALL(mn, flag, dst, size)                                    \
+    if(r[R_F] & (flag) || !(flag)) {                                        \
+        r[R_S] -= 2;                                                        \
+        core_mmu_writew(mmu, r[R_S], r[R_P]);                               \
+        r[R_P] = a;                                                         \
+        T_STORE(dst, size)                                                  \
+        if(cpu->hle)                                                        \
+            cycles += core_cpu_hle(cpu, r, &lf);                            \
+    } else {                                                                \
+        T_STORE(dst, size)                                                  \
+    }
+
+/* One specialized handler. */
+#define T_HANDLER(kind, mn, flag, sa, sb, dst, size)                        \
+    T_SRC_##sa(a, size)                                                     \
+    T_SRC_##sb(b, size)                                                     \
+    T_KIND_##kind(mn, flag, dst, size)                                      \
+    T_NEXT();
+
+/* Generate the handlers of every non-void instruction. */
+#define T_GEN_INSTR(op, mn, kind, flag)     T_GEN_##kind(op, mn, flag)
+#define T_GEN_VOID(op, mn, flag)
+#define T_GEN_JUMP(op, mn, flag)                                            \
+    CORE_ISA_MODES(T_GEN_MODE, op, JUMP, mn, flag)
+#define T_GEN_CALL(op, mn, flag)                                            \
+    CORE_ISA_MODES(T_GEN_MODE, op, CALL, mn, flag)
+#define T_GEN_ALU(op, mn, flag)                                             \
+    CORE_ISA_MODES(T_GEN_MODE, op, ALU, mn, flag)
+#define T_GEN_MODE(mode, mmn, len, cyc, sa, sb, dst, sz, op, kind, mn, flag)\
+    T_GEN_##sz(op, mode, kind, mn, flag, sa, sb, dst)
+#define T_GEN_BOTH(op, mode, kind, mn, flag, sa, sb, dst)                   \
+    T_ENTRY_SIZED(op, mode, OP_16)                                          \
+        T_HANDLER(kind, mn, flag, sa, sb, dst, OP_16)                       \
+    T_ENTRY_SIZED(op, mode, OP_8)                                           \
+        T_HANDLER(kind, mn, flag, sa, sb, dst, OP_8)
+#define T_GEN_ANY(op, mode, kind, mn, flag, sa, sb, dst)                    \
+    T_ENTRY_ANY(op, mode)                                                   \
+        T_HANDLER(kind, mn, flag, sa, sb, dst, OP_16)
+#define T_GEN_NONE(op, mode, kind, mn, flag, sa, sb, dst)
+
+/* The dispatch table, in CORE_ISA_HANDLER() order. */
+#define T_LABELS_INSTR(op, mn, kind, flag)                                  \
+    CORE_ISA_MODES(T_LABELS_MODE, op, kind)
+#define T_LABELS_MODE(mode, mn, len, cyc, sa, sb, dst, sz, op, kind)        \
+    T_LABELS_##kind(op, mode, sz)
+#define T_LABELS_VOID(op, mode, sz)     &&l_##op, &&l_##op,
+#define T_LABELS_JUMP(op, mode, sz)     T_LABELS_##sz(op, mode)
+#define T_LABELS_CALL(op, mode, sz)     T_LABELS_##sz(op, mode)
+#define T_LABELS_ALU(op, mode, sz)      T_LABELS_##sz(op, mode)
+#define T_LABELS_BOTH(op, mode)                                             \
+    &&l_##op##_##mode##_OP_16, &&l_##op##_##mode##_OP_8,
+#define T_LABELS_ANY(op, mode)          &&l_##op##_##mode, &&l_##op##_##mode,
+#define T_LABELS_NONE(op, mode)         &&l_invalid, &&l_invalid,
+
+/*
+ * Run instructions until at least the given number of cycles have been
+ * spent, entering interrupts as they become pending. The other devices are
+ * not advanced; returns the number of cycles the caller must catch them up
+ * on.
+ */
+int core_cpu_t_run(struct core_cpu *cpu, int budget)
+{
+#ifdef CORE_CPU_THREADED
+    static const void *labels[CORE_ISA_NUM_HANDLERS] = {
+        CORE_ISA_INSTRS(T_LABELS_INSTR)
+    };
+#endif
+    struct core_mmu *mmu = cpu->mmu;
+    struct core_instr *i = cpu->i;
+    struct core_instr_decoded *d = cpu->d;
+    uint16_t r[NUM_REGS];
+    struct core_lazy_flags lf = cpu->lf;
+    uint16_t op = i->ib0 | (i->ib1 << 8);
+    uint16_t a, b, t;
+    int cycles = 0;
+
+    memcpy(r, cpu->r, sizeof(r));
+    T_NEXT();
+
+#ifndef CORE_CPU_THREADED
+l_switch:
+    switch(CORE_ISA_HANDLER(d->opcode, d->mode, d->size)) {
+#endif
+    T_ENTRY(OP_NOP)
+        T_NEXT();
+    T_ENTRY(OP_INT)
+        r[R_S] -= 2;
+        core_mmu_writew(mmu, r[R_S], r[R_P]);
+        cpu->ahead = cycles - d->cycles;
+        core_cpu_int_raise(cpu, INT_USER_IRQ);
+        r[R_S] -= 2;
+        core_mmu_writew(mmu, r[R_S], r[R_F]);
+        r[R_P] = core_mmu_readw(mmu, 0xfffe);
+        T_NEXT();
+    T_ENTRY(OP_RTI)
+        r[R_P] = core_mmu_readw(mmu, r[R_S]);
+        r[R_S] += 2;
+        r[R_F] = core_mmu_readw(mmu, r[R_S]);
+        lf.mask = 0;
+        r[R_S] += 2;
+        if(cpu->intstat != NULL)
+            core_cpu_intstat_leave(cpu, cycles);
+        T_NEXT();
+    T_ENTRY(OP_RTS)
+        r[R_P] = core_mmu_readw(mmu, r[R_S]);
+        r[R_S] += 2;
+        T_NEXT();
+    CORE_ISA_INSTRS(T_GEN_INSTR)
+#ifndef CORE_CPU_THREADED
+    default:
+        goto l_invalid;
+    }
+#endif
+
+l_invalid:
+    /* The per-cycle state machine cannot execute these either. */
+    LOGE("core.cpu: invalid addressing mode %d", d->mode);
+    T_NEXT();
+
+l_interrupt:
+    memcpy(cpu->r, r, sizeof(r));
+    cpu->lf = lf;
+    cpu->ahead = cycles;
+    cycles += core_cpu_i_interrupt(cpu);
+    memcpy(r, cpu->r, sizeof(r));
+    lf = cpu->lf;
+    T_NEXT();
+
+l_exit:
+    memcpy(cpu->r, r, sizeof(r));
+    cpu->lf = lf;
+    i->ib0 = B_LO(op);
+    i->ib1 = B_HI(op);
+    cpu->d = d;
+    cpu->i_cycles = d->cycles;
+    cpu->i_done = 1;
+
+    return cycles;
+}
@@ -0,0 +1,262 @@
+/*
+ * core/cpu/tier.c -- Tiered execution.
+ *
+ * Blocks are counted by the address they are entered at, which is where the
+ * block cache and the recompiler would start decoding one. A block which
+ * cannot be cached or translated there, or on a host without a recompiler,
+ * is kept at the highest tier that could run it.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/cpu/tier.h"
+#include "log.h"
+
+static const char *core_tier_names[TIER_NUM] = {
+    [TIER_INTERP] = "interp", [TIER_BLOCK] = "block", [TIER_JIT] = "jit"
+};
+
+int core_tier_init(struct core_tier **ptier, uint32_t block, uint32_t jit)
+{
+    struct core_tier *t;
+
+    t = *ptier = calloc(1, sizeof(struct core_tier));
+    if(t == NULL) {
+        LOGE("core.cpu: could not allocate tier counters");
+        return 0;
+    }
+    /* A lower one for the recompiler skips the block cache. */
+    t->threshold[TIER_BLOCK] = block < jit ? block : jit;
+    t->threshold[TIER_JIT] = jit;
+    memset(t->top, TIER_NUM - 1, sizeof(t->top));
+    return 1;
+}
+
+void core_tier_destroy(struct core_tier *t)
+{
+    free(t);
+}
+
+/* Raise the block at an address as far as its entries allow. */
+static int core_tier__promote(struct core_tier *t, uint16_t pc)
+{
+    int level = t->level[pc];
+
+    while(level < t->top[pc] && t->entries[pc] >= t->threshold[level + 1])
+        ++level;
+    if(level != t->level[pc]) {
+        t->level[pc] = level;
+        t->stats[level].promoted += 1;
+    }
+    return level;
+}
+
+/* Keep the block at an address below a tier which cannot run it. */
+static int core_tier__cap(struct core_tier *t, uint16_t pc, int level)
+{
+    t->stats[t->level[pc]].demoted += 1;
+    t->level[pc] = t->top[pc] = level;
+    return level;
+}
+
+/*
+ * Interpret one block, up to and including the next control transfer, having
+ * run the given number of cycles out of the budget so far. As the block
+ * cache does, stops early at the first instruction boundary at or past the
+ * budget. Returns the cycles taken.
+ */
+static int core_cpu_tier__interp(struct core_cpu *cpu, int cycles, int budget)
+{
+    uint16_t start = cpu->r[R_P], last = start;
+    int n = 0, k;
+
+    cpu->block_exit = 0;
+    for(k = 0; k < CORE_TIER_MAX_INSTRS && !cpu->block_exit &&
+               cycles + n < budget; ++k) {
+        last = cpu->r[R_P];
+        cpu->ahead = cycles + n;
+        n += core_cpu_i_exec(cpu);
+        if(cpu->d->flags & DEC_ENDS_BLOCK) {
+            /* A block jumping back to its start may only be waiting. */
+            if(cpu->r[R_P] == start)
+                n += core_cpu_idle(cpu, cpu->r, &cpu->lf, last, cycles + n,
+                                   budget);
+            break;
+        }
+    }
+    return n;
+}
+
+/*
+ * Run blocks, each through the tier it has reached, until at least the given
+ * number of cycles have been spent, entering interrupts between blocks. Each
+ * tier leaves a block once the budget is spent, so an interrupt raised at
+ * the end of it is entered where the threaded engine enters it. As with
+ * core_cpu_t_run(), returns the number of cycles the other devices must be
+ * caught up on.
+ */
+int core_cpu_tier_run(struct core_cpu *cpu, int budget)
+{
+    struct core_tier *t;
+    uint16_t pc;
+    int cycles = 0, level, n = 0;
+
+    if(cpu->tier == NULL && !core_tier_init(&cpu->tier, CORE_TIER_BLOCK,
+                                            CORE_TIER_JIT)) {
+        LOGW("core.cpu: falling back to the threaded engine");
+        cpu->engine = CPU_ENGINE_THREADED;
+        return core_cpu_t_run(cpu, budget);
+    }
+    t = cpu->tier;
+
+    while(cycles < budget) {
+        if(core_cpu_int_due(cpu, cpu->r[R_F])) {
+            cpu->ahead = cycles;
+            cycles += core_cpu_i_interrupt(cpu);
+            continue;
+        }
+        pc = cpu->r[R_P];
+        level = t->level[pc];
+        if(level < t->top[pc] && ++t->entries[pc] >= t->threshold[level + 1])
+            level = core_tier__promote(t, pc);
+
+        if(level == TIER_JIT) {
+            n = core_cpu_j_step(cpu, cycles, budget);
+            if(n < 0)
+                level = core_tier__cap(t, pc, TIER_BLOCK);
+        }
+        if(level == TIER_BLOCK) {
+            n = core_cpu_b_step(cpu, cycles, budget);
+            if(n < 0)
+                level = core_tier__cap(t, pc, TIER_INTERP);
+        }
+        if(level == TIER_INTERP)
+            n = core_cpu_tier__interp(cpu, cycles, budget);
+
+        t->stats[level].entries += 1;
+        t->stats[level].cycles += n;
+        cycles += n;
+    }
+
+    return cycles;
+}
+
+/*
+ * As core_cpu_tier__interp(), for core_cpu_tier_probe(), passing each
+ * instruction to the given function as it is run.
+ */
+static int core_cpu_tier__interp_probe(struct core_cpu *cpu,
+        core_cpu_probe_fn fn, void *data)
+{
+    uint16_t pc, s;
+    int n = 0, k, i, stop = 0;
+
+    cpu->block_exit = 0;
+    for(i = 0; i < CORE_TIER_MAX_INSTRS && !cpu->block_exit && !stop; ++i) {
+        pc = cpu->r[R_P];
+        s = cpu->r[R_S];
+        cpu->ahead = n;
+        k = core_cpu_i_exec(cpu);
+        n += k;
+        stop = fn(data, pc, s, k) || (cpu->d->flags & DEC_ENDS_BLOCK);
+    }
+    return n;
+}
+
+/*
+ * Run the block at the program counter through the tier it has reached, as
+ * core_cpu_tier_run() would, for core_run_slice_probe(), passing each
+ * instruction to the given function as it is run. Returns the cycles taken.
+ */
+int core_cpu_tier_probe(struct core_cpu *cpu, core_cpu_probe_fn fn,
+        void *data)
+{
+    struct core_tier *t;
+    uint16_t pc = cpu->r[R_P];
+    int level, n = -1;
+
+    if(cpu->tier == NULL && !core_tier_init(&cpu->tier, CORE_TIER_BLOCK,
+                                            CORE_TIER_JIT))
+        return -1;
+    t = cpu->tier;
+
+    level = t->level[pc];
+    if(level < t->top[pc] && ++t->entries[pc] >= t->threshold[level + 1])
+        level = core_tier__promote(t, pc);
+
+    if(level == TIER_JIT) {
+        n = core_cpu_j_probe(cpu, fn, data);
+        if(n < 0)
+            level = core_tier__cap(t, pc, TIER_BLOCK);
+    }
+    if(level == TIER_BLOCK) {
+        n = core_cpu_b_probe(cpu, fn, data);
+        if(n < 0)
+            level = core_tier__cap(t, pc, TIER_INTERP);
+    }
+    if(level == TIER_INTERP)
+        n = core_cpu_tier__interp_probe(cpu, fn, data);
+
+    t->stats[level].entries += 1;
+    t->stats[level].cycles += n;
+    return n;
+}
+
+/*
+ * Send the blocks which may cover the page of an address back to the
+ * interpreter, its code having been written. A block is at most
+ * CORE_TIER_MAX_INSTRS instructions long, which is less than a page, so only
+ * those entered in that page and the one before can.
+ */
+void core_cpu_tier_invalidate(struct core_cpu *cpu, uint16_t a)
+{
+    struct core_tier *t = cpu->tier;
+    uint32_t pc, from = (a & 0xff00) >= 0x100 ? (a & 0xff00) - 0x100 : 0;
+
+    if(t == NULL)
+        return;
+    for(pc = from; pc <= (a | 0xff); ++pc) {
+        if(t->level[pc] != TIER_INTERP) {
+            t->stats[t->level[pc]].demoted += 1;
+            t->level[pc] = TIER_INTERP;
+        }
+        t->top[pc] = TIER_NUM - 1;
+        t->entries[pc] = 0;
+    }
+}
+
+void core_tier_report(struct core_tier *t, FILE *fp)
+{
+    struct core_tier_stats *s;
+    uint64_t entries = 0, cycles = 0;
+    int blocks[TIER_NUM] = { 0 }, n;
+    uint32_t pc;
+
+    for(pc = 0; pc < 65536; ++pc) {
+        if(t->level[pc] != TIER_INTERP || t->entries[pc] != 0)
+            blocks[t->level[pc]] += 1;
+    }
+    for(n = 0; n < TIER_NUM; ++n) {
+        entries += t->stats[n].entries;
+        cycles += t->stats[n].cycles;
+    }
+
+    fprintf(fp, "Promoted to block after %lu entries, to jit after %lu\n",
+            (unsigned long)t->threshold[TIER_BLOCK],
+            (unsigned long)t->threshold[TIER_JIT]);
+    fprintf(fp, "%-8s %8s %10s %10s %14s %7s %14s %7s\n", "tier", "blocks",
+            "promoted", "demoted", "entries", "%", "cycles", "%");
+    for(n = 0; n < TIER_NUM; ++n) {
+        s = &t->stats[n];
+        fprintf(fp, "%-8s %8d %10llu %10llu %14llu %6.2f%% %14llu %6.2f%%\n",
+                core_tier_names[n], blocks[n],
+                (unsigned long long)s->promoted,
+                (unsigned long long)s->demoted,
+                (unsigned long long)s->entries,
+                entries ? 100.0 * s->entries / entries : 0.0,
+                (unsigned long long)s->cycles,
+                cycles ? 100.0 * s->cycles / cycles : 0.0);
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * core/cpu/tier.h -- Tiered execution (header).
+ *
+ * The tiered engine runs each block through the interpreter at first, and
+ * counts how often each address is entered. Past a number of entries, a
+ * block is promoted to the block cache, and past another to the recompiler,
+ * so that code run once at start-up is not decoded or translated for
+ * nothing while hot loops still reach the fastest engine. Blocks whose code
+ * is written go back to the interpreter and are counted afresh.
+ *
+ */
+
+#ifndef QPRA_CORE_TIER_H
+#define QPRA_CORE_TIER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "core/cpu/cpu.h"
+
+/* Entries before a block is promoted to each tier, unless given. */
+#define CORE_TIER_BLOCK 16
+#define CORE_TIER_JIT   512
+
+/* Longest block run through the interpreter, as in the block cache. */
+#define CORE_TIER_MAX_INSTRS 64
+
+/* Engines a block may be run by, from slowest to start to fastest. */
+enum core_tier_level
+{
+    TIER_INTERP, TIER_BLOCK, TIER_JIT, TIER_NUM
+};
+
+struct core_tier_stats
+{
+    /* Blocks promoted to the tier, and those since demoted from it. */
+    uint64_t promoted;
+    uint64_t demoted;
+    /* Blocks run by the tier, and the cycles they took. */
+    uint64_t entries;
+    uint64_t cycles;
+};
+
+struct core_tier
+{
+    /* Entries before a block is promoted to each tier; 0 for the first. */
+    uint32_t threshold[TIER_NUM];
+
+    /*
+     * Tier of the block at each address, the highest it may reach, and the
+     * entries counted towards the next. Addresses in the swappable segments
+     * are counted alike whichever bank is in; the block cache and the
+     * recompiler tell the banks apart themselves.
+     */
+    uint8_t level[65536];
+    uint8_t top[65536];
+    uint32_t entries[65536];
+
+    struct core_tier_stats stats[TIER_NUM];
+};
+
+/* Function declarations. */
+int core_tier_init(struct core_tier **, uint32_t, uint32_t);
+void core_tier_report(struct core_tier *, FILE *);
+void core_tier_destroy(struct core_tier *);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * core/dbg/break.c -- Breakpoints, watchpoints and the monitor.
+ *
+ * When emulation stops, the monitor takes commands from standard input:
+ *
+ *     c                   carry on
+ *     s                   run one instruction
+ *     r                   show the registers
+ *     x <addr> [n]        show n bytes of memory
+ *     b <addr>            stop before the instruction at an address
+ *     bc <addr>           clear a breakpoint
+ *     w <addr> [n] [rw]   stop after a read or write of n bytes at an address
+ *     wc <addr>           clear the watchpoint at an address
+ *     l                   list breakpoints and watchpoints
+ *     q                   end emulation
+ *
+ * Addresses are in hex, with or without a leading $ or 0x, or labels from the
+ * symbol map. A watchpoint sees every access through the MMU, instruction
+ * fetches included.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/core.h"
+#include "core/cpu/alu.h"
+#include "core/cpu/cpu.h"
+#include "core/dbg/break.h"
+#include "core/dbg/sym.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+/* Longest command line read, and most bytes shown at once. */
+#define CORE_BREAK_LINE_LEN 256
+#define CORE_BREAK_MAX_DUMP 256
+
+static const char *core_break_regs[NUM_REGS] = {
+    "a", "b", "c", "d", "e", "p", "s", "f"
+};
+
+/*
+ * Mark the pages the watchpoints cover in the MMU, with the accesses; all of
+ * them while the code/data logger is on, as it sees every access.
+ */
+static void core_break__pages(struct core_break *brk, struct core_mmu *mmu)
+{
+    struct core_watch *w;
+    int k, page;
+
+    memset(mmu->watch_pages, mmu->cov != NULL ? BREAK_READ | BREAK_WRITE : 0,
+           sizeof(mmu->watch_pages));
+    for(k = 0; k < brk->num_watches; ++k) {
+        w = &brk->watches[k];
+        for(page = w->addr >> 8; page <= (w->addr + w->len - 1) >> 8; ++page)
+            mmu->watch_pages[page & 0xff] |= w->kind;
+    }
+}
+
+/* Set up the breakpoints of a system, marking the MMU's pages to watch. */
+int core_break_init(struct core_break **pbrk, struct core_mmu *mmu)
+{
+    *pbrk = calloc(1, sizeof(struct core_break));
+    if(*pbrk == NULL) {
+        LOGE("Could not allocate breakpoints");
+        return 0;
+    }
+    mmu->brk = *pbrk;
+    core_break__pages(*pbrk, mmu);
+    return 1;
+}
+
+void core_break_destroy(struct core_break *brk)
+{
+    free(brk);
+}
+
+void core_break_set(struct core_break *brk, uint16_t a)
+{
+    if(!core_break_at(brk, a)) {
+        brk->pc[a >> 3] |= 1 << (a & 7);
+        brk->num_pcs += 1;
+    }
+}
+
+void core_break_clear(struct core_break *brk, uint16_t a)
+{
+    if(core_break_at(brk, a)) {
+        brk->pc[a >> 3] &= ~(1 << (a & 7));
+        brk->num_pcs -= 1;
+    }
+}
+
+/*
+ * Watch len bytes from an address for the given accesses, dropping code
+ * translated to access memory directly. Returns 0 if there are too many
+ * watchpoints already.
+ */
+int core_break_watch(struct core_break *brk, struct core_mmu *mmu, uint16_t a,
+        uint16_t len, int kind)
+{
+    struct core_watch *w;
+
+    if(brk->num_watches == CORE_BREAK_MAX_WATCHES)
+        return 0;
+    w = &brk->watches[brk->num_watches++];
+    w->addr = a;
+    w->len = len;
+    w->kind = kind;
+    core_break__pages(brk, mmu);
+    if(mmu->cpu != NULL)
+        core_cpu_j_flush(mmu->cpu);
+    return 1;
+}
+
+/* Stop watching from an address. Returns 0 if nothing was. */
+int core_break_unwatch(struct core_break *brk, struct core_mmu *mmu,
+        uint16_t a)
+{
+    int k;
+
+    for(k = 0; k < brk->num_watches; ++k) {
+        if(brk->watches[k].addr == a)
+            break;
+    }
+    if(k == brk->num_watches)
+        return 0;
+    brk->watches[k] = brk->watches[--brk->num_watches];
+    core_break__pages(brk, mmu);
+    return 1;
+}
+
+/*
+ * Called by the MMU on an access to a page with watchpoints for that kind of
+ * access; stops emulation once the instruction is done if one covers it.
+ */
+void core_break_access(struct core_break *brk, uint16_t a, uint8_t v,
+        int kind)
+{
+    struct core_watch *w;
+    int k;
+
+    if(brk->reason != BREAK_NONE)
+        return;
+    for(k = 0; k < brk->num_watches; ++k) {
+        w = &brk->watches[k];
+        if((w->kind & kind) && (uint16_t)(a - w->addr) < w->len) {
+            brk->reason = BREAK_WATCH;
+            brk->addr = a;
+            brk->kind = kind;
+            brk->value = v;
+            return;
+        }
+    }
+}
+
+/* Clear every breakpoint and watchpoint. */
+void core_break_reset(struct core_break *brk, struct core_mmu *mmu)
+{
+    memset(brk->pc, 0, sizeof(brk->pc));
+    brk->num_pcs = 0;
+    brk->num_watches = 0;
+    brk->step = 0;
+    core_break__pages(brk, mmu);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Parse an address, as a label or in hex. Returns 0 if it is neither. */
+static int core_break__addr(struct core_system *core, const char *str,
+        uint16_t *a)
+{
+    struct core_sym *sym;
+    char *end;
+    long v;
+
+    if(core->syms != NULL && (sym = core_sym_lookup(core->syms, str))) {
+        *a = sym->addr;
+        return 1;
+    }
+    if(str[0] == '$')
+        ++str;
+    v = strtol(str, &end, 16);
+    if(end == str || *end != '\0' || v < 0 || v > 0xffff)
+        return 0;
+    *a = v;
+    return 1;
+}
+
+/* Show the registers, with the flags worked out. */
+static void core_break__regs(struct core_cpu *cpu)
+{
+    struct core_lazy_flags lf = cpu->lf;
+    uint16_t f = cpu->r[R_F];
+    int k;
+
+    core_alu_sync(&f, &lf);
+    for(k = 0; k < NUM_REGS; ++k)
+        printf("%s=%04x ", core_break_regs[k], k == R_F ? f : cpu->r[k]);
+    printf("[%c%c%c%c%c] cycles=%llu\n",
+           f & FLAG_I ? 'I' : '-', f & FLAG_N ? 'N' : '-',
+           f & FLAG_O ? 'O' : '-', f & FLAG_C ? 'C' : '-',
+           f & FLAG_Z ? 'Z' : '-', (unsigned long long)cpu->total_cycles);
+}
+
+/* Show the instruction at an address, by name and bytes. */
+static void core_break__instr(struct core_system *core, uint16_t a)
+{
+    struct core_mmu *mmu = core->mmu;
+    struct core_instr_decoded *d;
+    char name[80];
+    int k;
+
+    d = &core_cpu_dtab[core_mmu_readw(mmu, a)];
+    core_sym_format(core->syms, a, name, sizeof(name));
+    printf("%s ($%04x): %-4s", name, a, instrnam[d->opcode]);
+    for(k = 0; k < d->len; ++k)
+        printf(" %02x", core_mmu_readb(mmu, a + k));
+    printf("\n");
+}
+
+/* Say why emulation stopped. */
+static void core_break__stopped(struct core_system *core)
+{
+    struct core_break *brk = core->brk;
+    char name[80];
+
+    switch(brk->reason) {
+        case BREAK_EXEC:
+            printf("Breakpoint at ");
+            break;
+        case BREAK_WATCH:
+            core_sym_format(core->syms, brk->addr, name, sizeof(name));
+            if(brk->kind == BREAK_WRITE)
+                printf("Watchpoint: wrote $%02x to %s ($%04x)\n", brk->value,
+                       name, brk->addr);
+            else
+                printf("Watchpoint: read %s ($%04x)\n", name, brk->addr);
+            core_sym_format(core->syms, brk->at, name, sizeof(name));
+            printf("    by %s ($%04x); next is ", name, brk->at);
+            break;
+        default:
+            printf("Stopped at ");
+            break;
+    }
+    core_break__instr(core, core->cpu->r[R_P]);
+}
+
+static void core_break__list(struct core_system *core)
+{
+    struct core_break *brk = core->brk;
+    struct core_watch *w;
+    char name[80];
+    int a, k;
+
+    for(a = 0; a < 0x10000; ++a) {
+        if(core_break_at(brk, a)) {
+            core_sym_format(core->syms, a, name, sizeof(name));
+            printf("break %s ($%04x)\n", name, a);
+        }
+    }
+    for(k = 0; k < brk->num_watches; ++k) {
+        w = &brk->watches[k];
+        core_sym_format(core->syms, w->addr, name, sizeof(name));
+        printf("watch %s ($%04x), %d byte%s, %s%s\n", name, w->addr, w->len,
+               w->len == 1 ? "" : "s", w->kind & BREAK_READ ? "r" : "",
+               w->kind & BREAK_WRITE ? "w" : "");
+    }
+}
+
+static void core_break__dump(struct core_mmu *mmu, uint16_t a, int n)
+{
+    int k;
+
+    for(k = 0; k < n; ++k) {
+        if(k % 16 == 0)
+            printf("%s$%04x:", k ? "\n" : "", (uint16_t)(a + k));
+        printf(" %02x", core_mmu_readb(mmu, a + k));
+    }
+    printf("\n");
+}
+
+/*
+ * Stop emulation, and take commands from standard input until told to carry
+ * on. Returns 0 to end emulation.
+ */
+int core_break_monitor(struct core_system *core)
+{
+    struct core_break *brk = core->brk;
+    char line[CORE_BREAK_LINE_LEN], cmd[8], arg[CORE_BREAK_LINE_LEN], rw[4];
+    uint16_t a;
+    int n, len, kind, go = -1;
+
+    core_break__stopped(core);
+    while(go < 0) {
+        printf("(qpra) ");
+        fflush(stdout);
+        if(fgets(line, sizeof(line), stdin) == NULL) {
+            go = 0;
+            break;
+        }
+        n = sscanf(line, "%7s %255s %d %3s", cmd, arg, &len, rw);
+        if(n < 1)
+            continue;
+        if(n >= 2 && strcmp(cmd, "r") && strcmp(cmd, "c") &&
+           strcmp(cmd, "s") && strcmp(cmd, "l") && strcmp(cmd, "q") &&
+           !core_break__addr(core, arg, &a)) {
+            printf("No such address '%s'\n", arg);
+            continue;
+        }
+
+        if(!strcmp(cmd, "c")) {
+            go = 1;
+        } else if(!strcmp(cmd, "s")) {
+            brk->step = 1;
+            go = 1;
+        } else if(!strcmp(cmd, "r")) {
+            core_break__regs(core->cpu);
+        } else if(!strcmp(cmd, "x") && n >= 2) {
+            if(n < 3 || len <= 0)
+                len = 16;
+            if(len > CORE_BREAK_MAX_DUMP)
+                len = CORE_BREAK_MAX_DUMP;
+            core_break__dump(core->mmu, a, len);
+        } else if(!strcmp(cmd, "b") && n >= 2) {
+            core_break_set(brk, a);
+        } else if(!strcmp(cmd, "bc") && n >= 2) {
+            core_break_clear(brk, a);
+        } else if(!strcmp(cmd, "w") && n >= 2) {
+            if(n < 3 || len <= 0)
+                len = 1;
+            kind = BREAK_WRITE;
+            if(n == 4)
+                kind = (strchr(rw, 'r') ? BREAK_READ : 0) |
+                       (strchr(rw, 'w') ? BREAK_WRITE : 0);
+            if(!kind || len > 0xffff || len > 0x10000 - a)
+                printf("Bad watchpoint\n");
+            else if(!core_break_watch(brk, core->mmu, a, len, kind))
+                printf("Too many watchpoints\n");
+        } else if(!strcmp(cmd, "wc") && n >= 2) {
+            if(!core_break_unwatch(brk, core->mmu, a))
+                printf("No watchpoint at $%04x\n", a);
+        } else if(!strcmp(cmd, "l")) {
+            core_break__list(core);
+        } else if(!strcmp(cmd, "q")) {
+            go = 0;
+        } else {
+            printf("Commands: c, s, r, x <addr> [n], b <addr>, bc <addr>, "
+                   "w <addr> [n] [rw], wc <addr>, l, q\n");
+        }
+    }
+
+    /* The monitor's own reads may have hit a watchpoint. */
+    brk->reason = BREAK_NONE;
+    return go;
+}
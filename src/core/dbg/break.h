@@ -0,0 +1,87 @@
+/*
+ * core/dbg/break.h -- Breakpoints, watchpoints and the monitor (header).
+ *
+ * Breakpoints are a bitmap with a bit for each address, tested after each
+ * instruction by the run functions which step the CPU one instruction at a
+ * time; the core only uses those while something is armed. Watchpoints mark
+ * the pages they cover in the MMU, which looks further only on those pages.
+ *
+ */
+
+#ifndef QPRA_CORE_BREAK_H
+#define QPRA_CORE_BREAK_H
+
+#include <stdint.h>
+
+struct core_system;
+struct core_mmu;
+
+/* Most watchpoints set at once. */
+#define CORE_BREAK_MAX_WATCHES 16
+
+/* Accesses a watchpoint stops on, also kept per page by the MMU. */
+#define BREAK_READ      0x01
+#define BREAK_WRITE     0x02
+
+/* Why emulation stopped. */
+enum core_break_reason
+{
+    BREAK_NONE, BREAK_EXEC, BREAK_WATCH, BREAK_STEP, BREAK_PAUSE
+};
+
+struct core_watch
+{
+    uint16_t addr;
+    uint16_t len;
+    /* BREAK_READ, BREAK_WRITE or both. */
+    int kind;
+};
+
+struct core_break
+{
+    /* Bit a is set to stop before running the instruction at address a. */
+    uint8_t pc[65536 / 8];
+    int num_pcs;
+    struct core_watch watches[CORE_BREAK_MAX_WATCHES];
+    int num_watches;
+    /* Stop after the next instruction. */
+    int step;
+
+    /* Why emulation has stopped, if it has. */
+    enum core_break_reason reason;
+    /*
+     * Address of the access which hit a watchpoint, and of the instruction
+     * or interrupt entry which made it.
+     */
+    uint16_t addr;
+    uint16_t at;
+    /* BREAK_READ or BREAK_WRITE, and the value written. */
+    int kind;
+    uint8_t value;
+};
+
+/* Is there a breakpoint at the address? */
+static inline int core_break_at(struct core_break *brk, uint16_t a)
+{
+    return brk->pc[a >> 3] & (1 << (a & 7));
+}
+
+/* Does anything need the CPU stepped an instruction at a time? */
+static inline int core_break_armed(struct core_break *brk)
+{
+    return brk->num_pcs || brk->num_watches || brk->step;
+}
+
+/* Function declarations. */
+int core_break_init(struct core_break **, struct core_mmu *);
+void core_break_destroy(struct core_break *);
+void core_break_set(struct core_break *, uint16_t);
+void core_break_clear(struct core_break *, uint16_t);
+int core_break_watch(struct core_break *, struct core_mmu *, uint16_t,
+        uint16_t, int);
+int core_break_unwatch(struct core_break *, struct core_mmu *, uint16_t);
+void core_break_access(struct core_break *, uint16_t, uint8_t, int);
+void core_break_reset(struct core_break *, struct core_mmu *);
+int core_break_monitor(struct core_system *);
+
+#endif
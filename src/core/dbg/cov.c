@@ -0,0 +1,154 @@
+/*
+ * core/dbg/cov.c -- Code/data logger.
+ *
+ * The MMU passes on every access the CPU makes while logging; see
+ * core_mmu_readb(). Writes are logged at once. Reads are held until the
+ * instruction making them is done, when those of its own bytes are logged
+ * as fetches and the rest as data. Only the run functions which step the
+ * CPU an instruction at a time say when that is, so the core uses those
+ * while logging. Every page is marked watched meanwhile, which also keeps
+ * the recompiler from inlining accesses the MMU would not see.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/dbg/break.h"
+#include "core/dbg/cov.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+static const char core_cov_magic[4] = { 'Q', 'C', 'O', 'V' };
+
+#define CORE_COV_ROM_BANK (A_ROM_SWAP_END - A_ROM_SWAP + 1)
+#define CORE_COV_RAM_BANK (A_RAM_SWAP_END - A_RAM_SWAP + 1)
+
+int core_cov_init(struct core_cov **pcov, struct core_mmu *mmu)
+{
+    struct core_cov *cov;
+
+    cov = *pcov = calloc(1, sizeof(struct core_cov));
+    if(cov == NULL) {
+        LOGE("Could not allocate code/data log");
+        return 0;
+    }
+    cov->rom_banks = mmu->rom_s_total;
+    cov->ram_banks = mmu->ram_s_total;
+    cov->rom_s = calloc(cov->rom_banks, CORE_COV_ROM_BANK);
+    cov->ram_s = calloc(cov->ram_banks, CORE_COV_RAM_BANK);
+    if(cov->rom_s == NULL || cov->ram_s == NULL) {
+        LOGE("Could not allocate code/data log banks");
+        core_cov_destroy(cov);
+        return 0;
+    }
+    return 1;
+}
+
+void core_cov_destroy(struct core_cov *cov)
+{
+    free(cov->rom_s);
+    free(cov->ram_s);
+    free(cov);
+}
+
+/* Byte of the map for an address, in the bank switched in there now. */
+static uint8_t *core_cov__slot(struct core_cov *cov, struct core_mmu *mmu,
+        uint16_t a)
+{
+    if(a >= A_ROM_SWAP && a <= A_ROM_SWAP_END &&
+       mmu->rom_s_bank < cov->rom_banks)
+        return &cov->rom_s[mmu->rom_s_bank * CORE_COV_ROM_BANK +
+                           (a - A_ROM_SWAP)];
+    if(a >= A_RAM_SWAP && a <= A_RAM_SWAP_END &&
+       mmu->ram_s_bank < cov->ram_banks)
+        return &cov->ram_s[mmu->ram_s_bank * CORE_COV_RAM_BANK +
+                           (a - A_RAM_SWAP)];
+    return &cov->map[a];
+}
+
+/* Called by the MMU on each access, as BREAK_READ or BREAK_WRITE. */
+void core_cov_access(struct core_cov *cov, struct core_mmu *mmu, uint16_t a,
+        int kind)
+{
+    if(kind == BREAK_WRITE) {
+        *core_cov__slot(cov, mmu, a) |= COV_WRITE;
+    } else if(cov->num_reads < CORE_COV_MAX_READS) {
+        cov->reads[cov->num_reads] = core_cov__slot(cov, mmu, a);
+        cov->read_addrs[cov->num_reads++] = a;
+    }
+}
+
+/*
+ * Log the reads of an instruction of len bytes at pc, which is done. The CPU
+ * fetches the opcode, and any data after it, a word at a time, so reads of
+ * the byte after a 1- or 3-byte instruction are its own too.
+ */
+void core_cov_instr(struct core_cov *cov, struct core_mmu *mmu, uint16_t pc,
+        int len)
+{
+    uint16_t off;
+    int k, fetched = len > 2 ? 4 : 2;
+
+    for(k = 0; k < len; ++k)
+        *core_cov__slot(cov, mmu, pc + k) |= k < 2 ? COV_OPCODE : COV_OPERAND;
+    for(k = 0; k < cov->num_reads; ++k) {
+        off = cov->read_addrs[k] - pc;
+        if(off >= fetched)
+            *cov->reads[k] |= COV_READ;
+    }
+    cov->num_reads = 0;
+}
+
+/* Log the reads of an interrupt entry, which is done, as data. */
+void core_cov_interrupt(struct core_cov *cov)
+{
+    int k;
+
+    for(k = 0; k < cov->num_reads; ++k)
+        *cov->reads[k] |= COV_READ;
+    cov->num_reads = 0;
+}
+
+/* Count the bytes of a map with a bit set. */
+static void core_cov__count(const uint8_t *m, int len, int *counts)
+{
+    int k, b;
+
+    for(k = 0; k < len; ++k) {
+        for(b = 0; b < 4; ++b)
+            counts[b] += (m[k] >> b) & 1;
+    }
+}
+
+/* Write the log out to a file. */
+int core_cov_write(struct core_cov *cov, const char *fn)
+{
+    struct core_cov_file_header hdr;
+    int counts[4] = { 0, 0, 0, 0 };
+    FILE *fp;
+
+    fp = fopen(fn, "wb");
+    if(fp == NULL) {
+        LOGE("Couldn't open code/data log '%s' for writing", fn);
+        return 0;
+    }
+    memcpy(hdr.magic, core_cov_magic, sizeof(hdr.magic));
+    hdr.rom_banks = cov->rom_banks;
+    hdr.ram_banks = cov->ram_banks;
+    hdr.rom_bank_size = CORE_COV_ROM_BANK;
+    hdr.ram_bank_size = CORE_COV_RAM_BANK;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(cov->map, sizeof(cov->map), 1, fp);
+    fwrite(cov->rom_s, CORE_COV_ROM_BANK, cov->rom_banks, fp);
+    fwrite(cov->ram_s, CORE_COV_RAM_BANK, cov->ram_banks, fp);
+    fclose(fp);
+
+    core_cov__count(cov->map, sizeof(cov->map), counts);
+    core_cov__count(cov->rom_s, cov->rom_banks * CORE_COV_ROM_BANK, counts);
+    core_cov__count(cov->ram_s, cov->ram_banks * CORE_COV_RAM_BANK, counts);
+    LOGD("Wrote code/data log to '%s': %d opcode, %d operand, %d read and "
+         "%d written bytes", fn, counts[0], counts[1], counts[2], counts[3]);
+    return 1;
+}
@@ -0,0 +1,74 @@
+/*
+ * core/dbg/cov.h -- Code/data logger (header).
+ *
+ * Keeps a byte for each address, with a bit for each way it has been used:
+ * fetched as an opcode or as an instruction's data word, read as data, or
+ * written. The swappable ROM and RAM segments have a map for each of their
+ * banks.
+ *
+ * The file written at exit is a struct core_cov_file_header, the map of the
+ * 64 KiB address space, in which the swappable segments stay empty, then the
+ * map of each ROM bank and of each RAM bank in turn.
+ *
+ */
+
+#ifndef QPRA_CORE_COV_H
+#define QPRA_CORE_COV_H
+
+#include <stdint.h>
+
+struct core_mmu;
+
+/* Bits of each address's byte. */
+#define COV_OPCODE      0x01
+#define COV_OPERAND     0x02
+#define COV_READ        0x04
+#define COV_WRITE       0x08
+
+/* Most reads held back by an instruction before it is done. */
+#define CORE_COV_MAX_READS 16
+
+#pragma pack(push, 1)
+struct core_cov_file_header
+{
+    char magic[4];
+    /* Swappable banks mapped, and the size of each. */
+    uint8_t rom_banks;
+    uint8_t ram_banks;
+    uint16_t rom_bank_size;
+    uint16_t ram_bank_size;
+};
+#pragma pack(pop)
+
+struct core_cov
+{
+    uint8_t map[65536];
+    uint8_t *rom_s;
+    uint8_t *ram_s;
+    int rom_banks;
+    int ram_banks;
+
+    /*
+     * Reads made by the instruction being run, which are only told from its
+     * own fetches once its length is known.
+     */
+    uint8_t *reads[CORE_COV_MAX_READS];
+    uint16_t read_addrs[CORE_COV_MAX_READS];
+    int num_reads;
+};
+
+/* Forget reads made other than by the CPU, such as by a debugger. */
+static inline void core_cov_forget(struct core_cov *cov)
+{
+    cov->num_reads = 0;
+}
+
+/* Function declarations. */
+int core_cov_init(struct core_cov **, struct core_mmu *);
+void core_cov_access(struct core_cov *, struct core_mmu *, uint16_t, int);
+void core_cov_instr(struct core_cov *, struct core_mmu *, uint16_t, int);
+void core_cov_interrupt(struct core_cov *);
+int core_cov_write(struct core_cov *, const char *);
+void core_cov_destroy(struct core_cov *);
+
+#endif
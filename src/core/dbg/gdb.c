@@ -0,0 +1,621 @@
+/*
+ * core/dbg/gdb.c -- GDB remote serial protocol stub.
+ *
+ * Listens with -gdb <port> on 127.0.0.1, or with -gdb <path> on a Unix-domain
+ * socket, for one debugger at a time. The registers are a, b, c, d, e, p, s
+ * and f, in that order, 16 bits and little-endian each; GDB itself knows no
+ * Khepra, so is only of use with a client that is told the layout.
+ *
+ * The stub runs in all-stop mode: it touches the system only while the
+ * emulation thread waits in core_gdb_stopped(). On a connection it asks the
+ * emulation thread to stop; c and s let it run until a breakpoint or
+ * watchpoint is hit, a step is taken or the debugger sends an interrupt.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "core/core.h"
+#include "core/cpu/alu.h"
+#include "core/cpu/cpu.h"
+#include "core/dbg/break.h"
+#include "core/dbg/gdb.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+static const char core_gdb_hex[] = "0123456789abcdef";
+
+static int core_gdb__unhex(int c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Parse a hex number, leaving p past it. Returns -1 if there is none. */
+static long core_gdb__number(const char **p)
+{
+    long v = 0;
+    int d, n = 0;
+
+    while((d = core_gdb__unhex(**p)) >= 0 && n < 8) {
+        v = v << 4 | d;
+        ++*p;
+        ++n;
+    }
+    return n ? v : -1;
+}
+
+/* Put a 16-bit value as four hex digits, little-endian. */
+static char *core_gdb__put16(char *p, uint16_t v)
+{
+    *p++ = core_gdb_hex[(v >> 4) & 0xf];
+    *p++ = core_gdb_hex[v & 0xf];
+    *p++ = core_gdb_hex[(v >> 12) & 0xf];
+    *p++ = core_gdb_hex[(v >> 8) & 0xf];
+    return p;
+}
+
+/* Parse four hex digits, little-endian, leaving p past them. */
+static long core_gdb__get16(const char **p)
+{
+    int k, d[4];
+
+    for(k = 0; k < 4; ++k) {
+        if((d[k] = core_gdb__unhex((*p)[k])) < 0)
+            return -1;
+    }
+    *p += 4;
+    return d[0] << 4 | d[1] | d[2] << 12 | d[3] << 8;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Next byte from the debugger, or -1 once it has gone. */
+static int core_gdb__getc(struct core_gdb *gdb)
+{
+    int n;
+
+    if(gdb->in_pos == gdb->in_len) {
+        do {
+            n = read(gdb->fd, gdb->in, sizeof(gdb->in));
+        } while(n < 0 && errno == EINTR);
+        if(n <= 0)
+            return -1;
+        gdb->in_pos = 0;
+        gdb->in_len = n;
+    }
+    return (uint8_t)gdb->in[gdb->in_pos++];
+}
+
+static void core_gdb__write(struct core_gdb *gdb, const char *buf, int len)
+{
+    int n;
+
+    while(len > 0) {
+        n = send(gdb->fd, buf, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Read the next packet into buf, acknowledging it, skipping anything else.
+ * Returns its length, or -1 once the debugger has gone.
+ */
+static int core_gdb__recv(struct core_gdb *gdb, char *buf)
+{
+    int c, len, sum, check;
+
+    for(;;) {
+        while((c = core_gdb__getc(gdb)) != '$') {
+            if(c < 0)
+                return -1;
+        }
+        len = sum = 0;
+        while((c = core_gdb__getc(gdb)) != '#') {
+            if(c < 0)
+                return -1;
+            if(len < CORE_GDB_PACKET_LEN)
+                buf[len++] = c;
+            sum += c;
+        }
+        c = core_gdb__getc(gdb);
+        check = core_gdb__unhex(c) << 4;
+        c = core_gdb__getc(gdb);
+        if(c < 0)
+            return -1;
+        check |= core_gdb__unhex(c);
+        if(check == (sum & 0xff) && len < CORE_GDB_PACKET_LEN) {
+            core_gdb__write(gdb, "+", 1);
+            buf[len] = '\0';
+            return len;
+        }
+        core_gdb__write(gdb, "-", 1);
+    }
+}
+
+static void core_gdb__send(struct core_gdb *gdb, const char *data)
+{
+    char buf[CORE_GDB_PACKET_LEN + 4];
+    int k, len = strlen(data), sum = 0;
+
+    buf[0] = '$';
+    for(k = 0; k < len; ++k) {
+        buf[k + 1] = data[k];
+        sum += (uint8_t)data[k];
+    }
+    sprintf(buf + len + 1, "#%02x", sum & 0xff);
+    core_gdb__write(gdb, buf, len + 4);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*
+ * Have the emulation thread stop, and wait until it has. Returns 0 if the
+ * stub is to end instead.
+ */
+static int core_gdb__halt(struct core_gdb *gdb)
+{
+    int stopped;
+
+    pthread_mutex_lock(&gdb->lock);
+    if(!gdb->stopped)
+        __atomic_store_n(&gdb->stop, 1, __ATOMIC_RELEASE);
+    while(!gdb->stopped && !__atomic_load_n(&gdb->quit, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&gdb->cond, &gdb->lock);
+    stopped = gdb->stopped;
+    pthread_mutex_unlock(&gdb->lock);
+    return stopped;
+}
+
+static void core_gdb__resume(struct core_gdb *gdb, enum core_gdb_resume r)
+{
+    pthread_mutex_lock(&gdb->lock);
+    gdb->resume = r;
+    pthread_cond_broadcast(&gdb->cond);
+    pthread_mutex_unlock(&gdb->lock);
+}
+
+/*
+ * While emulation runs, pass interrupts from the debugger on, and wait for
+ * it to stop. Returns 0 if the debugger goes or the stub is to end first.
+ */
+static int core_gdb__wait(struct core_gdb *gdb)
+{
+    struct pollfd fds[2];
+    char drain[64];
+    int stopped;
+
+    fds[0].fd = gdb->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = gdb->wake[0];
+    fds[1].events = POLLIN;
+    for(;;) {
+        /* Anything other than an interrupt is an acknowledgement. */
+        while(gdb->in_pos < gdb->in_len) {
+            if(gdb->in[gdb->in_pos++] == 0x03)
+                __atomic_store_n(&gdb->stop, 1, __ATOMIC_RELEASE);
+        }
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            return 0;
+        }
+        if(fds[1].revents & POLLIN) {
+            if(read(gdb->wake[0], drain, sizeof(drain)) < 0)
+                return 0;
+            if(__atomic_load_n(&gdb->quit, __ATOMIC_ACQUIRE))
+                return 0;
+            pthread_mutex_lock(&gdb->lock);
+            stopped = gdb->stopped && gdb->resume == GDB_WAIT;
+            pthread_mutex_unlock(&gdb->lock);
+            if(stopped)
+                return 1;
+        }
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if(core_gdb__getc(gdb) < 0)
+                return 0;
+            --gdb->in_pos;
+        }
+    }
+}
+
+/* Why emulation stopped, as the debugger is told. */
+static void core_gdb__stop_reply(struct core_gdb *gdb, char *out)
+{
+    struct core_break *brk = gdb->core->brk;
+
+    switch(brk->reason) {
+        case BREAK_WATCH:
+            sprintf(out, "T05%swatch:%04x;",
+                    brk->kind == BREAK_READ ? "r" : "", brk->addr);
+            break;
+        case BREAK_PAUSE:
+            strcpy(out, "S02");
+            break;
+        default:
+            strcpy(out, "S05");
+            break;
+    }
+}
+
+/* Set or clear a breakpoint or watchpoint, from a Z or z packet. */
+static void core_gdb__point(struct core_gdb *gdb, const char *p, char *out)
+{
+    struct core_break *brk = gdb->core->brk;
+    struct core_mmu *mmu = gdb->core->mmu;
+    static const int kinds[] = {
+        0, 0, BREAK_WRITE, BREAK_READ, BREAK_READ | BREAK_WRITE
+    };
+    int set = *p++ == 'Z';
+    long type, a, len;
+
+    type = core_gdb__number(&p);
+    if(*p++ != ',' || (a = core_gdb__number(&p)) < 0 || a > 0xffff ||
+       *p++ != ',' || (len = core_gdb__number(&p)) < 0 || type < 0 ||
+       type > 4) {
+        out[0] = '\0';
+        return;
+    }
+
+    strcpy(out, "OK");
+    if(type < 2) {
+        if(set)
+            core_break_set(brk, a);
+        else
+            core_break_clear(brk, a);
+    } else if(!set) {
+        core_break_unwatch(brk, mmu, a);
+    } else if(len < 1 || len > 0x10000 - a ||
+              !core_break_watch(brk, mmu, a, len, kinds[type])) {
+        strcpy(out, "E01");
+    }
+}
+
+/*
+ * Act on a packet while emulation is stopped, leaving any reply in out.
+ * Returns GDB_CONTINUE to let emulation carry on, GDB_QUIT to end the
+ * session or GDB_WAIT to stay stopped.
+ */
+static enum core_gdb_resume core_gdb__packet(struct core_gdb *gdb,
+        const char *p, char *out)
+{
+    struct core_cpu *cpu = gdb->core->cpu;
+    struct core_mmu *mmu = gdb->core->mmu;
+    char *o = out;
+    long a, len, v;
+    int k;
+
+    out[0] = '\0';
+    core_alu_sync(&cpu->r[R_F], &cpu->lf);
+
+    switch(*p++) {
+        case '?':
+            core_gdb__stop_reply(gdb, out);
+            break;
+        case 'g':
+            for(k = 0; k < NUM_REGS; ++k)
+                o = core_gdb__put16(o, cpu->r[k]);
+            *o = '\0';
+            break;
+        case 'G':
+            for(k = 0; k < NUM_REGS && (v = core_gdb__get16(&p)) >= 0; ++k)
+                cpu->r[k] = v;
+            strcpy(out, "OK");
+            break;
+        case 'p':
+            if((a = core_gdb__number(&p)) < 0 || a >= NUM_REGS) {
+                strcpy(out, "E00");
+                break;
+            }
+            *core_gdb__put16(out, cpu->r[a]) = '\0';
+            break;
+        case 'P':
+            if((a = core_gdb__number(&p)) < 0 || a >= NUM_REGS ||
+               *p++ != '=' || (v = core_gdb__get16(&p)) < 0) {
+                strcpy(out, "E00");
+                break;
+            }
+            cpu->r[a] = v;
+            strcpy(out, "OK");
+            break;
+        case 'm':
+            if((a = core_gdb__number(&p)) < 0 || *p++ != ',' ||
+               (len = core_gdb__number(&p)) < 0) {
+                strcpy(out, "E00");
+                break;
+            }
+            if(len > CORE_GDB_PACKET_LEN / 2)
+                len = CORE_GDB_PACKET_LEN / 2;
+            for(k = 0; k < len; ++k) {
+                v = core_mmu_readb(mmu, a + k);
+                *o++ = core_gdb_hex[v >> 4];
+                *o++ = core_gdb_hex[v & 0xf];
+            }
+            *o = '\0';
+            break;
+        case 'M':
+            if((a = core_gdb__number(&p)) < 0 || *p++ != ',' ||
+               (len = core_gdb__number(&p)) < 0 || *p++ != ':') {
+                strcpy(out, "E00");
+                break;
+            }
+            for(k = 0; k < len; ++k, p += 2) {
+                if(core_gdb__unhex(p[0]) < 0 || core_gdb__unhex(p[1]) < 0)
+                    break;
+                core_mmu_writeb(mmu, a + k, core_gdb__unhex(p[0]) << 4 |
+                                core_gdb__unhex(p[1]));
+            }
+            strcpy(out, k == len ? "OK" : "E00");
+            break;
+        case 's':
+            gdb->core->brk->step = 1;
+            /* Fall through. */
+        case 'c':
+            if((a = core_gdb__number(&p)) >= 0)
+                cpu->r[R_P] = a;
+            return GDB_CONTINUE;
+        case 'Z':
+        case 'z':
+            core_gdb__point(gdb, p - 1, out);
+            break;
+        case 'k':
+            return GDB_QUIT;
+        case 'D':
+            strcpy(out, "OK");
+            return GDB_QUIT;
+        case 'H':
+        case 'T':
+            strcpy(out, "OK");
+            break;
+        case 'q':
+            if(!strncmp(p, "Supported", 9))
+                sprintf(out, "PacketSize=%x", CORE_GDB_PACKET_LEN);
+            else if(!strcmp(p, "Attached"))
+                strcpy(out, "1");
+            else if(!strcmp(p, "C"))
+                strcpy(out, "QC1");
+            else if(!strcmp(p, "fThreadInfo"))
+                strcpy(out, "m1");
+            else if(!strcmp(p, "sThreadInfo"))
+                strcpy(out, "l");
+            break;
+    }
+    return GDB_WAIT;
+}
+
+/*
+ * Serve a connected debugger until it goes. Returns 1 if it asked for
+ * emulation to end.
+ */
+static int core_gdb__session(struct core_gdb *gdb)
+{
+    char in[CORE_GDB_PACKET_LEN + 1], out[CORE_GDB_PACKET_LEN + 1];
+    enum core_gdb_resume r;
+
+    if(!core_gdb__halt(gdb))
+        return 0;
+    while(core_gdb__recv(gdb, in) >= 0) {
+        r = core_gdb__packet(gdb, in, out);
+        if(r == GDB_QUIT) {
+            if(in[0] == 'k')
+                return 1;
+            core_gdb__send(gdb, out);
+            return 0;
+        }
+        if(r == GDB_CONTINUE) {
+            core_gdb__resume(gdb, GDB_CONTINUE);
+            if(!core_gdb__wait(gdb))
+                return 0;
+            core_gdb__stop_reply(gdb, out);
+        }
+        core_gdb__send(gdb, out);
+    }
+    return 0;
+}
+
+/* Stub thread: take one debugger at a time, until the stub is to end. */
+static void *core_gdb__serve(void *data)
+{
+    struct core_gdb *gdb = data;
+    struct pollfd fds[2];
+    char drain[64];
+    int fd, kill;
+
+    fds[0].fd = gdb->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = gdb->wake[0];
+    fds[1].events = POLLIN;
+    while(!__atomic_load_n(&gdb->quit, __ATOMIC_ACQUIRE)) {
+        if(poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        if(!(fds[0].revents & POLLIN)) {
+            /* Woken for nothing, as there is no debugger to tell. */
+            if((fds[1].revents & POLLIN) &&
+               read(gdb->wake[0], drain, sizeof(drain)) < 0)
+                break;
+            continue;
+        }
+        if((fd = accept(gdb->listen_fd, NULL, NULL)) < 0)
+            continue;
+
+        pthread_mutex_lock(&gdb->lock);
+        gdb->fd = fd;
+        gdb->in_pos = gdb->in_len = 0;
+        pthread_mutex_unlock(&gdb->lock);
+        LOGD("Debugger attached");
+
+        kill = core_gdb__session(gdb);
+        if(kill) {
+            core_gdb__resume(gdb, GDB_QUIT);
+        } else if(__atomic_load_n(&gdb->quit, __ATOMIC_ACQUIRE)) {
+            core_gdb__send(gdb, "W00");
+        } else if(core_gdb__halt(gdb)) {
+            /* Leave nothing behind to stop at with no one to tell. */
+            core_break_reset(gdb->core->brk, gdb->core->mmu);
+            core_gdb__resume(gdb, GDB_CONTINUE);
+        }
+
+        pthread_mutex_lock(&gdb->lock);
+        close(gdb->fd);
+        gdb->fd = -1;
+        pthread_mutex_unlock(&gdb->lock);
+        LOGD("Debugger detached");
+    }
+    return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Listen on 127.0.0.1 if the address is a port number, else a Unix socket. */
+static int core_gdb__listen(const char *addr)
+{
+    struct sockaddr_in in;
+    struct sockaddr_un un;
+    char *end;
+    long port;
+    int fd, one = 1;
+
+    port = strtol(addr, &end, 10);
+    if(*end == '\0' && port > 0 && port < 65536) {
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(fd, (struct sockaddr *)&in, sizeof(in)) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        if(strlen(addr) >= sizeof(un.sun_path))
+            return -1;
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, addr);
+        if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if(bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if(listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Start serving debuggers on the given port of 127.0.0.1, or Unix socket
+ * path.
+ */
+int core_gdb_init(struct core_gdb **pgdb, struct core_system *core,
+        const char *addr)
+{
+    struct core_gdb *gdb;
+
+    gdb = *pgdb = calloc(1, sizeof(struct core_gdb));
+    if(gdb == NULL) {
+        LOGE("Could not allocate debugger stub");
+        return 0;
+    }
+    gdb->core = core;
+    gdb->fd = -1;
+    gdb->listen_fd = core_gdb__listen(addr);
+    if(gdb->listen_fd < 0) {
+        LOGE("Couldn't listen for a debugger on '%s': %s", addr,
+             strerror(errno));
+        free(gdb);
+        return 0;
+    }
+    if(addr[strspn(addr, "0123456789")] != '\0')
+        gdb->path = addr;
+
+    if(pipe(gdb->wake) < 0) {
+        LOGE("Couldn't make a pipe for the debugger stub");
+        close(gdb->listen_fd);
+        free(gdb);
+        return 0;
+    }
+    pthread_mutex_init(&gdb->lock, NULL);
+    pthread_cond_init(&gdb->cond, NULL);
+    if(pthread_create(&gdb->thread, NULL, core_gdb__serve, gdb) != 0) {
+        LOGE("Couldn't start the debugger stub thread");
+        close(gdb->wake[0]);
+        close(gdb->wake[1]);
+        close(gdb->listen_fd);
+        free(gdb);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Called by the emulation thread once it has stopped; waits for the
+ * debugger to let it carry on. Returns 0 to end emulation.
+ */
+int core_gdb_stopped(struct core_gdb *gdb)
+{
+    enum core_gdb_resume r;
+
+    pthread_mutex_lock(&gdb->lock);
+    __atomic_store_n(&gdb->stop, 0, __ATOMIC_RELEASE);
+    gdb->stopped = 1;
+    gdb->resume = GDB_WAIT;
+    pthread_cond_broadcast(&gdb->cond);
+    pthread_mutex_unlock(&gdb->lock);
+    if(write(gdb->wake[1], "", 1) < 0)
+        LOGW("Couldn't wake the debugger stub");
+
+    pthread_mutex_lock(&gdb->lock);
+    while(gdb->resume == GDB_WAIT)
+        pthread_cond_wait(&gdb->cond, &gdb->lock);
+    r = gdb->resume;
+    gdb->stopped = 0;
+    pthread_mutex_unlock(&gdb->lock);
+
+    gdb->core->brk->reason = BREAK_NONE;
+    return r != GDB_QUIT;
+}
+
+/* Tell any debugger emulation has ended, and stop serving. */
+void core_gdb_destroy(struct core_gdb *gdb)
+{
+    __atomic_store_n(&gdb->quit, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&gdb->lock);
+    pthread_cond_broadcast(&gdb->cond);
+    pthread_mutex_unlock(&gdb->lock);
+    if(write(gdb->wake[1], "", 1) < 0)
+        LOGW("Couldn't wake the debugger stub");
+    pthread_join(gdb->thread, NULL);
+    close(gdb->wake[0]);
+    close(gdb->wake[1]);
+    close(gdb->listen_fd);
+    if(gdb->path != NULL)
+        unlink(gdb->path);
+    pthread_mutex_destroy(&gdb->lock);
+    pthread_cond_destroy(&gdb->cond);
+    free(gdb);
+}
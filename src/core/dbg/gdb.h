@@ -0,0 +1,72 @@
+/*
+ * core/dbg/gdb.h -- GDB remote serial protocol stub (header).
+ *
+ * Serves a debugger over a loopback TCP port or a Unix-domain socket from a
+ * thread of its own, while emulation runs at full speed. When the debugger
+ * asks to stop, the emulation thread is told to at the next frame, then
+ * waits, while the stub reads and writes the registers and memory, and sets
+ * breakpoints and watchpoints through dbg/break.c, until told to carry on.
+ *
+ */
+
+#ifndef QPRA_CORE_GDB_H
+#define QPRA_CORE_GDB_H
+
+#include <pthread.h>
+
+struct core_system;
+
+/* Longest packet taken or sent, in characters between $ and #. */
+#define CORE_GDB_PACKET_LEN 1024
+
+/* What the stopped emulation thread is to do next. */
+enum core_gdb_resume
+{
+    GDB_WAIT, GDB_CONTINUE, GDB_QUIT
+};
+
+struct core_gdb
+{
+    struct core_system *core;
+    /* Socket listened on, the debugger's connection or -1, and its path. */
+    int listen_fd;
+    int fd;
+    const char *path;
+    /* Written by the emulation thread to wake the stub when it stops. */
+    int wake[2];
+    pthread_t thread;
+
+    /*
+     * Set by the stub for the emulation thread to stop at the next frame,
+     * and by the emulation thread for the stub to end.
+     */
+    int stop;
+    int quit;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /*
+     * Guarded by the lock: the emulation thread is waiting in
+     * core_gdb_stopped(), and what it is to do next.
+     */
+    int stopped;
+    enum core_gdb_resume resume;
+
+    /* Bytes read from the debugger but not yet looked at. */
+    char in[256];
+    int in_pos;
+    int in_len;
+};
+
+/* Has the debugger asked for emulation to stop? */
+static inline int core_gdb_stop_requested(struct core_gdb *gdb)
+{
+    return __atomic_load_n(&gdb->stop, __ATOMIC_ACQUIRE);
+}
+
+/* Function declarations. */
+int core_gdb_init(struct core_gdb **, struct core_system *, const char *);
+int core_gdb_stopped(struct core_gdb *);
+void core_gdb_destroy(struct core_gdb *);
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * core/dbg/lockstep.c -- Lockstep comparison of execution engines.
+ *
+ * Two systems agree when their registers, with the flags worked out, their
+ * cycle counts, pending interrupts, timers, bank selections and writable
+ * memory are the same. All of memory is compared rather than what was
+ * written since the last comparison, as the translated code of the faster
+ * engines writes RAM directly, out of sight of the MMU.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "core/core.h"
+#include "core/cpu/alu.h"
+#include "core/cpu/cpu.h"
+#include "core/cpu/hrc.h"
+#include "core/dbg/lockstep.h"
+#include "core/dbg/sym.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+static const char *core_lockstep_regs[NUM_REGS] = {
+    "a", "b", "c", "d", "e", "p", "s", "f"
+};
+
+/* Registers of the CPU, with the flags worked out. */
+static void core_lockstep__regs(struct core_cpu *cpu, uint16_t *r)
+{
+    struct core_lazy_flags lf = cpu->lf;
+
+    memcpy(r, cpu->r, NUM_REGS * sizeof(uint16_t));
+    core_alu_sync(&r[R_F], &lf);
+}
+
+static int core_lockstep__hrc_equal(struct core_hrc *x, struct core_hrc *y)
+{
+    return x->v == y->v && x->total_cycles == y->total_cycles &&
+           x->hsync_override == y->hsync_override &&
+           x->elapsed_cycles == y->elapsed_cycles &&
+           x->enabled == y->enabled;
+}
+
+static int core_lockstep__banks_equal(struct core_mmu *x, struct core_mmu *y)
+{
+    return x->rom_s_bank == y->rom_s_bank && x->ram_s_bank == y->ram_s_bank &&
+           x->tile_bank == y->tile_bank && x->dpcm_bank == y->dpcm_bank;
+}
+
+/*
+ * The kth region of writable memory, with the address it is mapped at and
+ * its length: the fixed RAM, the cart storage, the interrupt vectors, then
+ * each switchable RAM bank. Returns NULL past the last one.
+ */
+static uint8_t *core_lockstep__region(struct core_mmu *mmu, int k,
+        uint16_t *base, int *len)
+{
+    switch(k) {
+        case 0:
+            *base = A_RAM_FIXED;
+            *len = A_RAM_FIXED_END - A_RAM_FIXED + 1;
+            return mmu->ram_f;
+        case 1:
+            *base = A_CART_FIXED;
+            *len = A_CART_FIXED_END - A_CART_FIXED + 1;
+            return mmu->cart_f;
+        case 2:
+            *base = A_INT_VEC;
+            *len = sizeof(mmu->intvec);
+            return mmu->intvec;
+        default:
+            if(k - 3 >= mmu->ram_s_total)
+                return NULL;
+            *base = A_RAM_SWAP;
+            *len = A_RAM_SWAP_END - A_RAM_SWAP + 1;
+            return mmu->ram_s_banks[k - 3];
+    }
+}
+
+/* Returns 1 if the two systems are in the same state, as far as is seen. */
+int core_lockstep_compare(struct core_system *x, struct core_system *y)
+{
+    uint16_t rx[NUM_REGS], ry[NUM_REGS], base;
+    uint8_t *mx, *my;
+    int k, len;
+
+    core_lockstep__regs(x->cpu, rx);
+    core_lockstep__regs(y->cpu, ry);
+    if(memcmp(rx, ry, sizeof(rx)) != 0 ||
+       x->cpu->total_cycles != y->cpu->total_cycles ||
+       x->cpu->int_pending != y->cpu->int_pending ||
+       !core_lockstep__hrc_equal(x->cpu->hrc, y->cpu->hrc) ||
+       !core_lockstep__banks_equal(x->mmu, y->mmu))
+        return 0;
+
+    for(k = 0; (mx = core_lockstep__region(x->mmu, k, &base, &len)); ++k) {
+        my = core_lockstep__region(y->mmu, k, &base, &len);
+        if(memcmp(mx, my, len) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Show a row of up to 16 bytes of memory, marking those which differ. */
+static void core_lockstep__row(const char *name, uint16_t a, uint8_t *m,
+        uint8_t *other, int len)
+{
+    char buf[16 * 3 + 1] = "";
+    int n;
+
+    for(n = 0; n < len; ++n)
+        sprintf(buf + 3 * n, "%02x%c", m[n], m[n] != other[n] ? '*' : ' ');
+    LOGE("core.lockstep:   %-8s $%04x: %s", name, a, buf);
+}
+
+/*
+ * Describe how the two systems differ, for when they have been found to;
+ * agreed is the last cycle at which they were seen to agree.
+ */
+void core_lockstep_dump(struct core_system *x, struct core_system *y,
+        uint64_t agreed)
+{
+    const char *nx = core_cpu_engine_names[x->cpu->engine];
+    const char *ny = core_cpu_engine_names[y->cpu->engine];
+    struct core_hrc *hx = x->cpu->hrc, *hy = y->cpu->hrc;
+    uint16_t rx[NUM_REGS], ry[NUM_REGS], base;
+    uint8_t *mx, *my;
+    char name[80];
+    int k, n, len, row, rows = 0;
+
+    LOGE("core.lockstep: the '%s' and '%s' engines disagree at cycle %llu, "
+         "last agreeing at cycle %llu", nx, ny,
+         (unsigned long long)x->cpu->total_cycles,
+         (unsigned long long)agreed);
+
+    core_lockstep__regs(x->cpu, rx);
+    core_lockstep__regs(y->cpu, ry);
+    LOGE("core.lockstep:   %-12s %-8s %-8s", "", nx, ny);
+    for(k = 0; k < NUM_REGS; ++k)
+        LOGE("core.lockstep:   %-12s %04x     %04x     %s",
+             core_lockstep_regs[k], rx[k], ry[k], rx[k] != ry[k] ? "*" : "");
+    core_sym_format(x->syms, rx[R_P], name, sizeof(name));
+    LOGE("core.lockstep:   %-12s %s", "at", name);
+    LOGE("core.lockstep:   %-12s %-8llu %-8llu %s", "cycles",
+         (unsigned long long)x->cpu->total_cycles,
+         (unsigned long long)y->cpu->total_cycles,
+         x->cpu->total_cycles != y->cpu->total_cycles ? "*" : "");
+    LOGE("core.lockstep:   %-12s %02x       %02x       %s", "int pending",
+         x->cpu->int_pending, y->cpu->int_pending,
+         x->cpu->int_pending != y->cpu->int_pending ? "*" : "");
+    LOGE("core.lockstep:   %-12s %04x/%-3d %04x/%-3d %s", "timer",
+         hx->v, hx->elapsed_cycles, hy->v, hy->elapsed_cycles,
+         !core_lockstep__hrc_equal(hx, hy) ? "*" : "");
+    LOGE("core.lockstep:   %-12s %02x/%02x    %02x/%02x    %s", "rom/ram bank",
+         x->mmu->rom_s_bank, x->mmu->ram_s_bank,
+         y->mmu->rom_s_bank, y->mmu->ram_s_bank,
+         !core_lockstep__banks_equal(x->mmu, y->mmu) ? "*" : "");
+
+    /* Each row of memory that differs, from one system then the other. */
+    for(k = 0; (mx = core_lockstep__region(x->mmu, k, &base, &len)); ++k) {
+        my = core_lockstep__region(y->mmu, k, &base, &len);
+        for(n = 0; n < len; n += 16) {
+            row = len - n < 16 ? len - n : 16;
+            if(memcmp(mx + n, my + n, row) == 0)
+                continue;
+            if(rows++ == CORE_LOCKSTEP_MAX_ROWS) {
+                LOGE("core.lockstep:   ...");
+                return;
+            }
+            core_lockstep__row(nx, base + n, mx + n, my + n, row);
+            core_lockstep__row(ny, base + n, my + n, mx + n, row);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * core/dbg/lockstep.h -- Lockstep comparison of execution engines (header).
+ *
+ * Runs a second system on the same ROM with another CPU engine alongside the
+ * first, and compares the two whenever both have run the same number of
+ * cycles, stopping at the first difference.
+ *
+ */
+
+#ifndef QPRA_CORE_LOCKSTEP_H
+#define QPRA_CORE_LOCKSTEP_H
+
+#include <stdint.h>
+
+#include "core/core.h"
+
+/* Rows of differing memory shown, 16 bytes each. */
+#define CORE_LOCKSTEP_MAX_ROWS 16
+
+struct core_lockstep
+{
+    /* The system run with the other engine. */
+    struct core_system *other;
+    /* Cycles between comparisons; 0 to compare whenever the two line up. */
+    int every;
+    /* Compare at the first point the two line up at or after this cycle. */
+    uint64_t next;
+    /* Cycle at which the two last agreed. */
+    uint64_t agreed;
+    /* Comparisons made. */
+    uint64_t checks;
+    /* Set once they disagree, to stop emulation. */
+    int failed;
+};
+
+/* Function declarations. */
+int core_lockstep_compare(struct core_system *, struct core_system *);
+void core_lockstep_dump(struct core_system *, struct core_system *,
+        uint64_t);
+
+#endif
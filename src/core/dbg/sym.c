@@ -0,0 +1,263 @@
+/*
+ * core/dbg/sym.c -- Guest symbol maps.
+ *
+ * Reads the map file as.py writes next to the ROM it assembles, named after
+ * the ROM with a .map extension. It is made of lines such as:
+ *
+ *     ; comment
+ *     source asm/demo.s
+ *     label 0 000d loop
+ *     line 0 000d 10
+ *
+ * giving the bank and address of each label, and the bank, address and
+ * source line of each instruction. Banks are numbered as in the ROM file.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/core.h"
+#include "core/dbg/sym.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+/* Longest map file line read, and longest label. */
+#define CORE_SYM_LINE_LEN 512
+#define CORE_SYM_NAME_LEN 64
+
+/*
+ * Which bank the address lies in, so that a label is not taken to cover
+ * addresses in the next bank along. Returns -1 outside any bank.
+ */
+static int core_sym__bank(uint16_t addr)
+{
+    if(addr <= A_ROM_FIXED_END)
+        return CORE_HDR_ROMF;
+    if(addr <= A_ROM_SWAP_END)
+        return CORE_HDR_ROMS;
+    if(addr <= A_RAM_FIXED_END)
+        return CORE_HDR_RAMF;
+    if(addr <= A_RAM_SWAP_END)
+        return CORE_HDR_RAMS;
+    if(addr <= A_TILE_SWAP_END)
+        return CORE_HDR_TILS;
+    if(addr >= A_DPCM_SWAP && addr <= A_DPCM_SWAP_END)
+        return CORE_HDR_AUDS;
+    return -1;
+}
+
+/* Order symbols, or lines, by address. */
+static int core_sym__cmp(const void *x, const void *y)
+{
+    return ((const struct core_sym *)x)->addr -
+           ((const struct core_sym *)y)->addr;
+}
+
+static int core_sym__cmp_line(const void *x, const void *y)
+{
+    return ((const struct core_sym_line *)x)->addr -
+           ((const struct core_sym_line *)y)->addr;
+}
+
+/* Copy a string, which may be missing the trailing newline. */
+static char *core_sym__strdup(const char *str)
+{
+    size_t len = strcspn(str, "\n");
+    char *copy = malloc(len + 1);
+
+    if(copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/* Make room for one more entry in a table of n entries of the given size. */
+static int core_sym__grow(void **table, int n, size_t size)
+{
+    void *t;
+
+    /* Tables are grown to each power of two. */
+    if(n & (n - 1))
+        return 1;
+    t = realloc(*table, (n ? 2 * n : 16) * size);
+    if(t == NULL) {
+        LOGE("Could not allocate symbol map");
+        return 0;
+    }
+    *table = t;
+    return 1;
+}
+
+/* Read one line of a map file. Returns 0 if out of memory. */
+static int core_sym__parse(struct core_syms *syms, const char *buf, int n)
+{
+    char name[CORE_SYM_NAME_LEN];
+    unsigned int addr;
+    int bank, line;
+
+    if(sscanf(buf, "label %d %x %63s", &bank, &addr, name) == 3) {
+        if(!core_sym__grow((void **)&syms->syms, syms->num_syms,
+                           sizeof(struct core_sym)))
+            return 0;
+        syms->syms[syms->num_syms].addr = addr;
+        syms->syms[syms->num_syms].bank = bank;
+        syms->syms[syms->num_syms].name = core_sym__strdup(name);
+        if(syms->syms[syms->num_syms].name == NULL)
+            return 0;
+        syms->num_syms += 1;
+    } else if(sscanf(buf, "line %d %x %d", &bank, &addr, &line) == 3) {
+        if(!core_sym__grow((void **)&syms->lines, syms->num_lines,
+                           sizeof(struct core_sym_line)))
+            return 0;
+        syms->lines[syms->num_lines].addr = addr;
+        syms->lines[syms->num_lines].bank = bank;
+        syms->lines[syms->num_lines].line = line;
+        syms->num_lines += 1;
+    } else if(!strncmp(buf, "source ", 7)) {
+        free(syms->source);
+        syms->source = core_sym__strdup(buf + 7);
+        if(syms->source == NULL)
+            return 0;
+    } else if(buf[0] != ';' && buf[0] != '\n') {
+        LOGW("core.sym: ignoring line %d of the map file", n);
+    }
+    return 1;
+}
+
+/*
+ * Load the map file of the given ROM file, if there is one.
+ * Returns 0 if there is none or it could not be read, leaving *psyms NULL.
+ */
+int core_sym_load(struct core_syms **psyms, const char *rom_fn)
+{
+    struct core_syms *syms;
+    char buf[CORE_SYM_LINE_LEN], *fn, *ext;
+    FILE *fp;
+    int n = 0, ok = 1;
+
+    *psyms = NULL;
+    fn = malloc(strlen(rom_fn) + 5);
+    if(fn == NULL)
+        return 0;
+    strcpy(fn, rom_fn);
+    ext = strrchr(fn, '.');
+    if(ext == NULL || strchr(ext, '/') != NULL)
+        ext = fn + strlen(fn);
+    strcpy(ext, ".map");
+
+    fp = fopen(fn, "r");
+    if(fp == NULL) {
+        LOGD("No symbol map '%s'", fn);
+        free(fn);
+        return 0;
+    }
+    syms = calloc(1, sizeof(struct core_syms));
+    if(syms == NULL) {
+        LOGE("Could not allocate symbol map");
+        fclose(fp);
+        free(fn);
+        return 0;
+    }
+    while(ok && fgets(buf, sizeof(buf), fp) != NULL)
+        ok = core_sym__parse(syms, buf, ++n);
+    fclose(fp);
+    if(!ok) {
+        LOGE("Couldn't read symbol map '%s'", fn);
+        core_sym_destroy(syms);
+        free(fn);
+        return 0;
+    }
+
+    qsort(syms->syms, syms->num_syms, sizeof(struct core_sym), core_sym__cmp);
+    qsort(syms->lines, syms->num_lines, sizeof(struct core_sym_line),
+          core_sym__cmp_line);
+    LOGD("Loaded %d labels and %d lines from symbol map '%s'",
+         syms->num_syms, syms->num_lines, fn);
+    free(fn);
+    *psyms = syms;
+    return 1;
+}
+
+void core_sym_destroy(struct core_syms *syms)
+{
+    int k;
+
+    for(k = 0; k < syms->num_syms; ++k)
+        free(syms->syms[k].name);
+    free(syms->syms);
+    free(syms->lines);
+    free(syms->source);
+    free(syms);
+}
+
+/*
+ * Find the label an address comes under: the last one at or before it in
+ * the same bank. Returns NULL if there is none.
+ */
+struct core_sym *core_sym_find(struct core_syms *syms, uint16_t addr)
+{
+    int lo = 0, hi = syms->num_syms, mid;
+
+    /* Find the first label after the address. */
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(syms->syms[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == 0)
+        return NULL;
+    if(syms->syms[lo - 1].bank != core_sym__bank(addr))
+        return NULL;
+    return &syms->syms[lo - 1];
+}
+
+/* Find a label by name. Returns NULL if there is none. */
+struct core_sym *core_sym_lookup(struct core_syms *syms, const char *name)
+{
+    int k;
+
+    for(k = 0; k < syms->num_syms; ++k) {
+        if(!strcmp(syms->syms[k].name, name))
+            return &syms->syms[k];
+    }
+    return NULL;
+}
+
+/* Returns the source line of the instruction at an address, or 0. */
+int core_sym_line(struct core_syms *syms, uint16_t addr)
+{
+    int lo = 0, hi = syms->num_lines, mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(syms->lines[mid].addr < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < syms->num_lines && syms->lines[lo].addr == addr)
+        return syms->lines[lo].line;
+    return 0;
+}
+
+/*
+ * Write an address as the label it comes under, plus the offset from it if
+ * any, or in hex if there is no such label. syms may be NULL.
+ */
+void core_sym_format(struct core_syms *syms, uint16_t addr, char *buf,
+        size_t len)
+{
+    struct core_sym *sym = syms != NULL ? core_sym_find(syms, addr) : NULL;
+
+    if(sym == NULL)
+        snprintf(buf, len, "0x%04x", addr);
+    else if(sym->addr == addr)
+        snprintf(buf, len, "%s", sym->name);
+    else
+        snprintf(buf, len, "%s+0x%x", sym->name, addr - sym->addr);
+}
@@ -0,0 +1,50 @@
+/*
+ * core/dbg/sym.h -- Guest symbol maps (header).
+ *
+ * Holds the labels and source lines as.py lists in the map file it writes
+ * next to a ROM, so addresses can be shown by name.
+ *
+ */
+
+#ifndef QPRA_CORE_SYM_H
+#define QPRA_CORE_SYM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct core_sym
+{
+    uint16_t addr;
+    /* Bank the address lies in, an enum core_buf_type. */
+    uint8_t bank;
+    char *name;
+};
+
+/* Where the instruction at an address was assembled from. */
+struct core_sym_line
+{
+    uint16_t addr;
+    uint8_t bank;
+    int line;
+};
+
+/* The contents of a map file; both tables are sorted by address. */
+struct core_syms
+{
+    /* Source file the ROM was assembled from. */
+    char *source;
+    struct core_sym *syms;
+    int num_syms;
+    struct core_sym_line *lines;
+    int num_lines;
+};
+
+/* Function declarations. */
+int core_sym_load(struct core_syms **, const char *);
+void core_sym_destroy(struct core_syms *);
+struct core_sym *core_sym_find(struct core_syms *, uint16_t);
+struct core_sym *core_sym_lookup(struct core_syms *, const char *);
+int core_sym_line(struct core_syms *, uint16_t);
+void core_sym_format(struct core_syms *, uint16_t, char *, size_t);
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ * core/dbg/trace.c -- Binary execution trace.
+ *
+ * The emulation thread fills blocks of the ring and the flush thread writes
+ * them out, with no lock between them: each advances its own counter, with
+ * release stores matched by acquire loads in the other thread. When the
+ * flush thread falls behind, whole blocks are dropped rather than the
+ * emulation waiting on the disk. Without a flush thread, the ring keeps the
+ * last blocks filled, which are written out at the end.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "core/cpu/alu.h"
+#include "core/dbg/trace.h"
+#include "log.h"
+
+static const char core_trace_magic[4] = { 'Q', 'T', 'R', 'C' };
+
+static uint8_t *core_trace__slot(struct core_trace *trace, uint64_t n)
+{
+    return trace->ring + (n % CORE_TRACE_BLOCKS) * CORE_TRACE_BLOCK;
+}
+
+/*
+ * Start a block in the next free slot of the ring, or in the spare slot if
+ * there is none; that block is dropped when finished.
+ */
+static void core_trace__start(struct core_trace *trace)
+{
+    struct core_trace_block_header hdr;
+
+    if(trace->stream && trace->head -
+       __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) == CORE_TRACE_BLOCKS)
+        trace->block = trace->ring + CORE_TRACE_BLOCKS * CORE_TRACE_BLOCK;
+    else
+        trace->block = core_trace__slot(trace, trace->head);
+
+    hdr.seq = trace->seq++;
+    hdr.cycles = trace->cycles;
+    memcpy(hdr.r, trace->r, sizeof(hdr.r));
+    memcpy(trace->block, &hdr, sizeof(hdr));
+    trace->pos = sizeof(hdr);
+}
+
+/* Close the block being filled and hand it over to be written out. */
+static void core_trace__finish(struct core_trace *trace)
+{
+    memset(trace->block + trace->pos, TRACE_END,
+           CORE_TRACE_BLOCK - trace->pos);
+    if(trace->block != core_trace__slot(trace, trace->head))
+        trace->dropped += 1;
+    else
+        __atomic_store_n(&trace->head, trace->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns where to write the next record, starting a new block if needed. */
+static uint8_t *core_trace__reserve(struct core_trace *trace)
+{
+    if(trace->pos > CORE_TRACE_BLOCK - CORE_TRACE_MAX_RECORD) {
+        core_trace__finish(trace);
+        core_trace__start(trace);
+    }
+    return trace->block + trace->pos;
+}
+
+static uint8_t *core_trace__put16(uint8_t *p, uint16_t v)
+{
+    *p++ = B_LO(v);
+    *p++ = B_HI(v);
+    return p;
+}
+
+static uint8_t *core_trace__varint(uint8_t *p, uint32_t v)
+{
+    while(v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+/*
+ * Write the registers which changed since the last record, with the flags
+ * worked out, and finish the record there.
+ */
+static void core_trace__regs(struct core_trace *trace, struct core_cpu *cpu,
+        uint8_t *p, int cycles)
+{
+    struct core_lazy_flags lf = cpu->lf;
+    uint16_t r[NUM_REGS];
+    uint8_t *mask = p++;
+    int k;
+
+    memcpy(r, cpu->r, sizeof(r));
+    core_alu_sync(&r[R_F], &lf);
+    *mask = 0;
+    for(k = 0; k < NUM_REGS; ++k) {
+        if(r[k] != trace->r[k]) {
+            *mask |= 1 << k;
+            p = core_trace__put16(p, r[k]);
+            trace->r[k] = r[k];
+        }
+    }
+    trace->pos = p - trace->block;
+    trace->cycles += cycles;
+}
+
+/* Record the instruction just run from pc, which took the given cycles. */
+void core_trace_instr(struct core_trace *trace, struct core_cpu *cpu,
+        uint16_t pc, int cycles)
+{
+    struct core_instr_decoded *d = cpu->d;
+    struct core_instr *i = cpu->i;
+    uint16_t next = pc + d->len;
+    uint8_t *p = core_trace__reserve(trace);
+
+    *p++ = TRACE_INSTR | (cpu->r[R_P] != next ? TRACE_JUMP : 0);
+    *p++ = i->ib0;
+    if(!(d->flags & DEC_VOID)) {
+        *p++ = i->ib1;
+        if(d->flags & DEC_HAS_DATA) {
+            *p++ = i->db0;
+            *p++ = i->db1;
+        }
+    }
+    p = core_trace__varint(p, cycles);
+    if(cpu->r[R_P] != next)
+        p = core_trace__put16(p, cpu->r[R_P]);
+    trace->r[R_P] = cpu->r[R_P];
+    core_trace__regs(trace, cpu, p, cycles);
+}
+
+/* Record the interrupt just entered, which took the given cycles. */
+void core_trace_interrupt(struct core_trace *trace, struct core_cpu *cpu,
+        int cycles)
+{
+    uint8_t *p = core_trace__reserve(trace);
+
+    *p++ = TRACE_INTERRUPT;
+    p = core_trace__varint(p, cycles);
+    core_trace__regs(trace, cpu, p, cycles);
+}
+
+/* Flush thread: write blocks out as they are finished, until stopped. */
+static void *core_trace__flush(void *data)
+{
+    struct core_trace *trace = data;
+    struct timespec ts = { 0, 1000000 };
+    uint64_t head;
+    int stop;
+
+    for(;;) {
+        /* Stop is read first, so a head read after it is the last one. */
+        stop = __atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+        if(trace->tail == head) {
+            if(stop)
+                break;
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        fwrite(core_trace__slot(trace, trace->tail), CORE_TRACE_BLOCK, 1,
+               trace->fp);
+        __atomic_store_n(&trace->tail, trace->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * Start tracing the CPU to the given file. If streaming, blocks are written
+ * out by a thread of their own as they fill; otherwise the last ones are
+ * written when the trace is destroyed.
+ */
+int core_trace_init(struct core_trace **ptrace, struct core_cpu *cpu,
+        const char *fn, int stream)
+{
+    struct core_trace_file_header hdr;
+    struct core_trace *trace;
+    struct core_lazy_flags lf = cpu->lf;
+
+    trace = *ptrace = calloc(1, sizeof(struct core_trace));
+    if(trace == NULL) {
+        LOGE("Could not allocate trace");
+        return 0;
+    }
+    trace->ring = malloc((CORE_TRACE_BLOCKS + 1) * CORE_TRACE_BLOCK);
+    if(trace->ring == NULL) {
+        LOGE("Could not allocate trace ring buffer");
+        free(trace);
+        return 0;
+    }
+    trace->fp = fopen(fn, "wb");
+    if(trace->fp == NULL) {
+        LOGE("Couldn't open trace '%s' for writing", fn);
+        free(trace->ring);
+        free(trace);
+        return 0;
+    }
+    memcpy(hdr.magic, core_trace_magic, sizeof(hdr.magic));
+    hdr.block_size = CORE_TRACE_BLOCK;
+    fwrite(&hdr, sizeof(hdr), 1, trace->fp);
+
+    memcpy(trace->r, cpu->r, sizeof(trace->r));
+    core_alu_sync(&trace->r[R_F], &lf);
+    trace->stream = stream;
+    core_trace__start(trace);
+
+    if(stream &&
+       pthread_create(&trace->thread, NULL, core_trace__flush, trace) != 0) {
+        LOGE("Couldn't start the trace flush thread");
+        fclose(trace->fp);
+        free(trace->ring);
+        free(trace);
+        return 0;
+    }
+    return 1;
+}
+
+/* Write out whatever is left of the trace and close it. */
+void core_trace_destroy(struct core_trace *trace)
+{
+    uint64_t n;
+
+    core_trace__finish(trace);
+    if(trace->stream) {
+        __atomic_store_n(&trace->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(trace->thread, NULL);
+        if(trace->dropped)
+            LOGW("Dropped %llu trace blocks; the disk could not keep up",
+                 (unsigned long long)trace->dropped);
+    } else {
+        n = trace->head > CORE_TRACE_BLOCKS ?
+            trace->head - CORE_TRACE_BLOCKS : 0;
+        for(; n < trace->head; ++n)
+            fwrite(core_trace__slot(trace, n), CORE_TRACE_BLOCK, 1, trace->fp);
+    }
+    fclose(trace->fp);
+    free(trace->ring);
+    free(trace);
+}
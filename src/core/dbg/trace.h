@@ -0,0 +1,103 @@
+/*
+ * core/dbg/trace.h -- Binary execution trace (header).
+ *
+ * Records every instruction and interrupt entry into a ring buffer in a
+ * compact binary form, for trace.py to decode. The ring is a sequence of
+ * fixed-size blocks; each starts with the full register state and holds
+ * records giving only what changed, so any block can be decoded on its own.
+ *
+ * A file is a struct core_trace_file_header followed by blocks. A block is
+ * a struct core_trace_block_header followed by records, each of which is:
+ *
+ *     tag             TRACE_INSTR or TRACE_INTERRUPT, maybe with TRACE_JUMP
+ *     ib0 [ib1 [db0 db1]]     instructions only; as many bytes as have
+ *                             meaning for the instruction, as the CPU
+ *                             holds them after it; for a call run
+ *                             natively (see hle.c), the data bytes are
+ *                             those the routine left
+ *     cycles          unsigned LEB128
+ *     P               16 bits; only with TRACE_JUMP
+ *     mask            registers changed, bit n for register n
+ *     registers       16 bits each, for the bits set in the mask
+ *
+ * All 16-bit values are little-endian. After an instruction P is at the next
+ * instruction unless TRACE_JUMP says otherwise. A TRACE_END tag fills the
+ * rest of a block.
+ *
+ */
+
+#ifndef QPRA_CORE_TRACE_H
+#define QPRA_CORE_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "core/cpu/cpu.h"
+
+/* Bytes in a block, and blocks in the ring. */
+#define CORE_TRACE_BLOCK 4096
+#define CORE_TRACE_BLOCKS 256
+/* Longest a record can be. */
+#define CORE_TRACE_MAX_RECORD 32
+
+#define TRACE_END       0x00
+#define TRACE_INSTR     0x01
+#define TRACE_INTERRUPT 0x02
+#define TRACE_JUMP      0x04
+
+#pragma pack(push, 1)
+struct core_trace_file_header
+{
+    char magic[4];
+    uint32_t block_size;
+};
+
+struct core_trace_block_header
+{
+    /* Blocks are numbered from 0; a gap means some were dropped. */
+    uint32_t seq;
+    /* Cycles traced before the block. */
+    uint64_t cycles;
+    /* Registers before the block, with the flags worked out. */
+    uint16_t r[NUM_REGS];
+};
+#pragma pack(pop)
+
+struct core_trace
+{
+    /* CORE_TRACE_BLOCKS blocks, plus one to fill when the ring is full. */
+    uint8_t *ring;
+    /*
+     * Blocks finished by the emulation thread and written out by the flush
+     * thread. Each is written by one thread only, and read by the other.
+     */
+    uint64_t head;
+    uint64_t tail;
+    /* Set to have the flush thread stop once the ring is empty. */
+    int stop;
+
+    /* Write blocks out as they fill, rather than the last ones at the end. */
+    int stream;
+    FILE *fp;
+    pthread_t thread;
+
+    /* Block being filled, and how much of it is. */
+    uint8_t *block;
+    int pos;
+    uint32_t seq;
+    /* Blocks dropped because the flush thread fell behind. */
+    uint64_t dropped;
+    /* Cycles traced, and the registers as of the last record. */
+    uint64_t cycles;
+    uint16_t r[NUM_REGS];
+};
+
+/* Function declarations. */
+int core_trace_init(struct core_trace **, struct core_cpu *, const char *,
+        int);
+void core_trace_instr(struct core_trace *, struct core_cpu *, uint16_t, int);
+void core_trace_interrupt(struct core_trace *, struct core_cpu *, int);
+void core_trace_destroy(struct core_trace *);
+
+#endif
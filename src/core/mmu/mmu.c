@@ -12,26 +12,11 @@
 #include "core/mmu/mmu.h"
 #include "core/cpu/cpu.h"
 #include "core/cpu/hrc.h"
+#include "core/dbg/break.h"
+#include "core/dbg/cov.h"
 #include "core/vpu/vpu.h"
 #include "log.h"
 
-/* Static memory banks. */
-static uint8_t *rom_f;
-static uint8_t **rom_s;
-static uint8_t *ram_f;
-static uint8_t **ram_s;
-static uint8_t **tile_s;
-static uint8_t **dpcm_s;
-static uint8_t *cart_f;
-static uint8_t *fixed0_f;
-static uint8_t *fixed1_f;
-
-/* Private functions. */
-static uint8_t core_mmu_readb(struct core_mmu *, uint16_t);
-static void core_mmu_writeb(struct core_mmu *, uint16_t, uint8_t);
-static uint16_t core_mmu_readw(struct core_mmu *, uint16_t);
-static void core_mmu_writew(struct core_mmu *, uint16_t, uint16_t);
-
 /*
  * Initialize the MMU.
  * Allocates memory for the core_mmu structure, and for each of the memory
@@ -46,7 +31,7 @@ int core_mmu_init(struct core_mmu **pmmu, struct core_mmu_params *params,
    
     /* First, allocate the MMU structure. */
     *pmmu = NULL;
-    *pmmu = malloc(sizeof(struct core_mmu));
+    *pmmu = calloc(1, sizeof(struct core_mmu));
     if(*pmmu == NULL) {
         LOGE("Could not allocate mmu core; exiting");
         return 0;
@@ -54,28 +39,24 @@ int core_mmu_init(struct core_mmu **pmmu, struct core_mmu_params *params,
     mmu = *pmmu;
     
     /* Allocate the two fixed banks. */
-    rom_f = banks->rom_f; 
-    mmu->rom_f = rom_f;
+    mmu->rom_f = banks->rom_f;
 
-    ram_f = banks->ram_f ? banks->ram_f : calloc(8*1024, sizeof(uint8_t));
-    mmu->ram_f = ram_f;
+    mmu->ram_f = banks->ram_f ? banks->ram_f : calloc(8*1024, sizeof(uint8_t));
 
     /* Allocate the cart permanent storage. */
-    cart_f = calloc(256, sizeof(uint8_t));
-    if(cart_f == NULL)
+    mmu->cart_f = calloc(256, sizeof(uint8_t));
+    if(mmu->cart_f == NULL)
         goto l_malloc_error;
-    mmu->cart_f = cart_f;
 
     /* Allocate the two banks for misc. use at address space end. */
-    fixed0_f = calloc(6*256, sizeof(uint8_t));
-    fixed1_f = calloc(256, sizeof(uint8_t));
-    if(fixed0_f == NULL || fixed1_f == NULL)
+    mmu->fixed0_f = calloc(6*256, sizeof(uint8_t));
+    mmu->fixed1_f = calloc(256, sizeof(uint8_t));
+    if(mmu->fixed0_f == NULL || mmu->fixed1_f == NULL)
         goto l_malloc_error;
-    mmu->fixed0_f = fixed0_f;
-    mmu->fixed1_f = fixed1_f;
 
     /* Clear the interrupt vector. */
     memset(mmu->intvec, 0, sizeof(mmu->intvec));
+    memset(mmu->code_pages, 0, sizeof(mmu->code_pages));
 
     /* Allocate the switchable ROM banks. */
     if(params->rom_banks == 0) {
@@ -83,15 +64,15 @@ int core_mmu_init(struct core_mmu **pmmu, struct core_mmu_params *params,
         return 0;
     }
     mmu->rom_s_total = params->rom_banks;
-    rom_s = calloc(params->rom_banks, sizeof(uint8_t *));
-    if(rom_s == NULL)
+    mmu->rom_s_banks = calloc(params->rom_banks, sizeof(uint8_t *));
+    if(mmu->rom_s_banks == NULL)
         goto l_malloc_error;
     for(i = 0; i < params->rom_banks; ++i) {
-        rom_s[i] = banks->rom_s[i] ?
+        mmu->rom_s_banks[i] = banks->rom_s[i] ?
             banks->ram_f :
             calloc(8*1024, sizeof(uint8_t)); 
     }
-    mmu->rom_s = rom_s[0]; 
+    mmu->rom_s = mmu->rom_s_banks[0]; 
 
     /* Allocate the switchable RAM banks. */
     if(params->ram_banks == 0) {
@@ -99,15 +80,15 @@ int core_mmu_init(struct core_mmu **pmmu, struct core_mmu_params *params,
         return 0;
     }
     mmu->ram_s_total = params->ram_banks;
-    ram_s = calloc(params->ram_banks, sizeof(uint8_t *));
-    if(ram_s == NULL)
+    mmu->ram_s_banks = calloc(params->ram_banks, sizeof(uint8_t *));
+    if(mmu->ram_s_banks == NULL)
         goto l_malloc_error;
     for(i = 0; i < params->ram_banks; ++i) {
-        ram_s[i] = banks->ram_s[i] ?
+        mmu->ram_s_banks[i] = banks->ram_s[i] ?
             banks->ram_s[i] :
             calloc(8*1024, sizeof(uint8_t)); 
     }
-    mmu->ram_s = ram_s[0];
+    mmu->ram_s = mmu->ram_s_banks[0];
 
     /* Allocate the switchable tile ROM banks. */
     if(params->tile_banks == 0) {
@@ -115,15 +96,15 @@ int core_mmu_init(struct core_mmu **pmmu, struct core_mmu_params *params,
         return 0;
     }
     mmu->tile_s_total = params->tile_banks;
-    tile_s = calloc(params->tile_banks, sizeof(uint8_t *));
-    if(tile_s == NULL)
+    mmu->tile_s_banks = calloc(params->tile_banks, sizeof(uint8_t *));
+    if(mmu->tile_s_banks == NULL)
         goto l_malloc_error;
     for(i = 0; i < params->tile_banks; ++i) {
-        tile_s[i] = banks->tile_s[i] ?
+        mmu->tile_s_banks[i] = banks->tile_s[i] ?
             banks->tile_s[i] :
             calloc(8*1024, sizeof(uint8_t)); 
     }
-    mmu->tile_s = tile_s[0];
+    mmu->tile_s = mmu->tile_s_banks[0];
 
     /* Allocate the switchable DPCM ROM banks. */
     if(params->dpcm_banks == 0) {
@@ -131,15 +112,15 @@ int core_mmu_init(struct core_mmu **pmmu, struct core_mmu_params *params,
         return 0;
     }
     mmu->dpcm_s_total = params->dpcm_banks;
-    dpcm_s = calloc(params->dpcm_banks, sizeof(uint8_t *));
-    if(dpcm_s == NULL)
+    mmu->dpcm_s_banks = calloc(params->dpcm_banks, sizeof(uint8_t *));
+    if(mmu->dpcm_s_banks == NULL)
         goto l_malloc_error;
     for(i = 0; i < params->dpcm_banks; ++i) {
-        dpcm_s[i] = banks->dpcm_s[i] ?
+        mmu->dpcm_s_banks[i] = banks->dpcm_s[i] ?
             banks->dpcm_s :
             calloc(2*1024, sizeof(uint8_t)); 
     }
-    mmu->dpcm_s = dpcm_s[0];
+    mmu->dpcm_s = mmu->dpcm_s_banks[0];
    
     /* Everything was allocated properly, phew. */
     LOGD("Allocated: %hhu ROM bank%s, %hhu RAM bank%s, %hhu tile ROM bank%s,"
@@ -195,36 +176,27 @@ int core_mmu_destroy(struct core_mmu *mmu)
 {
     int i;
 
-    free(rom_f);
-    mmu->rom_f = rom_f = NULL;
-    free(ram_f);
-    mmu->ram_f = ram_f = NULL;
-    free(cart_f);
-    mmu->cart_f = cart_f = NULL;
-    free(fixed0_f);
-    mmu->fixed0_f = fixed0_f = NULL;
-    free(fixed1_f);
-    mmu->fixed1_f = fixed1_f = NULL;
+    free(mmu->rom_f);
+    free(mmu->ram_f);
+    free(mmu->cart_f);
+    free(mmu->fixed0_f);
+    free(mmu->fixed1_f);
 
     for(i = 0; i < mmu->rom_s_total; ++i)
-        free(rom_s[i]);
-    free(rom_s);
-    mmu->rom_s = NULL, rom_s = NULL;
+        free(mmu->rom_s_banks[i]);
+    free(mmu->rom_s_banks);
     
     for(i = 0; i < mmu->ram_s_total; ++i)
-        free(ram_s[i]);
-    free(ram_s);
-    mmu->ram_s = NULL, ram_s = NULL;
+        free(mmu->ram_s_banks[i]);
+    free(mmu->ram_s_banks);
     
     for(i = 0; i < mmu->tile_s_total; ++i)
-        free(tile_s[i]);
-    free(tile_s);
-    mmu->tile_s = NULL, tile_s = NULL;
+        free(mmu->tile_s_banks[i]);
+    free(mmu->tile_s_banks);
 
     for(i = 0; i < mmu->dpcm_s_total; ++i)
-        free(dpcm_s[i]);
-    free(dpcm_s);
-    mmu->dpcm_s = NULL, dpcm_s = NULL;
+        free(mmu->dpcm_s_banks[i]);
+    free(mmu->dpcm_s_banks);
     
     free(mmu);
 
@@ -243,19 +215,22 @@ int core_mmu_bank_select(struct core_mmu *mmu, enum core_mmu_bank bank,
     switch(bank) {
         case B_ROM_SWAP:
             mmu->rom_s_bank = index;
-            mmu->rom_s = rom_s[index];
+            mmu->rom_s = mmu->rom_s_banks[index];
+            /* Code may have been swapped out from under a running block. */
+            mmu->cpu->block_exit = 1;
             break;
         case B_RAM_SWAP:
             mmu->ram_s_bank = index;
-            mmu->ram_s = ram_s[index];
+            mmu->ram_s = mmu->ram_s_banks[index];
+            mmu->cpu->block_exit = 1;
             break;
         case B_TILE_SWAP:
             mmu->tile_bank = index;
-            mmu->tile_s = tile_s[index];
+            mmu->tile_s = mmu->tile_s_banks[index];
             break;
         case B_DPCM_SWAP:
             mmu->dpcm_bank = index;
-            mmu->dpcm_s = dpcm_s[index];
+            mmu->dpcm_s = mmu->dpcm_s_banks[index];
             break;
     }
     return 1;
@@ -392,6 +367,7 @@ void core_mmu_update(struct core_mmu *mmu)
     }
     mmu->pending_cpu = MMU_NONE;
     
+    mmu->vpu_access = 1;
     if(mmu->pending_vpu == MMU_READ) {
         if(mmu->vsz_vpu == 1)
             mmu->v_vpu = core_mmu_readb(mmu, mmu->a_vpu);
@@ -404,6 +380,19 @@ void core_mmu_update(struct core_mmu *mmu)
             core_mmu_writew(mmu, mmu->a_vpu, mmu->v_vpu);
     }
     mmu->pending_vpu = MMU_NONE;
+    mmu->vpu_access = 0;
+}
+
+
+/* An access to a page being watched; see watch_pages. */
+static void core_mmu__watched(struct core_mmu *mmu, uint16_t a, uint8_t v,
+        int kind)
+{
+    if(mmu->vpu_access)
+        return;
+    if(mmu->cov != NULL)
+        core_cov_access(mmu->cov, mmu, a, kind);
+    core_break_access(mmu->brk, a, v, kind);
 }
 
 
@@ -422,8 +411,11 @@ static inline int core_mmu_pending_vpu(struct core_mmu *mmu)
 }
 
 /* Read a byte from the correct device/bank for that address. */
-static uint8_t core_mmu_readb(struct core_mmu *mmu, uint16_t a)
+uint8_t core_mmu_readb(struct core_mmu *mmu, uint16_t a)
 {
+    if(mmu->watch_pages[a >> 8] & BREAK_READ)
+        core_mmu__watched(mmu, a, 0, BREAK_READ);
+
     /* Check which memory bank to access, or which handler to use. */
     if(a <= A_ROM_FIXED_END)
         return mmu->rom_f[a - A_ROM_FIXED];
@@ -467,8 +459,13 @@ static uint8_t core_mmu_readb(struct core_mmu *mmu, uint16_t a)
 
 
 /* Write a byte to the correct device/bank part for that address. */
-static void core_mmu_writeb(struct core_mmu *mmu, uint16_t a, uint8_t v)
+void core_mmu_writeb(struct core_mmu *mmu, uint16_t a, uint8_t v)
 {
+    if(mmu->code_pages[a >> 8])
+        core_cpu_code_written(mmu->cpu, a);
+    if(mmu->watch_pages[a >> 8] & BREAK_WRITE)
+        core_mmu__watched(mmu, a, v, BREAK_WRITE);
+
     /* Check which memory bank to access, or which handler to use. */
     if(a <= A_ROM_FIXED_END)
         mmu->rom_f[a - A_ROM_FIXED] = v;
@@ -515,7 +512,7 @@ static void core_mmu_writeb(struct core_mmu *mmu, uint16_t a, uint8_t v)
 
 
 /* Read a word from the correct device/bank part for that address. */
-static uint16_t core_mmu_readw(struct core_mmu *mmu, uint16_t a)
+uint16_t core_mmu_readw(struct core_mmu *mmu, uint16_t a)
 {
     uint16_t result = 0;
 
@@ -527,7 +524,7 @@ static uint16_t core_mmu_readw(struct core_mmu *mmu, uint16_t a)
 
 
 /* Write a word to the correct device/bank part for that address. */
-static void core_mmu_writew(struct core_mmu *mmu, uint16_t a, uint16_t v)
+void core_mmu_writew(struct core_mmu *mmu, uint16_t a, uint16_t v)
 {
     core_mmu_writeb(mmu, a, (v & 0xff));
     core_mmu_writeb(mmu, a + 1, v >> 8);
@@ -13,6 +13,15 @@
 
 #include <stdint.h>
 
+/*
+ * Bits of code_pages, one for each engine keeping code, so that one dropping
+ * its blocks does not stop writes reaching another's; the tiered engine runs
+ * both the block cache and the recompiler.
+ */
+#define CODE_BLOCK      0x01
+#define CODE_JIT        0x02
+#define CODE_AOT        0x04
+
 /* Segments of the address space which we handle. */
 static const uint16_t A_ROM_FIXED = 0x0000;
 static const uint16_t A_ROM_FIXED_END = 0x3fff;
@@ -89,6 +98,11 @@ struct core_mmu
     uint8_t *cart_f;
     uint8_t *fixed1_f;
     uint8_t intvec[8];
+    /* All the banks of each kind, of which one is switched in at a time. */
+    uint8_t **rom_s_banks;
+    uint8_t **ram_s_banks;
+    uint8_t **tile_s_banks;
+    uint8_t **dpcm_s_banks;
 
     uint8_t *bank_rom_f;        /* Fixed ROM bank */
     uint8_t *bank_rom_s;        /* Switchable ROM bank */
@@ -111,6 +125,23 @@ struct core_mmu
     uint8_t dpcm_bank;
     uint8_t dpcm_s_total;
 
+    /*
+     * Pages of the address space, 256 bytes each, holding code which has been
+     * cached or translated, with a CODE_* bit for each engine holding some.
+     * Writes to a page with any bit set drop the affected blocks.
+     */
+    uint8_t code_pages[256];
+
+    /*
+     * Accesses watched on each page of the address space, as BREAK_READ and
+     * BREAK_WRITE, for the watchpoints and the code/data logger to look
+     * into; see dbg/break.c and dbg/cov.c. Neither sees the VPU's.
+     */
+    uint8_t watch_pages[256];
+    struct core_break *brk;
+    struct core_cov *cov;
+    int vpu_access;
+
     /* MDR, MAR and state for read/write requests. */
     enum core_mmu_access pending_cpu, pending_vpu;
     uint16_t a_cpu, a_vpu;
@@ -120,6 +151,36 @@ struct core_mmu
 
 struct core_temp_banks;
 
+/*
+ * Index of the bank mapped at a ROM/RAM address, telling apart code cached
+ * from different swappable banks; 0 for the fixed banks.
+ */
+static inline uint8_t core_mmu_bank_at(struct core_mmu *mmu, uint16_t a)
+{
+    if(a >= A_ROM_SWAP && a <= A_ROM_SWAP_END)
+        return mmu->rom_s_bank;
+    if(a >= A_RAM_SWAP && a <= A_RAM_SWAP_END)
+        return mmu->ram_s_bank;
+    return 0;
+}
+
+/*
+ * Last address of the ROM/RAM segment holding an address, or 0 outside them.
+ * Cached code may not cross a segment boundary.
+ */
+static inline uint16_t core_mmu_segment_end(uint16_t a)
+{
+    if(a <= A_ROM_FIXED_END)
+        return A_ROM_FIXED_END;
+    if(a <= A_ROM_SWAP_END)
+        return A_ROM_SWAP_END;
+    if(a <= A_RAM_FIXED_END)
+        return A_RAM_FIXED_END;
+    if(a <= A_RAM_SWAP_END)
+        return A_RAM_SWAP_END;
+    return 0;
+}
+
 /* Function declarations. */
 int core_mmu_init(struct core_mmu **, struct core_mmu_params *,
         struct core_temp_banks *);
@@ -154,6 +215,15 @@ int core_mmu_ww_send_vpu(struct core_mmu *, uint16_t, uint16_t);
 
 void core_mmu_update(struct core_mmu *);
 
+/*
+ * Immediate accesses, bypassing the request/fetch protocol above. Used by the
+ * execution engines which do not model the bus cycle by cycle.
+ */
+uint8_t core_mmu_readb(struct core_mmu *, uint16_t);
+void core_mmu_writeb(struct core_mmu *, uint16_t, uint8_t);
+uint16_t core_mmu_readw(struct core_mmu *, uint16_t);
+void core_mmu_writew(struct core_mmu *, uint16_t, uint16_t);
+
 
 #endif
 
@@ -5,6 +5,7 @@
  *
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -385,7 +386,7 @@ void core_vpu_write_fb(struct core_vpu *vpu)
 void core_vpu_cycle(struct core_vpu *vpu, int total_cycles)
 {
     uint8_t *temp;
-    static int scanline = 0;
+    int scanline = vpu->scanline;
     int c = total_cycles % VPU_XRES_CYCLES;
 
     /* First, update state if necessary. */
@@ -447,7 +448,7 @@ void core_vpu_cycle(struct core_vpu *vpu, int total_cycles)
     /* The last cycle of the scanline is a good time to increment
      * the scanline counter, and wrap it if necessary! */
     if(c == 340) {
-        scanline = (scanline + 1) % VPU_YRES_SCANLINES;
+        scanline = vpu->scanline = (scanline + 1) % VPU_YRES_SCANLINES;
         /* XXX: this might be a good place to implement the double
          * buffering's framebuffer swap. */
         if(scanline == 0) {
@@ -468,6 +469,28 @@ void core_vpu_cycle(struct core_vpu *vpu, int total_cycles)
 }
 
 
+/*
+ * Number of calls to core_vpu_cycle(), from the one for the given cycle on,
+ * up to and including the one which next begins or ends the VBlank period.
+ */
+int core_vpu_next_event(struct core_vpu *vpu, int total_cycles)
+{
+    static const int at[2] = { 240, 12 };
+    int c = total_cycles % VPU_XRES_CYCLES, lines, n, next = INT_MAX, i;
+
+    for(i = 0; i < 2; ++i) {
+        lines = (at[i] - vpu->scanline + VPU_YRES_SCANLINES) %
+                VPU_YRES_SCANLINES;
+        if(lines == 0 && c != 0)
+            lines = VPU_YRES_SCANLINES;
+        n = lines * VPU_XRES_CYCLES - c + 1;
+        if(n < next)
+            next = n;
+    }
+    return next;
+}
+
+
 /* Makes the correct memory accesses for a given scanline and cycle. */
 static void core_vpu__fetch_data(struct core_vpu *vpu, int scanline, int c)
 {
@@ -632,7 +655,7 @@ static void core_vpu__write_px(struct core_vpu *vpu, int scanline, int c,
 /* Signal the start of the VBlank period, by firing the video interrupt. */
 void core_vpu_begin_vblank(struct core_vpu *vpu)
 {
-    vpu->cpu->interrupt = INT_VIDEO_IRQ;
+    core_cpu_int_raise(vpu->cpu, INT_VIDEO_IRQ);
     vpu->vblank = 1;
     ui_lock_fb();
     {
@@ -91,6 +91,8 @@ struct core_vpu {
 
     /* VBlank status flag. */
     int vblank;
+    /* Scanline being drawn. */
+    int scanline;
 
     /* Switchable tile bank. */
     uint8_t *tile_bank;
@@ -149,6 +151,7 @@ int core_vpu_init_palette(struct core_vpu *, uint8_t *);
 int core_vpu_destroy(struct core_vpu *);
 
 void core_vpu_cycle(struct core_vpu *, int);
+int core_vpu_next_event(struct core_vpu *, int);
 void core_vpu_update(struct core_vpu *);
 void core_vpu_write_fb(struct core_vpu *);
 void core_vpu_begin_vblank(struct core_vpu *);
@@ -0,0 +1,432 @@
+/*
+ * tools/tracediff.c -- Execution trace comparison.
+ *
+ * Finds the first instruction at which two traces written with -trace or
+ * -trace-ring disagree, and prints the instructions leading up to it and
+ * those from each trace after it, disassembled. The traces are mapped into
+ * memory and compared 64 bytes at a time; only the block holding the first
+ * difference is decoded.
+ *
+ *     tracediff [-c context] [-m rom] a.trc b.trc
+ *
+ * With -m, addresses are labelled from the symbol map of the given ROM.
+ * Exits with 0 if the traces match, 1 if not and 2 on error.
+ *
+ * asm/diverge.s (make diverge.kpr) has its VBlank interrupt raised in the
+ * middle of a block, where an engine entering interrupts late would part
+ * from the others. Every engine's trace of it must match:
+ *
+ *     qpra diverge.kpr -engine threaded -trace a.trc
+ *     qpra diverge.kpr -engine jit -trace b.trc
+ *     tracediff -m diverge.kpr a.trc b.trc
+ *
+ * finds no difference up to where the shorter run was stopped.
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "core/cpu/isa.h"
+#include "core/dbg/sym.h"
+#include "core/dbg/trace.h"
+
+/* Records shown before the first difference unless given, and after it. */
+#define DIFF_CONTEXT 16
+#define DIFF_AFTER 4
+/* Most records a block can hold. */
+#define DIFF_MAX_RECORDS (CORE_TRACE_BLOCK / 3)
+
+#define DIFF_NAME(op, mn, kind, flag)       #mn,
+static const char *diff_names[NUM_INSTRS] = {
+    CORE_ISA_INSTRS(DIFF_NAME)
+};
+
+#define DIFF_LEN(mode, mn, len, ...)        len,
+static const int diff_lens[16] = {
+    CORE_ISA_MODES(DIFF_LEN, 0)
+};
+
+/*
+ * Operands of each addressing mode: x and y are registers rx and ry, and d
+ * the data; in brackets if memory at that address.
+ */
+static const char *diff_forms[16] = {
+    "x", "[x]", "d", "[d]", "d", "[d]", "x, y", "x, [y]", "[x], y",
+    "x, d", "x, [d]", "x, d", "x, [d]", "[d], y", "[d], y", "?"
+};
+
+static const char diff_regs[NUM_REGS] = {
+    'a', 'b', 'c', 'd', 'e', 'p', 's', 'f'
+};
+
+struct diff_trace
+{
+    const char *fn;
+    const uint8_t *data;
+    size_t size;
+    /* Blocks, not counting any partial one at the end. */
+    size_t blocks;
+};
+
+/* A record decoded from a block. */
+struct diff_record
+{
+    /* Where it is in the block, and how long. */
+    int off;
+    int len;
+    int tag;
+    /* Cycle it started on, and where. */
+    uint64_t cycles;
+    uint16_t pc;
+    const uint8_t *ib;
+    /* Registers after it. */
+    uint16_t r[NUM_REGS];
+};
+
+static struct core_syms *diff_syms;
+
+/* Map a trace file into memory. Returns 0 on error. */
+static int diff_open(struct diff_trace *t, const char *fn)
+{
+    struct core_trace_file_header hdr;
+    struct stat st;
+    void *data;
+    int fd;
+
+    t->fn = fn;
+    fd = open(fn, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Couldn't open trace '%s'\n", fn);
+        return 0;
+    }
+    if((size_t)st.st_size < sizeof(hdr)) {
+        fprintf(stderr, "'%s' is not a trace\n", fn);
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map trace '%s'\n", fn);
+        return 0;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    if(memcmp(hdr.magic, "QTRC", 4) || hdr.block_size != CORE_TRACE_BLOCK) {
+        fprintf(stderr, "'%s' is not a trace, or one of another version\n",
+                fn);
+        munmap(data, st.st_size);
+        return 0;
+    }
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    t->data = data;
+    t->size = st.st_size;
+    t->blocks = (t->size - sizeof(hdr)) / CORE_TRACE_BLOCK;
+    return 1;
+}
+
+static const uint8_t *diff_block(struct diff_trace *t, size_t n)
+{
+    return t->data + sizeof(struct core_trace_file_header) +
+           n * CORE_TRACE_BLOCK;
+}
+
+static uint32_t diff_seq(struct diff_trace *t, size_t n)
+{
+    struct core_trace_block_header hdr;
+
+    memcpy(&hdr, diff_block(t, n), sizeof(hdr));
+    return hdr.seq;
+}
+
+/* Returns the offset of the first byte at which a and b differ, or n. */
+static size_t diff_first(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    size_t k = 0;
+
+#ifdef __SSE2__
+    __m128i m;
+
+    for(; k + 64 <= n; k += 64) {
+        m = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + k)),
+                                   _mm_loadu_si128((const __m128i *)(b + k))),
+                    _mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)(a + k + 16)),
+                        _mm_loadu_si128((const __m128i *)(b + k + 16)))),
+                _mm_and_si128(
+                    _mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)(a + k + 32)),
+                        _mm_loadu_si128((const __m128i *)(b + k + 32))),
+                    _mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)(a + k + 48)),
+                        _mm_loadu_si128((const __m128i *)(b + k + 48)))));
+        if(_mm_movemask_epi8(m) != 0xffff)
+            break;
+    }
+#else
+    uint64_t x[8], y[8];
+
+    for(; k + 64 <= n; k += 64) {
+        memcpy(x, a + k, 64);
+        memcpy(y, b + k, 64);
+        if((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3]) |
+           (x[4] ^ y[4]) | (x[5] ^ y[5]) | (x[6] ^ y[6]) | (x[7] ^ y[7]))
+            break;
+    }
+#endif
+    while(k < n && a[k] == b[k])
+        ++k;
+    return k;
+}
+
+/* Decode the records of a block. Returns how many there are. */
+static int diff_decode(const uint8_t *blk, struct diff_record *recs)
+{
+    struct core_trace_block_header hdr;
+    uint16_t r[NUM_REGS];
+    uint64_t cycles;
+    int pos = sizeof(hdr), n = 0, k, shift;
+    uint32_t v;
+    struct diff_record *rec;
+
+    memcpy(&hdr, blk, sizeof(hdr));
+    memcpy(r, hdr.r, sizeof(r));
+    cycles = hdr.cycles;
+
+    while(pos < CORE_TRACE_BLOCK && blk[pos] != TRACE_END &&
+          n < DIFF_MAX_RECORDS) {
+        rec = &recs[n++];
+        rec->off = pos;
+        rec->tag = blk[pos++];
+        rec->pc = r[R_P];
+        rec->cycles = cycles;
+        rec->ib = NULL;
+        if(!(rec->tag & TRACE_INTERRUPT)) {
+            rec->ib = &blk[pos];
+            if(blk[pos] >> 3 < OP_JP) {
+                pos += 1;
+                r[R_P] += 1;
+            } else {
+                k = diff_lens[((blk[pos] << 2) | (blk[pos + 1] >> 6)) & 0x0f];
+                pos += k > 2 ? 4 : 2;
+                r[R_P] += k;
+            }
+        }
+        v = 0;
+        shift = 0;
+        do {
+            v |= (uint32_t)(blk[pos] & 0x7f) << shift;
+            shift += 7;
+        } while(blk[pos++] & 0x80);
+        cycles += v;
+        if(rec->tag & TRACE_JUMP) {
+            r[R_P] = blk[pos] | (blk[pos + 1] << 8);
+            pos += 2;
+        }
+        k = blk[pos++];
+        for(shift = 0; shift < NUM_REGS; ++shift) {
+            if(k & (1 << shift)) {
+                r[shift] = blk[pos] | (blk[pos + 1] << 8);
+                pos += 2;
+            }
+        }
+        memcpy(rec->r, r, sizeof(r));
+        rec->len = pos - rec->off;
+    }
+    return n;
+}
+
+/* Write out the instruction of a record. */
+static void diff_disassemble(const struct diff_record *rec, char *buf,
+        size_t len)
+{
+    const uint8_t *ib = rec->ib;
+    const char *f;
+    char data[8];
+    int op = ib[0] >> 3, mode, n;
+
+    if(op < OP_JP) {
+        snprintf(buf, len, "%02x           %s", ib[0], diff_names[op]);
+        return;
+    }
+    mode = ((ib[0] << 2) | (ib[1] >> 6)) & 0x0f;
+    if(diff_lens[mode] > 2) {
+        n = snprintf(buf, len, "%02x %02x %02x %02x  %s.%c ", ib[0], ib[1],
+                     ib[2], ib[3], diff_names[op], ib[0] & 4 ? 'w' : 'b');
+        if(diff_lens[mode] == 3)
+            snprintf(data, sizeof(data), "$%02x", ib[2]);
+        else
+            snprintf(data, sizeof(data), "$%04x", ib[2] | (ib[3] << 8));
+    } else {
+        n = snprintf(buf, len, "%02x %02x        %s.%c ", ib[0], ib[1],
+                     diff_names[op], ib[0] & 4 ? 'w' : 'b');
+    }
+    for(f = diff_forms[mode]; *f && n < (int)len - 6; ++f) {
+        if(*f == 'x')
+            buf[n++] = diff_regs[(ib[1] >> 3) & 7];
+        else if(*f == 'y')
+            buf[n++] = diff_regs[ib[1] & 7];
+        else if(*f == 'd')
+            n += snprintf(buf + n, len - n, "%s", data);
+        else
+            buf[n++] = *f;
+    }
+    buf[n] = '\0';
+}
+
+/* Print a record, with the registers after it. */
+static void diff_print(const char *mark, const struct diff_record *rec)
+{
+    char ins[48], name[64];
+    int k;
+
+    if(rec->ib != NULL)
+        diff_disassemble(rec, ins, sizeof(ins));
+    else
+        snprintf(ins, sizeof(ins), "interrupt");
+    printf("%s %10llu  %04x ", mark, (unsigned long long)rec->cycles,
+           rec->pc);
+    if(diff_syms != NULL) {
+        core_sym_format(diff_syms, rec->pc, name, sizeof(name));
+        printf("%-16s ", name);
+    }
+    printf("%-28s", ins);
+    for(k = 0; k < NUM_REGS; ++k)
+        printf(" %c=%04x", diff_regs[k], rec->r[k]);
+    putchar('\n');
+}
+
+/*
+ * Print the records leading up to the one at index n of recs, along with
+ * the records of the previous block if there are too few in this one.
+ */
+static void diff_context(struct diff_trace *t, size_t blk,
+        struct diff_record *recs, int n, int context)
+{
+    struct diff_record *prev;
+    int k, num;
+
+    if(n < context && blk > 0) {
+        prev = malloc(DIFF_MAX_RECORDS * sizeof(struct diff_record));
+        if(prev != NULL) {
+            num = diff_decode(diff_block(t, blk - 1), prev);
+            for(k = num - (context - n); k < num; ++k) {
+                if(k >= 0)
+                    diff_print(" ", &prev[k]);
+            }
+            free(prev);
+        }
+    }
+    for(k = n > context ? n - context : 0; k < n; ++k)
+        diff_print(" ", &recs[k]);
+}
+
+/* Compare the traces from the given blocks on. Returns 1 if they differ. */
+static int diff_compare(struct diff_trace *a, size_t ba, struct diff_trace *b,
+        size_t bb, int context)
+{
+    struct diff_record *ra, *rb;
+    size_t n, off, blk;
+    int na, nb, k, i;
+
+    n = a->blocks - ba < b->blocks - bb ? a->blocks - ba : b->blocks - bb;
+    off = diff_first(diff_block(a, ba), diff_block(b, bb),
+                     n * CORE_TRACE_BLOCK);
+    if(off == n * CORE_TRACE_BLOCK) {
+        if(a->blocks - ba != b->blocks - bb)
+            printf("Traces match for %zu blocks, where '%s' ends\n", n,
+                   a->blocks - ba < b->blocks - bb ? a->fn : b->fn);
+        else
+            printf("Traces match\n");
+        return a->blocks - ba != b->blocks - bb;
+    }
+
+    blk = off / CORE_TRACE_BLOCK;
+    off %= CORE_TRACE_BLOCK;
+    if(diff_seq(a, ba + blk) != diff_seq(b, bb + blk)) {
+        printf("Traces differ in block sequence at block %u of '%s' and "
+               "block %u of '%s'; blocks were dropped\n",
+               diff_seq(a, ba + blk), a->fn, diff_seq(b, bb + blk), b->fn);
+        return 1;
+    }
+
+    ra = malloc(DIFF_MAX_RECORDS * sizeof(struct diff_record));
+    rb = malloc(DIFF_MAX_RECORDS * sizeof(struct diff_record));
+    if(ra == NULL || rb == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    na = diff_decode(diff_block(a, ba + blk), ra);
+    nb = diff_decode(diff_block(b, bb + blk), rb);
+    /* The records before the difference are the same in both. */
+    for(k = 0; k < na && ra[k].off + ra[k].len <= (int)off; ++k)
+        ;
+
+    if(k == 0 && off < sizeof(struct core_trace_block_header))
+        printf("Traces differ at the start of block %u\n",
+               diff_seq(a, ba + blk));
+    else
+        printf("Traces differ at record %d of block %u:\n", k,
+               diff_seq(a, ba + blk));
+    diff_context(a, ba + blk, ra, k, context);
+    printf("--- %s\n", a->fn);
+    for(i = k; i < na && i < k + DIFF_AFTER; ++i)
+        diff_print("-", &ra[i]);
+    if(k >= na)
+        printf("- (end of trace)\n");
+    printf("+++ %s\n", b->fn);
+    for(i = k; i < nb && i < k + DIFF_AFTER; ++i)
+        diff_print("+", &rb[i]);
+    if(k >= nb)
+        printf("+ (end of trace)\n");
+
+    free(ra);
+    free(rb);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct diff_trace a, b;
+    size_t ba = 0, bb = 0;
+    int context = DIFF_CONTEXT, i;
+
+    for(i = 1; i < argc - 2; ++i) {
+        if(!strcmp(argv[i], "-c") && i + 1 < argc - 2) {
+            context = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "-m") && i + 1 < argc - 2) {
+            core_sym_load(&diff_syms, argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if(i != argc - 2) {
+        fprintf(stderr, "usage: %s [-c context] [-m rom] a.trc b.trc\n",
+                argv[0]);
+        return 2;
+    }
+    if(!diff_open(&a, argv[i]) || !diff_open(&b, argv[i + 1]))
+        return 2;
+
+    /* Traces kept with -trace-ring may start at different blocks. */
+    if(a.blocks && b.blocks) {
+        while(ba < a.blocks && diff_seq(&a, ba) < diff_seq(&b, 0))
+            ++ba;
+        while(bb < b.blocks && diff_seq(&b, bb) < diff_seq(&a, 0))
+            ++bb;
+        if(ba || bb)
+            printf("Comparing from block %u\n",
+                   ba < a.blocks ? diff_seq(&a, ba) : diff_seq(&b, bb));
+    }
+    return diff_compare(&a, ba, &b, bb, context);
+}
@@ -0,0 +1,150 @@
+#!/bin/env python2
+
+# trace.py -- Execution trace decoder
+#
+# Prints an execution trace written by qpra with '-trace' or '-trace-ring'
+# as one line per instruction or interrupt entry: the cycle it started on,
+# its address and bytes, its disassembly and the registers it changed.
+# Labels are shown where the symbol map written by as.py names an address.
+# The format is described in src/core/dbg/trace.h.
+
+from __future__ import print_function
+
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from aot import Instr, HAS_DB, HAS_DW, R_P
+
+MAGIC = b"QTRC"
+BLOCK_HEADER = struct.Struct("<IQ8H")
+
+TRACE_END, TRACE_INSTR, TRACE_INTERRUPT, TRACE_JUMP = 0x00, 0x01, 0x02, 0x04
+
+regs = ["a", "b", "c", "d", "e", "p", "s", "f"]
+
+# Operands of each addressing mode: 'x' and 'y' are the registers, 'd' the
+# data; in brackets if memory at that address.
+operand_forms = [
+        "x", "[x]", "d", "[d]", "d", "[d]", "x, y", "x, [y]", "[x], y",
+        "x, d", "x, [d]", "x, d", "x, [d]", "[d], y", "[d], y", "?"
+        ]
+
+
+def disassemble(ins):
+    s = str(ins).split()[0]
+    if ins.is_void():
+        return s
+    if ins.am in HAS_DB:
+        d = "$%02x" % (ins.data & 0xff)
+    else:
+        d = "$%04x" % ins.data
+    form = operand_forms[ins.am]
+    ops = "".join(regs[ins.rx] if c == "x" else regs[ins.ry] if c == "y"
+                  else d if c == "d" else c for c in form)
+    return s + " " + ops
+
+
+def read_map(fn):
+    """ Labels by address from an as.py map file, if there is one. """
+    labels = {}
+    if not os.path.exists(fn):
+        return labels
+    for line in open(fn):
+        f = line.split()
+        if len(f) == 4 and f[0] == "label":
+            labels[int(f[2], 16)] = f[3]
+    return labels
+
+
+def varint(buf, pos):
+    v, shift = 0, 0
+    while True:
+        b = buf[pos]
+        pos += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return v, pos
+
+
+def decode_block(buf, labels, out):
+    """ Print the records of one block. Returns its sequence number. """
+    hdr = BLOCK_HEADER.unpack_from(buf, 0)
+    seq, cycles, r = hdr[0], hdr[1], list(hdr[2:])
+    pos = BLOCK_HEADER.size
+
+    while pos < len(buf) and buf[pos] != TRACE_END:
+        tag = buf[pos]
+        pos += 1
+        pc = r[R_P]
+        if tag & TRACE_INTERRUPT:
+            raw = None
+        else:
+            length = 1 if buf[pos] >> 3 < 4 else 2
+            if length == 2 and (((buf[pos] << 2) | (buf[pos + 1] >> 6)) &
+                                0x0f) in HAS_DB + HAS_DW:
+                length = 4
+            raw = buf[pos:pos + length]
+            pos += length
+            ins = Instr(raw + bytearray(4), 0)
+            r[R_P] = (pc + ins.length) & 0xffff
+        n, pos = varint(buf, pos)    # Cycles taken
+        if tag & TRACE_JUMP:
+            r[R_P] = buf[pos] | (buf[pos + 1] << 8)
+            pos += 2
+        mask = buf[pos]
+        pos += 1
+        changed = []
+        for k in range(8):
+            if mask & (1 << k):
+                r[k] = buf[pos] | (buf[pos + 1] << 8)
+                pos += 2
+                changed.append("%s=%04x" % (regs[k], r[k]))
+
+        if raw is None:
+            out.write("%10d        interrupt -> %04x  %s\n" %
+                      (cycles, r[R_P], " ".join(changed)))
+        else:
+            if pc in labels:
+                out.write("%s:\n" % labels[pc])
+            if tag & TRACE_JUMP:
+                changed.insert(0, "p=%04x" % r[R_P])
+            out.write("%10d  %04x  %-11s %-16s %s\n" %
+                      (cycles, pc, " ".join("%02x" % b for b in raw),
+                       disassemble(ins), " ".join(changed)))
+        cycles += n
+    return seq
+
+
+def main():
+    if len(sys.argv) < 2:
+        print("usage: trace.py <trace> [rom.map]")
+        sys.exit(1)
+    labels = read_map(sys.argv[2]) if len(sys.argv) > 2 else {}
+
+    f = open(sys.argv[1], "rb")
+    hdr = f.read(8)
+    if len(hdr) != 8 or hdr[:4] != MAGIC:
+        print("error: not a qpra trace")
+        sys.exit(1)
+    size = struct.unpack("<I", hdr[4:])[0]
+
+    out = sys.stdout
+    prev = None
+    while True:
+        buf = bytearray(f.read(size))
+        if len(buf) < size:
+            break
+        seq = BLOCK_HEADER.unpack_from(buf, 0)[0]
+        if prev is not None and seq != prev + 1:
+            out.write("; %d blocks dropped\n" % (seq - prev - 1))
+        elif prev is None and seq != 0:
+            out.write("; trace starts at block %d\n" % seq)
+        decode_block(buf, labels, out)
+        prev = seq
+    f.close()
+
+if __name__ == "__main__":
+    main()